@@ -1,19 +1,15 @@
-#include <string>
 #include <iostream>
-#include <stdio.h>
-#include "../libsam3/libsam3.h"
+#include "../libsam3/libsam3.hpp"
 
 int main() {
-	// The session is only usef for transporting the data
-	Sam3Session ss;
+	auto keys = sam3::Session::generateKeys(SAM3_HOST_DEFAULT, SAM3_PORT_DEFAULT,
+	                                        EdDSA_SHA512_Ed25519);
 
-	if (0 > sam3GenerateKeys(&ss, SAM3_HOST_DEFAULT, SAM3_PORT_DEFAULT, Sam3SigType::EdDSA_SHA512_Ed25519)) {
-		printf("got error");
+	if (!keys) {
+		std::cerr << "got error: " << keys.error().message() << std::endl;
 		return -1;
 	}
-	auto pub = std::string(ss.pubkey);
-	auto priv = std::string(ss.privkey);
-
-	std::cout << "pub  " << pub << std::endl << "priv " << priv << std::endl;
+	std::cout << "pub  " << keys->pubkey() << std::endl
+	          << "priv " << keys->privkey() << std::endl;
 	return 0;
-} 
+}
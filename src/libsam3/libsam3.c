@@ -23,6 +23,10 @@
  * http://git.idk.i2p/i2p-hackers/libsam3/
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // splice(), pipe2()
+#endif
+
 #include "libsam3.h"
 
 #include <ctype.h>
@@ -56,6 +60,10 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #endif
 
 #if defined(__unix__) && !defined(__APPLE__)
@@ -643,7 +651,7 @@ static inline uint32_t hashint(uint32_t a) {
 }
 
 static uint32_t genSeed(void) {
-  volatile uint32_t seed = 1;
+  static uint32_t seed = 1; // sessions created in the same second differ
   uint32_t res;
 #ifndef WIN32
   #ifndef __APPLE__
@@ -701,10 +709,14 @@ size_t sam3GenChannelName(char *dest, size_t minlen, size_t maxlen) {
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-static int sam3HandshakeInternal(int fd) {
+#define SAM3_HELLO "HELLO VERSION MIN=3.0 MAX=3.2\n"
+// PRIMARY sessions and subsessions need SAM 3.3 on every bridge socket
+#define SAM3_HELLO_PRIMARY "HELLO VERSION MIN=3.3 MAX=3.3\n"
+
+static int sam3HandshakeInternal(int fd, const char *hello) {
   SAMFieldList *rep = NULL;
   //
-  if (sam3tcpPrintf(fd, "HELLO VERSION MIN=3.0 MAX=3.1\n") < 0)
+  if (sam3tcpPrintf(fd, "%s", hello) < 0)
     goto error;
   rep = sam3ReadReply(fd);
   if (!sam3IsGoodReply(rep, "HELLO", "REPLY", "RESULT", "OK"))
@@ -723,17 +735,43 @@ int sam3HandshakeIP(uint32_t ip, int port) {
   //
   if ((fd = sam3tcpConnectIP(ip, (port < 1 || port > 65535 ? 7656 : port))) < 0)
     return -1;
-  return sam3HandshakeInternal(fd);
+  return sam3HandshakeInternal(fd, SAM3_HELLO);
 }
 
-int sam3Handshake(const char *hostname, int port, uint32_t *ip) {
+static int sam3HandshakeHost(const char *hostname, int port, uint32_t *ip,
+                             const char *hello) {
   int fd;
   //
   if ((fd = sam3tcpConnect(
            (hostname == NULL || !hostname[0] ? "localhost" : hostname),
            (port < 1 || port > 65535 ? 7656 : port), ip)) < 0)
     return -1;
-  return sam3HandshakeInternal(fd);
+  return sam3HandshakeInternal(fd, hello);
+}
+
+int sam3Handshake(const char *hostname, int port, uint32_t *ip) {
+  return sam3HandshakeHost(hostname, port, ip, SAM3_HELLO);
+}
+
+static inline const char *sesHello(const Sam3Session *ses) {
+  return ((ses->type == SAM3_SESSION_PRIMARY || ses->primary != NULL)
+              ? SAM3_HELLO_PRIMARY
+              : SAM3_HELLO);
+}
+
+// new bridge socket for STREAM commands of 'ses'
+static int sesHandshakeIP(const Sam3Session *ses) {
+  int fd, port = ses->port;
+  //
+  if ((fd = sam3tcpConnectIP(ses->ip,
+                             (port < 1 || port > 65535 ? 7656 : port))) < 0)
+    return -1;
+  return sam3HandshakeInternal(fd, sesHello(ses));
+}
+
+// control connection; subsessions share primary's
+static inline int sesCtlFd(const Sam3Session *ses) {
+  return (ses->primary != NULL ? ses->primary->fd : ses->fd);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -852,6 +890,16 @@ int sam3CloseConnection(Sam3Connection *conn) {
 
 int sam3CloseSession(Sam3Session *ses) {
   if (ses != NULL) {
+    if (ses->primary != NULL && ses->primary->fd >= 0) {
+      SAMFieldList *rep = NULL;
+      //
+      // drop subsession on the bridge; the reply doesn't matter
+      if (sam3tcpPrintf(ses->primary->fd, "SESSION REMOVE ID=%s\n",
+                        ses->channel) >= 0)
+        rep = sam3ReadReply(ses->primary->fd);
+      if (rep != NULL)
+        sam3FreeFieldList(rep);
+    }
     for (Sam3Connection *n, *c = ses->connlist; c != NULL; c = n) {
       n = c->next;
       sam3CloseConnectionInternal(c);
@@ -861,8 +909,13 @@ int sam3CloseSession(Sam3Session *ses) {
       sam3tcpDisconnect(ses->fwd_fd);
     if (ses->fd >= 0)
       sam3tcpDisconnect(ses->fd);
+    // only subsessions own one; others were never given -1
+    if (ses->primary != NULL && ses->udpfd >= 0)
+      close(ses->udpfd);
     memset(ses, 0, sizeof(Sam3Session));
     ses->fd = -1;
+    ses->fwd_fd = -1; // closing it again must not hit fd 0
+    ses->udpfd = -1;
     return 0;
   }
   return -1;
@@ -884,7 +937,8 @@ int sam3CreateSession(Sam3Session *ses, const char *hostname, int port,
                       const char *privkey, Sam3SessionType type,
                       Sam3SigType sigType, const char *params) {
   if (ses != NULL) {
-    static const char *typenames[3] = {"RAW", "DATAGRAM", "STREAM"};
+    static const char *typenames[4] = {"RAW", "DATAGRAM", "STREAM",
+                                       "PRIMARY"};
     static const char *sigtypes[5] = {
         "SIGNATURE_TYPE=DSA_SHA1", "SIGNATURE_TYPE=ECDSA_SHA256_P256",
         "SIGNATURE_TYPE=ECDSA_SHA384_P384", "SIGNATURE_TYPE=ECDSA_SHA512_P521",
@@ -897,23 +951,27 @@ int sam3CreateSession(Sam3Session *ses, const char *hostname, int port,
     memset(ses, 0, sizeof(Sam3Session));
     ses->fd = -1;
     ses->fwd_fd = -1;
+    ses->udpfd = -1;
     ses->silent = false;
     //
     if (privkey != NULL && strlen(privkey) < SAM3_PRIVKEY_MIN_SIZE)
       goto error;
-    if ((int)type < 0 || (int)type > 2)
+    if ((int)type < 0 || (int)type > 3)
       goto error;
     if (privkey == NULL)
       privkey = "TRANSIENT";
     //
     ses->type = type;
     ses->sigType = sigType;
-    ses->port = (type == SAM3_SESSION_STREAM ? (port ? port : 7656) : 7655);
+    ses->port = ((type == SAM3_SESSION_RAW || type == SAM3_SESSION_DGRAM)
+                     ? 7655
+                     : (port ? port : 7656));
     sam3GenChannelName(ses->channel, 32, 64);
     if (libsam3_debug)
       fprintf(stderr, "sam3CreateSession: channel=[%s]\n", ses->channel);
     //
-    if ((ses->fd = sam3Handshake(hostname, port, &ses->ip)) < 0)
+    if ((ses->fd = sam3HandshakeHost(hostname, port, &ses->ip,
+                                     sesHello(ses))) < 0)
       goto error;
     //
     if (libsam3_debug)
@@ -973,8 +1031,588 @@ error:
   return -1;
 }
 
+// open UDP socket the bridge forwards subsession datagrams to
+// returns its port or <0 on error
+static int subDgramOpen(Sam3Session *sub, int ctl, char *host, int hostsize) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  //
+  // bind to the interface we talk to bridge from
+  if (getsockname(ctl, (struct sockaddr *)&addr, &len) < 0 ||
+      addr.sin_family != AF_INET)
+    return -1;
+  if (inet_ntop(AF_INET, &addr.sin_addr, host, hostsize) == NULL)
+    return -1;
+  addr.sin_port = 0;
+  if ((sub->udpfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    return -1;
+  len = sizeof(addr);
+  if (bind(sub->udpfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      getsockname(sub->udpfd, (struct sockaddr *)&addr, &len) < 0) {
+    close(sub->udpfd);
+    sub->udpfd = -1;
+    return -1;
+  }
+  return ntohs(addr.sin_port);
+}
+
+int sam3AddSubsession(Sam3Session *primary, Sam3Session *sub,
+                      Sam3SessionType type, int listenport,
+                      const char *params) {
+  static const char *typenames[3] = {"RAW", "DATAGRAM", "STREAM"};
+  SAMFieldList *rep;
+  char lsn[32], fwd[64];
+  //
+  if (primary == NULL || sub == NULL || sub == primary)
+    return -1;
+  if (primary->type != SAM3_SESSION_PRIMARY || primary->fd < 0) {
+    strcpyerr(primary, "INVALID_SESSION");
+    return -1;
+  }
+  if ((int)type < 0 || (int)type > 2 || listenport < 0 || listenport > 65535) {
+    strcpyerr(primary, "INVALID_SESSION_TYPE");
+    return -1;
+  }
+  memset(sub, 0, sizeof(Sam3Session));
+  sub->fd = -1;
+  sub->fwd_fd = -1;
+  sub->udpfd = -1;
+  sub->type = type;
+  sub->sigType = primary->sigType;
+  sub->silent = primary->silent;
+  strcpy(sub->privkey, primary->privkey);
+  strcpy(sub->pubkey, primary->pubkey);
+  sub->ip = primary->ip;
+  sub->port = (type == SAM3_SESSION_STREAM ? primary->port : 7655);
+  sam3GenChannelName(sub->channel, 32, 64);
+  fwd[0] = 0;
+  if (type != SAM3_SESSION_STREAM) {
+    // datagrams of all subsessions would share primary's connection otherwise
+    char host[INET_ADDRSTRLEN];
+    int port = subDgramOpen(sub, primary->fd, host, sizeof(host));
+    //
+    if (port < 0) {
+      strcpyerr(primary, "UDP_ERROR");
+      goto error;
+    }
+    snprintf(fwd, sizeof(fwd), " PORT=%d HOST=%s", port, host);
+  }
+  lsn[0] = 0;
+  if (listenport > 0)
+    snprintf(lsn, sizeof(lsn), " LISTEN_PORT=%d", listenport);
+  if (sam3tcpPrintf(primary->fd, "SESSION ADD STYLE=%s ID=%s%s%s%s%s\n",
+                    typenames[(int)type], sub->channel, fwd, lsn,
+                    (params != NULL ? " " : ""),
+                    (params != NULL ? params : "")) < 0 ||
+      (rep = sam3ReadReply(primary->fd)) == NULL) {
+    strcpyerr(primary, "IO_ERROR");
+    goto error;
+  }
+  if (!sam3IsGoodReply(rep, "SESSION", "STATUS", "RESULT", "OK")) {
+    const char *v = sam3FindField(rep, "RESULT");
+    //
+    strcpyerr(primary, (v != NULL && v[0] ? v : "I2P_ERROR"));
+    sam3FreeFieldList(rep);
+    goto error;
+  }
+  sam3FreeFieldList(rep);
+  sub->primary = primary;
+  strcpyerr(primary, NULL);
+  return 0;
+error:
+  if (sub->udpfd >= 0)
+    close(sub->udpfd);
+  memset(sub, 0, sizeof(Sam3Session));
+  sub->fd = -1;
+  sub->fwd_fd = -1;
+  sub->udpfd = -1;
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// bridge sets
+static uint64_t bridgeNow(void) {
+  struct timespec ts;
+  //
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int sam3BridgeSetAdd(Sam3BridgeSet *set, const char *hostname, int port,
+                     int weight) {
+  Sam3Bridge *b;
+  //
+  if (set == NULL || set->count >= SAM3_BRIDGE_MAX || port < 0 ||
+      port > 65535 || weight < 1)
+    return -1;
+  if (hostname == NULL || !hostname[0])
+    hostname = "localhost";
+  if (strlen(hostname) >= sizeof(b->host))
+    return -1;
+  b = &set->bridges[set->count];
+  memset(b, 0, sizeof(Sam3Bridge));
+  strcpy(b->host, hostname);
+  b->port = (port ? port : 7656);
+  b->weight = weight;
+  b->healthy = 1; // until proven otherwise
+  b->rttms = -1;
+  return set->count++;
+}
+
+static void bridgeFailed(Sam3Bridge *b) {
+  b->healthy = 0;
+  ++b->failures;
+}
+
+static void bridgeRtt(Sam3Bridge *b, int ms) {
+  b->rttms = (b->rttms < 0 ? ms : (b->rttms * 7 + ms) / 8);
+}
+
+// smooth weighted round robin over healthy bridges not in 'tried'; when all
+// of them were tried, the one with fewest failures (then lowest RTT) is next
+// <0: every bridge was tried
+static int bridgePick(Sam3BridgeSet *set, uint32_t tried) {
+  int best = -1, total = 0;
+  //
+  for (int f = 0; f < set->count; ++f) {
+    Sam3Bridge *b = &set->bridges[f];
+    //
+    if ((tried & (1u << f)) || !b->healthy)
+      continue;
+    b->current += b->weight;
+    total += b->weight;
+    if (best < 0 || b->current > set->bridges[best].current)
+      best = f;
+  }
+  if (best >= 0) {
+    set->bridges[best].current -= total;
+    return best;
+  }
+  for (int f = 0; f < set->count; ++f) {
+    const Sam3Bridge *b = &set->bridges[f], *o;
+    //
+    if (tried & (1u << f))
+      continue;
+    o = (best >= 0 ? &set->bridges[best] : NULL);
+    if (o == NULL || b->failures < o->failures ||
+        (b->failures == o->failures && b->rttms >= 0 &&
+         (o->rttms < 0 || b->rttms < o->rttms)))
+      best = f;
+  }
+  return best;
+}
+
+// HELLO round trip (with connect); <0: error
+static int bridgeProbeOne(Sam3Bridge *b, int timeoutms) {
+  struct sockaddr_in addr;
+  struct pollfd pfd;
+  struct hostent *host;
+  SAMFieldList *rep = NULL;
+  uint64_t start = bridgeNow();
+  int fd, fl, res = -1, err;
+  socklen_t len = sizeof(err);
+  //
+  if ((host = gethostbyname(b->host)) == NULL || host->h_addr == NULL)
+    return -1;
+  b->ip = ((struct in_addr *)host->h_addr)->s_addr;
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(b->port);
+  addr.sin_addr.s_addr = b->ip;
+  // connect() has no timeout of its own
+  if ((fl = fcntl(fd, F_GETFL)) < 0 ||
+      fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0)
+    goto done;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (errno != EINPROGRESS)
+      goto done;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, timeoutms) != 1 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+      goto done;
+  }
+  timeoutms -= (int)(bridgeNow() - start);
+  if (timeoutms < 1 || fcntl(fd, F_SETFL, fl) < 0 ||
+      sam3tcpSetTimeoutSend(fd, timeoutms) < 0 ||
+      sam3tcpSetTimeoutReceive(fd, timeoutms) < 0 ||
+      sam3tcpPrintf(fd, "%s", SAM3_HELLO) < 0 ||
+      (rep = sam3ReadReply(fd)) == NULL ||
+      !sam3IsGoodReply(rep, "HELLO", "REPLY", "RESULT", "OK"))
+    goto done;
+  res = (int)(bridgeNow() - start);
+done:
+  if (rep != NULL)
+    sam3FreeFieldList(rep);
+  sam3tcpDisconnect(fd);
+  return res;
+}
+
+int sam3BridgeProbe(Sam3BridgeSet *set, int timeoutms) {
+  int healthy = 0;
+  //
+  if (set == NULL || timeoutms < 1)
+    return -1;
+  for (int f = 0; f < set->count; ++f) {
+    Sam3Bridge *b = &set->bridges[f];
+    int ms = bridgeProbeOne(b, timeoutms);
+    //
+    if (ms < 0) {
+      bridgeFailed(b);
+      continue;
+    }
+    bridgeRtt(b, ms);
+    b->healthy = 1;
+    b->failures = 0;
+    ++healthy;
+  }
+  return healthy;
+}
+
+// try bridges until one creates the session; 'ses' keys are used if
+// 'privkey' is NULL
+static int bridgeCreate(Sam3BridgeSet *set, Sam3Session *ses,
+                        const char *privkey, Sam3SessionType type,
+                        Sam3SigType sigType, bool silent, const char *params) {
+  uint32_t tried = 0;
+  int f;
+  //
+  while ((f = bridgePick(set, tried)) >= 0) {
+    Sam3Bridge *b = &set->bridges[f];
+    //
+    tried |= 1u << f;
+    if (sam3CreateSession(ses, b->host, b->port, privkey, type, sigType,
+                          params) == 0) {
+      ses->silent = silent;
+      b->ip = ses->ip;
+      b->healthy = 1;
+      b->failures = 0;
+      ++b->sessions;
+      return f;
+    }
+    bridgeFailed(b);
+  }
+  return -1;
+}
+
+int sam3BridgeCreateSession(Sam3BridgeSet *set, Sam3Session *ses,
+                            const char *privkey, Sam3SessionType type,
+                            Sam3SigType sigType, const char *params) {
+  if (set == NULL || ses == NULL)
+    return -1;
+  return bridgeCreate(set, ses, privkey, type, sigType, false, params);
+}
+
+int sam3BridgeRecreateSession(Sam3BridgeSet *set, Sam3Session *ses,
+                              int bridge, const char *params) {
+  char privkey[SAM3_PRIVKEY_MAX_SIZE + 1];
+  Sam3SessionType type;
+  Sam3SigType sigType;
+  bool silent;
+  //
+  if (set == NULL || ses == NULL || ses->primary != NULL ||
+      !ses->privkey[0] || bridge < 0 || bridge >= set->count)
+    return -1;
+  // same destination on whatever bridge is healthy now
+  strcpy(privkey, ses->privkey);
+  type = ses->type;
+  sigType = ses->sigType;
+  silent = ses->silent;
+  sam3CloseSession(ses);
+  bridgeFailed(&set->bridges[bridge]);
+  return bridgeCreate(set, ses, privkey, type, sigType, silent, params);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// supervisor
+// session errors nothing on this session will recover from
+int sam3SessionLost(const Sam3Session *ses) {
+  return (ses != NULL && (strncmp(ses->error, "IO_ERROR", 8) == 0 ||
+                          strcmp(ses->error, "INVALID_SESSION") == 0 ||
+                          strcmp(ses->error, "INVALID_ID") == 0));
+}
+
+int sam3SupervisorReconnect(Sam3Supervisor *sv, Sam3Session *ses,
+                            Sam3BridgeSet *set, const char *hostname,
+                            int port, const char *params) {
+  char privkey[SAM3_PRIVKEY_MAX_SIZE + 1];
+  Sam3SessionType type;
+  Sam3SigType sigType;
+  BJRandCtx rc;
+  uint64_t start;
+  int64_t delay;
+  bool silent;
+  int res = -1;
+  //
+  if (sv == NULL || ses == NULL || ses->primary != NULL || !ses->privkey[0] ||
+      sv->mindelayms < 1 || sv->maxdelayms < sv->mindelayms)
+    return -1;
+  start = bridgeNow();
+  strcpy(privkey, ses->privkey);
+  type = ses->type;
+  sigType = ses->sigType;
+  silent = ses->silent;
+  sam3CloseSession(ses);
+  if (set != NULL && sv->bridge >= 0 && sv->bridge < set->count)
+    bridgeFailed(&set->bridges[sv->bridge]);
+  bjprngInit(&rc, genSeed());
+  delay = sv->mindelayms;
+  for (int f = 0; sv->maxattempts <= 0 || f < sv->maxattempts; ++f) {
+    // equal jitter: upper half of the delay
+    poll(NULL, 0, (int)(delay - delay / 2 + bjprngRand(&rc) % (delay / 2 + 1)));
+    if ((delay *= 2) > sv->maxdelayms)
+      delay = sv->maxdelayms;
+    if (set != NULL) {
+      res = bridgeCreate(set, ses, privkey, type, sigType, silent, params);
+    } else if ((res = sam3CreateSession(ses, hostname, port, privkey, type,
+                                        sigType, params)) == 0) {
+      ses->silent = silent;
+    }
+    if (res >= 0 && sv->fwdhost != NULL &&
+        sam3StreamForward(ses, sv->fwdhost, sv->fwdport) < 0) {
+      sam3CloseSession(ses);
+      res = -1;
+    }
+    if (res >= 0)
+      break;
+    ++sv->failures;
+  }
+  if (res >= 0) {
+    ++sv->reconnects;
+    if (set != NULL)
+      sv->bridge = res;
+  }
+  sv->lastdownms = bridgeNow() - start;
+  sv->downtimems += sv->lastdownms;
+  return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// keepalive
+int sam3Ping(Sam3Session *ses, int timeoutms) {
+  static unsigned seq;
+  char buf[128], tag[16];
+  struct timeval oldtv;
+  socklen_t len = sizeof(oldtv);
+  uint64_t start;
+  int fd, res = -1;
+  //
+  if (ses == NULL || timeoutms < 1)
+    return -1;
+  if (ses->primary == NULL &&
+      (ses->type == SAM3_SESSION_DGRAM || ses->type == SAM3_SESSION_RAW)) {
+    // its datagrams come over control connection, we would eat them
+    strcpyerr(ses, "INVALID_SESSION_TYPE");
+    return -1;
+  }
+  if ((fd = sesCtlFd(ses)) < 0) {
+    strcpyerr(ses, "INVALID_SESSION");
+    return -1;
+  }
+  if (getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &oldtv, &len) < 0) {
+    strcpyerr(ses, "IO_ERROR");
+    return -1;
+  }
+  snprintf(tag, sizeof(tag), "%u", ++seq);
+  start = bridgeNow();
+  if (sam3tcpPrintf(fd, "PING %s\n", tag) < 0) {
+    strcpyerr(ses, "IO_ERROR");
+    return -1;
+  }
+  for (;;) {
+    int64_t left = timeoutms - (int64_t)(bridgeNow() - start);
+    //
+    if (left < 1) {
+      strcpyerr(ses, "PING_TIMEOUT");
+      break;
+    }
+    if (sam3tcpSetTimeoutReceive(fd, (int)left) < 0 ||
+        sam3tcpReceiveStr(fd, buf, sizeof(buf)) < 0) {
+      strcpyerr(ses, (errno == EAGAIN || errno == EWOULDBLOCK ? "PING_TIMEOUT"
+                                                               : "IO_ERROR"));
+      break;
+    }
+    if (strncmp(buf, "PING", 4) == 0 && (buf[4] == ' ' || !buf[4])) {
+      // the bridge pings us too
+      if (sam3tcpPrintf(fd, "PONG%s\n", buf + 4) < 0) {
+        strcpyerr(ses, "IO_ERROR");
+        break;
+      }
+    } else if (strncmp(buf, "PONG ", 5) == 0 && strcmp(buf + 5, tag) == 0) {
+      res = (int)(bridgeNow() - start);
+      strcpyerr(ses, NULL);
+      break;
+    }
+    // stale PONGs of timed out pings and the like are dropped
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &oldtv, sizeof(oldtv)); // caller's
+  return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// session pools
+int sam3SessionPoolCreate(Sam3SessionPool *pool, Sam3BridgeSet *set,
+                          const char *hostname, int port, int count,
+                          const char *privkey, Sam3SessionType type,
+                          Sam3SigType sigType, const char *params) {
+  int created = 0;
+  //
+  if (pool == NULL || count < 1 || count > SAM3_POOL_MAX ||
+      (int)type < 0 || type == SAM3_SESSION_PRIMARY)
+    return -1;
+  memset(pool, 0, sizeof(Sam3SessionPool));
+  pool->count = count;
+  for (int f = 0; f < count; ++f) {
+    Sam3PoolMember *m = &pool->members[f];
+    //
+    m->ses.fd = -1;
+    m->ses.fwd_fd = -1;
+    m->bridge = -1;
+    if (set != NULL)
+      m->bridge = sam3BridgeCreateSession(set, &m->ses, privkey, type,
+                                          sigType, params);
+    else if (sam3CreateSession(&m->ses, hostname, port, privkey, type,
+                               sigType, params) < 0)
+      continue;
+    if (set != NULL && m->bridge < 0)
+      continue;
+    m->healthy = true;
+    // the rest share destination of the first one (it may be TRANSIENT)
+    if (created++ == 0)
+      privkey = m->ses.privkey;
+  }
+  if (created == 0) {
+    sam3SessionPoolClose(pool);
+    return -1;
+  }
+  return created;
+}
+
+static int poolStreams(const Sam3Session *ses) {
+  int n = 0;
+  //
+  for (const Sam3Connection *c = ses->connlist; c != NULL; c = c->next)
+    ++n;
+  return n;
+}
+
+// healthy member not in 'tried' for 'destkey'; <0: none left
+// peer hash is rendezvous hashing, so losing a member moves only its peers
+static int poolPick(Sam3SessionPool *pool, const char *destkey,
+                    uint32_t tried) {
+  uint32_t h = 2166136261u, best = 0;
+  int pick = -1;
+  //
+  if (pool->policy == SAM3_POOL_PEER_HASH) {
+    for (const char *p = destkey; *p; ++p)
+      h = (h ^ (unsigned char)*p) * 16777619u; // FNV-1a
+  }
+  for (int f = 0; f < pool->count; ++f) {
+    Sam3PoolMember *m = &pool->members[f];
+    //
+    if ((tried & (1u << f)) || !m->healthy)
+      continue;
+    if (pool->policy == SAM3_POOL_PEER_HASH) {
+      uint32_t score = hashint(h ^ hashint(f + 1));
+      //
+      if (pick < 0 || score > best) {
+        pick = f;
+        best = score;
+      }
+      continue;
+    }
+    m->streams = poolStreams(&m->ses);
+    if (pick < 0 || m->streams < pool->members[pick].streams ||
+        (m->streams == pool->members[pick].streams &&
+         m->datagrams < pool->members[pick].datagrams))
+      pick = f;
+  }
+  return pick;
+}
+
+static void poolError(Sam3SessionPool *pool, const char *errstr) {
+  strncpy(pool->error, errstr, sizeof(pool->error) - 1);
+  pool->error[sizeof(pool->error) - 1] = 0;
+}
+
+Sam3Connection *sam3SessionPoolConnect(Sam3SessionPool *pool,
+                                       const char *destkey, int fromport,
+                                       int toport) {
+  uint32_t tried = 0;
+  int f;
+  //
+  if (pool == NULL || destkey == NULL)
+    return NULL;
+  poolError(pool, "NO_SESSION");
+  while ((f = poolPick(pool, destkey, tried)) >= 0) {
+    Sam3PoolMember *m = &pool->members[f];
+    Sam3Connection *conn;
+    //
+    tried |= 1u << f;
+    if ((conn = sam3StreamConnectEx(&m->ses, destkey, fromport, toport)) !=
+        NULL) {
+      ++m->connects;
+      ++m->streams;
+      poolError(pool, "");
+      return conn;
+    }
+    ++m->failures;
+    poolError(pool, m->ses.error);
+    if (!sam3SessionLost(&m->ses))
+      break; // peer trouble, other members won't do better
+    m->healthy = false;
+  }
+  return NULL;
+}
+
+int sam3SessionPoolDatagramSend(Sam3SessionPool *pool, const char *destkey,
+                                const void *buf, size_t bufsize) {
+  uint32_t tried = 0;
+  int f;
+  //
+  if (pool == NULL || destkey == NULL)
+    return -1;
+  poolError(pool, "NO_SESSION");
+  while ((f = poolPick(pool, destkey, tried)) >= 0) {
+    Sam3PoolMember *m = &pool->members[f];
+    //
+    tried |= 1u << f;
+    if (sam3DatagramSend(&m->ses, destkey, buf, bufsize) == 0) {
+      ++m->datagrams;
+      poolError(pool, "");
+      return 0;
+    }
+    ++m->failures;
+    poolError(pool, m->ses.error);
+    if (!sam3SessionLost(&m->ses))
+      break;
+    m->healthy = false;
+  }
+  return -1;
+}
+
+int sam3SessionPoolClose(Sam3SessionPool *pool) {
+  if (pool == NULL)
+    return -1;
+  for (int f = 0; f < pool->count; ++f) {
+    if (pool->members[f].ses.fd >= 0)
+      sam3CloseSession(&pool->members[f].ses);
+  }
+  memset(pool, 0, sizeof(Sam3SessionPool));
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
 Sam3Connection *sam3StreamConnect(Sam3Session *ses, const char *destkey) {
+  return sam3StreamConnectEx(ses, destkey, 0, 0);
+}
+
+Sam3Connection *sam3StreamConnectEx(Sam3Session *ses, const char *destkey,
+                                    int fromport, int toport) {
   if (ses != NULL) {
+    char ports[40] = "";
     SAMFieldList *rep;
     Sam3Connection *conn;
     //
@@ -988,7 +1626,7 @@ Sam3Connection *sam3StreamConnect(Sam3Session *ses, const char *destkey) {
       strcpyerr(ses, "INVALID_SESSION_TYPE");
       return NULL;
     }
-    if (ses->fd < 0) {
+    if (sesCtlFd(ses) < 0) {
       strcpyerr(ses, "INVALID_SESSION");
       return NULL;
     }
@@ -996,17 +1634,23 @@ Sam3Connection *sam3StreamConnect(Sam3Session *ses, const char *destkey) {
       strcpyerr(ses, "INVALID_KEY");
       return NULL;
     }
+    if (fromport < 0 || fromport > 65535 || toport < 0 || toport > 65535) {
+      strcpyerr(ses, "INVALID_PORT");
+      return NULL;
+    }
+    if (fromport != 0 || toport != 0)
+      sprintf(ports, " FROM_PORT=%d TO_PORT=%d", fromport, toport);
     if ((conn = calloc(1, sizeof(Sam3Connection))) == NULL) {
       strcpyerr(ses, "NO_MEMORY");
       return NULL;
     }
-    if ((conn->fd = sam3HandshakeIP(ses->ip, ses->port)) < 0) {
+    if ((conn->fd = sesHandshakeIP(ses)) < 0) {
       strcpyerr(ses, "IO_ERROR_SK");
       goto error;
     }
     if (sam3tcpPrintf(conn->fd,
-                      "STREAM CONNECT ID=%s DESTINATION=%s SILENT=%s\n",
-                      ses->channel, destkey, checkIsSilent(ses)) < 0) {
+                      "STREAM CONNECT ID=%s DESTINATION=%s SILENT=%s%s\n",
+                      ses->channel, destkey, checkIsSilent(ses), ports) < 0) {
       strcpyerr(ses, "IO_ERROR");
       goto error;
     }
@@ -1030,6 +1674,8 @@ Sam3Connection *sam3StreamConnect(Sam3Session *ses, const char *destkey) {
     sam3FreeFieldList(rep);
     if (conn != NULL) {
       strcpy(conn->destkey, destkey);
+      conn->fromPort = fromport;
+      conn->toPort = toport;
       conn->ses = ses;
       conn->next = ses->connlist;
       ses->connlist = conn;
@@ -1043,17 +1689,31 @@ Sam3Connection *sam3StreamConnect(Sam3Session *ses, const char *destkey) {
   return NULL;
 }
 
+// "FROM_PORT=n TO_PORT=n" after destination in SAM 3.2+ accept line
+static void connParsePorts(Sam3Connection *conn, char *opt) {
+  while (opt != NULL) {
+    char *tok = opt;
+    //
+    if ((opt = strchr(opt, ' ')) != NULL)
+      *opt++ = 0;
+    if (strncmp(tok, "FROM_PORT=", 10) == 0)
+      conn->fromPort = atoi(tok + 10);
+    else if (strncmp(tok, "TO_PORT=", 8) == 0)
+      conn->toPort = atoi(tok + 8);
+  }
+}
+
 Sam3Connection *sam3StreamAccept(Sam3Session *ses) {
   if (ses != NULL) {
     SAMFieldList *rep = NULL;
-    char repstr[1024];
+    char repstr[1024], *sp;
     Sam3Connection *conn;
     //
     if (ses->type != SAM3_SESSION_STREAM) {
       strcpyerr(ses, "INVALID_SESSION_TYPE");
       return NULL;
     }
-    if (ses->fd < 0) {
+    if (sesCtlFd(ses) < 0) {
       strcpyerr(ses, "INVALID_SESSION");
       return NULL;
     }
@@ -1061,7 +1721,7 @@ Sam3Connection *sam3StreamAccept(Sam3Session *ses) {
       strcpyerr(ses, "NO_MEMORY");
       return NULL;
     }
-    if ((conn->fd = sam3HandshakeIP(ses->ip, ses->port)) < 0) {
+    if ((conn->fd = sesHandshakeIP(ses)) < 0) {
       strcpyerr(ses, "IO_ERROR_SK");
       goto error;
     }
@@ -1086,18 +1746,25 @@ Sam3Connection *sam3StreamAccept(Sam3Session *ses) {
       goto error;
     }
     sam3FreeFieldList(rep);
-    if ((rep = sam3ParseReply(repstr)) != NULL) {
+    // error reply comes instead of destination line
+    if ((rep = sam3ParseReply(repstr)) != NULL &&
+        sam3IsGoodReply(rep, "STREAM", "STATUS", NULL, NULL)) {
       const char *v = sam3FindField(rep, "RESULT");
       //
       strcpyerr(ses, (v != NULL && v[0] ? v : "I2P_ERROR_RES1"));
       goto error;
     }
+    sam3FreeFieldList(rep);
+    rep = NULL;
+    // 3.2+ bridges append FROM_PORT/TO_PORT to destination
+    if ((sp = strchr(repstr, ' ')) != NULL)
+      *sp++ = 0;
     if (!sam3CheckValidKeyLength(repstr)) {
       strcpyerr(ses, "INVALID_KEY");
       goto error;
     }
-    sam3FreeFieldList(rep);
     strcpy(conn->destkey, repstr);
+    connParsePorts(conn, sp);
     conn->ses = ses;
     conn->next = ses->connlist;
     ses->connlist = conn;
@@ -1113,6 +1780,493 @@ Sam3Connection *sam3StreamAccept(Sam3Session *ses) {
   return NULL;
 }
 
+int sam3StreamAcceptDispatch(Sam3Session *ses, const Sam3PortHandler *table,
+                             int count) {
+  const Sam3PortHandler *def = NULL;
+  Sam3Connection *conn;
+  //
+  if (table == NULL || count < 0) {
+    if (ses != NULL)
+      strcpyerr(ses, "INVALID_ARGUMENT");
+    return -1;
+  }
+  if ((conn = sam3StreamAccept(ses)) == NULL)
+    return -1;
+  for (int f = 0; f < count; ++f) {
+    if (table[f].toport == conn->toPort) {
+      table[f].handler(conn, table[f].udata);
+      return 0;
+    }
+    if (table[f].toport == 0)
+      def = &table[f];
+  }
+  if (def == NULL) {
+    sam3CloseConnection(conn);
+    return 1;
+  }
+  def->handler(conn, def->udata);
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// relay: one pipe (or buffer elsewhere) per direction; direction 0 goes from
+// stream to local socket, 1 back
+#define SAM3_RELAY_CHUNK (65536) // default pipe capacity
+
+typedef struct {
+  int in, out;
+  int pipe[2];
+  char *buf;
+  size_t off, pending;
+  int eof, shut;
+  int64_t bytes;
+} Sam3RelayDir;
+
+// splice() into a socket has no MSG_NOSIGNAL: keep SIGPIPE blocked while
+// relaying and drop the one it raised (unless it was pending before)
+// returns bool: SIGPIPE was pending
+static int sigpipeBlock(sigset_t *old) {
+  sigset_t set, pend;
+  //
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  sigpending(&pend);
+  pthread_sigmask(SIG_BLOCK, &set, old);
+  return sigismember(&pend, SIGPIPE);
+}
+
+static void sigpipeRestore(const sigset_t *old, int waspending) {
+  if (!waspending) {
+    struct timespec ts = {0, 0};
+    sigset_t set, pend;
+    //
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    sigpending(&pend);
+    if (sigismember(&pend, SIGPIPE))
+      sigtimedwait(&set, NULL, &ts);
+  }
+  pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+// move what can be moved without blocking (a few chunks at most)
+// <0: error; 0: ok
+static int relayStep(Sam3RelayDir *d) {
+  for (int64_t moved = 0; moved < 4 * SAM3_RELAY_CHUNK;) {
+    ssize_t n;
+    //
+    while (d->pending > 0) {
+#if defined(__linux__)
+      n = splice(d->pipe[0], NULL, d->out, NULL, d->pending,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+      n = send(d->out, d->buf + d->off, d->pending, MSG_NOSIGNAL);
+#endif
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        return (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+      }
+      d->off += n;
+      d->pending -= n;
+      d->bytes += n;
+      moved += n;
+    }
+    d->off = 0;
+    if (d->eof) {
+      if (!d->shut) {
+        d->shut = 1;
+        shutdown(d->out, SHUT_WR);
+      }
+      return 0;
+    }
+#if defined(__linux__)
+    n = splice(d->in, NULL, d->pipe[1], NULL, SAM3_RELAY_CHUNK,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    n = recv(d->in, d->buf, SAM3_RELAY_CHUNK, 0);
+#endif
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+    }
+    if (n == 0)
+      d->eof = 1;
+    d->pending = n;
+  }
+  return 0;
+}
+
+int sam3Relay(Sam3Connection *conn, int fd, int64_t *tolocal,
+              int64_t *tostream) {
+  Sam3RelayDir dir[2];
+  int fl[2] = {-1, -1}, res = -1;
+  //
+  if (conn == NULL || conn->fd < 0 || fd < 0)
+    return -1;
+  memset(dir, 0, sizeof(dir));
+  dir[0].in = dir[1].out = conn->fd;
+  dir[0].out = dir[1].in = fd;
+  for (int d = 0; d < 2; ++d) {
+    dir[d].pipe[0] = dir[d].pipe[1] = -1;
+#if defined(__linux__)
+    if (pipe2(dir[d].pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+      goto done;
+#else
+    if ((dir[d].buf = malloc(SAM3_RELAY_CHUNK)) == NULL)
+      goto done;
+#endif
+  }
+  // both sockets are non-blocking while relaying, so neither direction
+  // can stall the other
+  if ((fl[0] = fcntl(conn->fd, F_GETFL)) < 0 ||
+      (fl[1] = fcntl(fd, F_GETFL)) < 0 ||
+      fcntl(conn->fd, F_SETFL, fl[0] | O_NONBLOCK) < 0 ||
+      fcntl(fd, F_SETFL, fl[1] | O_NONBLOCK) < 0)
+    goto done;
+  {
+    sigset_t old;
+    int waspending = sigpipeBlock(&old);
+    //
+    for (;;) {
+      struct pollfd pfd[2];
+      //
+      if (relayStep(&dir[0]) < 0 || relayStep(&dir[1]) < 0)
+        break;
+      if (dir[0].shut && dir[1].shut) {
+        res = 0;
+        break;
+      }
+      memset(pfd, 0, sizeof(pfd));
+      for (int d = 0; d < 2; ++d) {
+        // wait for destination while holding data, else for source
+        if (dir[d].shut)
+          continue;
+        if (dir[d].pending > 0)
+          pfd[!d].events |= POLLOUT;
+        else
+          pfd[d].events |= POLLIN;
+      }
+      // sockets with nothing to wait for are left out: they may be hung up
+      pfd[0].fd = (pfd[0].events ? conn->fd : -1);
+      pfd[1].fd = (pfd[1].events ? fd : -1);
+      if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+        break;
+    }
+    sigpipeRestore(&old, waspending);
+  }
+done:
+  if (fl[0] >= 0)
+    fcntl(conn->fd, F_SETFL, fl[0]);
+  if (fl[1] >= 0)
+    fcntl(fd, F_SETFL, fl[1]);
+  for (int d = 0; d < 2; ++d) {
+    for (int f = 0; f < 2; ++f)
+      if (dir[d].pipe[f] >= 0)
+        close(dir[d].pipe[f]);
+    free(dir[d].buf);
+  }
+  if (tolocal != NULL)
+    *tolocal = dir[0].bytes;
+  if (tostream != NULL)
+    *tostream = dir[1].bytes;
+  if (res < 0)
+    strcpy(conn->error, "IO_ERROR");
+  return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// hot restart: session and its streams go to another process over AF_UNIX
+// SOCK_SEQPACKET socket, one record per packet, fds attached as SCM_RIGHTS:
+//   HANDOVER SESSION VERSION=1 STYLE=.. ID=.. HOST=.. PORT=.. DESTINATION=..
+//     PUB=.. [SIGNATURE_TYPE=..] [SILENT=true] [FORWARD=true] [UDP=true]
+//   HANDOVER STREAM DESTINATION=.. FROM_PORT=.. TO_PORT=..
+//   HANDOVER END
+// session record carries control socket, then STREAM FORWARD and datagram
+// sockets if flagged; stream record carries stream socket
+#define SAM3_HANDOVER_VERSION (1)
+#define SAM3_HANDOVER_RECORD (4096) // longest record
+#define SAM3_HANDOVER_FDS (3)       // most fds in one record
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+typedef union {
+  struct cmsghdr hdr;
+  char buf[CMSG_SPACE(SAM3_HANDOVER_FDS * sizeof(int))];
+} Sam3HandoverCtl;
+
+// <0: error; 0: ok
+static int handoverSend(int sock, const char *rec, const int *fds, int nfds) {
+  Sam3HandoverCtl ctl;
+  struct iovec iov = {(void *)rec, strlen(rec)};
+  struct msghdr msg;
+  ssize_t n;
+  //
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (nfds > 0) {
+    struct cmsghdr *c;
+    //
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+  }
+  do {
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  return (n == (ssize_t)iov.iov_len ? 0 : -1);
+}
+
+static void handoverCloseFds(int *fds, int nfds) {
+  for (int f = 0; f < nfds; ++f)
+    close(fds[f]);
+}
+
+// returns parsed record or NULL on error; on success 'fds' gets attached
+// descriptors (up to SAM3_HANDOVER_FDS), on error they are closed
+static SAMFieldList *handoverRecv(int sock, int *fds, int *nfds) {
+  char rec[SAM3_HANDOVER_RECORD + 1];
+  Sam3HandoverCtl ctl;
+  struct iovec iov = {rec, SAM3_HANDOVER_RECORD};
+  struct msghdr msg;
+  SAMFieldList *list = NULL;
+  ssize_t n;
+  //
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  *nfds = 0;
+  if (n < 0)
+    return NULL;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL;
+       c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+      int cnt = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      //
+      for (int f = 0; f < cnt; ++f) {
+        int fd;
+        //
+        memcpy(&fd, CMSG_DATA(c) + f * sizeof(int), sizeof(int));
+        if (*nfds < SAM3_HANDOVER_FDS)
+          fds[(*nfds)++] = fd;
+        else
+          close(fd);
+      }
+    }
+  }
+  if (n > 0 && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    rec[n] = 0;
+    list = sam3ParseReply(rec);
+  }
+  if (list == NULL || !sam3IsGoodReply(list, "HANDOVER", NULL, NULL, NULL)) {
+    sam3FreeFieldList(list);
+    handoverCloseFds(fds, *nfds);
+    *nfds = 0;
+    return NULL;
+  }
+  return list;
+}
+
+static const char *handoverStyle(Sam3SessionType type) {
+  switch (type) {
+  case SAM3_SESSION_RAW:
+    return "RAW";
+  case SAM3_SESSION_DGRAM:
+    return "DATAGRAM";
+  case SAM3_SESSION_STREAM:
+    return "STREAM";
+  default:
+    return NULL;
+  }
+}
+
+int sam3HandoverSend(Sam3Session *ses, int sock) {
+  char rec[SAM3_HANDOVER_RECORD + 1], host[INET_ADDRSTRLEN];
+  struct in_addr addr;
+  int fds[2], nfds = 0, type;
+  socklen_t len = sizeof(type);
+  //
+  if (ses == NULL || ses->fd < 0 || ses->primary != NULL ||
+      handoverStyle(ses->type) == NULL)
+    return -1;
+  if (getsockopt(sock, SOL_SOCKET, SO_TYPE, &type, &len) < 0 ||
+      type != SOCK_SEQPACKET)
+    return -1; // record boundaries keep fds with their records
+  addr.s_addr = ses->ip;
+  if (inet_ntop(AF_INET, &addr, host, sizeof(host)) == NULL)
+    return -1;
+  fds[nfds++] = ses->fd;
+  if (ses->fwd_fd >= 0)
+    fds[nfds++] = ses->fwd_fd;
+  if (snprintf(rec, sizeof(rec),
+               "HANDOVER SESSION VERSION=%d STYLE=%s ID=%s HOST=%s PORT=%d "
+               "DESTINATION=%s PUB=%s SIGNATURE_TYPE=%d SILENT=%s "
+               "FORWARD=%s\n",
+               SAM3_HANDOVER_VERSION, handoverStyle(ses->type), ses->channel,
+               host, ses->port, ses->privkey, ses->pubkey, (int)ses->sigType,
+               (ses->silent ? "true" : "false"),
+               (ses->fwd_fd >= 0 ? "true" : "false")) >= (int)sizeof(rec) ||
+      handoverSend(sock, rec, fds, nfds) < 0)
+    return -1;
+  for (Sam3Connection *c = ses->connlist; c != NULL; c = c->next) {
+    if (c->fd < 0)
+      continue;
+    snprintf(rec, sizeof(rec),
+             "HANDOVER STREAM DESTINATION=%s FROM_PORT=%d TO_PORT=%d\n",
+             c->destkey, c->fromPort, c->toPort);
+    if (handoverSend(sock, rec, &c->fd, 1) < 0)
+      return -1;
+  }
+  if (handoverSend(sock, "HANDOVER END\n", NULL, 0) < 0)
+    return -1;
+  // the other process owns the sockets now: close, don't shut down
+  for (Sam3Connection *n, *c = ses->connlist; c != NULL; c = n) {
+    n = c->next;
+    if (c->fd >= 0)
+      close(c->fd);
+    free(c);
+  }
+  if (ses->fwd_fd >= 0)
+    close(ses->fwd_fd);
+  close(ses->fd);
+  memset(ses, 0, sizeof(Sam3Session));
+  ses->fd = -1;
+  ses->fwd_fd = -1;
+  ses->udpfd = -1;
+  return 0;
+}
+
+// absent flag is false
+static int handoverFlag(const SAMFieldList *rep, const char *name) {
+  const char *v = sam3FindField(rep, name);
+  //
+  return (v != NULL && strcmp(v, "true") == 0);
+}
+
+// session record to 'ses'; takes fds on success
+// <0: error; 0: ok
+static int handoverAdopt(Sam3Session *ses, const SAMFieldList *rep,
+                         const int *fds, int nfds) {
+  const char *style = sam3FindField(rep, "STYLE"),
+             *id = sam3FindField(rep, "ID"),
+             *host = sam3FindField(rep, "HOST"),
+             *port = sam3FindField(rep, "PORT"),
+             *priv = sam3FindField(rep, "DESTINATION"),
+             *pub = sam3FindField(rep, "PUB"),
+             *sig = sam3FindField(rep, "SIGNATURE_TYPE"),
+             *ver = sam3FindField(rep, "VERSION");
+  int fwd = handoverFlag(rep, "FORWARD");
+  struct in_addr addr;
+  //
+  if (!sam3IsGoodReply(rep, "HANDOVER", "SESSION", NULL, NULL) ||
+      ver == NULL || atoi(ver) != SAM3_HANDOVER_VERSION || style == NULL ||
+      id == NULL || strlen(id) >= sizeof(ses->channel) || host == NULL ||
+      inet_pton(AF_INET, host, &addr) != 1 || port == NULL || priv == NULL ||
+      strlen(priv) > SAM3_PRIVKEY_MAX_SIZE || pub == NULL ||
+      strlen(pub) >= sizeof(ses->pubkey))
+    return -1;
+  // datagram socket of libsam3a session is of no use here
+  if (handoverFlag(rep, "UDP") || nfds != (fwd ? 2 : 1))
+    return -1;
+  if (strcmp(style, "STREAM") == 0)
+    ses->type = SAM3_SESSION_STREAM;
+  else if (strcmp(style, "DATAGRAM") == 0)
+    ses->type = SAM3_SESSION_DGRAM;
+  else if (strcmp(style, "RAW") == 0)
+    ses->type = SAM3_SESSION_RAW;
+  else
+    return -1;
+  ses->sigType = (sig != NULL ? (Sam3SigType)atoi(sig) : EdDSA_SHA512_Ed25519);
+  strcpy(ses->channel, id);
+  strcpy(ses->privkey, priv);
+  strcpy(ses->pubkey, pub);
+  ses->ip = addr.s_addr;
+  ses->port = atoi(port);
+  ses->silent = handoverFlag(rep, "SILENT");
+  ses->fd = fds[0];
+  ses->fwd_fd = (fwd ? fds[1] : -1);
+  return 0;
+}
+
+int sam3HandoverRecv(Sam3Session *ses, int sock) {
+  SAMFieldList *rep;
+  int fds[SAM3_HANDOVER_FDS], nfds;
+  //
+  if (ses == NULL)
+    return -1;
+  memset(ses, 0, sizeof(Sam3Session));
+  ses->fd = -1;
+  ses->fwd_fd = -1;
+  ses->udpfd = -1;
+  if ((rep = handoverRecv(sock, fds, &nfds)) == NULL)
+    return -1;
+  if (handoverAdopt(ses, rep, fds, nfds) < 0) {
+    sam3FreeFieldList(rep);
+    handoverCloseFds(fds, nfds);
+    goto error;
+  }
+  sam3FreeFieldList(rep);
+  for (;;) {
+    const char *dest, *from, *to;
+    Sam3Connection *conn;
+    //
+    if ((rep = handoverRecv(sock, fds, &nfds)) == NULL)
+      goto error;
+    if (sam3IsGoodReply(rep, NULL, "END", NULL, NULL) && nfds == 0) {
+      sam3FreeFieldList(rep);
+      return 0;
+    }
+    dest = sam3FindField(rep, "DESTINATION");
+    from = sam3FindField(rep, "FROM_PORT");
+    to = sam3FindField(rep, "TO_PORT");
+    if (!sam3IsGoodReply(rep, NULL, "STREAM", NULL, NULL) || nfds != 1 ||
+        dest == NULL || strlen(dest) >= sizeof(conn->destkey) ||
+        (conn = calloc(1, sizeof(Sam3Connection))) == NULL) {
+      sam3FreeFieldList(rep);
+      handoverCloseFds(fds, nfds);
+      goto error;
+    }
+    strcpy(conn->destkey, dest);
+    conn->fromPort = (from != NULL ? atoi(from) : 0);
+    conn->toPort = (to != NULL ? atoi(to) : 0);
+    conn->fd = fds[0];
+    conn->ses = ses;
+    conn->next = ses->connlist;
+    ses->connlist = conn;
+    sam3FreeFieldList(rep);
+  }
+error:
+  // nothing reached the bridge; drop our copies only
+  for (Sam3Connection *n, *c = ses->connlist; c != NULL; c = n) {
+    n = c->next;
+    close(c->fd);
+    free(c);
+  }
+  if (ses->fwd_fd >= 0)
+    close(ses->fwd_fd);
+  if (ses->fd >= 0)
+    close(ses->fd);
+  memset(ses, 0, sizeof(Sam3Session));
+  ses->fd = -1;
+  ses->fwd_fd = -1;
+  ses->udpfd = -1;
+  return -1;
+}
+
 const char *checkIsSilent(Sam3Session *ses) {
   if (ses->silent == true) {
     return "true";
@@ -1129,7 +2283,7 @@ int sam3StreamForward(Sam3Session *ses, const char *hostname, int port) {
       strcpyerr(ses, "INVALID_SESSION_TYPE");
       return -1;
     }
-    if (ses->fd < 0) {
+    if (sesCtlFd(ses) < 0) {
       strcpyerr(ses, "INVALID_SESSION");
       return -1;
     }
@@ -1137,7 +2291,7 @@ int sam3StreamForward(Sam3Session *ses, const char *hostname, int port) {
       strcpyerr(ses, "DUPLICATE_FORWARD");
       return -1;
     }
-    if ((ses->fwd_fd = sam3HandshakeIP(ses->ip, ses->port)) < 0) {
+    if ((ses->fwd_fd = sesHandshakeIP(ses)) < 0) {
       strcpyerr(ses, "IO_ERROR_SK");
       goto error;
     }
@@ -1178,7 +2332,7 @@ int sam3DatagramSend(Sam3Session *ses, const char *destkey, const void *buf,
       strcpyerr(ses, "INVALID_SESSION_TYPE");
       return -1;
     }
-    if (ses->fd < 0) {
+    if (sesCtlFd(ses) < 0) {
       strcpyerr(ses, "INVALID_SESSION");
       return -1;
     }
@@ -1206,6 +2360,63 @@ int sam3DatagramSend(Sam3Session *ses, const char *destkey, const void *buf,
   return -1;
 }
 
+#define SAM3_DGRAM_BUFSIZE (31744 + 2048)
+
+// DGRAM/RAW subsession: read next datagram bridge forwarded to its socket
+static ssize_t subDatagramReceive(Sam3Session *ses, void *buf,
+                                  size_t bufsize) {
+  char *dg = malloc(SAM3_DGRAM_BUFSIZE + 1);
+  ssize_t res = -1;
+  //
+  if (dg == NULL) {
+    strcpyerr(ses, "NO_MEMORY");
+    return -1;
+  }
+  for (;;) {
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+    char *payload = dg;
+    ssize_t rd = recvfrom(ses->udpfd, dg, SAM3_DGRAM_BUFSIZE, 0,
+                          (struct sockaddr *)&from, &len);
+    //
+    if (rd < 0) {
+      if (errno == EINTR)
+        continue;
+      strcpyerr(ses, "IO_ERROR");
+      break;
+    }
+    // anybody can send to our port; take only what comes from bridge
+    if (from.sin_family != AF_INET || from.sin_addr.s_addr != ses->ip)
+      continue;
+    dg[rd] = 0;
+    if (ses->type == SAM3_SESSION_DGRAM) {
+      // "<destination>[ FROM_PORT=n TO_PORT=n]\n<payload>"
+      char *nl = memchr(dg, '\n', rd), *e = dg;
+      //
+      if (nl == NULL)
+        continue;
+      while (e < nl && *e != ' ')
+        ++e;
+      *e = 0;
+      if (!sam3CheckValidKeyLength(dg))
+        continue;
+      strcpy(ses->destkey, dg);
+      payload = nl + 1;
+    }
+    rd -= payload - dg;
+    if (rd > (ssize_t)bufsize) {
+      strcpyerr(ses, "I2P_ERROR_BUFFER_TOO_SMALL");
+      break;
+    }
+    memcpy(buf, payload, rd);
+    strcpyerr(ses, NULL);
+    res = rd;
+    break;
+  }
+  free(dg);
+  return res;
+}
+
 ssize_t sam3DatagramReceive(Sam3Session *ses, void *buf, size_t bufsize) {
   if (ses != NULL) {
     SAMFieldList *rep;
@@ -1216,7 +2427,7 @@ ssize_t sam3DatagramReceive(Sam3Session *ses, void *buf, size_t bufsize) {
       strcpyerr(ses, "INVALID_SESSION_TYPE");
       return -1;
     }
-    if (ses->fd < 0) {
+    if (sesCtlFd(ses) < 0) {
       strcpyerr(ses, "INVALID_SESSION");
       return -1;
     }
@@ -1224,7 +2435,9 @@ ssize_t sam3DatagramReceive(Sam3Session *ses, void *buf, size_t bufsize) {
       strcpyerr(ses, "INVALID_BUFFER");
       return -1;
     }
-    if ((rep = sam3ReadReply(ses->fd)) == NULL) {
+    if (ses->primary != NULL && ses->udpfd >= 0)
+      return subDatagramReceive(ses, buf, bufsize);
+    if ((rep = sam3ReadReply(sesCtlFd(ses))) == NULL) {
       strcpyerr(ses, "IO_ERROR");
       return -1;
     }
@@ -1260,7 +2473,7 @@ ssize_t sam3DatagramReceive(Sam3Session *ses, void *buf, size_t bufsize) {
     }
     sam3FreeFieldList(rep);
     //
-    if (sam3tcpReceive(ses->fd, buf, size) != size) {
+    if (sam3tcpReceive(sesCtlFd(ses), buf, size) != size) {
       strcpyerr(ses, "IO_ERROR");
       return -1;
     }
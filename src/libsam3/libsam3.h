@@ -138,7 +138,8 @@ extern int sam3HandshakeIP(uint32_t ip, int port);
 typedef enum {
   SAM3_SESSION_RAW,
   SAM3_SESSION_DGRAM,
-  SAM3_SESSION_STREAM
+  SAM3_SESSION_STREAM,
+  SAM3_SESSION_PRIMARY // SAM 3.3; carries subsessions, see sam3AddSubsession()
 } Sam3SessionType;
 
 typedef enum {
@@ -166,6 +167,8 @@ typedef struct Sam3Session {
   struct Sam3Connection *connlist; // list of opened connections
   int fwd_fd;
   bool silent;
+  struct Sam3Session *primary; // subsession: PRIMARY session it was added to
+  int udpfd; // DGRAM/RAW subsession: socket its datagrams are forwarded to
 } Sam3Session;
 
 typedef struct Sam3Connection {
@@ -176,6 +179,8 @@ typedef struct Sam3Connection {
                1]; // remote destination public key (asciiz)
   int destcert;
   char error[32]; // error message (asciiz)
+  int fromPort;   // SAM 3.2 stream ports; 0 if bridge didn't send them
+  int toPort;
 } Sam3Connection;
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -210,6 +215,23 @@ extern int sam3CreateSilentSession(Sam3Session *ses, const char *hostname,
                                    Sam3SessionType type, Sam3SigType sigType,
                                    const char *params);
 
+/*
+ * add subsession to PRIMARY session (SAM 3.3 SESSION ADD)
+ * 'sub' is used as session of 'type' (STREAM, DGRAM or RAW): it shares the
+ * destination, keys and tunnels of 'primary', but has its own ID; the bridge
+ * routes inbound streams by destination port to the subsession whose
+ * 'listenport' matches (0: ports no other subsession listens on)
+ * DGRAM/RAW subsessions get their own UDP socket (SESSION ADD PORT=/HOST=),
+ * so sam3DatagramReceive() on one returns only datagrams sent to it
+ * close subsessions before their primary; sam3CloseSession() on a
+ * subsession removes it on the bridge
+ * 'params' can be NULL
+ * returns <0 on error (sets primary->error), 0 on ok
+ */
+extern int sam3AddSubsession(Sam3Session *primary, Sam3Session *sub,
+                             Sam3SessionType type, int listenport,
+                             const char *params);
+
 /*
  * close SAM session (and all it's connections)
  * returns <0 on error, 0 on ok
@@ -217,6 +239,193 @@ extern int sam3CreateSilentSession(Sam3Session *ses, const char *hostname,
  */
 extern int sam3CloseSession(Sam3Session *ses);
 
+////////////////////////////////////////////////////////////////////////////////
+/*
+ * bridge set: several SAM bridges (routers) sessions can be created on
+ * new sessions go to healthy bridges in proportion to their weights; a
+ * bridge is unhealthy after a failed probe or session, and healthy again
+ * after a good one; unhealthy bridges are tried only when healthy ones fail
+ * 'rttms' is smoothed round trip of HELLO probe (with connect)
+ * zero the set before use; it needs no cleanup
+ */
+#define SAM3_BRIDGE_MAX (16)
+
+typedef struct {
+  char host[256];
+  int port;
+  int weight;
+  uint32_t ip;  // resolved address; 0: not known yet
+  int healthy;  // bool
+  int failures; // in a row
+  int rttms;    // -1: not probed yet
+  int sessions; // created on this bridge
+  int current;  // weighted round robin state
+} Sam3Bridge;
+
+typedef struct {
+  Sam3Bridge bridges[SAM3_BRIDGE_MAX];
+  int count;
+} Sam3BridgeSet;
+
+/*
+ * pass NULL as hostname for 'localhost' and 0 as port for 7656
+ * 'weight' is >= 1
+ * returns <0 on error, bridge index on ok
+ */
+extern int sam3BridgeSetAdd(Sam3BridgeSet *set, const char *hostname, int port,
+                            int weight);
+
+/*
+ * send HELLO to every bridge (one after another), update health and RTT
+ * 'timeoutms' limits each probe
+ * returns <0 on error, number of healthy bridges on ok
+ */
+extern int sam3BridgeProbe(Sam3BridgeSet *set, int timeoutms);
+
+/*
+ * sam3CreateSession() on a bridge of the set; bridges that fail are marked
+ * unhealthy and the next one is tried
+ * returns <0 on error (every bridge failed), bridge index on ok
+ */
+extern int sam3BridgeCreateSession(Sam3BridgeSet *set, Sam3Session *ses,
+                                   const char *privkey, Sam3SessionType type,
+                                   Sam3SigType sigType, const char *params);
+
+/*
+ * session on 'bridge' is lost: close it, mark the bridge unhealthy and
+ * create the session again on the set with the same destination (private
+ * key), type, signature type and SILENT flag
+ * 'params' are SESSION CREATE options as before (can be NULL); PRIMARY
+ * sessions lose their subsessions, subsessions can't be recreated
+ * returns <0 on error ('ses' is closed), bridge index on ok
+ */
+extern int sam3BridgeRecreateSession(Sam3BridgeSet *set, Sam3Session *ses,
+                                     int bridge, const char *params);
+
+////////////////////////////////////////////////////////////////////////////////
+/*
+ * supervisor: bring a lost session back
+ * calls block, so the caller sees the loss (a call failed and
+ * sam3SessionLost() is true) and calls sam3SupervisorReconnect()
+ * zero it, set the delays and (optionally) forwarding before use
+ */
+typedef struct {
+  int mindelayms;  // delay before first attempt
+  int maxdelayms;  // delays double up to this
+  int maxattempts; // <=0: no limit
+  const char *fwdhost; // sam3StreamForward() to restore; NULL: none
+  int fwdport;
+  int bridge; // bridge set: bridge of the session (in/out)
+  // counters
+  int reconnects;     // sessions created again
+  int failures;       // attempts that failed
+  int64_t downtimems; // total time spent in sam3SupervisorReconnect()
+  int64_t lastdownms; // time spent in the last one
+} Sam3Supervisor;
+
+/* returns bool: ses->error says the session is gone on the bridge */
+extern int sam3SessionLost(const Sam3Session *ses);
+
+/*
+ * close the lost session and create it again with the same destination
+ * (TRANSIENT sessions keep the one they got), type, signature type and
+ * SILENT flag; 'params' are SESSION CREATE options as before (can be NULL)
+ * with 'set' the session goes to a healthy bridge of the set and
+ * sv->bridge is marked unhealthy ('hostname' and 'port' are ignored)
+ * before each attempt it sleeps for exponential backoff from
+ * sv->mindelayms up to sv->maxdelayms, picked at random from the upper half
+ * so clients of a restarted router don't come back all at once; gives up
+ * after sv->maxattempts failed attempts
+ * streams are gone; sam3StreamForward() to sv->fwdhost is done again
+ * subsessions can't be reconnected, PRIMARY sessions lose theirs
+ * returns <0 on error ('ses' is closed), 0 or bridge index on ok
+ */
+extern int sam3SupervisorReconnect(Sam3Supervisor *sv, Sam3Session *ses,
+                                   Sam3BridgeSet *set, const char *hostname,
+                                   int port, const char *params);
+
+////////////////////////////////////////////////////////////////////////////////
+/*
+ * keepalive: PING the bridge over the control connection of 'ses'
+ * (subsessions use the one of their PRIMARY session) and wait for its PONG
+ * for up to 'timeoutms'; PINGs of the bridge met meanwhile are answered
+ * nothing runs in background here, call it between other calls on 'ses'
+ * when it has been idle and sam3SupervisorReconnect() on "IO_ERROR"
+ * receive timeout of the control socket is restored afterwards
+ * DGRAM/RAW sessions get their datagrams over the control connection, so
+ * they are refused ("INVALID_SESSION_TYPE"); their subsessions are fine
+ * returns <0 on error ("PING_TIMEOUT" or "IO_ERROR" in ses->error),
+ * round trip time in ms on ok
+ */
+extern int sam3Ping(Sam3Session *ses, int timeoutms);
+
+////////////////////////////////////////////////////////////////////////////////
+/*
+ * session pool: several sessions of one destination (on one bridge or a
+ * bridge set) with outgoing streams and datagrams spread over them, so one
+ * tunnel pool doesn't limit throughput
+ * the bridge must accept the same destination more than once (across
+ * routers it always does)
+ */
+#define SAM3_POOL_MAX (16)
+
+typedef enum {
+  SAM3_POOL_LEAST_OUTSTANDING, // fewest open streams, then fewest datagrams
+  SAM3_POOL_PEER_HASH // same peer, same member while the member is healthy
+} Sam3PoolPolicy;
+
+typedef struct {
+  Sam3Session ses;
+  int bridge;         // index in bridge set; -1: not from a set
+  bool healthy;       // created, and no session error since
+  int streams;        // open streams (as of last pick)
+  uint64_t connects;  // streams opened
+  uint64_t datagrams; // datagrams sent
+  uint64_t failures;  // failed connects and sends
+} Sam3PoolMember;
+
+typedef struct {
+  Sam3PoolMember members[SAM3_POOL_MAX];
+  int count;
+  Sam3PoolPolicy policy; // can be changed any time
+  char error[32];        // why last connect or send failed (asciiz)
+} Sam3SessionPool;
+
+/*
+ * create 'count' sessions of 'type' (not PRIMARY) with the same destination:
+ * 'privkey', or what the bridge gave the first one if 'privkey' is NULL
+ * with 'set' sessions are created by sam3BridgeCreateSession() and spread
+ * over its bridges ('hostname' and 'port' are ignored)
+ * members that couldn't be created are not healthy and are never picked
+ * returns <0 on error (no session was created), number of created sessions
+ * on ok
+ */
+extern int sam3SessionPoolCreate(Sam3SessionPool *pool, Sam3BridgeSet *set,
+                                 const char *hostname, int port, int count,
+                                 const char *privkey, Sam3SessionType type,
+                                 Sam3SigType sigType, const char *params);
+
+/*
+ * sam3StreamConnectEx() on a member picked by pool->policy
+ * member whose session failed (I/O error, bridge forgot it) is marked not
+ * healthy and the next one is tried; peer errors are returned at once
+ * returns NULL on error (sets pool->error); close connection as usual
+ */
+extern Sam3Connection *sam3SessionPoolConnect(Sam3SessionPool *pool,
+                                              const char *destkey,
+                                              int fromport, int toport);
+
+/*
+ * sam3DatagramSend() on a member picked by pool->policy (DGRAM/RAW pools)
+ * returns <0 on error (sets pool->error), 0 on ok
+ */
+extern int sam3SessionPoolDatagramSend(Sam3SessionPool *pool,
+                                       const char *destkey, const void *buf,
+                                       size_t bufsize);
+
+/* close all member sessions */
+extern int sam3SessionPoolClose(Sam3SessionPool *pool);
+
 /*
  * check to see if a SAM session is silent and output
  * characters for use with sam3tcpPrintf() checkIsSilent
@@ -239,6 +448,14 @@ int sam3CheckValidKeyLength(const char *pubkey);
  */
 extern Sam3Connection *sam3StreamConnect(Sam3Session *ses, const char *destkey);
 
+/*
+ * sam3StreamConnect() with SAM 3.2 FROM_PORT/TO_PORT (0..65535; 0: none)
+ * peer's sam3StreamAcceptDispatch() picks the handler by 'toport'
+ */
+extern Sam3Connection *sam3StreamConnectEx(Sam3Session *ses,
+                                           const char *destkey, int fromport,
+                                           int toport);
+
 /*
  * accepts stream connection and sets 'destkey'
  * 'destkey' is 516-byte public key
@@ -249,6 +466,21 @@ extern Sam3Connection *sam3StreamConnect(Sam3Session *ses, const char *destkey);
  */
 extern Sam3Connection *sam3StreamAccept(Sam3Session *ses);
 
+typedef struct {
+  int toport; // 0: every stream no other entry matched
+  void (*handler)(Sam3Connection *conn, void *udata);
+  void *udata;
+} Sam3PortHandler;
+
+/*
+ * accept one stream and pass it to the 'table' entry matching its TO_PORT
+ * streams no entry matched are closed
+ * handler owns 'conn' (close it or hand it to a worker thread)
+ * returns <0 on accept error, 0 if stream was handled, 1 if it was dropped
+ */
+extern int sam3StreamAcceptDispatch(Sam3Session *ses,
+                                    const Sam3PortHandler *table, int count);
+
 /*
  * sets up forwarding stream connection
  * returns <0 on error, 0 on ok
@@ -266,6 +498,44 @@ extern int sam3StreamForward(Sam3Session *ses, const char *hostname, int port);
  */
 extern int sam3CloseConnection(Sam3Connection *conn);
 
+/*
+ * relay stream to local socket 'fd' (i.e. backend connection) until both
+ * sides are done; bytes go both ways with splice() through a pipe per
+ * direction on Linux, so they never enter user space (elsewhere they are
+ * copied through a small buffer)
+ * a side that can't take more stops reading from the other one; EOF from
+ * either side is passed on as shutdown(SHUT_WR) once its data is delivered
+ * both sockets are non-blocking while relaying and SIGPIPE is blocked on the
+ * calling thread; neither socket is closed
+ * 'tolocal'/'tostream' (can be NULL) get bytes moved from stream to 'fd' and
+ * back, also on error
+ * returns <0 on error (sets conn->error), 0 on ok
+ */
+extern int sam3Relay(Sam3Connection *conn, int fd, int64_t *tolocal,
+                     int64_t *tostream);
+
+/*
+ * hot restart: pass live session and its streams to another process, so it
+ * doesn't have to wait for new tunnels and leaseset
+ * 'sock' is connected AF_UNIX SOCK_SEQPACKET socket; channel ID, keys, bridge
+ * address and type go as records, session control socket, STREAM FORWARD
+ * socket and stream sockets as SCM_RIGHTS; the bridge notices nothing
+ * on success the session is released here (sockets are closed, but not shut
+ * down) and 'ses' is cleared; on error nothing is released, close 'sock' so
+ * the other side fails too
+ * PRIMARY sessions and subsessions can't be handed over
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3HandoverSend(Sam3Session *ses, int sock);
+
+/*
+ * adopt session sent by sam3HandoverSend() (or sam3aHandoverSend() if it
+ * doesn't use datagram socket) without SESSION CREATE; its streams are in
+ * ses->connlist
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3HandoverRecv(Sam3Session *ses, int sock);
+
 ////////////////////////////////////////////////////////////////////////////////
 /*
  * generate new keypair
@@ -0,0 +1,368 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+#ifndef LIBSAM3_HPP
+#define LIBSAM3_HPP
+
+/*
+ * C++20 RAII wrapper over libsam3 (header only)
+ *
+ *   auto ses = sam3::Session::create(SAM3_HOST_DEFAULT, SAM3_PORT_DEFAULT);
+ *   if (!ses)
+ *     return fail(ses.error().message());
+ *   auto conn = ses->connect(dest);
+ *   if (!conn || !conn->send(std::as_bytes(std::span(req))))
+ *     ...
+ *
+ * sessions and connections are move-only and close on destruction;
+ * destroy (or close) connections before their session
+ *
+ * functions return Result<T>, which holds either T or Error, like
+ * std::expected; keys are passed and returned as std::string_view, and
+ * stream data goes straight between caller spans and the socket
+ */
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+#include "libsam3.h"
+
+namespace sam3 {
+
+// error message, as in ses->error (no allocation)
+class Error {
+public:
+  explicit Error(const char *msg) {
+    size_t len = strnlen(msg, sizeof(text) - 1);
+    //
+    memcpy(text, msg, len);
+    text[len] = 0;
+  }
+  std::string_view message() const { return text; }
+  const char *c_str() const { return text; }
+
+private:
+  char text[32];
+};
+
+// value or error; subset of std::expected<T, Error>
+template <typename T> class [[nodiscard]] Result {
+public:
+  Result(T v) : v(std::in_place_index<0>, std::move(v)) {}
+  Result(Error e) : v(std::in_place_index<1>, e) {}
+
+  bool has_value() const { return (v.index() == 0); }
+  explicit operator bool() const { return has_value(); }
+  T &value() & { return std::get<0>(v); }
+  const T &value() const & { return std::get<0>(v); }
+  T &&value() && { return std::get<0>(std::move(v)); }
+  T &operator*() & { return value(); }
+  T &&operator*() && { return std::move(*this).value(); }
+  T *operator->() { return &value(); }
+  const T *operator->() const { return &value(); }
+  const Error &error() const { return std::get<1>(v); }
+
+private:
+  std::variant<T, Error> v;
+};
+
+template <> class [[nodiscard]] Result<void> {
+public:
+  Result() : err("") {}
+  Result(Error e) : failed(true), err(e) {}
+
+  bool has_value() const { return !failed; }
+  explicit operator bool() const { return has_value(); }
+  const Error &error() const { return err; }
+
+private:
+  bool failed = false;
+  Error err;
+};
+
+namespace detail {
+
+// NUL-terminated copy of key on stack; libsam3 wants C strings
+template <size_t N> class KeyArg {
+public:
+  explicit KeyArg(std::string_view key) {
+    if ((ok = (key.size() <= N))) {
+      if (!key.empty())
+        memcpy(buf, key.data(), key.size());
+      buf[key.size()] = 0;
+    }
+  }
+  bool ok;
+  char buf[N + 1];
+};
+
+using PubKeyArg = KeyArg<SAM3_PUBKEY_SIZE + SAM3_CERT_SIZE>;
+using PrivKeyArg = KeyArg<SAM3_PRIVKEY_MAX_SIZE>;
+
+} // namespace detail
+
+// destination keys from Session::generateKeys()/lookup(); stored inline
+class Keys {
+public:
+  std::string_view pubkey() const { return pub; }
+  std::string_view privkey() const { return priv; }
+
+private:
+  friend class Session;
+  char pub[SAM3_PUBKEY_SIZE + SAM3_CERT_SIZE + 1] = "";
+  char priv[SAM3_PRIVKEY_MAX_SIZE + 1] = "";
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// stream connection; closed on destruction
+class Connection {
+public:
+  Connection() = default;
+  Connection(Connection &&c) noexcept : conn(std::exchange(c.conn, nullptr)) {}
+  Connection &operator=(Connection &&c) noexcept {
+    if (this != &c) {
+      close();
+      conn = std::exchange(c.conn, nullptr);
+    }
+    return *this;
+  }
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+  ~Connection() { close(); }
+
+  explicit operator bool() const { return (conn != nullptr); }
+  Sam3Connection *get() const { return conn; }
+  int fd() const { return (conn != nullptr ? conn->fd : -1); }
+  // remote destination
+  std::string_view destkey() const {
+    return (conn != nullptr ? conn->destkey : "");
+  }
+  // SAM 3.2 stream ports (0: none)
+  int fromPort() const { return (conn != nullptr ? conn->fromPort : 0); }
+  int toPort() const { return (conn != nullptr ? conn->toPort : 0); }
+
+  // send the whole buffer
+  Result<void> send(std::span<const std::byte> buf) {
+    if (sam3tcpSend(fd(), buf.data(), buf.size()) < 0)
+      return Error("IO_ERROR");
+    return {};
+  }
+
+  // receive what is available (blocks for at least one byte); 0: EOF
+  Result<size_t> receive(std::span<std::byte> buf) {
+    return recv(buf, 1);
+  }
+
+  // fill the whole buffer; less than buf.size() only on EOF
+  Result<size_t> receiveAll(std::span<std::byte> buf) { return recv(buf, 0); }
+
+  void close() {
+    if (conn != nullptr)
+      sam3CloseConnection(std::exchange(conn, nullptr));
+  }
+
+private:
+  friend class Session;
+  explicit Connection(Sam3Connection *c) : conn(c) {}
+  Sam3Connection *conn = nullptr;
+
+  Result<size_t> recv(std::span<std::byte> buf, int allowPartial) {
+    ssize_t rd;
+    //
+    errno = 0;
+    rd = sam3tcpReceiveEx(fd(), buf.data(), buf.size(), allowPartial);
+    // recv() failing before any byte arrived also gives 0
+    if (rd < 0 || (rd == 0 && errno != 0 && !buf.empty()))
+      return Error("IO_ERROR");
+    return (size_t)rd;
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// SAM session; closes itself and all its connections on destruction
+class Session {
+public:
+  Session() = default;
+  Session(Session &&) noexcept = default;
+  Session &operator=(Session &&s) noexcept {
+    if (this != &s) {
+      close();
+      ses = std::move(s.ses);
+    }
+    return *this;
+  }
+  ~Session() { close(); }
+
+  /*
+   * see sam3CreateSession(); empty 'privkey' creates TRANSIENT session
+   * 'hostname' and 'params' can be NULL
+   */
+  static Result<Session>
+  create(const char *hostname, int port, std::string_view privkey = {},
+         Sam3SessionType type = SAM3_SESSION_STREAM,
+         Sam3SigType sigType = EdDSA_SHA512_Ed25519,
+         const char *params = nullptr) {
+    detail::PrivKeyArg key(privkey);
+    Session s;
+    //
+    if (!key.ok)
+      return Error("INVALID_KEY");
+    s.ses = std::make_unique<Sam3Session>();
+    if (sam3CreateSession(s.ses.get(), hostname, port,
+                          (privkey.empty() ? nullptr : key.buf), type, sigType,
+                          params) < 0) {
+      // nothing to close
+      Error e(s.ses->error[0] ? s.ses->error : "SESSION_ERROR");
+      //
+      s.ses.reset();
+      return e;
+    }
+    return s;
+  }
+
+  // see sam3GenerateKeys()
+  static Result<Keys> generateKeys(const char *hostname, int port,
+                                   Sam3SigType sigType = EdDSA_SHA512_Ed25519) {
+    std::unique_ptr<Sam3Session> tmp = std::make_unique<Sam3Session>();
+    Keys keys;
+    //
+    if (sam3GenerateKeys(tmp.get(), hostname, port, sigType) < 0)
+      return Error("KEYS_ERROR");
+    memcpy(keys.pub, tmp->pubkey, sizeof(keys.pub));
+    memcpy(keys.priv, tmp->privkey, sizeof(keys.priv));
+    return keys;
+  }
+
+  // see sam3NameLookup(); fills pubkey() only
+  static Result<Keys> lookup(const char *hostname, int port,
+                             const char *name) {
+    std::unique_ptr<Sam3Session> tmp = std::make_unique<Sam3Session>();
+    Keys keys;
+    //
+    if (sam3NameLookup(tmp.get(), hostname, port, name) < 0)
+      return Error(tmp->error[0] ? tmp->error : "LOOKUP_ERROR");
+    memcpy(keys.pub, tmp->destkey, sizeof(keys.pub));
+    return keys;
+  }
+
+  explicit operator bool() const { return (ses != nullptr); }
+  Sam3Session *get() const { return ses.get(); }
+  std::string_view pubkey() const { return (ses ? ses->pubkey : ""); }
+  std::string_view privkey() const { return (ses ? ses->privkey : ""); }
+  // sender of the last datagram received
+  std::string_view destkey() const { return (ses ? ses->destkey : ""); }
+
+  // see sam3StreamConnectEx()
+  Result<Connection> connect(std::string_view destkey, int fromport = 0,
+                             int toport = 0) {
+    detail::PubKeyArg key(destkey);
+    Sam3Connection *c;
+    //
+    if (!key.ok)
+      return Error("INVALID_KEY");
+    if (!ses || (c = sam3StreamConnectEx(ses.get(), key.buf, fromport,
+                                         toport)) == nullptr)
+      return err("CONNECT_ERROR");
+    return Connection(c);
+  }
+
+  Result<Connection> accept() {
+    Sam3Connection *c;
+    //
+    if (!ses || (c = sam3StreamAccept(ses.get())) == nullptr)
+      return err("ACCEPT_ERROR");
+    return Connection(c);
+  }
+
+  // see sam3StreamForward()
+  Result<void> forward(const char *hostname, int port) {
+    if (!ses || sam3StreamForward(ses.get(), hostname, port) < 0)
+      return err("FORWARD_ERROR");
+    return {};
+  }
+
+  /*
+   * see sam3AddSubsession(); this must be a PRIMARY session and outlive the
+   * returned subsession
+   */
+  Result<Session> addSubsession(Sam3SessionType type, int listenport = 0,
+                                const char *params = nullptr) {
+    Session s;
+    //
+    if (!ses)
+      return Error("INVALID_SESSION");
+    s.ses = std::make_unique<Sam3Session>();
+    if (sam3AddSubsession(ses.get(), s.ses.get(), type, listenport, params) <
+        0)
+      return err("SESSION_ERROR");
+    return s;
+  }
+
+  Result<void> datagramSend(std::string_view destkey,
+                            std::span<const std::byte> buf) {
+    detail::PubKeyArg key(destkey);
+    //
+    if (!key.ok)
+      return Error("INVALID_KEY");
+    if (!ses || sam3DatagramSend(ses.get(), key.buf, buf.data(), buf.size()) <
+                    0)
+      return err("DATAGRAM_ERROR");
+    return {};
+  }
+
+  // sets destkey() to sender (not for RAW)
+  Result<size_t> datagramReceive(std::span<std::byte> buf) {
+    ssize_t rd;
+    //
+    if (!ses || (rd = sam3DatagramReceive(ses.get(), buf.data(), buf.size())) <
+                    0)
+      return err("DATAGRAM_ERROR");
+    return (size_t)rd;
+  }
+
+  void close() {
+    if (ses) {
+      sam3CloseSession(ses.get());
+      ses.reset();
+    }
+  }
+
+private:
+  std::unique_ptr<Sam3Session> ses; // connections point to it
+
+  Error err(const char *def) const {
+    return Error((ses && ses->error[0]) ? ses->error : def);
+  }
+};
+
+} // namespace sam3
+
+#endif
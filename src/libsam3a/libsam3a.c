@@ -23,6 +23,10 @@
  * http://git.idk.i2p/i2p-hackers/libsam3/
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // sendmmsg(), recvmmsg(), splice()
+#endif
+
 #include "libsam3a.h"
 
 #include <ctype.h>
@@ -55,10 +59,19 @@
 #if defined(__unix__) || defined(__APPLE__)
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
 #endif
 
 #if defined(__APPLE__)
@@ -149,26 +162,195 @@ static int sam3aSocketSetTimeoutReceive (int fd, int timeoutms) {
 }
 */
 
-static int sam3aBytesAvail(int fd) {
-  int av = 0;
-  //
-  if (ioctl(fd, FIONREAD, &av) < 0)
+////////////////////////////////////////////////////////////////////////////////
+// wakeup fd: lets other threads make the event loop's select() return
+// eventfd on Linux, nonblocking pipe elsewhere; fds[0] is polled for reading,
+// fds[1] is signalled (both are the same eventfd)
+// <0: error; 0: ok
+static int wakeOpen(int fds[2]) {
+#if defined(__linux__)
+  if ((fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
     return -1;
-  return av;
+  fds[1] = fds[0];
+#else
+  if (pipe(fds) < 0)
+    return -1;
+  for (int f = 0; f < 2; ++f) {
+    fcntl(fds[f], F_SETFL, fcntl(fds[f], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[f], F_SETFD, FD_CLOEXEC);
+  }
+#endif
+  return 0;
+}
+
+static void wakeClose(int fds[2]) {
+  if (fds[1] != fds[0] && fds[1] >= 0)
+    close(fds[1]);
+  if (fds[0] >= 0)
+    close(fds[0]);
+  fds[0] = fds[1] = -1;
 }
 
-static uint32_t sam3aResolveHost(const char *hostname) {
-  struct hostent *host;
+static void wakeSignal(int fd) {
+#if defined(__linux__)
+  uint64_t one = 1;
   //
-  if (hostname == NULL || !hostname[0])
-    return 0;
-  if ((host = gethostbyname(hostname)) == NULL || host->h_name == NULL ||
-      !host->h_addr_list[0][0]) {
-    if (libsam3a_debug)
-      fprintf(stderr, "ERROR: can't resolve '%s'\n", hostname);
+  while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+    ;
+#else
+  char ch = 0;
+  //
+  while (write(fd, &ch, 1) < 0 && errno == EINTR)
+    ;
+#endif
+}
+
+// consume all pending signals
+static void wakeDrain(int fd) {
+  char buf[64];
+  //
+  for (;;) {
+    ssize_t rd = read(fd, buf, sizeof(buf));
+    //
+    if (rd < 0 && errno == EINTR)
+      continue;
+    if (rd <= 0 || rd < (ssize_t)sizeof(buf))
+      break;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// bridge host name resolution
+// numeric addresses and cached names are resolved in place; anything else is
+// handed to a resolver thread which signals the job wakeup fd when done
+struct Sam3AResolve {
+  int refs;     // session + resolver thread; guarded by resolveLock
+  int done;     // guarded by resolveLock
+  uint32_t ip;  // 0: lookup failed
+  int port;     // bridge TCP port to connect to when resolved
+  int wake[2];
+  char host[];
+};
+
+typedef struct {
+  char host[256];
+  uint32_t ip;
+  time_t expires;
+} Sam3AResolveCacheEntry;
+
+static pthread_mutex_t resolveLock = PTHREAD_MUTEX_INITIALIZER;
+static Sam3AResolveCacheEntry resolveCache[SAM3A_RESOLVE_CACHE_SIZE];
+
+// 0: not numeric
+static uint32_t resolveNumeric(const char *hostname) {
+  struct in_addr addr;
+  //
+  if (inet_pton(AF_INET, hostname, &addr) != 1)
     return 0;
+  return addr.s_addr;
+}
+
+// 0: not in cache
+static uint32_t resolveCacheGet(const char *hostname) {
+  time_t now = time(NULL);
+  uint32_t ip = 0;
+  //
+  pthread_mutex_lock(&resolveLock);
+  for (int f = 0; f < SAM3A_RESOLVE_CACHE_SIZE; ++f) {
+    if (resolveCache[f].expires > now &&
+        strcmp(resolveCache[f].host, hostname) == 0) {
+      ip = resolveCache[f].ip;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&resolveLock);
+  return ip;
+}
+
+// replaces same name, expired or oldest entry
+static void resolveCachePut(const char *hostname, uint32_t ip) {
+  Sam3AResolveCacheEntry *e = &resolveCache[0];
+  //
+  if (strlen(hostname) >= sizeof(e->host))
+    return;
+  pthread_mutex_lock(&resolveLock);
+  for (int f = 0; f < SAM3A_RESOLVE_CACHE_SIZE; ++f) {
+    if (strcmp(resolveCache[f].host, hostname) == 0) {
+      e = &resolveCache[f];
+      break;
+    }
+    if (resolveCache[f].expires < e->expires)
+      e = &resolveCache[f];
+  }
+  strcpy(e->host, hostname);
+  e->ip = ip;
+  e->expires = time(NULL) + SAM3A_RESOLVE_CACHE_TTL;
+  pthread_mutex_unlock(&resolveLock);
+}
+
+static void resolveRelease(Sam3AResolve *rs) {
+  int refs;
+  //
+  pthread_mutex_lock(&resolveLock);
+  refs = --rs->refs;
+  pthread_mutex_unlock(&resolveLock);
+  if (refs == 0) {
+    wakeClose(rs->wake);
+    free(rs);
+  }
+}
+
+static void *resolveThread(void *arg) {
+  Sam3AResolve *rs = (Sam3AResolve *)arg;
+  struct addrinfo hints, *res = NULL;
+  uint32_t ip = 0;
+  //
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(rs->host, NULL, &hints, &res) == 0 && res != NULL) {
+    ip = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+    resolveCachePut(rs->host, ip);
+  } else if (libsam3a_debug) {
+    fprintf(stderr, "ERROR: can't resolve '%s'\n", rs->host);
+  }
+  if (res != NULL)
+    freeaddrinfo(res);
+  pthread_mutex_lock(&resolveLock);
+  rs->ip = ip;
+  rs->done = 1;
+  pthread_mutex_unlock(&resolveLock);
+  wakeSignal(rs->wake[1]);
+  resolveRelease(rs);
+  return NULL;
+}
+
+// start background lookup; returns NULL on error
+static Sam3AResolve *resolveStart(const char *hostname, int port) {
+  Sam3AResolve *rs = calloc(1, sizeof(Sam3AResolve) + strlen(hostname) + 1);
+  pthread_attr_t attr;
+  pthread_t thr;
+  int res;
+  //
+  if (rs == NULL)
+    return NULL;
+  strcpy(rs->host, hostname);
+  rs->port = port;
+  rs->refs = 2;
+  if (wakeOpen(rs->wake) < 0) {
+    free(rs);
+    return NULL;
   }
-  return ((struct in_addr *)host->h_addr_list[0])->s_addr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  res = pthread_create(&thr, &attr, resolveThread, rs);
+  pthread_attr_destroy(&attr);
+  if (res != 0) {
+    wakeClose(rs->wake);
+    free(rs);
+    return NULL;
+  }
+  return rs;
 }
 
 static int sam3aConnect(uint32_t ip, int port, int *complete) {
@@ -686,7 +868,7 @@ static inline uint32_t hashint(uint32_t a) {
 }
 
 static uint32_t genSeed(void) {
-  volatile uint32_t seed = 1;
+  static uint32_t seed = 1; // sessions created in the same second differ
   uint32_t res;
 #ifndef WIN32
   #ifndef __APPLE__
@@ -743,6 +925,9 @@ int sam3aGenChannelName(char *dest, int minlen, int maxlen) {
 
 ////////////////////////////////////////////////////////////////////////////////
 int sam3aIsActiveSession(const Sam3ASession *ses) {
+  // subsessions live on primary's control connection
+  if (ses != NULL && ses->primary != NULL)
+    return (!ses->cancelled && sam3aIsActiveSession(ses->primary));
   return (ses != NULL && ses->fd >= 0 && !ses->cancelled);
 }
 
@@ -765,31 +950,452 @@ static inline void strcpyerrc(Sam3AConnection *conn, const char *errstr) {
     strncpy(conn->error, errstr, sizeof(conn->error) - 1);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// max segments passed to one sendmsg() call
+#define SAM3A_SEND_IOV_MAX (16)
+
+static Sam3ASendSeg *poolGetSeg(Sam3APool *pool) {
+  Sam3ASendSeg *seg = pool->segFree;
+  //
+  if (seg != NULL) {
+    pool->segFree = seg->next;
+    --pool->segFreeCount;
+  } else if ((seg = malloc(sizeof(Sam3ASendSeg) + SAM3A_SENDSEG_SIZE)) ==
+             NULL) {
+    return NULL;
+  } else {
+    ++pool->allocs;
+  }
+  seg->next = NULL;
+  seg->buf = (char *)(seg + 1);
+  seg->size = SAM3A_SENDSEG_SIZE;
+  seg->used = seg->pos = 0;
+  seg->freecb = NULL;
+  seg->udata = NULL;
+  return seg;
+}
+
+static Sam3ASendSeg *poolGetRef(Sam3APool *pool, const void *buf, int size) {
+  Sam3ASendSeg *seg = pool->refFree;
+  //
+  if (seg != NULL) {
+    pool->refFree = seg->next;
+    --pool->refFreeCount;
+  } else if ((seg = malloc(sizeof(Sam3ASendSeg))) == NULL) {
+    return NULL;
+  } else {
+    ++pool->allocs;
+  }
+  seg->next = NULL;
+  seg->buf = (char *)buf;
+  seg->size = 0;
+  seg->used = size;
+  seg->pos = 0;
+  seg->freecb = NULL;
+  seg->udata = NULL;
+  return seg;
+}
+
+// doesn't call segment callback
+static void poolPutSeg(Sam3APool *pool, Sam3ASendSeg *seg) {
+  if (seg->size == 0) {
+    if (pool->refFreeCount < SAM3A_SENDSEG_CACHE) {
+      seg->next = pool->refFree;
+      pool->refFree = seg;
+      ++pool->refFreeCount;
+      return;
+    }
+  } else if (pool->segFreeCount < SAM3A_SENDSEG_CACHE) {
+    seg->next = pool->segFree;
+    pool->segFree = seg;
+    ++pool->segFreeCount;
+    return;
+  }
+  free(seg);
+}
+
+// returns SAM3A_READBUF_SIZE+1 bytes (there is always room for '\0')
+// free buffers keep 'next' pointer in their first bytes
+static char *poolGetReadBuf(Sam3APool *pool) {
+  char *buf = pool->readFree;
+  //
+  if (buf != NULL) {
+    pool->readFree = *(char **)buf;
+    --pool->readFreeCount;
+  } else if ((buf = malloc(SAM3A_READBUF_SIZE + 1)) != NULL) {
+    ++pool->allocs;
+  }
+  return buf;
+}
+
+static void poolPutReadBuf(Sam3APool *pool, char *buf) {
+  if (pool->readFreeCount < SAM3A_READBUF_CACHE) {
+    *(char **)buf = pool->readFree;
+    pool->readFree = buf;
+    ++pool->readFreeCount;
+  } else {
+    free(buf);
+  }
+}
+
+static void poolClear(Sam3APool *pool) {
+  while (pool->readFree != NULL) {
+    char *buf = pool->readFree;
+    //
+    pool->readFree = *(char **)buf;
+    free(buf);
+  }
+  pool->readFreeCount = 0;
+  while (pool->segFree != NULL) {
+    Sam3ASendSeg *seg = pool->segFree;
+    //
+    pool->segFree = seg->next;
+    free(seg);
+  }
+  while (pool->refFree != NULL) {
+    Sam3ASendSeg *seg = pool->refFree;
+    //
+    pool->refFree = seg->next;
+    free(seg);
+  }
+  pool->segFreeCount = pool->refFreeCount = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+struct Sam3AConnSlab {
+  Sam3AConnSlab *next;
+  Sam3AConnection conns[SAM3A_CONN_SLAB_SIZE];
+};
+
+// sam3aSubmitConnect() allocates off the loop thread and reactor shards
+// free on theirs; sessions are reset with memset(), so the lock can't live
+// in them; it is held for a few pointer updates only
+static pthread_mutex_t connCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void connCacheLock(Sam3AConnCache *cc) {
+  (void)cc;
+  pthread_mutex_lock(&connCacheMutex);
+}
+
+static inline void connCacheUnlock(Sam3AConnCache *cc) {
+  (void)cc;
+  pthread_mutex_unlock(&connCacheMutex);
+}
+
+// returns zeroed connection or NULL
+static Sam3AConnection *connCacheGet(Sam3AConnCache *cc) {
+  Sam3AConnection *conn;
+  //
+  connCacheLock(cc);
+  if (cc->free == NULL) {
+    Sam3AConnSlab *slab = malloc(sizeof(Sam3AConnSlab));
+    //
+    if (slab == NULL) {
+      connCacheUnlock(cc);
+      return NULL;
+    }
+    slab->next = cc->slabs;
+    cc->slabs = slab;
+    ++cc->allocs;
+    for (int f = SAM3A_CONN_SLAB_SIZE - 1; f >= 0; --f) {
+      slab->conns[f].next = cc->free;
+      cc->free = &slab->conns[f];
+    }
+    cc->freeCount += SAM3A_CONN_SLAB_SIZE;
+  }
+  conn = cc->free;
+  cc->free = conn->next;
+  --cc->freeCount;
+  ++cc->used;
+  connCacheUnlock(cc);
+  memset(conn, 0, sizeof(Sam3AConnection));
+  return conn;
+}
+
+static void connCachePut(Sam3AConnCache *cc, Sam3AConnection *conn) {
+  memset(conn, 0, sizeof(Sam3AConnection));
+  // stale pointers see a dead connection, not fd 0
+  conn->fd = -1;
+  conn->cancelled = 1;
+  connCacheLock(cc);
+  conn->next = cc->free;
+  cc->free = conn;
+  ++cc->freeCount;
+  --cc->used;
+  connCacheUnlock(cc);
+}
+
+// all connections must be closed
+static void connCacheClear(Sam3AConnCache *cc) {
+  while (cc->slabs != NULL) {
+    Sam3AConnSlab *slab = cc->slabs;
+    //
+    cc->slabs = slab->next;
+    free(slab);
+  }
+  cc->free = NULL;
+  cc->freeCount = cc->used = 0;
+}
+
+// remove head segment from the queue and notify its owner
+static void sendqPop(Sam3ASendQueue *q, Sam3APool *pool) {
+  Sam3ASendSeg *seg = q->head;
+  void (*freecb)(void *udata) = seg->freecb;
+  void *udata = seg->udata;
+  //
+  if ((q->head = seg->next) == NULL)
+    q->tail = NULL;
+  q->bytes -= seg->used - seg->pos;
+  poolPutSeg(pool, seg);
+  if (freecb != NULL)
+    freecb(udata);
+}
+
+static void sendqClear(Sam3ASendQueue *q, Sam3APool *pool) {
+  while (q->head != NULL)
+    sendqPop(q, pool);
+  q->bytes = 0;
+}
+
+// drop segments added after 'oldtail'; callbacks are not called
+static void sendqRollback(Sam3ASendQueue *q, Sam3APool *pool,
+                          Sam3ASendSeg *oldtail, int oldused) {
+  Sam3ASendSeg *seg = (oldtail != NULL ? oldtail->next : q->head);
+  //
+  if (oldtail != NULL) {
+    oldtail->used = oldused;
+    oldtail->next = NULL;
+  } else {
+    q->head = NULL;
+  }
+  q->tail = oldtail;
+  while (seg != NULL) {
+    Sam3ASendSeg *n = seg->next;
+    //
+    poolPutSeg(pool, seg);
+    seg = n;
+  }
+}
+
+// <0: error; 0: ok
+// either all data is queued or nothing
+static int sendqAppend(Sam3ASendQueue *q, Sam3APool *pool, const void *data,
+                       int datasize) {
+  Sam3ASendSeg *oldtail = q->tail;
+  int oldused = (oldtail != NULL ? oldtail->used : 0);
+  const char *d = (const char *)data;
+  int left = datasize;
+  //
+  while (left > 0) {
+    Sam3ASendSeg *seg = q->tail;
+    int n;
+    //
+    if (seg == NULL || seg->size == 0 || seg->used == seg->size) {
+      // no tail or it is caller memory or it is full
+      if ((seg = poolGetSeg(pool)) == NULL) {
+        sendqRollback(q, pool, oldtail, oldused);
+        return -1;
+      }
+      if (q->tail != NULL)
+        q->tail->next = seg;
+      else
+        q->head = seg;
+      q->tail = seg;
+    }
+    if ((n = seg->size - seg->used) > left)
+      n = left;
+    memcpy(seg->buf + seg->used, d, n);
+    seg->used += n;
+    d += n;
+    left -= n;
+  }
+  q->bytes += datasize;
+  return 0;
+}
+
+// <0: error; 0: ok
+// either all buffers are queued or nothing
+static int sendqAppendRefs(Sam3ASendQueue *q, Sam3APool *pool,
+                           const struct iovec *iov, int n,
+                           void (*freecb)(void *udata), void *udata) {
+  Sam3ASendSeg *oldtail = q->tail, *seg = NULL;
+  int oldused = (oldtail != NULL ? oldtail->used : 0);
+  int64_t total = 0;
+  //
+  for (int f = 0; f < n; ++f) {
+    if (iov[f].iov_len == 0)
+      continue;
+    if ((seg = poolGetRef(pool, iov[f].iov_base, iov[f].iov_len)) == NULL) {
+      sendqRollback(q, pool, oldtail, oldused);
+      return -1;
+    }
+    if (q->tail != NULL)
+      q->tail->next = seg;
+    else
+      q->head = seg;
+    q->tail = seg;
+    total += iov[f].iov_len;
+  }
+  q->bytes += total;
+  // segments are written in order, so the last one completes the batch
+  if (seg != NULL) {
+    seg->freecb = freecb;
+    seg->udata = udata;
+  } else if (freecb != NULL) {
+    freecb(udata); // nothing to send
+  }
+  return 0;
+}
+
+// write as much as socket accepts, but no more than 'budget' (<0: no limit);
+// several segments per call
+// <0: error; >=0: bytes sent
+static int64_t sendqWrite(int fd, Sam3ASendQueue *q, Sam3APool *pool,
+                          int64_t budget) {
+  int64_t total = 0;
+  //
+  while (q->head != NULL && (budget < 0 || total < budget)) {
+    struct iovec iov[SAM3A_SEND_IOV_MAX];
+    struct msghdr msg;
+    ssize_t wr;
+    int64_t room = (budget < 0 ? INT64_MAX : budget - total);
+    int cnt = 0;
+    //
+    for (Sam3ASendSeg *seg = q->head;
+         seg != NULL && cnt < SAM3A_SEND_IOV_MAX && room > 0;
+         seg = seg->next, ++cnt) {
+      iov[cnt].iov_base = seg->buf + seg->pos;
+      iov[cnt].iov_len = seg->used - seg->pos;
+      if ((int64_t)iov[cnt].iov_len > room)
+        iov[cnt].iov_len = room;
+      room -= iov[cnt].iov_len;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    //
+    if ((wr = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR)
+        continue; // interrupted by signal
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break; // socket buffer is full
+      return -1;
+    }
+    if (wr == 0)
+      break; // can't send anything
+    total += wr;
+    // release written segments
+    while (q->head != NULL) {
+      Sam3ASendSeg *seg = q->head;
+      int left = seg->used - seg->pos;
+      //
+      if (wr < left) {
+        seg->pos += wr;
+        q->bytes -= wr;
+        break;
+      }
+      wr -= left;
+      sendqPop(q, pool);
+    }
+  }
+  //
+  return total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void aioFreeLineBuf(Sam3AIO *aio) {
+  if (aio->rbuf != NULL) {
+    free(aio->rbuf);
+    aio->rbuf = NULL;
+  }
+  aio->rbufSize = aio->rbufUsed = aio->rbufScan = 0;
+}
+
+static void relayStop(Sam3AConnection *conn);
+static void drainFinish(Sam3AConnection *conn);
+
 static void connDisconnect(Sam3AConnection *conn) {
+  int up = (!conn->cancelled && conn->fd >= 0);
+  //
+  if (conn->drain != 0)
+    drainFinish(conn);
+  if (conn->relay != NULL)
+    relayStop(conn);
   conn->cbAIOProcessorR = conn->cbAIOProcessorW = NULL;
   if (conn->aio.data != NULL) {
     free(conn->aio.data);
     conn->aio.data = NULL;
   }
-  if (!conn->cancelled && conn->fd >= 0) {
+  aioFreeLineBuf(&conn->aio);
+  // sam3aSendv() owners of dropped data must see the connection dead
+  if (up)
     conn->cancelled = 1;
+  sendqClear(&conn->sendq, conn->pool);
+  if (up) {
     shutdown(conn->fd, SHUT_RDWR);
     if (conn->callDisconnectCB && conn->cb.cbDisconnected != NULL)
       conn->cb.cbDisconnected(conn);
   }
 }
 
+static void sesDgramClear(Sam3ASession *ses);
+static int bridgeFailover(Sam3ASession *ses);
+static void bridgeCreated(Sam3ASession *ses);
+static int superLost(Sam3ASession *ses);
+static void superCreated(Sam3ASession *ses);
+static int keepaliveLine(Sam3ASession *ses);
+static void keepaliveCreated(Sam3ASession *ses);
+
+// reactor shard inbox operations
+enum {
+  SHARD_OP_SESSION,    // become session home
+  SHARD_OP_ADOPT,      // poll new connection
+  SHARD_OP_CONNECTED,  // poll connection handed off after STREAM CONNECT
+  SHARD_OP_ACCEPTED,   // poll connection handed off after STREAM ACCEPT
+  SHARD_OP_DISCONNECT, // sam3aCancelConnection() from other thread
+  SHARD_OP_CLOSE,      // sam3aCloseConnection() from other thread
+  SHARD_OP_DRAIN       // sam3aDrainSession() from other thread
+};
+
+// <0: caller is the owner (or there is no reactor); 0: posted to owner
+static int shardForward(Sam3AConnection *conn, int op);
+static int shardPost(Sam3AShard *sh, int op, Sam3ASession *ses,
+                     Sam3AConnection *conn);
+static void shardRelease(Sam3AConnection *conn);
+static void reactorLock(Sam3AShard *sh);
+static void reactorUnlock(Sam3AShard *sh);
+static Sam3ASubmitQueue *shardSubmitQueue(Sam3AShard *sh);
+// <0: run submitted requests here; 0: passed to owner or deferred
+static int shardRouteSubmit(Sam3AConnection *conn);
+
+static void sesResolveCancel(Sam3ASession *ses);
+
 static void sesDisconnect(Sam3ASession *ses) {
   ses->cbAIOProcessorR = ses->cbAIOProcessorW = NULL;
+  sesResolveCancel(ses);
   if (ses->aio.data != NULL) {
     free(ses->aio.data);
     ses->aio.data = NULL;
   }
-  if (!ses->cancelled && ses->fd >= 0) {
+  aioFreeLineBuf(&ses->aio);
+  sesDgramClear(ses);
+  if (ses->pong != NULL) {
+    free(ses->pong);
+    ses->pong = NULL;
+  }
+  if (!ses->cancelled && (ses->fd >= 0 || ses->primary != NULL)) {
     ses->cancelled = 1;
-    shutdown(ses->fd, SHUT_RDWR);
+    if (ses->fd >= 0)
+      shutdown(ses->fd, SHUT_RDWR);
+    reactorLock(ses->home);
     for (Sam3AConnection *c = ses->connlist; c != NULL; c = c->next)
-      connDisconnect(c);
+      sam3aCancelConnection(c);
+    reactorUnlock(ses->home);
+    // bridge drops subsessions along with their primary
+    for (Sam3ASession *s = ses->subs, *next; s != NULL; s = next) {
+      next = s->subNext;
+      sesDisconnect(s);
+    }
     if (ses->callDisconnectCB && ses->cb.cbDisconnected != NULL)
       ses->cb.cbDisconnected(ses);
   }
@@ -799,6 +1405,10 @@ static void sesError(Sam3ASession *ses, const char *errstr) {
   if (errstr == NULL || !errstr[0])
     errstr = "I2P_ERROR";
   strcpyerrs(ses, errstr);
+  if (ses->bridges != NULL && bridgeFailover(ses))
+    return;
+  if (ses->super != NULL && superLost(ses))
+    return;
   if (ses->cb.cbError != NULL)
     ses->cb.cbError(ses);
   sesDisconnect(ses);
@@ -824,66 +1434,123 @@ static int aioSender(int fd, Sam3AIO *aio) {
   return 0;
 }
 
-// dataUsed: max line size (with '\n')
-// dataSize: must be at least (dataUsed+1)
+// one recv() per call at most; bytes after '\n' stay in aio->rbuf
+// on success line is copied to aio->data (asciiz), dataUsed/dataPos: length
+// <0: error; 0: need more data; 1: got line
 static int aioLineReader(int fd, Sam3AIO *aio) {
-  //
-  for (;;) {
-    int av = sam3aBytesAvail(fd), rd;
+  for (int tries = 0;; ++tries) {
+    char *nl = NULL;
+    ssize_t rd;
     //
-    if (av < 0)
-      return -1;
-    if (av == 0)
-      return 0; // do nothing
-    if (aio->dataPos >= aio->dataUsed - 1)
-      return -1; // line too long
-    if ((rd = (aio->dataUsed - 1) - aio->dataPos) > av)
-      rd = av;
-    if ((rd = recv(fd, aio->data + aio->dataPos, rd, MSG_PEEK)) < 0) {
-      if (errno == EINTR)
-        continue;
-      return -1;
+    if (aio->rbufScan < aio->rbufUsed) {
+      char *from = aio->rbuf + aio->rbufScan;
+      int left = aio->rbufUsed - aio->rbufScan;
+      //
+      if ((nl = memchr(from, '\n', left)) != NULL)
+        left = nl - from;
+      if (memchr(from, 0, left) != NULL)
+        return -1; // there should not be zero bytes
+      aio->rbufScan += left;
     }
-    if (rd == 0)
-      return 0; // do nothing
-    // now look for '\n'
-    for (int f = aio->dataPos; f < aio->dataPos + rd; ++f) {
-      if (aio->data[f] == '\n') {
-        // got it!
-        if (recv(fd, aio->data + aio->dataPos, f - aio->dataPos + 1, 0) !=
-            f + 1)
-          return -1;                      // the thing that should not be
-        aio->data[f] = 0;                 // convert to asciiz
-        aio->dataUsed = aio->dataPos = f; // length
-        return 1;                         // '\n' found!
+    if (nl != NULL) {
+      int len = nl - aio->rbuf;
+      //
+      if (aio->dataSize < len + 1) {
+        char *n = realloc(aio->data, len + 1);
+        //
+        if (n == NULL)
+          return -1;
+        aio->data = n;
+        aio->dataSize = len + 1;
       }
-      if (!aio->data[f])
-        return -1; // there should not be zero bytes
+      memcpy(aio->data, aio->rbuf, len);
+      aio->data[len] = 0;                 // convert to asciiz
+      aio->dataUsed = aio->dataPos = len; // length
+      aio->rbufUsed -= len + 1;
+      memmove(aio->rbuf, nl + 1, aio->rbufUsed);
+      aio->rbufScan = 0;
+      return 1; // '\n' found!
+    }
+    if (tries > 0)
+      return 0; // socket is drained, wait for more
+    if (aio->rbufUsed >= SAM3A_LINE_MAX)
+      return -1; // line too long
+    // keep room for '\0' after leftovers handed to cbRead()
+    if (aio->rbufSize - aio->rbufUsed < 2) {
+      int nsz = (aio->rbufSize ? aio->rbufSize * 2 : SAM3A_LINE_BUFSIZE);
+      char *n;
+      //
+      if (nsz > SAM3A_LINE_MAX + 1)
+        nsz = SAM3A_LINE_MAX + 1;
+      if ((n = realloc(aio->rbuf, nsz)) == NULL)
+        return -1;
+      aio->rbuf = n;
+      aio->rbufSize = nsz;
     }
-    // no '\n' found
-    if (recv(fd, aio->data + aio->dataPos, rd, 0) != rd)
-      return -1; // the thing that should not be
-    aio->dataPos += rd;
+    do {
+      rd = recv(fd, aio->rbuf + aio->rbufUsed,
+                aio->rbufSize - aio->rbufUsed - 1, 0);
+    } while (rd < 0 && errno == EINTR);
+    if (rd < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+    if (rd == 0)
+      return -1; // bridge closed connection in the middle of handshake
+    aio->rbufUsed += rd;
   }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 static void aioSesCmdReplyReader(Sam3ASession *ses) {
-  int res = aioLineReader(ses->fd, &ses->aio);
-  //
-  if (res < 0) {
-    sesError(ses, "IO_ERROR");
-    return;
-  }
-  if (res > 0) {
+  // buffered bytes may already hold the next reply
+  while (ses->cbAIOProcessorR == aioSesCmdReplyReader) {
+    int res = aioLineReader(ses->fd, &ses->aio);
+    //
+    if (res < 0) {
+      sesError(ses, "IO_ERROR");
+      return;
+    }
+    if (res == 0)
+      return;
     // we got full line
     if (libsam3a_debug)
       fprintf(stderr, "CMDREPLY: %s\n", ses->aio.data);
-    if (ses->aio.cbReplyCheckSes != NULL)
-      ses->aio.cbReplyCheckSes(ses);
+    if (keepaliveLine(ses))
+      continue;
+    if (ses->aio.cbReplyCheckSes == NULL)
+      return;
+    ses->aio.cbReplyCheckSes(ses);
+  }
+}
+
+// created session gets nothing unasked but PING/PONG; EOF is loss
+static void aioSesIdle(Sam3ASession *ses) {
+  while (ses->cbAIOProcessorR == aioSesIdle) {
+    int res = aioLineReader(ses->fd, &ses->aio);
+    //
+    if (res < 0) {
+      sesError(ses, "IO_ERROR");
+      return;
+    }
+    if (res == 0)
+      return;
+    if (!keepaliveLine(ses) && libsam3a_debug)
+      fprintf(stderr, "IDLE: %s\n", ses->aio.data);
   }
 }
 
+// created session with no command in flight; supervised ones and ones with
+// keepalive watch the control socket
+static inline void sesSetIdle(Sam3ASession *ses) {
+  ses->cbAIOProcessorR =
+      (ses->super != NULL || ses->keepalive != NULL ? aioSesIdle : NULL);
+  ses->cbAIOProcessorW = NULL;
+}
+
+static inline int sesIsIdle(const Sam3ASession *ses) {
+  return (ses->cbAIOProcessorW == NULL && (ses->cbAIOProcessorR == NULL ||
+                                           ses->cbAIOProcessorR == aioSesIdle));
+}
+
 static void aioSesCmdSender(Sam3ASession *ses) {
   if (ses->aio.dataPos < ses->aio.dataUsed) {
     if (aioSender(ses->fd, &ses->aio) < 0) {
@@ -893,20 +1560,20 @@ static void aioSesCmdSender(Sam3ASession *ses) {
   }
   //
   if (ses->aio.dataPos == ses->aio.dataUsed) {
-    // hello sent, now wait for reply
-    // 2048 bytes of reply line should be enough
-    if (ses->aio.dataSize < 2049) {
-      char *n = realloc(ses->aio.data, 2049);
+    if (ses->pong != NULL) {
+      // bridge PINGed while command was being written
+      int len = strlen(ses->pong);
+      int res = sam3aSendBytes(ses->fd, ses->pong, len);
       //
-      if (n == NULL) {
-        sesError(ses, "MEMORY_ERROR");
+      free(ses->pong);
+      ses->pong = NULL;
+      if (res != len) {
+        sesError(ses, "IO_ERROR");
         return;
       }
-      ses->aio.data = n;
-      ses->aio.dataSize = 2049;
     }
-    ses->aio.dataUsed = 2048;
-    ses->aio.dataPos = 0;
+    // hello sent, now wait for reply
+    ses->aio.dataUsed = ses->aio.dataPos = 0;
     ses->cbAIOProcessorR = aioSesCmdReplyReader;
     ses->cbAIOProcessorW = NULL;
   }
@@ -941,11 +1608,32 @@ aioSesSendCmdWaitReply(Sam3ASession *ses, void (*cbCheck)(Sam3ASession *ses),
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+// PRIMARY sessions and subsessions need SAM 3.3 on every bridge socket;
+// others ask for 3.2 (stream ports) but get along with 3.0
+static inline int sesNeedPrimary(const Sam3ASession *ses) {
+  return (ses->type == SAM3A_SESSION_PRIMARY || ses->primary != NULL);
+}
+
+static inline const char *sesHello(const Sam3ASession *ses) {
+  return (sesNeedPrimary(ses) ? "HELLO VERSION MIN=3.3 MAX=3.3\n"
+                              : "HELLO VERSION MIN=3.0 MAX=3.2\n");
+}
+
+// returns bool: 'rep' is good reply to sesHello()
+static int sesHelloOk(const Sam3ASession *ses, const SAMFieldList *rep) {
+  const char *v;
+  //
+  if (!sam3aIsGoodReply(rep, "HELLO", "REPLY", "RESULT", "OK") ||
+      (v = sam3aFindField(rep, "VERSION")) == NULL)
+    return 0;
+  return (sesNeedPrimary(ses) ? strcmp(v, "3.3") == 0
+                              : strncmp(v, "3.", 2) == 0);
+}
+
 static void aioSesHelloChecker(Sam3ASession *ses) {
   SAMFieldList *rep = sam3aParseReply(ses->aio.data);
   //
-  if (rep != NULL && sam3aIsGoodReply(rep, "HELLO", "REPLY", "RESULT", "OK") &&
-      sam3aIsGoodReply(rep, NULL, NULL, "VERSION", "3.0")) {
+  if (sesHelloOk(ses, rep)) {
     ses->cbAIOProcessorR = ses->cbAIOProcessorW = NULL;
     sam3aFreeFieldList(rep);
     if (ses->aio.udata != NULL) {
@@ -963,8 +1651,8 @@ static int sam3aSesStartHandshake(Sam3ASession *ses,
                                   void (*cbComplete)(Sam3ASession *ses)) {
   if (cbComplete != NULL)
     ses->aio.udata = cbComplete;
-  if (aioSesSendCmdWaitReply(ses, aioSesHelloChecker, "%s\n",
-                             "HELLO VERSION MIN=3.0 MAX=3.0") < 0)
+  if (aioSesSendCmdWaitReply(ses, aioSesHelloChecker, "%s", sesHello(ses)) <
+      0)
     return -1;
   return 0;
 }
@@ -992,8 +1680,14 @@ static void aioSesNameMeChecker(Sam3ASession *ses) {
   strcpy(ses->pubkey, v);
   sam3aFreeFieldList(rep);
   //
-  ses->cbAIOProcessorR = ses->cbAIOProcessorW = NULL;
   ses->callDisconnectCB = 1;
+  sesSetIdle(ses);
+  if (ses->bridges != NULL)
+    bridgeCreated(ses);
+  if (ses->super != NULL)
+    superCreated(ses);
+  if (ses->keepalive != NULL)
+    keepaliveCreated(ses);
   if (ses->cb.cbCreated != NULL)
     ses->cb.cbCreated(ses);
 }
@@ -1009,10 +1703,10 @@ static void aioSesCreateChecker(Sam3ASession *ses) {
   if (!sam3aIsGoodReply(rep, "SESSION", "STATUS", "RESULT", "OK") ||
       (v = sam3aFindField(rep, "DESTINATION")) == NULL ||
       strlen(v) != SAM3A_PRIVKEY_SIZE) {
-    sam3aFreeFieldList(rep);
     if ((v = sam3aFindField(rep, "RESULT")) != NULL && strcmp(v, "OK") == 0)
       v = NULL;
     sesError(ses, v);
+    sam3aFreeFieldList(rep);
     return;
   }
   // ok
@@ -1026,14 +1720,29 @@ static void aioSesCreateChecker(Sam3ASession *ses) {
   }
 }
 
+static int sesDgramOpen(Sam3ASession *ses, char *host, int hostsize);
+
 // handshake for SESSION CREATE complete
 static void aioSesHandshacked(Sam3ASession *ses) {
-  static const char *typenames[3] = {"RAW", "DATAGRAM", "STREAM"};
+  static const char *typenames[4] = {"RAW", "DATAGRAM", "STREAM", "PRIMARY"};
+  char fwd[64];
   //
+  fwd[0] = 0;
+  if (ses->type == SAM3A_SESSION_RAW || ses->type == SAM3A_SESSION_DGRAM) {
+    // ask bridge to forward incoming datagrams to our UDP socket
+    char host[INET_ADDRSTRLEN];
+    int port = sesDgramOpen(ses, host, sizeof(host));
+    //
+    if (port < 0) {
+      sesError(ses, "UDP_ERROR");
+      return;
+    }
+    snprintf(fwd, sizeof(fwd), " PORT=%d HOST=%s", port, host);
+  }
   if (aioSesSendCmdWaitReply(
           ses, aioSesCreateChecker,
-          "SESSION CREATE STYLE=%s ID=%s DESTINATION=%s%s%s\n",
-          typenames[(int)ses->type], ses->channel, ses->privkey,
+          "SESSION CREATE STYLE=%s ID=%s DESTINATION=%s%s%s%s\n",
+          typenames[(int)ses->type], ses->channel, ses->privkey, fwd,
           (ses->params != NULL ? " " : ""),
           (ses->params != NULL ? ses->params : "")) < 0) {
     sesError(ses, "MEMORY_ERROR");
@@ -1054,6 +1763,57 @@ static void aioSesConnected(Sam3ASession *ses) {
   }
 }
 
+static void sesResolveCancel(Sam3ASession *ses) {
+  if (ses->resolve != NULL) {
+    resolveRelease(ses->resolve);
+    ses->resolve = NULL;
+    ses->fd = -1; // it was the lookup wakeup fd
+  }
+}
+
+// RESOLVING state: resolver thread signalled the wakeup fd
+static void aioSesResolved(Sam3ASession *ses) {
+  uint32_t ip;
+  int done, port = ses->resolve->port;
+  //
+  pthread_mutex_lock(&resolveLock);
+  done = ses->resolve->done;
+  ip = ses->resolve->ip;
+  pthread_mutex_unlock(&resolveLock);
+  if (!done)
+    return;
+  sesResolveCancel(ses);
+  ses->cbAIOProcessorR = NULL;
+  if (ip == 0) {
+    sesError(ses, "RESOLVE_ERROR");
+    return;
+  }
+  ses->ip = ip;
+  ses->cbAIOProcessorW = aioSesConnected;
+  if ((ses->fd = sam3aConnect(ip, port, NULL)) < 0)
+    sesError(ses, "CONNECTION_ERROR");
+}
+
+// start connecting to bridge; ses->aio.udata must be set
+// goes through RESOLVING state if 'hostname' is neither numeric nor cached
+// <0: error; 0: ok
+static int sesConnectHost(Sam3ASession *ses, const char *hostname, int port) {
+  uint32_t ip;
+  //
+  if ((ip = resolveNumeric(hostname)) == 0)
+    ip = resolveCacheGet(hostname);
+  if (ip != 0) {
+    ses->ip = ip;
+    ses->cbAIOProcessorW = aioSesConnected;
+    return ((ses->fd = sam3aConnect(ip, port, NULL)) < 0 ? -1 : 0);
+  }
+  if ((ses->resolve = resolveStart(hostname, port)) == NULL)
+    return -1;
+  ses->fd = ses->resolve->wake[0];
+  ses->cbAIOProcessorR = aioSesResolved;
+  return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 int sam3aCreateSessionEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
                          const char *hostname, int port, const char *privkey,
@@ -1064,6 +1824,7 @@ int sam3aCreateSessionEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
     //
     memset(ses, 0, sizeof(Sam3ASession));
     ses->fd = -1;
+    ses->udpfd = -1;
     if (cb != NULL)
       ses->cb = *cb;
     if (hostname == NULL || !hostname[0])
@@ -1072,7 +1833,7 @@ int sam3aCreateSessionEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
       goto error;
     if (privkey != NULL && strlen(privkey) != SAM3A_PRIVKEY_SIZE)
       goto error;
-    if ((int)type < 0 || (int)type > 2)
+    if ((int)type < 0 || (int)type > 3)
       goto error;
     if (privkey == NULL)
       privkey = "TRANSIENT";
@@ -1083,17 +1844,17 @@ int sam3aCreateSessionEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
     //
     if (!port)
       port = DEFAULT_TCP_PORT;
+    ses->ctlPort = port;
     ses->type = type;
-    ses->port = (type == SAM3A_SESSION_STREAM ? port : DEFAULT_UDP_PORT);
-    if ((ses->ip = sam3aResolveHost(hostname)) == 0)
-      goto error;
+    ses->port = ((type == SAM3A_SESSION_RAW || type == SAM3A_SESSION_DGRAM)
+                     ? DEFAULT_UDP_PORT
+                     : port);
     sam3aGenChannelName(ses->channel, 32, 64);
     if (libsam3a_debug)
       fprintf(stderr, "sam3aCreateSession: channel=[%s]\n", ses->channel);
     //
     ses->aio.udata = aioSesHandshacked;
-    ses->cbAIOProcessorW = aioSesConnected;
-    if ((ses->fd = sam3aConnect(ses->ip, port, NULL)) < 0)
+    if (sesConnectHost(ses, hostname, port) < 0)
       goto error;
     /*
     if (complete) {
@@ -1110,13 +1871,326 @@ int sam3aCreateSessionEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
       free(ses->params);
     memset(ses, 0, sizeof(Sam3ASession));
     ses->fd = -1;
+    ses->udpfd = -1;
+  }
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// bridge sets
+static uint64_t bridgeNow(void) {
+  struct timeval tv;
+  //
+  gettimeofday(&tv, NULL);
+  return sam3atimeval2ms(&tv);
+}
+
+int sam3aBridgeSetAdd(Sam3ABridgeSet *set, const char *hostname, int port,
+                      int weight) {
+  Sam3ABridge *b;
+  //
+  if (set == NULL || set->count >= SAM3A_BRIDGE_MAX || port < 0 ||
+      port > 65535 || weight < 1)
+    return -1;
+  if (hostname == NULL || !hostname[0])
+    hostname = "127.0.0.1";
+  if (strlen(hostname) >= sizeof(b->host))
+    return -1;
+  b = &set->bridges[set->count];
+  memset(b, 0, sizeof(Sam3ABridge));
+  strcpy(b->host, hostname);
+  b->port = (port ? port : DEFAULT_TCP_PORT);
+  b->weight = weight;
+  b->healthy = 1; // until proven otherwise
+  b->rttms = -1;
+  return set->count++;
+}
+
+static void bridgeFailed(Sam3ABridge *b) {
+  b->healthy = 0;
+  ++b->failures;
+}
+
+// smooth weighted round robin over healthy bridges not in 'tried'; when all
+// of them were tried, the one with fewest failures (then lowest RTT) is next
+// <0: every bridge was tried
+static int bridgePick(Sam3ABridgeSet *set, uint32_t tried) {
+  int best = -1, total = 0;
+  //
+  for (int f = 0; f < set->count; ++f) {
+    Sam3ABridge *b = &set->bridges[f];
+    //
+    if ((tried & (1u << f)) || !b->healthy)
+      continue;
+    b->current += b->weight;
+    total += b->weight;
+    if (best < 0 || b->current > set->bridges[best].current)
+      best = f;
+  }
+  if (best >= 0) {
+    set->bridges[best].current -= total;
+    return best;
+  }
+  for (int f = 0; f < set->count; ++f) {
+    const Sam3ABridge *b = &set->bridges[f], *o;
+    //
+    if (tried & (1u << f))
+      continue;
+    o = (best >= 0 ? &set->bridges[best] : NULL);
+    if (o == NULL || b->failures < o->failures ||
+        (b->failures == o->failures && b->rttms >= 0 &&
+         (o->rttms < 0 || b->rttms < o->rttms)))
+      best = f;
+  }
+  return best;
+}
+
+// connect to next bridge not tried yet; ses->aio.udata must be set
+// <0: every bridge failed
+static int bridgeStart(Sam3ASession *ses) {
+  Sam3ABridgeSet *set = ses->bridges;
+  int f;
+  //
+  while ((f = bridgePick(set, ses->bridgeTried)) >= 0) {
+    Sam3ABridge *b = &set->bridges[f];
+    //
+    ses->bridge = f;
+    ses->bridgeTried |= 1u << f;
+    if (sesConnectHost(ses, b->host, b->port) == 0)
+      return f;
+    bridgeFailed(b);
+  }
+  return -1;
+}
+
+// sesError() before the session was created; returns bool: next bridge will
+// be tried at the end of this sam3aProcessSessionIO(), cbError() is not
+// called
+static int bridgeFailover(Sam3ASession *ses) {
+  Sam3ABridgeSet *set = ses->bridges;
+  uint32_t all = (set->count < 32 ? (1u << set->count) - 1 : ~0u);
+  //
+  if (ses->callDisconnectCB || ses->cancelled || ses->home != NULL)
+    return 0;
+  bridgeFailed(&set->bridges[ses->bridge]);
+  if ((ses->bridgeTried & all) == all)
+    return 0;
+  ses->cbAIOProcessorR = ses->cbAIOProcessorW = NULL;
+  ses->bridgeRetry = 1;
+  return 1;
+}
+
+// drop failed attempt, start over on the next bridge
+static void bridgeRestart(Sam3ASession *ses) {
+  ses->bridgeRetry = 0;
+  if (ses->resolve != NULL)
+    sesResolveCancel(ses);
+  else if (ses->fd >= 0)
+    close(ses->fd);
+  ses->fd = -1;
+  if (ses->aio.data != NULL) {
+    free(ses->aio.data);
+    ses->aio.data = NULL;
+  }
+  aioFreeLineBuf(&ses->aio);
+  sesDgramClear(ses);
+  ses->ip = 0;
+  ses->aio.udata = aioSesHandshacked;
+  if (bridgeStart(ses) >= 0 || (ses->super != NULL && superLost(ses)))
+    return;
+  if (ses->cb.cbError != NULL)
+    ses->cb.cbError(ses); // ses->error is from the last bridge
+}
+
+static void bridgeCreated(Sam3ASession *ses) {
+  Sam3ABridge *b = &ses->bridges->bridges[ses->bridge];
+  //
+  b->ip = ses->ip;
+  b->healthy = 1;
+  b->failures = 0;
+  ++b->sessions;
+  ses->bridgeTried = 0;
+}
+
+int sam3aBridgeCreateSession(Sam3ABridgeSet *set, Sam3ASession *ses,
+                             const Sam3ASessionCallbacks *cb,
+                             const char *privkey, Sam3ASessionType type,
+                             const char *params, int timeoutms) {
+  uint32_t tried = 0;
+  int f;
+  //
+  if (set == NULL || ses == NULL ||
+      (privkey != NULL && strlen(privkey) != SAM3A_PRIVKEY_SIZE) ||
+      (int)type < 0 || (int)type > 3)
+    return -1;
+  while ((f = bridgePick(set, tried)) >= 0) {
+    Sam3ABridge *b = &set->bridges[f];
+    //
+    tried |= 1u << f;
+    if (sam3aCreateSessionEx(ses, cb, b->host, b->port, privkey, type, params,
+                             timeoutms) == 0) {
+      ses->bridges = set;
+      ses->bridge = f;
+      ses->bridgeTried = tried;
+      return f;
+    }
+    bridgeFailed(b);
   }
   return -1;
 }
 
+int sam3aBridgeRecreateSession(Sam3ASession *ses) {
+  char privkey[SAM3A_PRIVKEY_SIZE + 1];
+  Sam3ASessionCallbacks cb;
+  Sam3ABridgeSet *set;
+  Sam3ASessionType type;
+  char *params;
+  void *udata;
+  int timeoutms, res;
+  //
+  if (ses == NULL || (set = ses->bridges) == NULL || ses->home != NULL ||
+      ses->primary != NULL || sam3aIsActiveSession(ses))
+    return -1;
+  strcpy(privkey, ses->privkey);
+  cb = ses->cb;
+  udata = ses->udata;
+  type = ses->type;
+  timeoutms = ses->timeoutms;
+  params = ses->params;
+  ses->params = NULL;
+  bridgeFailed(&set->bridges[ses->bridge]);
+  memset(&ses->cb, 0, sizeof(ses->cb)); // it's the same session for caller
+  sam3aCloseSession(ses);
+  res = sam3aBridgeCreateSession(
+      set, ses, &cb, (sam3aIsValidPrivKey(privkey) ? privkey : NULL), type,
+      params, timeoutms);
+  free(params);
+  if (res >= 0)
+    ses->udata = udata;
+  return res;
+}
+
+// probes are sessions that stop after HELLO
+static void bridgeProbeHello(Sam3ASession *ses) {
+  ((Sam3ABridge *)ses->udata)->probeDone = 1;
+}
+
+static void bridgeProbeError(Sam3ASession *ses) {
+  ((Sam3ABridge *)ses->udata)->probeDone = -1;
+}
+
+static void bridgeProbeFinish(Sam3ABridgeSet *set, Sam3ABridge *b, int ok) {
+  if (ok) {
+    int ms = (int)(bridgeNow() - b->probeStart);
+    //
+    b->rttms = (b->rttms < 0 ? ms : (b->rttms * 7 + ms) / 8);
+    b->ip = b->probe->ip;
+    b->healthy = 1;
+    b->failures = 0;
+  } else {
+    bridgeFailed(b);
+  }
+  memset(&b->probe->cb, 0, sizeof(b->probe->cb));
+  sam3aCloseSession(b->probe);
+  free(b->probe);
+  b->probe = NULL;
+  --set->probing;
+}
+
+int sam3aBridgeProbe(Sam3ABridgeSet *set, int timeoutms) {
+  int started = 0;
+  //
+  if (set == NULL || timeoutms < 1)
+    return -1;
+  set->probeTimeoutms = timeoutms;
+  for (int f = 0; f < set->count; ++f) {
+    Sam3ABridge *b = &set->bridges[f];
+    Sam3ASession *p;
+    //
+    if (b->probe != NULL)
+      continue; // still running
+    if ((p = calloc(1, sizeof(Sam3ASession))) == NULL)
+      return -1;
+    p->fd = -1;
+    p->udpfd = -1;
+    p->cb.cbError = bridgeProbeError;
+    p->udata = b;
+    p->port = b->port;
+    p->aio.udata = bridgeProbeHello;
+    b->probe = p;
+    b->probeStart = bridgeNow();
+    b->probeDone = 0;
+    if (sesConnectHost(p, b->host, b->port) < 0)
+      b->probeDone = -1; // reported by sam3aProcessBridgeSetIO()
+    ++set->probing;
+    ++started;
+  }
+  return started;
+}
+
+int sam3aAddBridgeSetToFDS(Sam3ABridgeSet *set, int maxfd, fd_set *rds,
+                           fd_set *wrs) {
+  if (set == NULL)
+    return -1;
+  for (int f = 0; f < set->count; ++f) {
+    int m;
+    //
+    if (set->bridges[f].probe != NULL &&
+        (m = sam3aAddSessionToFDS(set->bridges[f].probe, maxfd, rds, wrs)) >
+            maxfd)
+      maxfd = m;
+  }
+  return maxfd;
+}
+
+void sam3aProcessBridgeSetIO(Sam3ABridgeSet *set, fd_set *rds, fd_set *wrs) {
+  uint64_t now = bridgeNow();
+  //
+  if (set == NULL)
+    return;
+  for (int f = 0; f < set->count; ++f) {
+    Sam3ABridge *b = &set->bridges[f];
+    //
+    if (b->probe == NULL)
+      continue;
+    if (b->probeDone == 0)
+      sam3aProcessSessionIO(b->probe, rds, wrs);
+    if (b->probeDone != 0 ||
+        now - b->probeStart >= (uint64_t)set->probeTimeoutms)
+      bridgeProbeFinish(set, b, (b->probeDone > 0));
+  }
+}
+
+void sam3aBridgeSetClose(Sam3ABridgeSet *set) {
+  if (set == NULL)
+    return;
+  for (int f = 0; f < set->count; ++f) {
+    Sam3ABridge *b = &set->bridges[f];
+    //
+    if (b->probe != NULL) {
+      memset(&b->probe->cb, 0, sizeof(b->probe->cb));
+      sam3aCloseSession(b->probe);
+      free(b->probe);
+      b->probe = NULL;
+    }
+  }
+  set->probing = 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
+static void submitQueueFree(Sam3ASubmitQueue *q);
+static void listenFree(Sam3ASession *ses);
+static void warmFree(Sam3ASession *ses);
+static void subDetach(Sam3ASession *sub);
+static void subFree(Sam3ASession *primary);
+static void portsFree(Sam3ASession *ses);
+static void drainFree(Sam3ASession *ses);
+static void superFree(Sam3ASession *ses);
+static void keepaliveFree(Sam3ASession *ses);
+
 int sam3aCancelSession(Sam3ASession *ses) {
   if (ses != NULL) {
+    superFree(ses); // user's cancel is not a loss
     sesDisconnect(ses);
     return 0;
   }
@@ -1125,9 +2199,31 @@ int sam3aCancelSession(Sam3ASession *ses) {
 
 int sam3aCloseSession(Sam3ASession *ses) {
   if (ses != NULL) {
+    if (ses->submit != NULL) {
+      // run what was submitted; new connections are closed below
+      submitQueueFree(ses->submit);
+      ses->submit = NULL;
+    }
     sam3aCancelSession(ses);
     while (ses->connlist != NULL)
       sam3aCloseConnection(ses->connlist);
+    if (ses->primary != NULL)
+      subDetach(ses);
+    subFree(ses);
+    if (ses->fd >= 0) {
+      close(ses->fd);
+      ses->fd = -1;
+    }
+    poolClear(&ses->pool);
+    connCacheClear(&ses->connCache);
+    listenFree(ses);
+    warmFree(ses);
+    portsFree(ses);
+    drainFree(ses);
+    superFree(ses);
+    keepaliveFree(ses);
+    if (ses->dgRecvBuf != NULL)
+      free(ses->dgRecvBuf);
     if (ses->cb.cbDestroy != NULL)
       ses->cb.cbDestroy(ses);
     if (ses->params != NULL) {
@@ -1135,10 +2231,194 @@ int sam3aCloseSession(Sam3ASession *ses) {
       ses->params = NULL;
     }
     memset(ses, 0, sizeof(Sam3ASession));
+    ses->fd = -1;
+    ses->udpfd = -1;
+  }
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// subsessions
+// SESSION ADD/REMOVE go over primary's control connection; it carries one
+// command at a time, the rest wait in primary->subCmds
+struct Sam3ASubCmd {
+  Sam3ASubCmd *next;
+  Sam3ASession *sub; // NULL: REMOVE, or subsession was closed meanwhile
+  char *cmd;
+};
+
+// send next queued command if control connection is idle
+static void subPump(Sam3ASession *primary);
+
+static void aioSubChecker(Sam3ASession *primary) {
+  SAMFieldList *rep = sam3aParseReply(primary->aio.data);
+  Sam3ASubCmd *c = primary->subCmds;
+  Sam3ASession *sub = c->sub;
+  //
+  primary->subCmds = c->next;
+  free(c->cmd);
+  free(c);
+  sesSetIdle(primary);
+  if (!sam3aIsGoodReply(rep, "SESSION", "STATUS", NULL, NULL)) {
+    sam3aFreeFieldList(rep);
+    sesError(primary, NULL);
+    return;
+  }
+  if (sub != NULL) {
+    if (!sam3aIsGoodReply(rep, NULL, NULL, "RESULT", "OK")) {
+      sesError(sub, sam3aFindField(rep, "RESULT"));
+    } else {
+      sub->callDisconnectCB = 1;
+      if (!sub->cancelled && sub->cb.cbCreated != NULL)
+        sub->cb.cbCreated(sub);
+    }
+  }
+  sam3aFreeFieldList(rep);
+  subPump(primary);
+}
+
+static void subPump(Sam3ASession *primary) {
+  if (primary->subCmds == NULL || !sam3aIsActiveSession(primary) ||
+      !primary->callDisconnectCB || !sesIsIdle(primary))
+    return;
+  if (aioSesSendCmdWaitReply(primary, aioSubChecker, "%s",
+                             primary->subCmds->cmd) < 0)
+    sesError(primary, "MEMORY_ERROR");
+}
+
+// <0: error; 0: ok
+static __attribute__((format(printf, 3, 4))) int
+subQueue(Sam3ASession *primary, Sam3ASession *sub, const char *fmt, ...) {
+  Sam3ASubCmd *c = calloc(1, sizeof(Sam3ASubCmd)), **tail;
+  va_list ap;
+  int len;
+  //
+  if (c == NULL)
+    return -1;
+  va_start(ap, fmt);
+  c->cmd = sam3PrintfVA(&len, fmt, ap);
+  va_end(ap);
+  if (c->cmd == NULL) {
+    free(c);
+    return -1;
   }
+  c->sub = sub;
+  for (tail = &primary->subCmds; *tail != NULL; tail = &(*tail)->next)
+    ;
+  *tail = c;
+  subPump(primary);
+  return 0;
+}
+
+int sam3aAddSubsession(Sam3ASession *primary, Sam3ASession *sub,
+                       const Sam3ASessionCallbacks *cb, Sam3ASessionType type,
+                       int listenport, const char *params) {
+  static const char *typenames[3] = {"RAW", "DATAGRAM", "STREAM"};
+  char fwd[64], lsn[32];
+  //
+  if (sub == NULL || sub == primary || !sam3aIsActiveSession(primary) ||
+      primary->type != SAM3A_SESSION_PRIMARY || !primary->callDisconnectCB ||
+      primary->home != NULL)
+    return -1;
+  if ((int)type < 0 || (int)type > 2 || listenport < 0 || listenport > 65535)
+    return -1;
+  memset(sub, 0, sizeof(Sam3ASession));
+  sub->fd = -1;
+  sub->udpfd = -1;
+  if (cb != NULL)
+    sub->cb = *cb;
+  sub->type = type;
+  strcpy(sub->privkey, primary->privkey);
+  strcpy(sub->pubkey, primary->pubkey);
+  sub->ip = primary->ip;
+  sub->port = (type == SAM3A_SESSION_STREAM ? primary->port : DEFAULT_UDP_PORT);
+  sub->timeoutms = primary->timeoutms;
+  sub->primary = primary;
+  sam3aGenChannelName(sub->channel, 32, 64);
+  if (params != NULL && (sub->params = strdup(params)) == NULL)
+    goto error;
+  fwd[0] = lsn[0] = 0;
+  if (type != SAM3A_SESSION_STREAM) {
+    // ask bridge to forward incoming datagrams to our UDP socket
+    char host[INET_ADDRSTRLEN];
+    int port = sesDgramOpen(sub, host, sizeof(host));
+    //
+    if (port < 0)
+      goto error;
+    snprintf(fwd, sizeof(fwd), " PORT=%d HOST=%s", port, host);
+  }
+  if (listenport > 0)
+    snprintf(lsn, sizeof(lsn), " LISTEN_PORT=%d", listenport);
+  // linked first: a failing send cancels it along with the primary
+  sub->subNext = primary->subs;
+  primary->subs = sub;
+  if (subQueue(primary, sub, "SESSION ADD STYLE=%s ID=%s%s%s%s%s\n",
+               typenames[(int)type], sub->channel, fwd, lsn,
+               (params != NULL ? " " : ""),
+               (params != NULL ? params : "")) < 0) {
+    primary->subs = sub->subNext;
+    goto error;
+  }
+  return 0;
+error:
+  sesDgramClear(sub);
+  if (sub->params != NULL)
+    free(sub->params);
+  memset(sub, 0, sizeof(Sam3ASession));
+  sub->fd = -1;
+  sub->udpfd = -1;
   return -1;
 }
 
+// subsession is being closed: unlink it and drop it on the bridge
+static void subDetach(Sam3ASession *sub) {
+  Sam3ASession *primary = sub->primary;
+  int added = sub->callDisconnectCB;
+  //
+  for (Sam3ASession **pp = &primary->subs; *pp != NULL; pp = &(*pp)->subNext) {
+    if (*pp == sub) {
+      *pp = sub->subNext;
+      break;
+    }
+  }
+  for (Sam3ASubCmd **pc = &primary->subCmds; *pc != NULL; pc = &(*pc)->next) {
+    Sam3ASubCmd *c = *pc;
+    //
+    if (c->sub != sub)
+      continue;
+    if (c == primary->subCmds) {
+      // already sent, bridge may still add it
+      c->sub = NULL;
+      added = 1;
+    } else {
+      *pc = c->next;
+      free(c->cmd);
+      free(c);
+    }
+    break;
+  }
+  sub->primary = sub->subNext = NULL;
+  if (added && sam3aIsActiveSession(primary))
+    subQueue(primary, NULL, "SESSION REMOVE ID=%s\n", sub->channel);
+}
+
+// primary is being closed; its subsessions are cancelled already
+static void subFree(Sam3ASession *primary) {
+  while (primary->subs != NULL) {
+    Sam3ASession *s = primary->subs;
+    //
+    primary->subs = s->subNext;
+    s->primary = s->subNext = NULL;
+  }
+  while (primary->subCmds != NULL) {
+    Sam3ASubCmd *c = primary->subCmds;
+    //
+    primary->subCmds = c->next;
+    free(c->cmd);
+    free(c);
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 static void aioSesKeyGenChecker(Sam3ASession *ses) {
   SAMFieldList *rep = sam3aParseReply(ses->aio.data);
@@ -1179,6 +2459,7 @@ int sam3aGenerateKeysEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
   if (ses != NULL) {
     memset(ses, 0, sizeof(Sam3ASession));
     ses->fd = -1;
+    ses->udpfd = -1;
     if (cb != NULL)
       ses->cb = *cb;
     if (hostname == NULL || !hostname[0])
@@ -1190,12 +2471,9 @@ int sam3aGenerateKeysEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
     if (!port)
       port = DEFAULT_TCP_PORT;
     ses->port = port;
-    if ((ses->ip = sam3aResolveHost(hostname)) == 0)
-      goto error;
     //
     ses->aio.udata = aioSesKeyGenHandshacked;
-    ses->cbAIOProcessorW = aioSesConnected;
-    if ((ses->fd = sam3aConnect(ses->ip, port, NULL)) < 0)
+    if (sesConnectHost(ses, hostname, port) < 0)
       goto error;
     //
     return 0; // ok, connection process initiated
@@ -1206,6 +2484,7 @@ int sam3aGenerateKeysEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
       free(ses->params);
     memset(ses, 0, sizeof(Sam3ASession));
     ses->fd = -1;
+    ses->udpfd = -1;
   }
   return -1;
 }
@@ -1254,6 +2533,7 @@ int sam3aNameLookupEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
   if (ses != NULL) {
     memset(ses, 0, sizeof(Sam3ASession));
     ses->fd = -1;
+    ses->udpfd = -1;
     if (cb != NULL)
       ses->cb = *cb;
     if (name == NULL || !name[0] ||
@@ -1271,12 +2551,9 @@ int sam3aNameLookupEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
     if (!port)
       port = DEFAULT_TCP_PORT;
     ses->port = port;
-    if ((ses->ip = sam3aResolveHost(hostname)) == 0)
-      goto error;
     //
     ses->aio.udata = aioSesNameResHandshacked;
-    ses->cbAIOProcessorW = aioSesConnected;
-    if ((ses->fd = sam3aConnect(ses->ip, port, NULL)) < 0)
+    if (sesConnectHost(ses, hostname, port) < 0)
       goto error;
     //
     return 0; // ok, connection process initiated
@@ -1287,24 +2564,38 @@ int sam3aNameLookupEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
       free(ses->params);
     memset(ses, 0, sizeof(Sam3ASession));
     ses->fd = -1;
+    ses->udpfd = -1;
   }
   return -1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+static int shardHolds(const Sam3AShard *sh, int slot,
+                      const Sam3AConnection *conn);
+
 static void aioConnCmdReplyReader(Sam3AConnection *conn) {
-  int res = aioLineReader(conn->fd, &conn->aio);
-  //
-  if (res < 0) {
-    connError(conn, "IO_ERROR");
-    return;
-  }
-  if (res > 0) {
+  // STREAM ACCEPT status and peer destination usually come in one packet
+  while (conn->cbAIOProcessorR == aioConnCmdReplyReader) {
+    int res = aioLineReader(conn->fd, &conn->aio), slot;
+    Sam3AShard *sh;
+    //
+    if (res < 0) {
+      connError(conn, "IO_ERROR");
+      return;
+    }
+    if (res == 0)
+      return;
     // we got full line
     if (libsam3a_debug)
       fprintf(stderr, "CMDREPLY: %s\n", conn->aio.data);
-    if (conn->aio.cbReplyCheckConn != NULL)
-      conn->aio.cbReplyCheckConn(conn);
+    if (conn->aio.cbReplyCheckConn == NULL)
+      return;
+    sh = conn->owner;
+    slot = conn->slot;
+    conn->aio.cbReplyCheckConn(conn);
+    // handed off to another shard (or closed): not ours to look at anymore
+    if (sh != NULL && !shardHolds(sh, slot, conn))
+      return;
   }
 }
 
@@ -1318,19 +2609,7 @@ static void aioConnCmdSender(Sam3AConnection *conn) {
   //
   if (conn->aio.dataPos == conn->aio.dataUsed) {
     // hello sent, now wait for reply
-    // 2048 bytes of reply line should be enough
-    if (conn->aio.dataSize < 2049) {
-      char *n = realloc(conn->aio.data, 2049);
-      //
-      if (n == NULL) {
-        connError(conn, "MEMORY_ERROR");
-        return;
-      }
-      conn->aio.data = n;
-      conn->aio.dataSize = 2049;
-    }
-    conn->aio.dataUsed = 2048;
-    conn->aio.dataPos = 0;
+    conn->aio.dataUsed = conn->aio.dataPos = 0;
     conn->cbAIOProcessorR = aioConnCmdReplyReader;
     conn->cbAIOProcessorW = NULL;
   }
@@ -1366,137 +2645,236 @@ aioConnSendCmdWaitReply(Sam3AConnection *conn,
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+static void aioConnDataReader(Sam3AConnection *conn);
+
+// per-tick byte budget; <0: unlimited
+static inline int64_t sesBudget(int64_t budget, int64_t def) {
+  return (budget == 0 ? def : budget);
+}
+
+// stream bytes received with handshake reply wait for delivery; such
+// connection is readable without polling
+static inline int connHaveLeftover(const Sam3AConnection *conn) {
+  return (conn->aio.rbufUsed > 0 && !conn->readPaused &&
+          conn->cbAIOProcessorR == aioConnDataReader);
+}
+
 static void aioConnDataReader(Sam3AConnection *conn) {
-  char *buf = NULL;
-  int bufsz = 0;
+  Sam3APool *pool = conn->pool;
+  char *buf = poolGetReadBuf(pool);
+  int64_t budget = sesBudget(conn->ses->readBudget, SAM3A_READ_BUDGET),
+          got = 0;
   //
-  while (sam3aIsActiveConnection(conn)) {
-    int av = sam3aBytesAvail(conn->fd), rd;
+  if (buf == NULL) {
+    connError(conn, "MEMORY_ERROR");
+    return;
+  }
+  if (connHaveLeftover(conn)) {
+    // stream data that came along with the handshake reply
+    char *left = conn->aio.rbuf;
+    int len = conn->aio.rbufUsed;
     //
-    if (av < 0) {
-      if (buf != NULL)
-        free(buf);
-      connError(conn, "IO_ERROR");
-      return;
-    }
-    if (av == 0)
-      av = 1;
-    if (bufsz < av) {
-      char *n = realloc(buf, av + 1);
-      //
-      if (n == NULL) {
-        if (buf != NULL)
-          free(buf);
-        connError(conn, "IO_ERROR");
-        return;
-      }
-      buf = n;
-      bufsz = av;
-    }
-    memset(buf, 0, av + 1);
+    conn->aio.rbuf = NULL;
+    aioFreeLineBuf(&conn->aio);
+    left[len] = 0;
+    if (conn->cb.cbRead != NULL)
+      conn->cb.cbRead(conn, left, len);
+    free(left);
+  }
+  while (sam3aIsActiveConnection(conn) && !conn->readPaused &&
+         (budget < 0 || got < budget)) {
+    size_t want = SAM3A_READBUF_SIZE;
+    ssize_t rd;
     //
-    rd = recv(conn->fd, buf, av, 0);
+    if (budget >= 0 && budget - got < (int64_t)want)
+      want = budget - got;
+    rd = recv(conn->fd, buf, want, 0);
     //
     if (rd < 0) {
       if (errno == EINTR)
         continue; // interrupted by signal
       if (errno == EAGAIN || errno == EWOULDBLOCK)
         break; // no more data
-      free(buf);
+      poolPutReadBuf(pool, buf);
       connError(conn, "IO_ERROR");
       return;
     }
     //
     if (rd == 0) {
       // connection closed
-      free(buf);
+      poolPutReadBuf(pool, buf);
       connDisconnect(conn);
       return;
     }
     //
+    buf[rd] = 0;
+    got += rd;
     if (conn->cb.cbRead != NULL)
       conn->cb.cbRead(conn, buf, rd);
   }
-  free(buf);
+  poolPutReadBuf(pool, buf);
 }
 
 static void aioConnDataWriter(Sam3AConnection *conn) {
-  if (!sam3aIsActiveConnection(conn)) {
-    conn->aio.dataPos = conn->aio.dataUsed = 0;
+  if (!sam3aIsActiveConnection(conn) || conn->sendq.head == NULL)
     return;
-  }
   //
-  if (conn->aio.dataPos >= conn->aio.dataUsed) {
-    conn->aio.dataPos = conn->aio.dataUsed = 0;
+  if (sendqWrite(conn->fd, &conn->sendq, conn->pool,
+                 sesBudget(conn->ses->writeBudget, SAM3A_WRITE_BUDGET)) < 0) {
+    connError(conn, "IO_ERROR");
     return;
   }
   //
-  while (sam3aIsActiveConnection(conn) &&
-         conn->aio.dataPos < conn->aio.dataUsed) {
-    int wr = sam3aSendBytes(conn->fd, conn->aio.data + conn->aio.dataPos,
-                            conn->aio.dataUsed - conn->aio.dataPos);
-    //
-    if (wr < 0) {
-      connError(conn, "IO_ERROR");
+  if (conn->aboveHighWater && conn->sendq.bytes <= conn->lowWater) {
+    conn->aboveHighWater = 0;
+    if (conn->cb.cbWritable != NULL)
+      conn->cb.cbWritable(conn);
+    if (!sam3aIsActiveConnection(conn))
       return;
-    }
-    if (wr == 0)
-      break; // can't write more bytes
-    conn->aio.dataPos += wr;
-    if (conn->aio.dataPos < conn->aio.dataUsed) {
-      memmove(conn->aio.data, conn->aio.data + conn->aio.dataPos,
-              conn->aio.dataUsed - conn->aio.dataPos);
-      conn->aio.dataUsed -= conn->aio.dataPos;
-      conn->aio.dataPos = 0;
-    }
-  }
-  //
-  if (conn->aio.dataPos >= conn->aio.dataUsed) {
-    conn->aio.dataPos = conn->aio.dataUsed = 0;
-    if (conn->cb.cbSent != NULL)
-      conn->cb.cbSent(conn);
-    if (conn->aio.dataSize > 8192) {
-      // shrink buffer
-      char *nn = realloc(conn->aio.data, 8192);
-      //
-      if (nn != NULL) {
-        conn->aio.data = nn;
-        conn->aio.dataSize = 8192;
-      }
-    }
   }
+  if (conn->sendq.head == NULL && conn->cb.cbSent != NULL)
+    conn->cb.cbSent(conn);
+}
+
+static inline void connCheckHighWater(Sam3AConnection *conn) {
+  if (conn->highWater > 0 && conn->sendq.bytes >= conn->highWater)
+    conn->aboveHighWater = 1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-static void aioConnHelloChecker(Sam3AConnection *conn) {
-  SAMFieldList *rep = sam3aParseReply(conn->aio.data);
+// TO_PORT dispatch table
+struct Sam3APortHandler {
+  int port;
+  Sam3AConnectionCallbacks cb;
+  void *udata;
+};
+
+// index of 'port' or of the place to insert it at (returned negative - 1)
+static int portFind(const Sam3ASession *ses, int port) {
+  int lo = 0, hi = ses->portCount - 1;
   //
-  if (rep != NULL && sam3aIsGoodReply(rep, "HELLO", "REPLY", "RESULT", "OK") &&
-      sam3aIsGoodReply(rep, NULL, NULL, "VERSION", "3.0")) {
-    conn->cbAIOProcessorR = conn->cbAIOProcessorW = NULL;
-    sam3aFreeFieldList(rep);
-    if (conn->aio.udata != NULL) {
-      void (*cbComplete)(Sam3AConnection * conn) = conn->aio.udata;
-      //
-      cbComplete(conn);
-    }
-  } else {
-    sam3aFreeFieldList(rep);
-    connError(conn, NULL);
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    //
+    if (ses->ports[mid].port == port)
+      return mid;
+    if (ses->ports[mid].port < port)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
   }
+  return -lo - 1;
 }
 
-static int sam3aConnStartHandshake(Sam3AConnection *conn,
-                                   void (*cbComplete)(Sam3AConnection *conn)) {
-  if (cbComplete != NULL)
-    conn->aio.udata = cbComplete;
-  if (aioConnSendCmdWaitReply(conn, aioConnHelloChecker, "%s\n",
-                              "HELLO VERSION MIN=3.0 MAX=3.0") < 0)
+int sam3aSetPortHandler(Sam3ASession *ses, int toport,
+                        const Sam3AConnectionCallbacks *cb, void *udata) {
+  int idx;
+  //
+  if (ses == NULL || toport < 1 || toport > 65535)
     return -1;
+  if ((idx = portFind(ses, toport)) < 0) {
+    Sam3APortHandler *np;
+    //
+    if (cb == NULL)
+      return 0;
+    idx = -idx - 1;
+    if ((np = realloc(ses->ports, (ses->portCount + 1) *
+                                      sizeof(Sam3APortHandler))) == NULL)
+      return -1;
+    ses->ports = np;
+    memmove(&np[idx + 1], &np[idx],
+            (ses->portCount - idx) * sizeof(Sam3APortHandler));
+    ++ses->portCount;
+  } else if (cb == NULL) {
+    --ses->portCount;
+    memmove(&ses->ports[idx], &ses->ports[idx + 1],
+            (ses->portCount - idx) * sizeof(Sam3APortHandler));
+    return 0;
+  }
+  ses->ports[idx].port = toport;
+  ses->ports[idx].cb = *cb;
+  ses->ports[idx].udata = udata;
   return 0;
 }
 
-static void aioConnConnected(Sam3AConnection *conn) {
+// give inbound stream to the handler of its TO_PORT
+static void connDispatchPort(Sam3AConnection *conn) {
+  Sam3ASession *ses = conn->ses;
+  int idx;
+  //
+  if (conn->toPort > 0 && ses->portCount > 0 &&
+      (idx = portFind(ses, conn->toPort)) >= 0) {
+    conn->cb = ses->ports[idx].cb;
+    conn->udata = ses->ports[idx].udata;
+  }
+}
+
+static void portsFree(Sam3ASession *ses) {
+  if (ses->ports != NULL)
+    free(ses->ports);
+  ses->ports = NULL;
+  ses->portCount = 0;
+}
+
+// tell user that connection is up
+static void connNotifyUp(Sam3AConnection *conn, int accepted) {
+  if (accepted) {
+    if (conn->listener == NULL)
+      connDispatchPort(conn); // sam3aListen() does it when taking the stream
+    if (conn->cb.cbAccepted != NULL)
+      conn->cb.cbAccepted(conn);
+  } else {
+    if (conn->cb.cbConnected != NULL)
+      conn->cb.cbConnected(conn);
+  }
+  if (sam3aIsActiveConnection(conn) && connHaveLeftover(conn))
+    aioConnDataReader(conn);
+  // indicate that we are ready for new data
+  if (sam3aIsActiveConnection(conn) && conn->cb.cbSent != NULL)
+    conn->cb.cbSent(conn);
+}
+
+static int shardHandOff(Sam3AConnection *conn, int accepted);
+
+// switch to data phase; under reactor connection may move to another shard
+static void connEstablished(Sam3AConnection *conn, int accepted) {
+  conn->callDisconnectCB = 1;
+  conn->cbAIOProcessorR = aioConnDataReader;
+  conn->cbAIOProcessorW = aioConnDataWriter;
+  conn->aio.dataPos = conn->aio.dataUsed = 0;
+  if (conn->owner == NULL || shardHandOff(conn, accepted) < 0)
+    connNotifyUp(conn, accepted);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void aioConnHelloChecker(Sam3AConnection *conn) {
+  SAMFieldList *rep = sam3aParseReply(conn->aio.data);
+  //
+  if (sesHelloOk(conn->ses, rep)) {
+    conn->cbAIOProcessorR = conn->cbAIOProcessorW = NULL;
+    sam3aFreeFieldList(rep);
+    if (conn->aio.udata != NULL) {
+      void (*cbComplete)(Sam3AConnection * conn) = conn->aio.udata;
+      //
+      cbComplete(conn);
+    }
+  } else {
+    sam3aFreeFieldList(rep);
+    connError(conn, NULL);
+  }
+}
+
+static int sam3aConnStartHandshake(Sam3AConnection *conn,
+                                   void (*cbComplete)(Sam3AConnection *conn)) {
+  if (cbComplete != NULL)
+    conn->aio.udata = cbComplete;
+  if (aioConnSendCmdWaitReply(conn, aioConnHelloChecker, "%s",
+                              sesHello(conn->ses)) < 0)
+    return -1;
+  return 0;
+}
+
+static void aioConnConnected(Sam3AConnection *conn) {
   int res;
   socklen_t len = sizeof(res);
   //
@@ -1526,81 +2904,197 @@ static void aioConnConnectChecker(Sam3AConnection *conn) {
   } else {
     // no error
     sam3aFreeFieldList(rep);
-    conn->callDisconnectCB = 1;
-    conn->cbAIOProcessorR = aioConnDataReader;
-    conn->cbAIOProcessorW = aioConnDataWriter;
-    conn->aio.dataPos = conn->aio.dataUsed = 0;
-    if (conn->cb.cbConnected != NULL)
-      conn->cb.cbConnected(conn);
-    // indicate that we are ready for new data
-    if (sam3aIsActiveConnection(conn) && conn->cb.cbSent != NULL)
-      conn->cb.cbSent(conn);
+    connEstablished(conn, 0);
+  }
+}
+
+static int shardPostAdopt(Sam3AShard *sh, Sam3AConnection *conn);
+static int shardAdoptHere(Sam3AShard *sh, Sam3AConnection *conn);
+
+// add new connection to session list; under reactor it is polled by home
+// shard, or by calling shard 'here' if that is given
+// <0: error; 0: ok
+static int sesLinkConnectionOn(Sam3ASession *ses, Sam3AConnection *conn,
+                               Sam3AShard *here) {
+  reactorLock(ses->home);
+  conn->prev = NULL;
+  if ((conn->next = ses->connlist) != NULL)
+    conn->next->prev = conn;
+  ses->connlist = conn;
+  if (ses->home != NULL &&
+      (here != NULL ? shardAdoptHere(here, conn)
+                    : shardPostAdopt(ses->home, conn)) < 0) {
+    if ((ses->connlist = conn->next) != NULL)
+      conn->next->prev = NULL;
+    conn->next = NULL;
+    reactorUnlock(ses->home);
+    return -1;
   }
+  reactorUnlock(ses->home);
+  return 0;
+}
+
+static int sesLinkConnection(Sam3ASession *ses, Sam3AConnection *conn) {
+  return sesLinkConnectionOn(ses, conn, NULL);
+}
+
+// O(1); connection may be not linked yet (failed sam3aSubmitConnect())
+static void sesUnlinkConnection(Sam3ASession *ses, Sam3AConnection *conn) {
+  reactorLock(ses->home);
+  if (ses->ioCursor == conn)
+    ses->ioCursor = conn->next;
+  if (conn->prev != NULL)
+    conn->prev->next = conn->next;
+  else if (ses->connlist == conn)
+    ses->connlist = conn->next;
+  if (conn->next != NULL)
+    conn->next->prev = conn->prev;
+  conn->next = conn->prev = NULL;
+  reactorUnlock(ses->home);
 }
 
 // handshake for SESSION CREATE complete
 static void aioConConnectHandshacked(Sam3AConnection *conn) {
+  char ports[40];
+  //
+  ports[0] = 0;
+  if (conn->fromPort > 0 || conn->toPort > 0)
+    snprintf(ports, sizeof(ports), " FROM_PORT=%d TO_PORT=%d", conn->fromPort,
+             conn->toPort);
   if (aioConnSendCmdWaitReply(conn, aioConnConnectChecker,
-                              "STREAM CONNECT ID=%s DESTINATION=%s\n",
-                              conn->ses->channel, conn->destkey) < 0) {
+                              "STREAM CONNECT ID=%s DESTINATION=%s%s\n",
+                              conn->ses->channel, conn->destkey, ports) < 0) {
     connError(conn, "MEMORY_ERROR");
   }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-Sam3AConnection *sam3aStreamConnectEx(Sam3ASession *ses,
-                                      const Sam3AConnectionCallbacks *cb,
-                                      const char *destkey, int timeoutms) {
-  if (sam3aIsActiveSession(ses) && ses->type == SAM3A_SESSION_STREAM &&
-      destkey != NULL && strlen(destkey) == SAM3A_PUBKEY_SIZE) {
-    Sam3AConnection *conn = calloc(1, sizeof(Sam3AConnection));
-    //
-    if (conn == NULL)
-      return NULL;
-    if (cb != NULL)
-      conn->cb = *cb;
+// 'destkey' can be NULL
+static Sam3AConnection *connAlloc(Sam3ASession *ses,
+                                  const Sam3AConnectionCallbacks *cb,
+                                  const char *destkey, int timeoutms) {
+  Sam3AConnection *conn = connCacheGet(&ses->connCache);
+  //
+  if (conn == NULL)
+    return NULL;
+  conn->ses = ses;
+  conn->fd = -1;
+  if (cb != NULL)
+    conn->cb = *cb;
+  if (destkey != NULL)
     strcpy(conn->destkey, destkey);
-    conn->timeoutms = timeoutms;
-    //
-    conn->aio.udata = aioConConnectHandshacked;
+  conn->timeoutms = timeoutms;
+  return conn;
+}
+
+// <0: pool is empty or not usable on this thread; >=0: HELLO'd socket
+static int warmTake(Sam3ASession *ses);
+
+// warm socket is writable: send STREAM command
+static void aioConnWarmStart(Sam3AConnection *conn) {
+  void (*cbHandshacked)(Sam3AConnection * conn) = conn->aio.udata;
+  //
+  conn->cbAIOProcessorW = NULL;
+  cbHandshacked(conn);
+}
+
+// sam3aDrainSession() state; set by any thread
+static inline Sam3ADrain *sesDrain(const Sam3ASession *ses) {
+  return __atomic_load_n(&ses->drain, __ATOMIC_ACQUIRE);
+}
+
+// connect to bridge and add to session; 'cbHandshacked' sends STREAM command
+// <0: error (fd is closed, connection is not linked); 0: ok
+static int sesStartConnection(Sam3ASession *ses, Sam3AConnection *conn,
+                              void (*cbHandshacked)(Sam3AConnection *conn)) {
+  if (sesDrain(ses) != NULL)
+    return -1; // sam3aDrainSession() was called
+  conn->aio.udata = cbHandshacked;
+  if (conn->warm == NULL && (conn->fd = warmTake(ses)) >= 0) {
+    conn->cbAIOProcessorW = aioConnWarmStart; // HELLO is done already
+  } else {
     conn->cbAIOProcessorW = aioConnConnected;
     if ((conn->fd = sam3aConnect(ses->ip, ses->port, NULL)) < 0)
-      goto error;
+      return -1;
+  }
+  //
+  conn->pool = &ses->pool;
+  if (sesLinkConnection(ses, conn) < 0) {
+    sam3aDisconnect(conn->fd);
+    conn->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+Sam3AConnection *sam3aStreamConnectPorts(Sam3ASession *ses,
+                                         const Sam3AConnectionCallbacks *cb,
+                                         const char *destkey, int fromport,
+                                         int toport, int timeoutms) {
+  if (sam3aIsActiveSession(ses) && ses->type == SAM3A_SESSION_STREAM &&
+      destkey != NULL && strlen(destkey) == SAM3A_PUBKEY_SIZE &&
+      fromport >= 0 && fromport <= 65535 && toport >= 0 && toport <= 65535) {
+    Sam3AConnection *conn = connAlloc(ses, cb, destkey, timeoutms);
     //
-    conn->ses = ses;
-    conn->next = ses->connlist;
-    ses->connlist = conn;
+    if (conn == NULL)
+      return NULL;
+    conn->fromPort = fromport;
+    conn->toPort = toport;
+    if (sesStartConnection(ses, conn, aioConConnectHandshacked) < 0) {
+      connCachePut(&ses->connCache, conn);
+      return NULL;
+    }
     return conn; // ok, connection process initiated
-  error:
-    if (conn->fd >= 0)
-      sam3aDisconnect(conn->fd);
-    memset(conn, 0, sizeof(Sam3AConnection));
-    free(conn);
   }
   return NULL;
 }
 
+Sam3AConnection *sam3aStreamConnectEx(Sam3ASession *ses,
+                                      const Sam3AConnectionCallbacks *cb,
+                                      const char *destkey, int timeoutms) {
+  return sam3aStreamConnectPorts(ses, cb, destkey, 0, 0, timeoutms);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
+// "<destination>[ FROM_PORT=n TO_PORT=n]" line that starts inbound stream
+// <0: invalid destination
+static int connParsePeer(Sam3AConnection *conn, char *line) {
+  char *opt = strchr(line, ' ');
+  //
+  if (opt != NULL)
+    *opt++ = 0;
+  if (strlen(line) != SAM3A_PUBKEY_SIZE || !sam3aIsValidPubKey(line))
+    return -1;
+  strcpy(conn->destkey, line);
+  while (opt != NULL) {
+    char *tok = opt;
+    //
+    if ((opt = strchr(opt, ' ')) != NULL)
+      *opt++ = 0;
+    if (strncmp(tok, "FROM_PORT=", 10) == 0)
+      conn->fromPort = atoi(tok + 10);
+    else if (strncmp(tok, "TO_PORT=", 8) == 0)
+      conn->toPort = atoi(tok + 8);
+  }
+  return 0;
+}
+
 static void aioConnAcceptCheckerA(Sam3AConnection *conn) {
-  SAMFieldList *rep = sam3aParseReply(conn->aio.data);
+  SAMFieldList *rep;
   //
-  if (rep != NULL || strlen(conn->aio.data) != SAM3A_PUBKEY_SIZE ||
-      !sam3aIsValidPubKey(conn->aio.data)) {
+  // error reply comes instead of destination line
+  if ((rep = sam3aParseReply(conn->aio.data)) != NULL &&
+      sam3aIsGoodReply(rep, "STREAM", "STATUS", NULL, NULL)) {
+    connError(conn, sam3aFindField(rep, "RESULT"));
     sam3aFreeFieldList(rep);
-    connError(conn, NULL);
     return;
   }
   sam3aFreeFieldList(rep);
-  strcpy(conn->destkey, conn->aio.data);
-  conn->callDisconnectCB = 1;
-  conn->cbAIOProcessorR = aioConnDataReader;
-  conn->cbAIOProcessorW = aioConnDataWriter;
-  conn->aio.dataPos = conn->aio.dataUsed = 0;
-  if (conn->cb.cbAccepted != NULL)
-    conn->cb.cbAccepted(conn);
-  // indicate that we are ready for new data
-  if (sam3aIsActiveConnection(conn) && conn->cb.cbSent != NULL)
-    conn->cb.cbSent(conn);
+  if (connParsePeer(conn, conn->aio.data) < 0) {
+    connError(conn, NULL);
+    return;
+  }
+  connEstablished(conn, 1);
 }
 
 static void aioConnAcceptChecker(Sam3AConnection *conn) {
@@ -1616,21 +3110,9 @@ static void aioConnAcceptChecker(Sam3AConnection *conn) {
     connError(conn, v);
     sam3aFreeFieldList(rep);
   } else {
-    // no error
+    // no error; peer destination line follows
     sam3aFreeFieldList(rep);
-    // 2048 bytes of reply line should be enough
-    if (conn->aio.dataSize < 2049) {
-      char *n = realloc(conn->aio.data, 2049);
-      //
-      if (n == NULL) {
-        connError(conn, "MEMORY_ERROR");
-        return;
-      }
-      conn->aio.data = n;
-      conn->aio.dataSize = 2049;
-    }
-    conn->aio.dataUsed = 2048;
-    conn->aio.dataPos = 0;
+    conn->aio.dataUsed = conn->aio.dataPos = 0;
     conn->cbAIOProcessorR = aioConnCmdReplyReader;
     conn->cbAIOProcessorW = NULL;
     conn->aio.cbReplyCheckConn = aioConnAcceptCheckerA;
@@ -1651,164 +3133,3371 @@ Sam3AConnection *sam3aStreamAcceptEx(Sam3ASession *ses,
                                      const Sam3AConnectionCallbacks *cb,
                                      int timeoutms) {
   if (sam3aIsActiveSession(ses) && ses->type == SAM3A_SESSION_STREAM) {
-    Sam3AConnection *conn = calloc(1, sizeof(Sam3AConnection));
+    Sam3AConnection *conn = connAlloc(ses, cb, NULL, timeoutms);
     //
     if (conn == NULL)
       return NULL;
-    if (cb != NULL)
-      conn->cb = *cb;
-    conn->timeoutms = timeoutms;
-    //
-    conn->aio.udata = aioConAcceptHandshacked;
-    conn->cbAIOProcessorW = aioConnConnected;
-    if ((conn->fd = sam3aConnect(ses->ip, ses->port, NULL)) < 0)
-      goto error;
-    //
-    conn->ses = ses;
-    conn->next = ses->connlist;
-    ses->connlist = conn;
+    if (sesStartConnection(ses, conn, aioConAcceptHandshacked) < 0) {
+      connCachePut(&ses->connCache, conn);
+      return NULL;
+    }
     return conn; // ok, connection process initiated
-  error:
-    if (conn->fd >= 0)
-      sam3aDisconnect(conn->fd);
-    memset(conn, 0, sizeof(Sam3AConnection));
-    free(conn);
   }
   return NULL;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-int sam3aSend(Sam3AConnection *conn, const void *data, int datasize) {
-  if (datasize == -1)
-    datasize = (data != NULL ? strlen((const char *)data) : 0);
-  //
-  if (sam3aIsActiveConnection(conn) && conn->callDisconnectCB &&
-      conn->cbAIOProcessorW != NULL &&
-      ((datasize > 0 && data != NULL) || datasize == 0)) {
-    // try to add data to send buffer
-    if (datasize > 0) {
-      if (conn->aio.dataUsed + datasize > conn->aio.dataSize) {
-        // we need more pepper!
-        int newsz = conn->aio.dataUsed + datasize;
-        char *nb = realloc(conn->aio.data, newsz);
-        //
-        if (nb == NULL)
-          return -1; // alas
-        conn->aio.data = nb;
-        conn->aio.dataSize = newsz;
-      }
-      //
-      memcpy(conn->aio.data + conn->aio.dataUsed, data, datasize);
-      conn->aio.dataUsed += datasize;
-    }
-    return 0;
+// stream forwarding
+// control connection keeps STREAM FORWARD alive; bridge connects to local
+// listener, which is an internal connection polled like any other, so it
+// works with select loop and reactor alike. every accepted socket starts with
+// "<destination>[ FROM_PORT=n TO_PORT=n]" line
+struct Sam3AForward {
+  Sam3AConnectionCallbacks cb; // for forwarded connections
+  Sam3AConnection *ctl;        // returned to user
+  Sam3AConnection *lsn;        // local listener
+  char host[INET_ADDRSTRLEN];
+  int port;
+};
+
+// header line of forwarded connection
+static void aioFwdHeaderChecker(Sam3AConnection *conn) {
+  if (connParsePeer(conn, conn->aio.data) < 0) {
+    connError(conn, "INVALID_KEY");
+    return;
   }
-  //
-  return -1;
+  connEstablished(conn, 1);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-int sam3aIsHaveActiveConnections(const Sam3ASession *ses) {
-  if (sam3aIsActiveSession(ses)) {
-    for (const Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
-      if (sam3aIsActiveConnection(c))
-        return 1;
+// accept all pending bridge connections
+static void aioFwdAcceptor(Sam3AConnection *lsn) {
+  Sam3ASession *ses = lsn->ses;
+  //
+  for (;;) {
+    Sam3AConnection *conn;
+    int fd;
+    //
+#if defined(__linux__)
+    fd = accept4(lsn->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    if ((fd = accept(lsn->fd, NULL, NULL)) >= 0 &&
+        (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+         fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)) {
+      close(fd);
+      continue;
+    }
+#endif
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK && lsn->fwd->ctl != NULL)
+        connError(lsn->fwd->ctl, "IO_ERROR");
+      return;
+    }
+    if ((conn = connAlloc(ses, &lsn->fwd->cb, NULL, -1)) == NULL) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->pool = &ses->pool;
+    conn->cbAIOProcessorR = aioConnCmdReplyReader;
+    conn->aio.cbReplyCheckConn = aioFwdHeaderChecker;
+    if (sesLinkConnection(ses, conn) < 0) {
+      // reactor could not adopt it; nobody would poll it
+      close(fd);
+      connCachePut(&ses->connCache, conn);
     }
   }
-  return 0;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-int sam3aCancelConnection(Sam3AConnection *conn) {
-  if (conn != NULL) {
+// bridge must not send anything after STREAM STATUS; EOF ends forwarding
+static void aioFwdCtlReader(Sam3AConnection *conn) {
+  char buf[256];
+  ssize_t rd;
+  //
+  do {
+    rd = recv(conn->fd, buf, sizeof(buf), 0);
+  } while (rd < 0 && errno == EINTR);
+  if (rd == 0)
     connDisconnect(conn);
-    return 0;
+  else if (rd < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    connError(conn, "IO_ERROR");
+}
+
+static void aioFwdChecker(Sam3AConnection *conn) {
+  SAMFieldList *rep = sam3aParseReply(conn->aio.data);
+  //
+  if (rep == NULL) {
+    connError(conn, NULL);
+    return;
   }
-  return -1;
+  if (!sam3aIsGoodReply(rep, "STREAM", "STATUS", "RESULT", "OK")) {
+    const char *v = sam3aFindField(rep, "RESULT");
+    //
+    connError(conn, v);
+    sam3aFreeFieldList(rep);
+    return;
+  }
+  sam3aFreeFieldList(rep);
+  conn->callDisconnectCB = 1;
+  conn->cbAIOProcessorR = aioFwdCtlReader;
+  conn->cbAIOProcessorW = NULL;
+  if (conn->cb.cbConnected != NULL)
+    conn->cb.cbConnected(conn);
 }
 
-int sam3aCloseConnection(Sam3AConnection *conn) {
-  if (conn != NULL) {
-    sam3aCancelConnection(conn);
-    if (conn->cb.cbDestroy != NULL)
-      conn->cb.cbDestroy(conn);
-    for (Sam3AConnection *p = NULL, *c = conn->ses->connlist; c != NULL;
-         p = c, c = c->next) {
-      if (c == conn) {
-        // got it!
-        if (p == NULL)
-          c->ses->connlist = c->next;
-        else
-          p->next = c->next;
-        break;
-      }
-    }
-    if (conn->params != NULL) {
-      free(conn->params);
-      conn->params = NULL;
-    }
-    memset(conn, 0, sizeof(Sam3AConnection));
-    free(conn);
+static void aioFwdHandshacked(Sam3AConnection *conn) {
+  if (aioConnSendCmdWaitReply(
+          conn, aioFwdChecker,
+          "STREAM FORWARD ID=%s PORT=%d HOST=%s SILENT=false\n",
+          conn->ses->channel, conn->fwd->port, conn->fwd->host) < 0) {
+    connError(conn, "MEMORY_ERROR");
   }
-  return -1;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-int sam3aAddSessionToFDS(Sam3ASession *ses, int maxfd, fd_set *rds,
-                         fd_set *wrs) {
-  if (ses != NULL) {
-    if (sam3aIsActiveSession(ses)) {
-      if (rds != NULL && ses->cbAIOProcessorR != NULL) {
-        if (maxfd < ses->fd)
-          maxfd = ses->fd;
-        FD_SET(ses->fd, rds);
-      }
-      //
-      if (wrs != NULL && ses->cbAIOProcessorW != NULL) {
-        if (maxfd < ses->fd)
-          maxfd = ses->fd;
-        FD_SET(ses->fd, wrs);
-      }
-      //
-      for (Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
-        if (sam3aIsActiveConnection(c)) {
-          if (rds != NULL && c->cbAIOProcessorR != NULL) {
-            if (maxfd < c->fd)
-              maxfd = c->fd;
-            FD_SET(c->fd, rds);
-          }
-          //
-          if (wrs != NULL && c->cbAIOProcessorW != NULL) {
-            if (!c->callDisconnectCB || (c->aio.dataPos < c->aio.dataUsed))
-              if (maxfd < c->fd)
-                maxfd = c->fd;
-            FD_SET(c->fd, wrs);
-          }
-        }
-      }
-    }
-    return maxfd;
+// non-blocking listener; fills fwd->port when it was 0
+// <0: error; >=0: fd
+static int fwdListen(Sam3AForward *fwd) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd, val = 1;
+  //
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(fwd->port);
+  if (inet_pton(AF_INET, fwd->host, &addr.sin_addr) != 1)
+    return -1;
+  if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) <
+      0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+    close(fd);
+    return -1;
   }
+  fwd->port = ntohs(addr.sin_port);
+  return fd;
+}
+
+// control or listener connection is being closed; one takes the other along
+static void fwdForget(Sam3AConnection *conn) {
+  Sam3AForward *fwd = conn->fwd;
   //
-  return -1;
+  conn->fwd = NULL;
+  if (conn == fwd->lsn)
+    fwd->lsn = NULL;
+  else
+    fwd->ctl = NULL;
+  if (fwd->lsn != NULL)
+    sam3aCloseConnection(fwd->lsn);
+  else if (fwd->ctl == NULL)
+    free(fwd);
 }
 
-void sam3aProcessSessionIO(Sam3ASession *ses, fd_set *rds, fd_set *wrs) {
+static inline int connIsInternal(const Sam3AConnection *conn) {
+  return (conn->warm != NULL || (conn->fwd != NULL && conn->fwd->lsn == conn));
+}
+
+Sam3AConnection *sam3aStreamForwardEx(Sam3ASession *ses,
+                                      const Sam3AConnectionCallbacks *cb,
+                                      const char *hostname, int port,
+                                      int timeoutms) {
+  Sam3AForward *fwd;
+  Sam3AConnection *lsn, *ctl;
+  int fd;
+  //
+  if (!sam3aIsActiveSession(ses) || ses->type != SAM3A_SESSION_STREAM ||
+      port < 0 || port > 65535)
+    return NULL;
+  if (hostname == NULL || !hostname[0])
+    hostname = "127.0.0.1";
+  if (strlen(hostname) >= INET_ADDRSTRLEN ||
+      (fwd = calloc(1, sizeof(Sam3AForward))) == NULL)
+    return NULL;
+  if (cb != NULL)
+    fwd->cb = *cb;
+  strcpy(fwd->host, hostname);
+  fwd->port = port;
+  if ((fd = fwdListen(fwd)) < 0) {
+    free(fwd);
+    return NULL;
+  }
+  if ((lsn = connAlloc(ses, NULL, NULL, -1)) == NULL) {
+    close(fd);
+    free(fwd);
+    return NULL;
+  }
+  lsn->fd = fd;
+  lsn->fwd = fwd;
+  lsn->pool = &ses->pool;
+  lsn->cbAIOProcessorR = aioFwdAcceptor;
+  fwd->lsn = lsn;
+  sesLinkConnection(ses, lsn);
+  if ((ctl = connAlloc(ses, cb, NULL, timeoutms)) == NULL) {
+    sam3aCloseConnection(lsn);
+    return NULL;
+  }
+  ctl->fwd = fwd;
+  fwd->ctl = ctl;
+  if (sesStartConnection(ses, ctl, aioFwdHandshacked) < 0) {
+    fwd->ctl = NULL;
+    connCachePut(&ses->connCache, ctl);
+    sam3aCloseConnection(lsn);
+    return NULL;
+  }
+  return ctl; // ok, forwarding process initiated
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// accept pool
+// pending accepts live in 'pend' slots and use internal callbacks; once
+// accepted a connection leaves its slot, gets user callbacks and the slot is
+// re-armed. state is guarded by reactor lock (accepted connections may be
+// closed by any shard)
+struct Sam3AListener {
+  Sam3AConnectionCallbacks cb;
+  int backlog;
+  int maxConns; // <=0: no limit
+  Sam3AConnection **pend;
+  int pendAlloc;
+  int pending;  // outstanding accepts
+  int accepted; // accepted and not closed yet
+  int failures; // failed accepts in a row
+};
+
+static void listenAccepted(Sam3AConnection *conn);
+
+static const Sam3AConnectionCallbacks listenCb = {
+    .cbAccepted = listenAccepted,
+};
+
+// fill empty slots; called with reactor lock held
+static void listenArm(Sam3ASession *ses) {
+  Sam3AListener *l = ses->listener;
+  //
+  for (int f = 0; f < l->backlog && sam3aIsActiveSession(ses); ++f) {
+    Sam3AConnection *conn;
+    //
+    if (l->pend[f] != NULL)
+      continue;
+    if (l->maxConns > 0 && l->accepted + l->pending >= l->maxConns)
+      break;
+    if ((conn = sam3aStreamAccept(ses, &listenCb)) == NULL) {
+      ++l->failures;
+      break; // bridge is unreachable; retry on next tick
+    }
+    conn->listener = l;
+    conn->listenSlot = f;
+    l->pend[f] = conn;
+    ++l->pending;
+  }
+}
+
+// close failed accepts and re-arm; runs on the thread polling accepts
+static void listenRefill(Sam3ASession *ses) {
+  Sam3AListener *l = ses->listener;
+  //
+  reactorLock(ses->home);
+  for (int f = 0; f < l->pendAlloc; ++f) {
+    Sam3AConnection *conn = l->pend[f];
+    //
+    if (conn == NULL || sam3aIsActiveConnection(conn))
+      continue;
+    if (++l->failures >= SAM3A_LISTEN_MAX_FAILURES) {
+      l->backlog = 0; // give up
+      if (l->cb.cbError != NULL)
+        l->cb.cbError(conn);
+    }
+    sam3aCloseConnection(conn); // clears the slot
+  }
+  if (l->failures < SAM3A_LISTEN_MAX_FAILURES)
+    listenArm(ses);
+  reactorUnlock(ses->home);
+}
+
+static void listenAccepted(Sam3AConnection *conn) {
+  Sam3ASession *ses = conn->ses;
+  Sam3AListener *l = conn->listener;
+  //
+  reactorLock(ses->home);
+  if (conn->listenSlot < l->pendAlloc && l->pend[conn->listenSlot] == conn)
+    l->pend[conn->listenSlot] = NULL;
+  conn->listenSlot = -1;
+  --l->pending;
+  ++l->accepted;
+  l->failures = 0;
+  conn->cb = l->cb;
+  connDispatchPort(conn);
+  listenArm(ses);
+  reactorUnlock(ses->home);
+  if (conn->cb.cbAccepted != NULL)
+    conn->cb.cbAccepted(conn);
+}
+
+// connection is being closed
+static void listenForget(Sam3AConnection *conn) {
+  Sam3ASession *ses = conn->ses;
+  Sam3AListener *l = conn->listener;
+  //
+  reactorLock(ses->home);
+  if (conn->listenSlot < 0) {
+    --l->accepted;
+  } else if (conn->listenSlot < l->pendAlloc &&
+             l->pend[conn->listenSlot] == conn) {
+    l->pend[conn->listenSlot] = NULL;
+    --l->pending;
+  }
+  conn->listener = NULL;
+  if (l->failures < SAM3A_LISTEN_MAX_FAILURES)
+    listenArm(ses);
+  reactorUnlock(ses->home);
+}
+
+int sam3aListen(Sam3ASession *ses, int backlog,
+                const Sam3AConnectionCallbacks *cb, int maxconns) {
+  Sam3AListener *l;
+  //
+  if (!sam3aIsActiveSession(ses) || ses->type != SAM3A_SESSION_STREAM ||
+      backlog < 1)
+    return -1;
+  reactorLock(ses->home);
+  if ((l = ses->listener) == NULL &&
+      (l = ses->listener = calloc(1, sizeof(Sam3AListener))) == NULL) {
+    reactorUnlock(ses->home);
+    return -1;
+  }
+  if (backlog > l->pendAlloc) {
+    Sam3AConnection **n = realloc(l->pend, backlog * sizeof(*n));
+    //
+    if (n == NULL) {
+      reactorUnlock(ses->home);
+      return -1;
+    }
+    memset(n + l->pendAlloc, 0, (backlog - l->pendAlloc) * sizeof(*n));
+    l->pend = n;
+    l->pendAlloc = backlog;
+  }
+  if (cb != NULL)
+    l->cb = *cb;
+  else
+    memset(&l->cb, 0, sizeof(l->cb));
+  l->backlog = backlog;
+  l->maxConns = maxconns;
+  l->failures = 0;
+  listenArm(ses);
+  reactorUnlock(ses->home);
+  return 0;
+}
+
+int sam3aStopListen(Sam3ASession *ses) {
+  Sam3AListener *l;
+  //
+  if (ses == NULL || (l = ses->listener) == NULL)
+    return -1;
+  reactorLock(ses->home);
+  l->backlog = 0;
+  for (int f = 0; f < l->pendAlloc; ++f)
+    if (l->pend[f] != NULL)
+      sam3aCloseConnection(l->pend[f]);
+  reactorUnlock(ses->home);
+  return 0;
+}
+
+// all connections must be closed
+static void listenFree(Sam3ASession *ses) {
+  if (ses->listener != NULL) {
+    free(ses->listener->pend);
+    free(ses->listener);
+    ses->listener = NULL;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// warm pool
+// idle sockets are ordinary session connections with no user callbacks, so
+// select loops and reactor shards poll them as usual; a ready one has passed
+// HELLO and waits in aioWarmIdle(). taking one moves its fd to the new stream
+// and closes the empty shell
+struct Sam3AWarmPool {
+  int size;
+  Sam3AConnection **conns; // NULL: empty slot
+  int alloc;
+  uint64_t retryAt; // don't connect before this time after a failure
+};
+
+static int sesOnHomeThread(const Sam3ASession *ses);
+
+// ready idle socket must not get any data; anything readable is EOF or junk
+static void aioWarmIdle(Sam3AConnection *conn) { connError(conn, "IO_ERROR"); }
+
+// HELLO done
+static void aioWarmReady(Sam3AConnection *conn) {
+  conn->cbAIOProcessorR = aioWarmIdle;
+}
+
+static inline int warmIsReady(const Sam3AConnection *conn) {
+  return (sam3aIsActiveConnection(conn) &&
+          conn->cbAIOProcessorR == aioWarmIdle);
+}
+
+static int warmTake(Sam3ASession *ses) {
+  Sam3AWarmPool *wp = ses->warm;
+  //
+  if (wp == NULL || !sesOnHomeThread(ses))
+    return -1;
+  for (int f = 0; f < wp->alloc; ++f) {
+    Sam3AConnection *conn = wp->conns[f];
+    int fd;
+    //
+    if (conn == NULL || !warmIsReady(conn))
+      continue;
+    fd = conn->fd;
+    conn->fd = -1;
+    wp->conns[f] = NULL;
+    conn->warm = NULL;
+    sam3aCloseConnection(conn);
+    return fd;
+  }
+  return -1;
+}
+
+// close dead idle sockets, open new ones; runs on the thread polling them
+static void warmRefill(Sam3ASession *ses) {
+  Sam3AWarmPool *wp = ses->warm;
+  struct timeval tv;
+  uint64_t now;
+  //
+  gettimeofday(&tv, NULL);
+  now = sam3atimeval2ms(&tv);
+  for (int f = 0; f < wp->alloc; ++f) {
+    Sam3AConnection *conn = wp->conns[f];
+    //
+    if (conn != NULL && !sam3aIsActiveConnection(conn)) {
+      wp->retryAt = now + SAM3A_WARM_RETRY_MS;
+      sam3aCloseConnection(conn); // clears the slot
+    }
+  }
+  for (int f = 0; f < wp->size && now >= wp->retryAt; ++f) {
+    Sam3AConnection *conn;
+    //
+    if (wp->conns[f] != NULL)
+      continue;
+    if ((conn = connAlloc(ses, NULL, NULL, -1)) == NULL)
+      break;
+    conn->warm = wp;
+    conn->warmSlot = f;
+    if (sesStartConnection(ses, conn, aioWarmReady) < 0) {
+      connCachePut(&ses->connCache, conn);
+      wp->retryAt = now + SAM3A_WARM_RETRY_MS;
+      break;
+    }
+    wp->conns[f] = conn;
+  }
+}
+
+// idle socket is being closed
+static void warmForget(Sam3AConnection *conn) {
+  Sam3AWarmPool *wp = conn->warm;
+  //
+  if (conn->warmSlot < wp->alloc && wp->conns[conn->warmSlot] == conn)
+    wp->conns[conn->warmSlot] = NULL;
+  conn->warm = NULL;
+}
+
+int sam3aSetWarmPool(Sam3ASession *ses, int size) {
+  Sam3AWarmPool *wp;
+  //
+  if (!sam3aIsActiveSession(ses) || ses->type != SAM3A_SESSION_STREAM ||
+      size < 0)
+    return -1;
+  if ((wp = ses->warm) == NULL &&
+      (wp = ses->warm = calloc(1, sizeof(Sam3AWarmPool))) == NULL)
+    return -1;
+  if (size > wp->alloc) {
+    Sam3AConnection **n = realloc(wp->conns, size * sizeof(*n));
+    //
+    if (n == NULL)
+      return -1;
+    memset(n + wp->alloc, 0, (size - wp->alloc) * sizeof(*n));
+    wp->conns = n;
+    wp->alloc = size;
+  }
+  wp->size = size;
+  wp->retryAt = 0;
+  // shrink
+  for (int f = size; f < wp->alloc; ++f)
+    if (wp->conns[f] != NULL)
+      sam3aCloseConnection(wp->conns[f]);
+  return 0;
+}
+
+int sam3aWarmPoolReady(const Sam3ASession *ses) {
+  int res = 0;
+  //
+  if (ses == NULL)
+    return -1;
+  if (ses->warm != NULL) {
+    for (int f = 0; f < ses->warm->alloc; ++f)
+      if (ses->warm->conns[f] != NULL && warmIsReady(ses->warm->conns[f]))
+        ++res;
+  }
+  return res;
+}
+
+// all connections must be closed
+static void warmFree(Sam3ASession *ses) {
+  if (ses->warm != NULL) {
+    free(ses->warm->conns);
+    free(ses->warm);
+    ses->warm = NULL;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// supervisor
+// lost session keeps its memory, keys, options and connection list; retry
+// reconnects it in place and goes through HELLO and SESSION CREATE again
+struct Sam3ASupervisor {
+  int mindelayms;
+  int maxdelayms;
+  int maxattempts; // <=0: no limit
+  BJRandCtx rc;    // jitter
+  uint64_t retryAt; // 0: no attempt scheduled
+  uint64_t downAt;  // 0: session is up
+  Sam3ASupervisorStats st;
+};
+
+// equal jitter: upper half of min(max, min * 2^attempt)
+static int superDelay(Sam3ASupervisor *sv) {
+  int64_t d = sv->mindelayms;
+  //
+  for (int f = 0; f < sv->st.attempt && d < sv->maxdelayms; ++f)
+    d *= 2;
+  if (d > sv->maxdelayms)
+    d = sv->maxdelayms;
+  return (int)(d - d / 2 + bjprngRand(&sv->rc) % (d / 2 + 1));
+}
+
+static void superDown(Sam3ASupervisor *sv, uint64_t now) {
+  sv->st.lastdownms = now - sv->downAt;
+  sv->st.downtimems += sv->st.lastdownms;
+  sv->downAt = 0;
+}
+
+// sesError() on supervised session; returns bool: next attempt is
+// scheduled, cbError() is not called
+static int superLost(Sam3ASession *ses) {
+  Sam3ASupervisor *sv = ses->super;
+  uint64_t now = bridgeNow();
+  //
+  if (ses->cancelled || ses->home != NULL)
+    return 0;
+  if (!ses->callDisconnectCB) {
+    // attempt failed before the session was created
+    ++sv->st.failures;
+    ++sv->st.attempt;
+  } else if (ses->bridges != NULL) {
+    bridgeFailed(&ses->bridges->bridges[ses->bridge]);
+  }
+  if (sv->downAt == 0)
+    sv->downAt = now;
+  if (sv->maxattempts > 0 && sv->st.attempt >= sv->maxattempts) {
+    superDown(sv, now); // give up
+    sv->st.attempt = 0;
+    return 0;
+  }
+  sv->retryAt = now + superDelay(sv);
+  sesDisconnect(ses); // cbDisconnected() if it was created; may close 'ses'
+  return 1;
+}
+
+// close the lost connection and start over
+static void superRestart(Sam3ASession *ses) {
+  int res;
+  //
+  ses->super->retryAt = 0;
+  if (ses->resolve != NULL)
+    sesResolveCancel(ses);
+  else if (ses->fd >= 0)
+    close(ses->fd);
+  ses->fd = -1;
+  ses->cancelled = 0;
+  ses->callDisconnectCB = 0;
+  subFree(ses); // bridge dropped subsessions with the primary
+  sam3aGenChannelName(ses->channel, 32, 64);
+  ses->aio.udata = aioSesHandshacked;
+  if (ses->bridges != NULL) {
+    ses->bridgeTried = 0;
+    res = bridgeStart(ses);
+  } else {
+    ses->cbAIOProcessorW = aioSesConnected;
+    res = ses->fd = sam3aConnect(ses->ip, ses->ctlPort, NULL);
+  }
+  if (res < 0)
+    sesError(ses, "CONNECTION_ERROR");
+}
+
+// STREAM FORWARD again on the connection the user kept
+static void fwdRearm(Sam3AConnection *ctl) {
+  Sam3AForward *fwd = ctl->fwd;
+  Sam3AConnection *lsn = fwd->lsn;
+  //
+  if (lsn != NULL) {
+    // shutdown() stopped the listener; same port, new socket
+    close(lsn->fd);
+    if ((lsn->fd = fwdListen(fwd)) < 0)
+      return;
+    lsn->cancelled = 0;
+    lsn->cbAIOProcessorR = aioFwdAcceptor;
+  }
+  close(ctl->fd);
+  ctl->cancelled = 0;
+  ctl->callDisconnectCB = 0;
+  ctl->aio.udata = aioFwdHandshacked;
+  ctl->cbAIOProcessorW = aioConnConnected;
+  if ((ctl->fd = sam3aConnect(ctl->ses->ip, ctl->ses->port, NULL)) < 0)
+    connError(ctl, "CONNECTION_ERROR");
+}
+
+// bring back listener, warm pool and forwards of the lost session
+static void superRearm(Sam3ASession *ses) {
+  for (Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
+    if (c->fwd != NULL && c->fwd->ctl == c && !sam3aIsActiveConnection(c))
+      fwdRearm(c);
+  }
+  if (ses->listener != NULL) {
+    Sam3AListener *l = ses->listener;
+    //
+    // failed accepts are not the listener's fault; listenRefill() re-arms
+    l->failures = 0;
+    for (int f = 0; f < l->pendAlloc; ++f)
+      if (l->pend[f] != NULL && !sam3aIsActiveConnection(l->pend[f]))
+        sam3aCloseConnection(l->pend[f]);
+  }
+  if (ses->warm != NULL) {
+    Sam3AWarmPool *wp = ses->warm;
+    //
+    for (int f = 0; f < wp->alloc; ++f)
+      if (wp->conns[f] != NULL && !sam3aIsActiveConnection(wp->conns[f]))
+        sam3aCloseConnection(wp->conns[f]);
+    wp->retryAt = 0;
+  }
+}
+
+static void superCreated(Sam3ASession *ses) {
+  Sam3ASupervisor *sv = ses->super;
+  //
+  sv->st.attempt = 0;
+  if (sv->downAt != 0) {
+    superDown(sv, bridgeNow());
+    ++sv->st.reconnects;
+    superRearm(ses);
+  }
+}
+
+// from sam3aProcessSessionIO(); attempt is due
+static void superTick(Sam3ASession *ses) {
+  if (bridgeNow() >= ses->super->retryAt)
+    superRestart(ses);
+}
+
+static void superFree(Sam3ASession *ses) {
+  if (ses->super != NULL) {
+    free(ses->super);
+    ses->super = NULL;
+  }
+}
+
+int sam3aSuperviseSession(Sam3ASession *ses, int mindelayms, int maxdelayms,
+                          int maxattempts) {
+  Sam3ASupervisor *sv;
+  //
+  if (!sam3aIsActiveSession(ses) || ses->home != NULL ||
+      ses->primary != NULL || mindelayms < 1 || maxdelayms < mindelayms)
+    return -1;
+  if ((sv = ses->super) == NULL) {
+    if ((sv = calloc(1, sizeof(Sam3ASupervisor))) == NULL)
+      return -1;
+    bjprngInit(&sv->rc, genSeed());
+    ses->super = sv;
+  }
+  sv->mindelayms = mindelayms;
+  sv->maxdelayms = maxdelayms;
+  sv->maxattempts = maxattempts;
+  if (ses->callDisconnectCB && sesIsIdle(ses))
+    sesSetIdle(ses); // start watching
+  return 0;
+}
+
+int sam3aSupervisorStats(const Sam3ASession *ses, Sam3ASupervisorStats *st) {
+  const Sam3ASupervisor *sv;
+  uint64_t now;
+  //
+  if (ses == NULL || (sv = ses->super) == NULL || st == NULL)
+    return -1;
+  now = bridgeNow();
+  *st = sv->st;
+  if (sv->downAt != 0)
+    st->downtimems += now - sv->downAt;
+  st->retryms = -1;
+  if (sv->retryAt != 0)
+    st->retryms = (sv->retryAt > now ? (int)(sv->retryAt - now) : 0);
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// keepalive
+// PING carries a sequence number; PONG echoes it
+struct Sam3AKeepalive {
+  int intervalms; // <=0: off
+  int maxmissed;
+  int missed;      // in a row
+  uint32_t seq;    // of PING in flight
+  uint64_t sentAt; // 0: no PING in flight
+  uint64_t nextAt;
+  Sam3AKeepaliveStats st;
+};
+
+static void keepaliveRtt(Sam3ASession *ses, int ms) {
+  Sam3AKeepaliveStats *st = &ses->keepalive->st;
+  int f = 0;
+  //
+  if (st->received++ == 0 || ms < st->minrttms)
+    st->minrttms = ms;
+  if (ms > st->maxrttms)
+    st->maxrttms = ms;
+  st->lastrttms = ms;
+  st->sumrttms += ms;
+  while (f < SAM3A_RTT_BUCKETS - 1 && ms >= (1 << f))
+    ++f;
+  ++st->hist[f];
+  if (ses->bridges != NULL) {
+    Sam3ABridge *b = &ses->bridges->bridges[ses->bridge];
+    //
+    b->rttms = (b->rttms < 0 ? ms : (b->rttms * 7 + ms) / 8);
+  }
+}
+
+// line in ses->aio.data; returns bool: it was PING or PONG (and is handled)
+static int keepaliveLine(Sam3ASession *ses) {
+  const char *line = ses->aio.data;
+  Sam3AKeepalive *k = ses->keepalive;
+  //
+  if (strncmp(line, "PING", 4) == 0 && (line[4] == 0 || line[4] == ' ')) {
+    char *pong;
+    int len;
+    //
+    if ((pong = sam3Printf(&len, "PONG%s\n", line + 4)) == NULL) {
+      sesError(ses, "MEMORY_ERROR");
+      return 1;
+    }
+    // answer between commands only, PONG must not split one
+    if (ses->cbAIOProcessorW != NULL) {
+      free(ses->pong); // bridge wants the last one
+      ses->pong = pong;
+      return 1;
+    }
+    if (sam3aSendBytes(ses->fd, pong, len) != len) {
+      free(pong);
+      sesError(ses, "IO_ERROR");
+      return 1;
+    }
+    free(pong);
+    return 1;
+  }
+  if (strncmp(line, "PONG", 4) != 0 || (line[4] != 0 && line[4] != ' '))
+    return 0;
+  if (k != NULL && k->sentAt != 0 &&
+      strtoul(line + 4, NULL, 10) == (unsigned long)k->seq) {
+    keepaliveRtt(ses, (int)(bridgeNow() - k->sentAt));
+    k->sentAt = 0;
+    k->missed = 0;
+  }
+  return 1; // late or unknown PONG
+}
+
+// new bridge connection: nothing is in flight
+static void keepaliveCreated(Sam3ASession *ses) {
+  Sam3AKeepalive *k = ses->keepalive;
+  //
+  k->sentAt = 0;
+  k->missed = 0;
+  k->nextAt = bridgeNow() + k->intervalms;
+}
+
+static void keepaliveTick(Sam3ASession *ses) {
+  Sam3AKeepalive *k = ses->keepalive;
+  uint64_t now;
+  char ping[32];
+  int len;
+  //
+  if (k->intervalms <= 0 || !sam3aIsActiveSession(ses) ||
+      !ses->callDisconnectCB || (now = bridgeNow()) < k->nextAt)
+    return;
+  if (k->sentAt != 0) {
+    k->sentAt = 0;
+    ++k->st.missed;
+    if (++k->missed >= k->maxmissed) {
+      sesError(ses, "PING_TIMEOUT");
+      return;
+    }
+  }
+  if (!sesIsIdle(ses))
+    return; // after the command
+  len = snprintf(ping, sizeof(ping), "PING %u\n", ++k->seq);
+  if (sam3aSendBytes(ses->fd, ping, len) != len) {
+    sesError(ses, "IO_ERROR");
+    return;
+  }
+  ++k->st.sent;
+  k->sentAt = now;
+  k->nextAt = now + k->intervalms;
+}
+
+static void keepaliveFree(Sam3ASession *ses) {
+  if (ses->keepalive != NULL) {
+    free(ses->keepalive);
+    ses->keepalive = NULL;
+  }
+}
+
+int sam3aSetKeepalive(Sam3ASession *ses, int intervalms, int maxmissed) {
+  Sam3AKeepalive *k;
+  //
+  if (!sam3aIsActiveSession(ses) || ses->home != NULL ||
+      ses->primary != NULL || maxmissed < 1)
+    return -1;
+  if ((k = ses->keepalive) == NULL) {
+    if ((k = calloc(1, sizeof(Sam3AKeepalive))) == NULL)
+      return -1;
+    k->st.lastrttms = -1;
+    ses->keepalive = k;
+  }
+  k->intervalms = intervalms;
+  k->maxmissed = maxmissed;
+  keepaliveCreated(ses);
+  if (ses->callDisconnectCB && sesIsIdle(ses))
+    sesSetIdle(ses); // start watching
+  return 0;
+}
+
+int sam3aKeepaliveStats(const Sam3ASession *ses, Sam3AKeepaliveStats *st) {
+  if (ses == NULL || ses->keepalive == NULL || st == NULL)
+    return -1;
+  *st = ses->keepalive->st;
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// relay
+// local socket is an internal connection polled by the same thread as the
+// stream, so both sides are served without locking. direction 0 goes from
+// stream to local socket, 1 back; each one empties its pipe before reading
+// more, so a destination that can't take data pauses reading its source
+typedef struct {
+  int pipe[2];   // Linux: splice() goes through it
+  char *buf;     // elsewhere: data is copied through it
+  int off;
+  int pending;   // bytes in pipe or buffer
+  int eof;       // source is done
+  int shut;      // destination got shutdown(SHUT_WR)
+  int64_t bytes; // delivered to destination (atomic)
+} Sam3ARelayDir;
+
+struct Sam3ARelay {
+  Sam3AConnection *conn; // stream
+  Sam3AConnection *peer; // local socket
+  Sam3ARelayDir dir[2];
+  int done; // atomic
+};
+
+static int connOnOwnerThread(const Sam3AConnection *conn);
+
+static inline Sam3AConnection *relaySrc(Sam3ARelay *r, int d) {
+  return (d == 0 ? r->conn : r->peer);
+}
+
+static inline Sam3AConnection *relayDst(Sam3ARelay *r, int d) {
+  return (d == 0 ? r->peer : r->conn);
+}
+
+static inline void relayCount(Sam3ARelayDir *dir, int64_t n) {
+  __atomic_store_n(&dir->bytes, dir->bytes + n, __ATOMIC_RELAXED);
+}
+
+static void relayDirClose(Sam3ARelayDir *dir) {
+  for (int f = 0; f < 2; ++f) {
+    if (dir->pipe[f] >= 0) {
+      close(dir->pipe[f]);
+      dir->pipe[f] = -1;
+    }
+  }
+  if (dir->buf != NULL) {
+    free(dir->buf);
+    dir->buf = NULL;
+  }
+  dir->pending = 0;
+}
+
+#if defined(__linux__)
+// splice() into a socket has no MSG_NOSIGNAL: block SIGPIPE meanwhile and
+// drop the one it raised (unless it was pending before)
+// returns bool: SIGPIPE was pending
+static int sigpipeBlock(sigset_t *old) {
+  sigset_t set, pend;
+  //
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  sigpending(&pend);
+  pthread_sigmask(SIG_BLOCK, &set, old);
+  return sigismember(&pend, SIGPIPE);
+}
+
+static void sigpipeRestore(const sigset_t *old, int waspending) {
+  if (!waspending) {
+    struct timespec ts = {0, 0};
+    sigset_t set, pend;
+    //
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    sigpending(&pend);
+    if (sigismember(&pend, SIGPIPE))
+      sigtimedwait(&set, NULL, &ts);
+  }
+  pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+#endif
+
+// deliver what direction 'd' holds
+// <0: error; 0: destination is full; 1: all delivered
+static int relayDrain(Sam3ARelay *r, int d) {
+  Sam3ARelayDir *dir = &r->dir[d];
+  Sam3AConnection *dst = relayDst(r, d);
+  int res = 1;
+  //
+  if (dst->sendq.head != NULL) {
+    // stream leftovers or data queued before relaying go first
+    int64_t was = dst->sendq.bytes;
+    //
+    if (sendqWrite(dst->fd, &dst->sendq, dst->pool, -1) < 0)
+      return -1;
+    if (d == 0)
+      relayCount(dir, was - dst->sendq.bytes);
+    if (dst->sendq.head != NULL)
+      return 0;
+  }
+  if (dir->pending > 0) {
+#if defined(__linux__)
+    sigset_t old;
+    int waspending = sigpipeBlock(&old);
+#endif
+    //
+    while (dir->pending > 0) {
+#if defined(__linux__)
+      ssize_t wr = splice(dir->pipe[0], NULL, dst->fd, NULL, dir->pending,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+      ssize_t wr =
+          send(dst->fd, dir->buf + dir->off, dir->pending, MSG_NOSIGNAL);
+#endif
+      //
+      if (wr < 0) {
+        if (errno == EINTR)
+          continue;
+        res = (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+        break;
+      }
+      dir->off += wr;
+      dir->pending -= wr;
+      relayCount(dir, wr);
+    }
+#if defined(__linux__)
+    sigpipeRestore(&old, waspending);
+#endif
+  }
+  if (dir->pending == 0)
+    dir->off = 0;
+  return res;
+}
+
+// read source of direction 'd' into its empty pipe or buffer
+// <0: error (see errno); 0: EOF; >0: bytes
+static ssize_t relayFill(Sam3ARelay *r, int d, size_t want) {
+  Sam3ARelayDir *dir = &r->dir[d];
+  //
+#if defined(__linux__)
+  return splice(relaySrc(r, d)->fd, NULL, dir->pipe[1], NULL, want,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+  return recv(relaySrc(r, d)->fd, dir->buf, want, 0);
+#endif
+}
+
+static void relayDone(Sam3ARelay *r) {
+  __atomic_store_n(&r->done, 1, __ATOMIC_RELAXED);
+  connDisconnect(r->conn);
+}
+
+// move data of direction 'd' until either side blocks or budget is spent
+static void relayPump(Sam3ARelay *r, int d) {
+  Sam3ARelayDir *dir = &r->dir[d];
+  Sam3AConnection *src = relaySrc(r, d), *dst = relayDst(r, d);
+  int64_t budget = sesBudget(r->conn->ses->readBudget, SAM3A_READ_BUDGET),
+          got = 0;
+  //
+  for (;;) {
+    int res = relayDrain(r, d);
+    size_t want = SAM3A_RELAY_CHUNK;
+    ssize_t rd;
+    //
+    if (res < 0) {
+      connError(r->conn, "IO_ERROR");
+      return;
+    }
+    // full destination holds source back
+    dst->writeBlocked = (res == 0);
+    src->readPaused = (res == 0 || dir->eof);
+    if (res == 0)
+      return;
+    if (dir->eof) {
+      if (!dir->shut) {
+        dir->shut = 1;
+        shutdown(dst->fd, SHUT_WR);
+      }
+      if (r->dir[!d].shut)
+        relayDone(r);
+      return;
+    }
+    if (budget >= 0 && got >= budget)
+      return; // source is still polled
+    if (budget >= 0 && budget - got < (int64_t)want)
+      want = budget - got;
+    rd = relayFill(r, d, want);
+    if (rd < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        connError(r->conn, "IO_ERROR");
+      return;
+    }
+    if (rd == 0)
+      dir->eof = 1;
+    dir->pending = rd;
+    got += rd;
+  }
+}
+
+// readable side feeds one direction, writable side drains the other
+static void relayReader(Sam3AConnection *conn) {
+  Sam3ARelay *r = conn->relay;
+  //
+  relayPump(r, (conn == r->conn ? 0 : 1));
+}
+
+static void relayWriter(Sam3AConnection *conn) {
+  Sam3ARelay *r = conn->relay;
+  //
+  relayPump(r, (conn == r->conn ? 1 : 0));
+}
+
+// stream is being disconnected; local side goes down with it
+static void relayStop(Sam3AConnection *conn) {
+  Sam3ARelay *r = conn->relay;
+  //
+  if (r == NULL || r->conn != conn)
+    return;
+  if (r->peer != NULL)
+    connDisconnect(r->peer);
+  relayDirClose(&r->dir[0]);
+  relayDirClose(&r->dir[1]);
+}
+
+// stream or local side is being closed; stream takes local side along
+static void relayForget(Sam3AConnection *conn) {
+  Sam3ARelay *r = conn->relay;
+  //
+  conn->relay = NULL;
+  if (conn == r->peer) {
+    r->peer = NULL;
+    return;
+  }
+  if (r->peer != NULL) {
+    r->peer->relay = NULL;
+    sam3aCloseConnection(r->peer);
+  }
+  relayDirClose(&r->dir[0]);
+  relayDirClose(&r->dir[1]);
+  free(r);
+}
+
+int sam3aRelay(Sam3AConnection *conn, int fd) {
+  Sam3AConnection *peer = NULL;
+  Sam3ARelay *r;
+  int fl;
+  //
+  if (!sam3aIsActiveConnection(conn) || fd < 0 || conn->relay != NULL ||
+      conn->cbAIOProcessorR != aioConnDataReader || !connOnOwnerThread(conn))
+    return -1;
+  if ((fl = fcntl(fd, F_GETFL)) < 0 ||
+      (r = calloc(1, sizeof(Sam3ARelay))) == NULL)
+    return -1;
+  for (int d = 0; d < 2; ++d) {
+    r->dir[d].pipe[0] = r->dir[d].pipe[1] = -1;
+#if defined(__linux__)
+    if (pipe2(r->dir[d].pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+      goto error;
+#else
+    if ((r->dir[d].buf = malloc(SAM3A_RELAY_CHUNK)) == NULL)
+      goto error;
+#endif
+  }
+  if ((peer = connAlloc(conn->ses, NULL, NULL, -1)) == NULL ||
+      fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0)
+    goto error;
+  peer->fd = fd;
+  peer->pool = conn->pool;
+  peer->relay = r;
+  peer->callDisconnectCB = 1;
+  peer->cbAIOProcessorR = relayReader;
+  peer->cbAIOProcessorW = relayWriter;
+  // stream bytes that came with handshake reply
+  if (conn->aio.rbufUsed > 0 &&
+      sendqAppend(&peer->sendq, peer->pool, conn->aio.rbuf,
+                  conn->aio.rbufUsed) < 0)
+    goto error;
+  if (sesLinkConnectionOn(conn->ses, peer, conn->owner) < 0)
+    goto error;
+  r->conn = conn;
+  r->peer = peer;
+  conn->relay = r;
+  aioFreeLineBuf(&conn->aio);
+  conn->readPaused = 0;
+  conn->cbAIOProcessorR = relayReader;
+  conn->cbAIOProcessorW = relayWriter;
+  return 0;
+error:
+  if (peer != NULL) {
+    if (peer->fd >= 0)
+      fcntl(fd, F_SETFL, fl);
+    sendqClear(&peer->sendq, peer->pool);
+    connCachePut(&conn->ses->connCache, peer);
+  }
+  relayDirClose(&r->dir[0]);
+  relayDirClose(&r->dir[1]);
+  free(r);
+  return -1;
+}
+
+int sam3aRelayStats(const Sam3AConnection *conn, int64_t *tolocal,
+                    int64_t *tostream) {
+  Sam3ARelay *r;
+  //
+  if (conn == NULL || (r = conn->relay) == NULL || r->conn != conn)
+    return -1;
+  if (tolocal != NULL)
+    *tolocal = __atomic_load_n(&r->dir[0].bytes, __ATOMIC_RELAXED);
+  if (tostream != NULL)
+    *tostream = __atomic_load_n(&r->dir[1].bytes, __ATOMIC_RELAXED);
+  return __atomic_load_n(&r->done, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// drain
+// home thread stops accepting and waits; every connection is stepped by the
+// thread polling it: established streams flush their send queue, shut down
+// write side and wait for EOF, everything else is cancelled at once
+enum {
+  DRAIN_NONE,  // not seen yet
+  DRAIN_FLUSH, // sending what was queued
+  DRAIN_SHUT,  // write side is shut down, waiting for peer to close
+  DRAIN_DONE   // nothing to wait for
+};
+
+struct Sam3ADrain {
+  uint64_t deadline;
+  void (*cbDrained)(Sam3ASession *ses, const Sam3ADrainStats *st);
+  Sam3ADrainStats st; // updated atomically by connection owners
+  int started;        // accepting stopped, owners may step (atomic)
+  int done;           // cbDrained() was called
+};
+
+static uint64_t drainNow(void) {
+  struct timeval tv;
+  //
+  gettimeofday(&tv, NULL);
+  return sam3atimeval2ms(&tv);
+}
+
+static inline void drainSet(Sam3AConnection *conn, int step) {
+  __atomic_store_n(&conn->drain, step, __ATOMIC_RELEASE);
+}
+
+// draining stream is being disconnected; count the outcome
+static void drainFinish(Sam3AConnection *conn) {
+  Sam3ADrainStats *st = &sesDrain(conn->ses)->st;
+  //
+  if (conn->drain != DRAIN_FLUSH && conn->drain != DRAIN_SHUT)
+    return;
+  if (!conn->error[0]) {
+    __atomic_add_fetch(&st->finished, 1, __ATOMIC_RELAXED);
+  } else {
+    if (strcmp(conn->error, "DRAIN_TIMEOUT") == 0)
+      __atomic_add_fetch(&st->timedOut, 1, __ATOMIC_RELAXED);
+    else
+      __atomic_add_fetch(&st->failed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->unsent, conn->sendq.bytes, __ATOMIC_RELAXED);
+  }
+  drainSet(conn, DRAIN_DONE);
+}
+
+// runs on the thread polling the connection
+static void drainConn(Sam3AConnection *conn, uint64_t now) {
+  Sam3ADrain *d = sesDrain(conn->ses);
+  //
+  switch (conn->drain) {
+  case DRAIN_NONE:
+    // local side of a relay ends along with its stream
+    if (!sam3aIsActiveConnection(conn) ||
+        (conn->relay != NULL && conn->relay->peer == conn)) {
+      drainSet(conn, DRAIN_DONE);
+      return;
+    }
+    // forwarding, idle warm sockets and sam3aListen() accepts
+    if (connIsInternal(conn) || conn->fwd != NULL ||
+        (conn->listener != NULL && conn->listenSlot >= 0)) {
+      drainSet(conn, DRAIN_DONE);
+      connDisconnect(conn);
+      return;
+    }
+    if (conn->cbAIOProcessorR != aioConnDataReader && conn->relay == NULL) {
+      __atomic_add_fetch(&d->st.cancelled, 1, __ATOMIC_RELAXED);
+      drainSet(conn, DRAIN_DONE);
+      connError(conn, "SESSION_DRAINING");
+      return;
+    }
+    __atomic_add_fetch(&d->st.streams, 1, __ATOMIC_RELAXED);
+    drainSet(conn, DRAIN_FLUSH);
+    // fallthrough
+  case DRAIN_FLUSH:
+    if (conn->relay == NULL && conn->sendq.head == NULL) {
+      shutdown(conn->fd, SHUT_WR);
+      conn->cbAIOProcessorW = NULL; // sam3aSend() fails from now on
+      drainSet(conn, DRAIN_SHUT);
+    }
+    // fallthrough
+  case DRAIN_SHUT:
+    if (now >= d->deadline)
+      connError(conn, "DRAIN_TIMEOUT");
+    break;
+  }
+}
+
+// stop accepting, then let connection owners go; runs on the home thread
+static void drainStart(Sam3ASession *ses) {
+  Sam3ADrain *d = sesDrain(ses);
+  //
+  if (d->started)
+    return;
+  if (ses->listener != NULL)
+    sam3aStopListen(ses);
+  if (ses->warm != NULL)
+    sam3aSetWarmPool(ses, 0);
+  __atomic_store_n(&d->started, 1, __ATOMIC_RELEASE);
+}
+
+// runs on the home thread; cancels the session when nothing is left
+static void drainCheck(Sam3ASession *ses) {
+  Sam3ADrain *d = sesDrain(ses);
+  Sam3ADrainStats st;
+  int busy = 0;
+  //
+  if (d->done)
+    return;
+  drainStart(ses);
+  reactorLock(ses->home);
+  for (Sam3AConnection *c = ses->connlist; c != NULL && !busy; c = c->next)
+    busy = (__atomic_load_n(&c->drain, __ATOMIC_ACQUIRE) != DRAIN_DONE);
+  reactorUnlock(ses->home);
+  if (busy)
+    return;
+  d->done = 1;
+  st = d->st;
+  sesDisconnect(ses);
+  if (d->cbDrained != NULL)
+    d->cbDrained(ses, &st);
+}
+
+// select loop: step every connection, then check if drain is over
+static void drainSession(Sam3ASession *ses) {
+  uint64_t now = drainNow();
+  //
+  drainStart(ses);
+  for (Sam3AConnection *c = ses->connlist, *next; c != NULL; c = next) {
+    next = c->next;
+    drainConn(c, now);
+  }
+  drainCheck(ses);
+}
+
+static void drainFree(Sam3ASession *ses) {
+  free(ses->drain);
+  ses->drain = NULL;
+}
+
+int sam3aDrainSession(Sam3ASession *ses, int timeoutms,
+                      void (*cbDrained)(Sam3ASession *ses,
+                                        const Sam3ADrainStats *st)) {
+  Sam3ADrain *d, *none = NULL;
+  //
+  if (ses == NULL || ses->type != SAM3A_SESSION_STREAM || timeoutms < 0)
+    return -1;
+  // other threads can't look at session state; home skips dead session
+  if (sesOnHomeThread(ses) && !sam3aIsActiveSession(ses))
+    return -1;
+  if ((d = calloc(1, sizeof(Sam3ADrain))) == NULL)
+    return -1;
+  d->deadline = drainNow() + timeoutms;
+  d->cbDrained = cbDrained;
+  if (!__atomic_compare_exchange_n(&ses->drain, &none, d, 0, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE)) {
+    free(d);
+    return -1; // draining already
+  }
+  // home shard also starts it on its next round; posting just wakes it up
+  if (sesOnHomeThread(ses))
+    drainStart(ses);
+  else
+    shardPost(ses->home, SHARD_OP_DRAIN, ses, NULL);
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// hot restart; same records as libsam3 (see sam3HandoverSend() there):
+//   HANDOVER SESSION VERSION=1 STYLE=.. ID=.. HOST=.. PORT=.. DESTINATION=..
+//     PUB=.. [SIGNATURE_TYPE=..] [SILENT=true] [FORWARD=true] [UDP=true]
+//   HANDOVER STREAM DESTINATION=.. FROM_PORT=.. TO_PORT=..
+//   HANDOVER END
+// one record per SOCK_SEQPACKET packet; session record carries control
+// socket, then STREAM FORWARD and datagram sockets if flagged; stream record
+// carries stream socket
+#define SAM3A_HANDOVER_VERSION (1)
+#define SAM3A_HANDOVER_RECORD (4096) // longest record
+#define SAM3A_HANDOVER_FDS (3)       // most fds in one record
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+typedef union {
+  struct cmsghdr hdr;
+  char buf[CMSG_SPACE(SAM3A_HANDOVER_FDS * sizeof(int))];
+} Sam3AHandoverCtl;
+
+// <0: error; 0: ok
+static int handoverSend(int sock, const char *rec, const int *fds, int nfds) {
+  Sam3AHandoverCtl ctl;
+  struct iovec iov = {(void *)rec, strlen(rec)};
+  struct msghdr msg;
+  ssize_t n;
+  //
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (nfds > 0) {
+    struct cmsghdr *c;
+    //
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+  }
+  do {
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  return (n == (ssize_t)iov.iov_len ? 0 : -1);
+}
+
+static void handoverCloseFds(int *fds, int nfds) {
+  for (int f = 0; f < nfds; ++f)
+    close(fds[f]);
+}
+
+// returns parsed record or NULL on error; on success 'fds' gets attached
+// descriptors (up to SAM3A_HANDOVER_FDS), on error they are closed
+static SAMFieldList *handoverRecv(int sock, int *fds, int *nfds) {
+  char rec[SAM3A_HANDOVER_RECORD + 1];
+  Sam3AHandoverCtl ctl;
+  struct iovec iov = {rec, SAM3A_HANDOVER_RECORD};
+  struct msghdr msg;
+  SAMFieldList *list = NULL;
+  ssize_t n;
+  //
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  *nfds = 0;
+  if (n < 0)
+    return NULL;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL;
+       c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+      int cnt = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      //
+      for (int f = 0; f < cnt; ++f) {
+        int fd;
+        //
+        memcpy(&fd, CMSG_DATA(c) + f * sizeof(int), sizeof(int));
+        if (*nfds < SAM3A_HANDOVER_FDS)
+          fds[(*nfds)++] = fd;
+        else
+          close(fd);
+      }
+    }
+  }
+  if (n > 0 && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    rec[n] = 0;
+    list = sam3aParseReply(rec);
+  }
+  if (list == NULL || !sam3aIsGoodReply(list, "HANDOVER", NULL, NULL, NULL)) {
+    sam3aFreeFieldList(list);
+    handoverCloseFds(fds, *nfds);
+    *nfds = 0;
+    return NULL;
+  }
+  return list;
+}
+
+static const char *handoverStyle(Sam3ASessionType type) {
+  switch (type) {
+  case SAM3A_SESSION_RAW:
+    return "RAW";
+  case SAM3A_SESSION_DGRAM:
+    return "DATAGRAM";
+  case SAM3A_SESSION_STREAM:
+    return "STREAM";
+  default:
+    return NULL;
+  }
+}
+
+// stream in data phase; only those go to the other process
+static int handoverCarries(const Sam3AConnection *conn) {
+  return (sam3aIsActiveConnection(conn) && conn->callDisconnectCB &&
+          conn->cbAIOProcessorR == aioConnDataReader);
+}
+
+int sam3aHandoverSend(Sam3ASession *ses, int sock) {
+  char rec[SAM3A_HANDOVER_RECORD + 1], host[INET_ADDRSTRLEN];
+  struct in_addr addr;
+  int fds[2], nfds = 0, type;
+  socklen_t len = sizeof(type);
+  //
+  // created (no command in flight), polled by the caller
+  if (!sam3aIsActiveSession(ses) || !ses->callDisconnectCB || !sesIsIdle(ses) ||
+      ses->primary != NULL || ses->home != NULL || ses->dgHead != NULL ||
+      handoverStyle(ses->type) == NULL)
+    return -1;
+  for (Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
+    if (handoverCarries(c) &&
+        (c->sendq.head != NULL || c->aio.rbufUsed > 0))
+      return -1; // let it flush (and deliver) first
+  }
+  if (getsockopt(sock, SOL_SOCKET, SO_TYPE, &type, &len) < 0 ||
+      type != SOCK_SEQPACKET)
+    return -1; // record boundaries keep fds with their records
+  addr.s_addr = ses->ip;
+  if (inet_ntop(AF_INET, &addr, host, sizeof(host)) == NULL)
+    return -1;
+  fds[nfds++] = ses->fd;
+  if (ses->udpfd >= 0)
+    fds[nfds++] = ses->udpfd;
+  if (snprintf(rec, sizeof(rec),
+               "HANDOVER SESSION VERSION=%d STYLE=%s ID=%s HOST=%s PORT=%d "
+               "DESTINATION=%s PUB=%s UDP=%s\n",
+               SAM3A_HANDOVER_VERSION, handoverStyle(ses->type), ses->channel,
+               host, ses->port, ses->privkey, ses->pubkey,
+               (ses->udpfd >= 0 ? "true" : "false")) >= (int)sizeof(rec) ||
+      handoverSend(sock, rec, fds, nfds) < 0)
+    return -1;
+  for (Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
+    if (!handoverCarries(c))
+      continue;
+    snprintf(rec, sizeof(rec),
+             "HANDOVER STREAM DESTINATION=%s FROM_PORT=%d TO_PORT=%d\n",
+             c->destkey, c->fromPort, c->toPort);
+    if (handoverSend(sock, rec, &c->fd, 1) < 0)
+      return -1;
+  }
+  if (handoverSend(sock, "HANDOVER END\n", NULL, 0) < 0)
+    return -1;
+  // the other process owns these sockets now: close, don't shut down
+  ses->cancelled = 1;
+  for (Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
+    if (handoverCarries(c))
+      c->cancelled = 1;
+  }
+  sam3aCloseSession(ses);
+  return 0;
+}
+
+// absent flag is false
+static int handoverFlag(const SAMFieldList *rep, const char *name) {
+  const char *v = sam3aFindField(rep, name);
+  //
+  return (v != NULL && strcmp(v, "true") == 0);
+}
+
+// session record to 'ses'; takes fds on success
+// <0: error; 0: ok
+static int handoverAdopt(Sam3ASession *ses, const SAMFieldList *rep,
+                         const int *fds, int nfds) {
+  const char *style = sam3aFindField(rep, "STYLE"),
+             *id = sam3aFindField(rep, "ID"),
+             *host = sam3aFindField(rep, "HOST"),
+             *port = sam3aFindField(rep, "PORT"),
+             *priv = sam3aFindField(rep, "DESTINATION"),
+             *pub = sam3aFindField(rep, "PUB"),
+             *ver = sam3aFindField(rep, "VERSION");
+  int udp = handoverFlag(rep, "UDP");
+  struct in_addr addr;
+  //
+  if (!sam3aIsGoodReply(rep, "HANDOVER", "SESSION", NULL, NULL) ||
+      ver == NULL || atoi(ver) != SAM3A_HANDOVER_VERSION || style == NULL ||
+      id == NULL || strlen(id) >= sizeof(ses->channel) || host == NULL ||
+      inet_pton(AF_INET, host, &addr) != 1 || port == NULL || priv == NULL ||
+      strlen(priv) != SAM3A_PRIVKEY_SIZE || pub == NULL ||
+      strlen(pub) != SAM3A_PUBKEY_SIZE)
+    return -1;
+  // STREAM FORWARD socket of libsam3 session is of no use here
+  if (handoverFlag(rep, "FORWARD") || nfds != (udp ? 2 : 1))
+    return -1;
+  if (strcmp(style, "STREAM") == 0)
+    ses->type = SAM3A_SESSION_STREAM;
+  else if (strcmp(style, "DATAGRAM") == 0)
+    ses->type = SAM3A_SESSION_DGRAM;
+  else if (strcmp(style, "RAW") == 0)
+    ses->type = SAM3A_SESSION_RAW;
+  else
+    return -1;
+  // libsam3 sockets are blocking
+  for (int f = 0; f < nfds; ++f) {
+    int fl = fcntl(fds[f], F_GETFL);
+    //
+    if (fl < 0 || fcntl(fds[f], F_SETFL, fl | O_NONBLOCK) < 0)
+      return -1;
+  }
+  strcpy(ses->channel, id);
+  strcpy(ses->privkey, priv);
+  strcpy(ses->pubkey, pub);
+  ses->ip = addr.s_addr;
+  ses->port = atoi(port);
+  // record has stream port; DGRAM/RAW sessions are on the default bridge port
+  ses->ctlPort =
+      (ses->type == SAM3A_SESSION_STREAM ? ses->port : DEFAULT_TCP_PORT);
+  ses->fd = fds[0];
+  if (udp) {
+    ses->udpfd = fds[1];
+    ses->dgQueueMax = SAM3A_DGRAM_QUEUE_MAX;
+  }
+  ses->callDisconnectCB = 1; // created
+  return 0;
+}
+
+int sam3aHandoverRecv(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
+                      const Sam3AConnectionCallbacks *ccb, int sock) {
+  SAMFieldList *rep;
+  int fds[SAM3A_HANDOVER_FDS], nfds;
+  //
+  if (ses == NULL)
+    return -1;
+  memset(ses, 0, sizeof(Sam3ASession));
+  ses->fd = -1;
+  ses->udpfd = -1;
+  if ((rep = handoverRecv(sock, fds, &nfds)) == NULL)
+    return -1;
+  if (handoverAdopt(ses, rep, fds, nfds) < 0) {
+    sam3aFreeFieldList(rep);
+    handoverCloseFds(fds, nfds);
+    memset(ses, 0, sizeof(Sam3ASession));
+    ses->fd = -1;
+    ses->udpfd = -1;
+    return -1;
+  }
+  sam3aFreeFieldList(rep);
+  for (;;) {
+    const char *dest, *from, *to;
+    Sam3AConnection *conn;
+    int fl;
+    //
+    if ((rep = handoverRecv(sock, fds, &nfds)) == NULL)
+      goto error;
+    if (sam3aIsGoodReply(rep, NULL, "END", NULL, NULL) && nfds == 0) {
+      sam3aFreeFieldList(rep);
+      break;
+    }
+    dest = sam3aFindField(rep, "DESTINATION");
+    from = sam3aFindField(rep, "FROM_PORT");
+    to = sam3aFindField(rep, "TO_PORT");
+    if (!sam3aIsGoodReply(rep, NULL, "STREAM", NULL, NULL) || nfds != 1 ||
+        dest == NULL || strlen(dest) != SAM3A_PUBKEY_SIZE ||
+        (fl = fcntl(fds[0], F_GETFL)) < 0 ||
+        fcntl(fds[0], F_SETFL, fl | O_NONBLOCK) < 0 ||
+        (conn = connAlloc(ses, ccb, dest, -1)) == NULL) {
+      sam3aFreeFieldList(rep);
+      handoverCloseFds(fds, nfds);
+      goto error;
+    }
+    conn->fd = fds[0];
+    conn->pool = &ses->pool;
+    conn->fromPort = (from != NULL ? atoi(from) : 0);
+    conn->toPort = (to != NULL ? atoi(to) : 0);
+    sam3aFreeFieldList(rep);
+    conn->callDisconnectCB = 1;
+    conn->cbAIOProcessorR = aioConnDataReader;
+    conn->cbAIOProcessorW = aioConnDataWriter;
+    if (sesLinkConnection(ses, conn) < 0) {
+      close(conn->fd);
+      connCachePut(&ses->connCache, conn);
+      goto error;
+    }
+  }
+  if (cb != NULL)
+    ses->cb = *cb;
+  return 0;
+error:
+  // nothing reached the bridge; drop our copies quietly
+  ses->cancelled = 1;
+  for (Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
+    memset(&c->cb, 0, sizeof(c->cb));
+    c->cancelled = 1;
+  }
+  sam3aCloseSession(ses);
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// session pools
+// member sessions run pool callbacks; they keep member state and call the
+// user's ones
+static void poolStart(Sam3ASessionPool *pool, int f, const char *privkey);
+static int poolStartFirst(Sam3ASessionPool *pool, int f);
+
+static void poolCbError(Sam3ASession *ses) {
+  Sam3APoolMember *m = ses->udata;
+  Sam3ASessionPool *pool = m->pool;
+  //
+  m->healthy = 0;
+  if (pool->waiting)
+    poolStartFirst(pool, (int)(m - pool->members) + 1); // next one tries
+  if (pool->cb.cbError != NULL)
+    pool->cb.cbError(ses);
+}
+
+static void poolCbCreated(Sam3ASession *ses) {
+  Sam3APoolMember *m = ses->udata;
+  Sam3ASessionPool *pool = m->pool;
+  //
+  m->healthy = 1;
+  if (pool->created++ == 0 && pool->waiting) {
+    // TRANSIENT: the rest get the destination the bridge gave this one
+    pool->waiting = 0;
+    for (int f = 0; f < pool->count; ++f) {
+      if (&pool->members[f] != m)
+        poolStart(pool, f, ses->privkey); // ones that failed are closed
+    }
+  }
+  if (pool->cb.cbCreated != NULL)
+    pool->cb.cbCreated(ses);
+}
+
+static void poolCbDisconnected(Sam3ASession *ses) {
+  Sam3APoolMember *m = ses->udata;
+  //
+  m->healthy = 0;
+  if (m->pool->cb.cbDisconnected != NULL)
+    m->pool->cb.cbDisconnected(ses);
+}
+
+static void poolCbDatagramRead(Sam3ASession *ses, const void *buf,
+                               int bufsize) {
+  Sam3APoolMember *m = ses->udata;
+  //
+  if (m->pool->cb.cbDatagramRead != NULL)
+    m->pool->cb.cbDatagramRead(ses, buf, bufsize);
+}
+
+static void poolCbDestroy(Sam3ASession *ses) {
+  Sam3APoolMember *m = ses->udata;
+  //
+  if (m->pool->cb.cbDestroy != NULL)
+    m->pool->cb.cbDestroy(ses);
+}
+
+static const Sam3ASessionCallbacks poolCallbacks = {
+    .cbError = poolCbError,
+    .cbCreated = poolCbCreated,
+    .cbDisconnected = poolCbDisconnected,
+    .cbDatagramRead = poolCbDatagramRead,
+    .cbDestroy = poolCbDestroy,
+};
+
+// start creating member 'f'; failure leaves it closed and not healthy
+static void poolStart(Sam3ASessionPool *pool, int f, const char *privkey) {
+  Sam3APoolMember *m = &pool->members[f];
+  int res;
+  //
+  sam3aCloseSession(&m->ses);
+  if (pool->bridges != NULL)
+    res = sam3aBridgeCreateSession(pool->bridges, &m->ses, &poolCallbacks,
+                                   privkey, pool->type, pool->params,
+                                   pool->timeoutms);
+  else
+    res = sam3aCreateSessionEx(&m->ses, &poolCallbacks, pool->host,
+                               pool->port, privkey, pool->type, pool->params,
+                               pool->timeoutms);
+  if (res >= 0)
+    m->ses.udata = m;
+}
+
+// TRANSIENT pool: create members from 'f' on one at a time until one starts
+// returns bool: one did
+static int poolStartFirst(Sam3ASessionPool *pool, int f) {
+  for (; f < pool->count; ++f) {
+    poolStart(pool, f, NULL);
+    if (sam3aIsActiveSession(&pool->members[f].ses))
+      return 1;
+  }
+  pool->waiting = 0; // every member failed
+  return 0;
+}
+
+int sam3aSessionPoolCreate(Sam3ASessionPool *pool, Sam3ABridgeSet *set,
+                           const Sam3ASessionCallbacks *cb,
+                           const char *hostname, int port, int count,
+                           const char *privkey, Sam3ASessionType type,
+                           const char *params, int timeoutms) {
+  int started = 0;
+  //
+  if (pool == NULL || count < 1 || count > SAM3A_POOL_MAX ||
+      (int)type < 0 || type >= SAM3A_SESSION_PRIMARY ||
+      (privkey != NULL && strlen(privkey) != SAM3A_PRIVKEY_SIZE) ||
+      (hostname != NULL && strlen(hostname) >= sizeof(pool->host)))
+    return -1;
+  memset(pool, 0, sizeof(Sam3ASessionPool));
+  if (params != NULL && (pool->params = strdup(params)) == NULL)
+    return -1;
+  if (cb != NULL)
+    pool->cb = *cb;
+  pool->bridges = set;
+  if (hostname != NULL)
+    strcpy(pool->host, hostname);
+  pool->port = port;
+  pool->type = type;
+  pool->timeoutms = timeoutms;
+  pool->count = count;
+  for (int f = 0; f < count; ++f) {
+    pool->members[f].pool = pool;
+    pool->members[f].ses.fd = -1;
+    pool->members[f].ses.udpfd = -1;
+  }
+  // without a key the first session has to be created first
+  if (privkey == NULL && count > 1) {
+    pool->waiting = 1;
+    started = poolStartFirst(pool, 0);
+  } else {
+    for (int f = 0; f < count; ++f) {
+      poolStart(pool, f, privkey);
+      if (sam3aIsActiveSession(&pool->members[f].ses))
+        ++started;
+    }
+  }
+  if (started == 0) {
+    sam3aSessionPoolClose(pool);
+    return -1;
+  }
+  return 0;
+}
+
+// member is created and its control connection is alive
+static inline int poolUsable(const Sam3APoolMember *m) {
+  return (m->healthy && sam3aIsActiveSession(&m->ses) &&
+          m->ses.callDisconnectCB);
+}
+
+static int poolStreams(const Sam3ASession *ses) {
+  int n = 0;
+  //
+  for (const Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
+    if (sam3aIsActiveConnection(c) && !connIsInternal(c))
+      ++n;
+  }
+  return n;
+}
+
+// usable member for 'destkey'; <0: none
+// peer hash is rendezvous hashing, so losing a member moves only its peers
+static int poolPick(Sam3ASessionPool *pool, const char *destkey, int dgram) {
+  uint32_t h = 2166136261u, best = 0;
+  int pick = -1;
+  //
+  if (pool->policy == SAM3A_POOL_PEER_HASH) {
+    for (const char *p = destkey; *p; ++p)
+      h = (h ^ (unsigned char)*p) * 16777619u; // FNV-1a
+  }
+  for (int f = 0; f < pool->count; ++f) {
+    Sam3APoolMember *m = &pool->members[f], *o;
+    //
+    if (!poolUsable(m))
+      continue;
+    if (pool->policy == SAM3A_POOL_PEER_HASH) {
+      uint32_t score = hashint(h ^ hashint(f + 1));
+      //
+      if (pick < 0 || score > best) {
+        pick = f;
+        best = score;
+      }
+      continue;
+    }
+    m->streams = poolStreams(&m->ses);
+    o = (pick >= 0 ? &pool->members[pick] : NULL);
+    if (o == NULL ||
+        (dgram ? m->ses.dgQueued < o->ses.dgQueued : m->streams < o->streams))
+      pick = f;
+  }
+  return pick;
+}
+
+Sam3AConnection *sam3aSessionPoolConnect(Sam3ASessionPool *pool,
+                                         const Sam3AConnectionCallbacks *cb,
+                                         const char *destkey, int fromport,
+                                         int toport, int timeoutms) {
+  Sam3APoolMember *m;
+  Sam3AConnection *conn;
+  int f;
+  //
+  if (pool == NULL || !sam3aIsValidPubKey(destkey) ||
+      (f = poolPick(pool, destkey, 0)) < 0)
+    return NULL;
+  m = &pool->members[f];
+  if ((conn = sam3aStreamConnectPorts(&m->ses, cb, destkey, fromport, toport,
+                                      timeoutms)) == NULL) {
+    ++m->failures;
+    return NULL;
+  }
+  ++m->connects;
+  ++m->streams;
+  return conn;
+}
+
+int sam3aSessionPoolDatagramSend(Sam3ASessionPool *pool, const char *destkey,
+                                 const void *buf, int bufsize) {
+  Sam3APoolMember *m;
+  int f, res;
+  //
+  if (pool == NULL || !sam3aIsValidPubKey(destkey) ||
+      (f = poolPick(pool, destkey, 1)) < 0)
+    return -1;
+  m = &pool->members[f];
+  if ((res = sam3aDatagramSend(&m->ses, destkey, buf, bufsize)) == 0)
+    ++m->datagrams;
+  else if (res != SAM3A_SEND_FULL)
+    ++m->failures;
+  return res;
+}
+
+int sam3aAddSessionPoolToFDS(Sam3ASessionPool *pool, int maxfd, fd_set *rds,
+                             fd_set *wrs) {
+  if (pool == NULL)
+    return -1;
+  for (int f = 0; f < pool->count; ++f) {
+    int m = sam3aAddSessionToFDS(&pool->members[f].ses, maxfd, rds, wrs);
+    //
+    if (m > maxfd)
+      maxfd = m;
+  }
+  return maxfd;
+}
+
+void sam3aProcessSessionPoolIO(Sam3ASessionPool *pool, fd_set *rds,
+                               fd_set *wrs) {
+  if (pool == NULL)
+    return;
+  for (int f = 0; f < pool->count; ++f)
+    sam3aProcessSessionIO(&pool->members[f].ses, rds, wrs);
+}
+
+int sam3aSessionPoolClose(Sam3ASessionPool *pool) {
+  if (pool == NULL)
+    return -1;
+  for (int f = 0; f < pool->count; ++f)
+    sam3aCloseSession(&pool->members[f].ses);
+  free(pool->params);
+  memset(pool, 0, sizeof(Sam3ASessionPool));
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int sam3aSend(Sam3AConnection *conn, const void *data, int datasize) {
+  if (datasize == -1)
+    datasize = (data != NULL ? strlen((const char *)data) : 0);
+  //
+  if (sam3aIsActiveConnection(conn) && conn->callDisconnectCB &&
+      conn->cbAIOProcessorW != NULL &&
+      ((datasize > 0 && data != NULL) || datasize == 0)) {
+    // try to add data to send queue
+    if (datasize > 0) {
+      if (conn->sendq.maxBytes > 0 && conn->sendq.bytes > 0 &&
+          conn->sendq.bytes + datasize > conn->sendq.maxBytes)
+        return SAM3A_SEND_FULL;
+      if (sendqAppend(&conn->sendq, conn->pool, data, datasize) < 0)
+        return -1; // alas
+      connCheckHighWater(conn);
+    }
+    return 0;
+  }
+  //
+  return -1;
+}
+
+int sam3aSetSendQueueLimit(Sam3AConnection *conn, int64_t maxbytes) {
+  if (conn != NULL && maxbytes >= 0) {
+    conn->sendq.maxBytes = maxbytes;
+    return 0;
+  }
+  return -1;
+}
+
+int sam3aSendv(Sam3AConnection *conn, const struct iovec *iov, int n,
+               void (*freecb)(void *udata), void *udata) {
+  if (sam3aIsActiveConnection(conn) && conn->callDisconnectCB &&
+      conn->cbAIOProcessorW != NULL && n >= 0 && (iov != NULL || n == 0)) {
+    int64_t total = 0;
+    //
+    for (int f = 0; f < n; ++f) {
+      if (iov[f].iov_len > 0 && iov[f].iov_base == NULL)
+        return -1;
+      if (iov[f].iov_len > INT32_MAX)
+        return -1; // segment sizes are ints
+      total += iov[f].iov_len;
+    }
+    if (conn->sendq.maxBytes > 0 && conn->sendq.bytes > 0 &&
+        conn->sendq.bytes + total > conn->sendq.maxBytes)
+      return SAM3A_SEND_FULL;
+    if (sendqAppendRefs(&conn->sendq, conn->pool, iov, n, freecb,
+                        udata) < 0)
+      return -1;
+    connCheckHighWater(conn);
+    return 0;
+  }
+  //
+  return -1;
+}
+
+int64_t sam3aSendQueueSize(const Sam3AConnection *conn) {
+  return (conn != NULL ? conn->sendq.bytes : -1);
+}
+
+int sam3aSetWatermarks(Sam3AConnection *conn, int64_t low, int64_t high) {
+  if (conn != NULL && low >= 0 && high >= 0 && (high == 0 || low <= high)) {
+    conn->lowWater = low;
+    conn->highWater = high;
+    conn->aboveHighWater = 0;
+    connCheckHighWater(conn);
+    return 0;
+  }
+  return -1;
+}
+
+int sam3aIsWritable(const Sam3AConnection *conn) {
+  return (sam3aIsActiveConnection(conn) && !conn->aboveHighWater);
+}
+
+int sam3aPauseRead(Sam3AConnection *conn) {
+  if (conn != NULL) {
+    conn->readPaused = 1;
+    return 0;
+  }
+  return -1;
+}
+
+int sam3aResumeRead(Sam3AConnection *conn) {
+  if (conn != NULL) {
+    conn->readPaused = 0;
+    return 0;
+  }
+  return -1;
+}
+
+int sam3aIsReadPaused(const Sam3AConnection *conn) {
+  return (conn != NULL && conn->readPaused);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// datagrams are exchanged with bridge over UDP:
+//   outgoing: "3.0 <channel> <destkey>\n<payload>" to bridge UDP port
+//   incoming (DGRAM): "<destkey>[ options]\n<payload>" to our PORT/HOST
+//   incoming (RAW): "<payload>"
+#define SAM3A_DGRAM_MAX (31744)
+#define SAM3A_DGRAM_BUFSIZE (SAM3A_DGRAM_MAX + 2048)
+// datagrams per sendmmsg()/recvmmsg() call
+#define SAM3A_DGRAM_BATCH (16)
+// recvmmsg() calls per tick; don't starve stream connections
+#define SAM3A_DGRAM_READ_ROUNDS (4)
+
+struct Sam3ADatagram {
+  Sam3ADatagram *next;
+  int size;
+  char data[];
+};
+
+// returns bound UDP port or -1; 'host' is set to our address as bridge sees it
+static int sesDgramOpen(Sam3ASession *ses, char *host, int hostsize) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int ctl = (ses->primary != NULL ? ses->primary->fd : ses->fd);
+  //
+  if (ses->udpfd >= 0)
+    return -1;
+  // bind to the interface we talk to bridge from
+  if (getsockname(ctl, (struct sockaddr *)&addr, &len) < 0 ||
+      addr.sin_family != AF_INET)
+    return -1;
+  if (inet_ntop(AF_INET, &addr.sin_addr, host, hostsize) == NULL)
+    return -1;
+  addr.sin_port = 0;
+  if ((ses->udpfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                           0)) < 0)
+    return -1;
+  len = sizeof(addr);
+  if (bind(ses->udpfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      getsockname(ses->udpfd, (struct sockaddr *)&addr, &len) < 0) {
+    close(ses->udpfd);
+    ses->udpfd = -1;
+    return -1;
+  }
+  if (ses->dgQueueMax <= 0)
+    ses->dgQueueMax = SAM3A_DGRAM_QUEUE_MAX;
+  return ntohs(addr.sin_port);
+}
+
+static void sesDgramClear(Sam3ASession *ses) {
+  while (ses->dgHead != NULL) {
+    Sam3ADatagram *dg = ses->dgHead;
+    //
+    ses->dgHead = dg->next;
+    free(dg);
+  }
+  ses->dgTail = NULL;
+  ses->dgQueued = 0;
+  if (ses->udpfd >= 0) {
+    close(ses->udpfd);
+    ses->udpfd = -1;
+  }
+}
+
+static void sesDgramPop(Sam3ASession *ses) {
+  Sam3ADatagram *dg = ses->dgHead;
+  //
+  if ((ses->dgHead = dg->next) == NULL)
+    ses->dgTail = NULL;
+  --ses->dgQueued;
+  free(dg);
+}
+
+// send queued datagrams until socket buffer is full
+// <0: error; 0: ok
+static int sesDgramFlush(Sam3ASession *ses) {
+  struct sockaddr_in addr;
+  //
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(ses->port);
+  addr.sin_addr.s_addr = ses->ip;
+  //
+  while (ses->dgHead != NULL) {
+#if defined(__linux__)
+    struct mmsghdr msgs[SAM3A_DGRAM_BATCH];
+    struct iovec iov[SAM3A_DGRAM_BATCH];
+    int cnt = 0, sent;
+    //
+    memset(msgs, 0, sizeof(msgs));
+    for (Sam3ADatagram *dg = ses->dgHead; dg != NULL && cnt < SAM3A_DGRAM_BATCH;
+         dg = dg->next, ++cnt) {
+      iov[cnt].iov_base = dg->data;
+      iov[cnt].iov_len = dg->size;
+      msgs[cnt].msg_hdr.msg_name = &addr;
+      msgs[cnt].msg_hdr.msg_namelen = sizeof(addr);
+      msgs[cnt].msg_hdr.msg_iov = &iov[cnt];
+      msgs[cnt].msg_hdr.msg_iovlen = 1;
+    }
+    if ((sent = sendmmsg(ses->udpfd, msgs, cnt, 0)) < 0) {
+#else
+    int sent = 1;
+    //
+    if (sendto(ses->udpfd, ses->dgHead->data, ses->dgHead->size, 0,
+               (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+#endif
+      if (errno == EINTR)
+        continue; // interrupted by signal
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+        return 0; // try again on next tick
+      return -1;
+    }
+    while (sent-- > 0)
+      sesDgramPop(ses);
+  }
+  return 0;
+}
+
+// parse one forwarded datagram and pass it to cbDatagramRead()
+static void sesDgramDispatch(Sam3ASession *ses, char *buf, int size) {
+  char *payload = buf;
+  //
+  buf[size] = 0;
+  if (ses->type == SAM3A_SESSION_DGRAM) {
+    char *nl = memchr(buf, '\n', size), *e;
+    //
+    if (nl == NULL)
+      return; // not a SAM datagram
+    // destination is the first token of the header line
+    for (e = buf; e < nl && *e != ' '; ++e)
+      ;
+    if (e - buf != SAM3A_PUBKEY_SIZE)
+      return;
+    memcpy(ses->destkey, buf, SAM3A_PUBKEY_SIZE);
+    ses->destkey[SAM3A_PUBKEY_SIZE] = 0;
+    if (!sam3aIsValidPubKey(ses->destkey))
+      return;
+    payload = nl + 1;
+    size -= payload - buf;
+  }
+  if (ses->cb.cbDatagramRead != NULL)
+    ses->cb.cbDatagramRead(ses, payload, size);
+}
+
+// <0: error; 0: ok
+static int sesDgramRead(Sam3ASession *ses) {
+  if (ses->dgRecvBuf == NULL &&
+      (ses->dgRecvBuf = malloc(SAM3A_DGRAM_BATCH *
+                               (SAM3A_DGRAM_BUFSIZE + 1))) == NULL)
+    return -1;
+  //
+  for (int round = 0; round < SAM3A_DGRAM_READ_ROUNDS; ++round) {
+    struct sockaddr_in from[SAM3A_DGRAM_BATCH];
+    int got;
+#if defined(__linux__)
+    struct mmsghdr msgs[SAM3A_DGRAM_BATCH];
+    struct iovec iov[SAM3A_DGRAM_BATCH];
+    //
+    memset(msgs, 0, sizeof(msgs));
+    for (int f = 0; f < SAM3A_DGRAM_BATCH; ++f) {
+      iov[f].iov_base = ses->dgRecvBuf + f * (SAM3A_DGRAM_BUFSIZE + 1);
+      iov[f].iov_len = SAM3A_DGRAM_BUFSIZE;
+      msgs[f].msg_hdr.msg_name = &from[f];
+      msgs[f].msg_hdr.msg_namelen = sizeof(from[f]);
+      msgs[f].msg_hdr.msg_iov = &iov[f];
+      msgs[f].msg_hdr.msg_iovlen = 1;
+    }
+    got = recvmmsg(ses->udpfd, msgs, SAM3A_DGRAM_BATCH, 0, NULL);
+#else
+    int sizes[1];
+    socklen_t alen = sizeof(from[0]);
+    //
+    got = recvfrom(ses->udpfd, ses->dgRecvBuf, SAM3A_DGRAM_BUFSIZE, 0,
+                   (struct sockaddr *)&from[0], &alen);
+    if (got >= 0) {
+      sizes[0] = got;
+      got = 1;
+    }
+#endif
+    if (got < 0) {
+      if (errno == EINTR)
+        continue; // interrupted by signal
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0; // no more datagrams
+      return -1;
+    }
+    for (int f = 0; f < got; ++f) {
+#if defined(__linux__)
+      int size = msgs[f].msg_len;
+      //
+      if (msgs[f].msg_hdr.msg_flags & MSG_TRUNC)
+        continue; // too big for SAM datagram
+#else
+      int size = sizes[f];
+#endif
+      // only bridge can send us datagrams
+      if (from[f].sin_family != AF_INET || from[f].sin_addr.s_addr != ses->ip)
+        continue;
+      sesDgramDispatch(ses, ses->dgRecvBuf + f * (SAM3A_DGRAM_BUFSIZE + 1),
+                       size);
+      if (!sam3aIsActiveSession(ses) || ses->udpfd < 0)
+        return 0; // closed in callback
+    }
+    if (got < SAM3A_DGRAM_BATCH)
+      break;
+  }
+  return 0;
+}
+
+int sam3aDatagramSend(Sam3ASession *ses, const char *destkey, const void *buf,
+                      int bufsize) {
+  Sam3ADatagram *dg;
+  int hdrsize;
+  //
+  if (ses == NULL)
+    return -1;
+  if (!sam3aIsActiveSession(ses) || ses->udpfd < 0 || !ses->callDisconnectCB) {
+    strcpyerrs(ses, "INVALID_SESSION");
+    return -1;
+  }
+  if (ses->type == SAM3A_SESSION_STREAM) {
+    strcpyerrs(ses, "INVALID_SESSION_TYPE");
+    return -1;
+  }
+  if (!sam3aIsValidPubKey(destkey)) {
+    strcpyerrs(ses, "INVALID_KEY");
+    return -1;
+  }
+  if (buf == NULL || bufsize < 1 || bufsize > SAM3A_DGRAM_MAX) {
+    strcpyerrs(ses, "INVALID_DATA");
+    return -1;
+  }
+  if (ses->dgQueued >= ses->dgQueueMax)
+    return SAM3A_SEND_FULL;
+  //
+  hdrsize = 4 + strlen(ses->channel) + 1 + SAM3A_PUBKEY_SIZE + 1;
+  if ((dg = malloc(sizeof(Sam3ADatagram) + hdrsize + bufsize + 1)) == NULL) {
+    strcpyerrs(ses, "OUT_OF_MEMORY");
+    return -1;
+  }
+  sprintf(dg->data, "3.0 %s %s\n", ses->channel, destkey);
+  memcpy(dg->data + hdrsize, buf, bufsize);
+  dg->size = hdrsize + bufsize;
+  dg->next = NULL;
+  if (ses->dgTail != NULL)
+    ses->dgTail->next = dg;
+  else
+    ses->dgHead = dg;
+  ses->dgTail = dg;
+  ++ses->dgQueued;
+  return 0;
+}
+
+int sam3aSetIOBudget(Sam3ASession *ses, int64_t readbytes,
+                     int64_t writebytes) {
+  if (ses != NULL) {
+    ses->readBudget = readbytes;
+    ses->writeBudget = writebytes;
+    return 0;
+  }
+  return -1;
+}
+
+int sam3aSetDatagramQueueLimit(Sam3ASession *ses, int maxcount) {
+  if (ses != NULL && maxcount > 0) {
+    ses->dgQueueMax = maxcount;
+    return 0;
+  }
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int sam3aIsHaveActiveConnections(const Sam3ASession *ses) {
+  if (sam3aIsActiveSession(ses)) {
+    for (const Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
+      if (sam3aIsActiveConnection(c) && !connIsInternal(c))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int sam3aCancelConnection(Sam3AConnection *conn) {
+  if (conn != NULL) {
+    if (shardForward(conn, SHARD_OP_DISCONNECT) == 0)
+      return 0; // owner thread will do it
+    connDisconnect(conn);
+    return 0;
+  }
+  return -1;
+}
+
+int sam3aCloseConnection(Sam3AConnection *conn) {
+  if (conn != NULL && conn->ses != NULL) { // no session: already closed
+    if (shardForward(conn, SHARD_OP_CLOSE) == 0)
+      return 0; // owner thread will do it
+    connDisconnect(conn);
+    if (conn->fd >= 0) {
+      close(conn->fd);
+      conn->fd = -1;
+    }
+    if (conn->cb.cbDestroy != NULL)
+      conn->cb.cbDestroy(conn);
+    shardRelease(conn);
+    sesUnlinkConnection(conn->ses, conn);
+    if (conn->listener != NULL)
+      listenForget(conn);
+    if (conn->warm != NULL)
+      warmForget(conn);
+    if (conn->fwd != NULL)
+      fwdForget(conn);
+    if (conn->relay != NULL)
+      relayForget(conn);
+    if (conn->params != NULL) {
+      free(conn->params);
+      conn->params = NULL;
+    }
+    connCachePut(&conn->ses->connCache, conn);
+  }
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// cross-thread submission
+// workers push requests onto the connection's lock-free stack; the first
+// request also pushes the connection itself onto the loop's lock-free stack
+// and signals the loop's wakeup fd. the loop takes both stacks whole with one
+// exchange and runs requests in submission order.
+enum {
+  SUBMIT_SEND,
+  SUBMIT_CLOSE,
+  SUBMIT_CONNECT
+};
+
+struct Sam3ASubmit {
+  Sam3ASubmit *next;
+  int op; // SUBMIT_*
+  void *data;
+  int size;
+  void (*freecb)(void *udata);
+  void *udata;
+};
+
+struct Sam3ASubmitQueue {
+  Sam3AConnection *head; // connections with pending requests
+  int wake[2];
+  int ownWake; // wake[] belongs to this queue
+};
+
+static Sam3ASubmitQueue *submitQueueNew(void) {
+  Sam3ASubmitQueue *q = calloc(1, sizeof(Sam3ASubmitQueue));
+  //
+  if (q == NULL)
+    return NULL;
+  if (wakeOpen(q->wake) < 0) {
+    free(q);
+    return NULL;
+  }
+  q->ownWake = 1;
+  return q;
+}
+
+static void submitPushConn(Sam3ASubmitQueue *q, Sam3AConnection *conn) {
+  Sam3AConnection *head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  //
+  do {
+    conn->submitNext = head;
+  } while (!__atomic_compare_exchange_n(&q->head, &head, conn, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  if (head == NULL)
+    wakeSignal(q->wake[1]); // loop takes everything, one signal is enough
+}
+
+// loop which runs connection code; NULL: there is none
+static Sam3ASubmitQueue *connLoopQueue(Sam3AConnection *conn) {
+  Sam3AShard *sh = __atomic_load_n(&conn->owner, __ATOMIC_ACQUIRE);
+  //
+  if (sh == NULL)
+    sh = conn->ses->home;
+  return (sh != NULL ? shardSubmitQueue(sh) : conn->ses->submit);
+}
+
+// <0: error; 0: ok
+static int connSubmit(Sam3AConnection *conn, int op, void *data, int size,
+                      void (*freecb)(void *udata), void *udata) {
+  Sam3ASubmitQueue *q = connLoopQueue(conn);
+  Sam3ASubmit *it, *head;
+  //
+  if (q == NULL || (it = malloc(sizeof(Sam3ASubmit))) == NULL)
+    return -1;
+  it->op = op;
+  it->data = data;
+  it->size = size;
+  it->freecb = freecb;
+  it->udata = udata;
+  head = __atomic_load_n(&conn->submitHead, __ATOMIC_RELAXED);
+  do {
+    it->next = head;
+  } while (!__atomic_compare_exchange_n(&conn->submitHead, &head, it, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  if (head == NULL)
+    submitPushConn(q, conn);
+  return 0;
+}
+
+static void submitDrop(Sam3ASubmit *it) {
+  if (it->op == SUBMIT_SEND && it->freecb != NULL)
+    it->freecb(it->udata);
+  free(it);
+}
+
+// run pending requests of connection on its loop
+static void submitRun(Sam3AConnection *conn) {
+  Sam3ASubmit *it = __atomic_exchange_n(&conn->submitHead, NULL,
+                                        __ATOMIC_ACQ_REL),
+              *rev = NULL;
+  //
+  while (it != NULL) {
+    Sam3ASubmit *next = it->next;
+    //
+    it->next = rev;
+    rev = it;
+    it = next;
+  }
+  for (it = rev; it != NULL;) {
+    Sam3ASubmit *next = it->next;
+    //
+    switch (it->op) {
+    case SUBMIT_SEND:
+      if (conn->fd >= 0 && !conn->cancelled) {
+        struct iovec iov;
+        //
+        iov.iov_base = it->data;
+        iov.iov_len = it->size;
+        if (sendqAppendRefs(&conn->sendq, conn->pool, &iov, 1, it->freecb,
+                            it->udata) == 0) {
+          connCheckHighWater(conn);
+          free(it);
+          break;
+        }
+        connError(conn, "MEMORY_ERROR");
+      }
+      submitDrop(it);
+      break;
+    case SUBMIT_CONNECT:
+      if (!sam3aIsActiveSession(conn->ses) ||
+          sesStartConnection(conn->ses, conn, aioConConnectHandshacked) < 0) {
+        // not linked; user gets the error and closes it as usual
+        strcpyerrc(conn, "CONNECTION_ERROR");
+        if (conn->cb.cbError != NULL)
+          conn->cb.cbError(conn);
+      }
+      free(it);
+      break;
+    case SUBMIT_CLOSE:
+      free(it);
+      // nothing may be submitted after close
+      for (; next != NULL; next = it) {
+        it = next->next;
+        submitDrop(next);
+      }
+      sam3aCloseConnection(conn);
+      return;
+    }
+    it = next;
+  }
+}
+
+// take all connections with pending requests and run them in order
+static void submitDrain(Sam3ASubmitQueue *q) {
+  Sam3AConnection *c = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQ_REL),
+                  *rev = NULL;
+  //
+  while (c != NULL) {
+    Sam3AConnection *next = c->submitNext;
+    //
+    c->submitNext = rev;
+    rev = c;
+    c = next;
+  }
+  for (c = rev; c != NULL;) {
+    // next request may push 'c' again as soon as submitRun() takes its list
+    Sam3AConnection *next = c->submitNext;
+    //
+    if (shardRouteSubmit(c) < 0)
+      submitRun(c);
+    c = next;
+  }
+}
+
+static void submitQueueFree(Sam3ASubmitQueue *q) {
+  if (q != NULL) {
+    submitDrain(q);
+    if (q->ownWake)
+      wakeClose(q->wake);
+    free(q);
+  }
+}
+
+int sam3aEnableSubmit(Sam3ASession *ses) {
+  if (ses == NULL)
+    return -1;
+  if (ses->submit == NULL && (ses->submit = submitQueueNew()) == NULL)
+    return -1;
+  return 0;
+}
+
+int sam3aSubmitSend(Sam3AConnection *conn, void *data, int datasize,
+                    void (*freecb)(void *udata), void *udata) {
+  if (conn == NULL || datasize < 0 || (data == NULL && datasize > 0))
+    return -1;
+  if (freecb == NULL) {
+    freecb = free;
+    udata = data;
+  }
+  return connSubmit(conn, SUBMIT_SEND, data, datasize, freecb, udata);
+}
+
+int sam3aSubmitClose(Sam3AConnection *conn) {
+  if (conn == NULL)
+    return -1;
+  return connSubmit(conn, SUBMIT_CLOSE, NULL, 0, NULL, NULL);
+}
+
+Sam3AConnection *sam3aSubmitConnect(Sam3ASession *ses,
+                                    const Sam3AConnectionCallbacks *cb,
+                                    const char *destkey, void *udata) {
+  Sam3AConnection *conn;
+  //
+  if (ses == NULL || ses->type != SAM3A_SESSION_STREAM || destkey == NULL ||
+      strlen(destkey) != SAM3A_PUBKEY_SIZE)
+    return NULL;
+  if ((conn = connAlloc(ses, cb, destkey, -1)) == NULL)
+    return NULL;
+  conn->udata = udata;
+  if (connSubmit(conn, SUBMIT_CONNECT, NULL, 0, NULL, NULL) < 0) {
+    connCachePut(&ses->connCache, conn);
+    return NULL;
+  }
+  return conn;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int sam3aAddSessionToFDS(Sam3ASession *ses, int maxfd, fd_set *rds,
+                         fd_set *wrs) {
+  if (ses != NULL) {
+    if (sam3aIsActiveSession(ses)) {
+      if (rds != NULL && ses->cbAIOProcessorR != NULL) {
+        if (maxfd < ses->fd)
+          maxfd = ses->fd;
+        FD_SET(ses->fd, rds);
+      }
+      //
+      if (wrs != NULL && ses->cbAIOProcessorW != NULL) {
+        if (maxfd < ses->fd)
+          maxfd = ses->fd;
+        FD_SET(ses->fd, wrs);
+      }
+      //
+      if (ses->udpfd >= 0) {
+        if (maxfd < ses->udpfd)
+          maxfd = ses->udpfd;
+        if (rds != NULL)
+          FD_SET(ses->udpfd, rds);
+        if (wrs != NULL && ses->dgHead != NULL)
+          FD_SET(ses->udpfd, wrs);
+      }
+      //
+      if (ses->submit != NULL && rds != NULL) {
+        if (maxfd < ses->submit->wake[0])
+          maxfd = ses->submit->wake[0];
+        FD_SET(ses->submit->wake[0], rds);
+      }
+      //
+      // rejected or cancelled subsessions stay linked until closed
+      for (Sam3ASession *s = ses->subs; s != NULL; s = s->subNext) {
+        int m = sam3aAddSessionToFDS(s, maxfd, rds, wrs);
+        //
+        if (m > maxfd)
+          maxfd = m;
+      }
+      //
+      for (Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
+        if (sam3aIsActiveConnection(c)) {
+          if (rds != NULL && c->cbAIOProcessorR != NULL && !c->readPaused) {
+            if (maxfd < c->fd)
+              maxfd = c->fd;
+            FD_SET(c->fd, rds);
+          }
+          //
+          if (wrs != NULL && c->cbAIOProcessorW != NULL &&
+              (!c->callDisconnectCB || c->sendq.head != NULL ||
+               c->writeBlocked)) {
+            if (maxfd < c->fd)
+              maxfd = c->fd;
+            FD_SET(c->fd, wrs);
+          }
+        }
+      }
+    }
+    return maxfd;
+  }
+  //
+  return -1;
+}
+
+// session control socket and datagram socket readiness
+static void sesProcessIO(Sam3ASession *ses, int rd, int wr, int udprd,
+                         int udpwr) {
+  if (ses->fd >= 0 && !ses->cancelled && ses->cbAIOProcessorR != NULL && rd)
+    ses->cbAIOProcessorR(ses);
+  if (ses->fd >= 0 && !ses->cancelled && ses->cbAIOProcessorW != NULL && wr)
+    ses->cbAIOProcessorW(ses);
+  //
+  if (ses->udpfd >= 0 && !ses->cancelled && ses->dgHead != NULL && udpwr) {
+    if (sesDgramFlush(ses) < 0)
+      sesError(ses, "UDP_ERROR");
+  }
+  if (ses->udpfd >= 0 && !ses->cancelled && udprd) {
+    if (sesDgramRead(ses) < 0)
+      sesError(ses, "UDP_ERROR");
+  }
+}
+
+static void connProcessIO(Sam3AConnection *c, fd_set *rds, fd_set *wrs) {
+  if (c->fd >= 0 && !c->cancelled && c->cbAIOProcessorR != NULL &&
+      !c->readPaused && rds != NULL &&
+      (FD_ISSET(c->fd, rds) || connHaveLeftover(c)))
+    c->cbAIOProcessorR(c);
+  if (c->fd >= 0 && !c->cancelled && c->cbAIOProcessorW != NULL &&
+      wrs != NULL && FD_ISSET(c->fd, wrs))
+    c->cbAIOProcessorW(c);
+}
+
+void sam3aProcessSessionIO(Sam3ASession *ses, fd_set *rds, fd_set *wrs) {
+  if (ses != NULL && ses->super != NULL && ses->super->retryAt != 0)
+    superTick(ses);
   if (sam3aIsActiveSession(ses)) {
-    if (ses->fd >= 0 && !ses->cancelled && ses->cbAIOProcessorR != NULL &&
-        rds != NULL && FD_ISSET(ses->fd, rds))
-      ses->cbAIOProcessorR(ses);
-    if (ses->fd >= 0 && !ses->cancelled && ses->cbAIOProcessorW != NULL &&
-        wrs != NULL && FD_ISSET(ses->fd, wrs))
-      ses->cbAIOProcessorW(ses);
+    Sam3AConnection *start;
+    //
+    if (ses->submit != NULL) {
+      if (rds != NULL && FD_ISSET(ses->submit->wake[0], rds))
+        wakeDrain(ses->submit->wake[0]);
+      submitDrain(ses->submit);
+      if (!sam3aIsActiveSession(ses))
+        return;
+    }
+    if (ses->listener != NULL)
+      listenRefill(ses);
+    if (ses->warm != NULL)
+      warmRefill(ses);
+    sesProcessIO(ses, (rds != NULL && ses->fd >= 0 && FD_ISSET(ses->fd, rds)),
+                 (wrs != NULL && ses->fd >= 0 && FD_ISSET(ses->fd, wrs)),
+                 (rds != NULL && ses->udpfd >= 0 && FD_ISSET(ses->udpfd, rds)),
+                 (wrs != NULL && ses->udpfd >= 0 &&
+                  FD_ISSET(ses->udpfd, wrs)));
+    if (ses->bridgeRetry)
+      bridgeRestart(ses);
+    if (ses->keepalive != NULL)
+      keepaliveTick(ses);
+    for (Sam3ASession *s = ses->subs, *next; s != NULL; s = next) {
+      next = s->subNext;
+      sam3aProcessSessionIO(s, rds, wrs);
+    }
+    if (sesDrain(ses) != NULL)
+      drainSession(ses);
+    if (!sam3aIsActiveSession(ses))
+      return;
+    // round-robin: start where previous call stopped
+    start = (ses->ioCursor ? ses->ioCursor : ses->connlist);
+    if (start == NULL)
+      return;
+    ses->ioCursor = start->next;
+    // callbacks may close the connection, take next first; a closed next
+    // is back in the cache with no session
+    for (Sam3AConnection *c = start, *next; c != NULL && c->ses == ses;
+         c = next) {
+      next = c->next;
+      connProcessIO(c, rds, wrs);
+    }
+    for (Sam3AConnection *c = ses->connlist, *next;
+         c != NULL && c != start && c->ses == ses; c = next) {
+      next = c->next;
+      connProcessIO(c, rds, wrs);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// reactor
+// every shard is a thread with its own poll() set, buffer pool and inbox;
+// other threads hand work to a shard by appending to its inbox and signalling
+// its wakeup fd
+typedef struct Sam3AShardOp {
+  struct Sam3AShardOp *next;
+  int op; // SHARD_OP_*
+  Sam3ASession *ses;
+  Sam3AConnection *conn;
+} Sam3AShardOp;
+
+struct Sam3AShard {
+  Sam3AReactor *r;
+  pthread_t thread;
+  int wake[2];
+  Sam3APool pool;
+  Sam3ASubmitQueue submit;     // uses shard wakeup fd
+  Sam3AConnection *deferred;   // submitted to connections not adopted yet
+  Sam3AConnection *deferredTail;
+  int load; // owned + incoming connections (atomic)
+  // inbox, guarded by lock
+  pthread_mutex_t lock;
+  Sam3AShardOp *inHead;
+  Sam3AShardOp *inTail;
+  int inSteal; // handed off connections waiting in inbox (atomic)
+  // owned by shard thread
+  Sam3ASession **sess;
+  int sesCount;
+  int sesAlloc;
+  Sam3AConnection **conns; // NULL slots are compacted after every round
+  int connCount;
+  int connAlloc;
+  struct pollfd *pfds;
+  // what pfds[n] is: >=0: connection slot; -1-f*2: session f control socket;
+  // -2-f*2: session f datagram socket
+  int *pmap;
+  int pfdAlloc;
+  int leftovers; // connections with buffered stream data; don't sleep
+  int rr;        // connection slot served first in this round
+};
+
+struct Sam3AReactor {
+  pthread_mutex_t lock; // session connection lists; recursive
+  int stop;
+  int nshards;
+  Sam3AShard shards[];
+};
+
+static __thread Sam3AShard *curShard; // shard running on this thread
+
+static int sesOnHomeThread(const Sam3ASession *ses) {
+  return (ses->home == NULL || ses->home == curShard);
+}
+
+static int connOnOwnerThread(const Sam3AConnection *conn) {
+  return (conn->owner == NULL || conn->owner == curShard);
+}
+
+static void reactorLock(Sam3AShard *sh) {
+  if (sh != NULL)
+    pthread_mutex_lock(&sh->r->lock);
+}
+
+static void reactorUnlock(Sam3AShard *sh) {
+  if (sh != NULL)
+    pthread_mutex_unlock(&sh->r->lock);
+}
+
+// <0: error; 0: ok
+static int shardPost(Sam3AShard *sh, int op, Sam3ASession *ses,
+                     Sam3AConnection *conn) {
+  Sam3AShardOp *o = malloc(sizeof(Sam3AShardOp));
+  //
+  if (o == NULL)
+    return -1;
+  o->next = NULL;
+  o->op = op;
+  o->ses = ses;
+  o->conn = conn;
+  pthread_mutex_lock(&sh->lock);
+  if (op == SHARD_OP_ADOPT || op == SHARD_OP_CONNECTED ||
+      op == SHARD_OP_ACCEPTED) {
+    __atomic_store_n(&conn->owner, sh, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&sh->load, 1, __ATOMIC_RELAXED);
+    if (op != SHARD_OP_ADOPT)
+      __atomic_add_fetch(&sh->inSteal, 1, __ATOMIC_RELAXED);
+  }
+  if (sh->inTail != NULL)
+    sh->inTail->next = o;
+  else
+    sh->inHead = o;
+  sh->inTail = o;
+  pthread_mutex_unlock(&sh->lock);
+  wakeSignal(sh->wake[1]);
+  return 0;
+}
+
+static Sam3ASubmitQueue *shardSubmitQueue(Sam3AShard *sh) {
+  return &sh->submit;
+}
+
+static int shardRouteSubmit(Sam3AConnection *conn) {
+  Sam3AShard *sh = __atomic_load_n(&conn->owner, __ATOMIC_ACQUIRE);
+  //
+  if (sh == NULL || curShard == NULL)
+    return -1; // not started yet or no reactor
+  if (sh != curShard) {
+    submitPushConn(&sh->submit, conn);
+    return 0;
+  }
+  if (conn->slot < sh->connCount && sh->conns[conn->slot] == conn)
+    return -1;
+  // still in our inbox (or being stolen); try again next round
+  conn->submitNext = NULL;
+  if (sh->deferredTail != NULL)
+    sh->deferredTail->submitNext = conn;
+  else
+    sh->deferred = conn;
+  sh->deferredTail = conn;
+  return 0;
+}
+
+// deferred connections go first to keep submission order
+static void shardSubmitDrain(Sam3AShard *sh) {
+  Sam3AConnection *c = sh->deferred;
+  //
+  sh->deferred = sh->deferredTail = NULL;
+  while (c != NULL) {
+    Sam3AConnection *next = c->submitNext;
+    //
+    if (shardRouteSubmit(c) < 0)
+      submitRun(c);
+    c = next;
+  }
+  submitDrain(&sh->submit);
+}
+
+static int shardPostAdopt(Sam3AShard *sh, Sam3AConnection *conn) {
+  return shardPost(sh, SHARD_OP_ADOPT, NULL, conn);
+}
+
+static int shardForward(Sam3AConnection *conn, int op) {
+  Sam3AShard *sh = __atomic_load_n(&conn->owner, __ATOMIC_ACQUIRE);
+  //
+  if (sh == NULL || sh == curShard)
+    return -1;
+  return shardPost(sh, op, NULL, conn);
+}
+
+// <0: error; 0: ok
+static int shardAddConn(Sam3AShard *sh, Sam3AConnection *conn) {
+  if (sh->connCount == sh->connAlloc) {
+    int na = (sh->connAlloc ? sh->connAlloc * 2 : 64);
+    Sam3AConnection **n = realloc(sh->conns, na * sizeof(Sam3AConnection *));
+    //
+    if (n == NULL)
+      return -1;
+    sh->conns = n;
+    sh->connAlloc = na;
+  }
+  conn->slot = sh->connCount;
+  conn->pool = &sh->pool;
+  sh->conns[sh->connCount++] = conn;
+  return 0;
+}
+
+// poll new connection on calling shard at once (must be called by 'sh')
+// <0: error; 0: ok
+static int shardAdoptHere(Sam3AShard *sh, Sam3AConnection *conn) {
+  if (sh != curShard || shardAddConn(sh, conn) < 0)
+    return -1;
+  conn->owner = sh;
+  __atomic_add_fetch(&sh->load, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// returns bool: 'conn' is still polled in 'slot' of 'sh' (called by 'sh')
+static int shardHolds(const Sam3AShard *sh, int slot,
+                      const Sam3AConnection *conn) {
+  return (slot < sh->connCount && sh->conns[slot] == conn);
+}
+
+// stop polling connection on owner shard (must be called by owner)
+static void shardRelease(Sam3AConnection *conn) {
+  Sam3AShard *sh = conn->owner;
+  //
+  if (sh != NULL && sh == curShard && conn->slot < sh->connCount &&
+      sh->conns[conn->slot] == conn) {
+    sh->conns[conn->slot] = NULL;
+    __atomic_sub_fetch(&sh->load, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static Sam3AShard *reactorLeastLoaded(Sam3AReactor *r) {
+  Sam3AShard *best = &r->shards[0];
+  int bestLoad = __atomic_load_n(&best->load, __ATOMIC_RELAXED);
+  //
+  for (int f = 1; f < r->nshards; ++f) {
+    int load = __atomic_load_n(&r->shards[f].load, __ATOMIC_RELAXED);
+    //
+    if (load < bestLoad) {
+      best = &r->shards[f];
+      bestLoad = load;
+    }
+  }
+  return best;
+}
+
+// connection reached data phase on its home shard
+// <0: keep it here; 0: handed off, new owner will notify user
+static int shardHandOff(Sam3AConnection *conn, int accepted) {
+  Sam3AShard *sh = conn->owner, *to;
+  //
+  if (sh == NULL || sh != curShard)
+    return -1;
+  if ((to = reactorLeastLoaded(sh->r)) == sh)
+    return -1;
+  shardRelease(conn);
+  if (shardPost(to, (accepted ? SHARD_OP_ACCEPTED : SHARD_OP_CONNECTED), NULL,
+                conn) < 0) {
+    // keep it
+    __atomic_add_fetch(&sh->load, 1, __ATOMIC_RELAXED);
+    sh->conns[conn->slot] = conn;
+    return -1;
+  }
+  return 0;
+}
+
+static void shardRunOp(Sam3AShard *sh, Sam3AShardOp *o) {
+  Sam3AConnection *conn = o->conn;
+  //
+  switch (o->op) {
+  case SHARD_OP_SESSION:
+    if (sh->sesCount == sh->sesAlloc) {
+      int na = (sh->sesAlloc ? sh->sesAlloc * 2 : 4);
+      Sam3ASession **n = realloc(sh->sess, na * sizeof(Sam3ASession *));
+      //
+      if (n == NULL) {
+        sesError(o->ses, "MEMORY_ERROR");
+        break;
+      }
+      sh->sess = n;
+      sh->sesAlloc = na;
+    }
+    sh->sess[sh->sesCount] = o->ses;
+    __atomic_store_n(&sh->sesCount, sh->sesCount + 1, __ATOMIC_RELAXED);
+    break;
+  case SHARD_OP_ADOPT:
+  case SHARD_OP_CONNECTED:
+  case SHARD_OP_ACCEPTED:
+    if (shardAddConn(sh, conn) < 0) {
+      // nobody polls it now; let user close it
+      __atomic_sub_fetch(&sh->load, 1, __ATOMIC_RELAXED);
+      conn->owner = NULL;
+      connError(conn, "MEMORY_ERROR");
+      break;
+    }
+    if (o->op != SHARD_OP_ADOPT)
+      connNotifyUp(conn, (o->op == SHARD_OP_ACCEPTED));
+    break;
+  case SHARD_OP_DISCONNECT:
+    if (shardForward(conn, o->op) < 0)
+      connDisconnect(conn);
+    break;
+  case SHARD_OP_CLOSE:
+    if (shardForward(conn, o->op) < 0)
+      sam3aCloseConnection(conn);
+    break;
+  case SHARD_OP_DRAIN:
+    if (sam3aIsActiveSession(o->ses))
+      drainStart(o->ses);
+    break;
+  }
+}
+
+static void shardDrainInbox(Sam3AShard *sh) {
+  Sam3AShardOp *o;
+  //
+  pthread_mutex_lock(&sh->lock);
+  o = sh->inHead;
+  sh->inHead = sh->inTail = NULL;
+  __atomic_store_n(&sh->inSteal, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&sh->lock);
+  while (o != NULL) {
+    Sam3AShardOp *next = o->next;
+    //
+    shardRunOp(sh, o);
+    free(o);
+    o = next;
+  }
+}
+
+// take one handed off connection from the busiest inbox
+static void shardSteal(Sam3AShard *sh) {
+  Sam3AReactor *r = sh->r;
+  Sam3AShard *victim = NULL;
+  Sam3AShardOp *o = NULL;
+  // only worth it if victim stays at least as loaded as we become
+  int maxLoad = __atomic_load_n(&sh->load, __ATOMIC_RELAXED) + 1;
+  //
+  for (int f = 0; f < r->nshards; ++f) {
+    Sam3AShard *v = &r->shards[f];
+    int load = __atomic_load_n(&v->load, __ATOMIC_RELAXED);
+    //
+    if (v != sh && load > maxLoad &&
+        __atomic_load_n(&v->inSteal, __ATOMIC_RELAXED) > 0) {
+      victim = v;
+      maxLoad = load;
+    }
+  }
+  if (victim == NULL)
+    return;
+  pthread_mutex_lock(&victim->lock);
+  for (Sam3AShardOp *p = NULL, *c = victim->inHead; c != NULL;
+       p = c, c = c->next) {
+    if (c->op == SHARD_OP_CONNECTED || c->op == SHARD_OP_ACCEPTED) {
+      if (p == NULL)
+        victim->inHead = c->next;
+      else
+        p->next = c->next;
+      if (victim->inTail == c)
+        victim->inTail = p;
+      __atomic_sub_fetch(&victim->inSteal, 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&victim->load, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&sh->load, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&c->conn->owner, sh, __ATOMIC_RELEASE);
+      o = c;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&victim->lock);
+  if (o != NULL) {
+    shardRunOp(sh, o);
+    free(o);
+  }
+}
+
+// returns number of pollfds
+static int shardBuildPoll(Sam3AShard *sh) {
+  int need = 1 + sh->sesCount * 2 + sh->connCount, n = 1;
+  //
+  if (need > sh->pfdAlloc) {
+    struct pollfd *np = realloc(sh->pfds, need * sizeof(struct pollfd));
+    int *nm;
+    //
+    if (np == NULL)
+      return 1;
+    sh->pfds = np;
+    if ((nm = realloc(sh->pmap, need * sizeof(int))) == NULL)
+      return 1;
+    sh->pmap = nm;
+    sh->pfdAlloc = need;
+  }
+  sh->pfds[0].fd = sh->wake[0];
+  sh->pfds[0].events = POLLIN;
+  sh->leftovers = 0;
+  for (int f = 0; f < sh->sesCount; ++f) {
+    Sam3ASession *ses = sh->sess[f];
+    //
+    if (!sam3aIsActiveSession(ses))
+      continue;
+    if (ses->cbAIOProcessorR != NULL || ses->cbAIOProcessorW != NULL) {
+      sh->pfds[n].fd = ses->fd;
+      sh->pfds[n].events = (ses->cbAIOProcessorR != NULL ? POLLIN : 0) |
+                           (ses->cbAIOProcessorW != NULL ? POLLOUT : 0);
+      sh->pmap[n++] = -1 - f * 2;
+    }
+    if (ses->udpfd >= 0) {
+      sh->pfds[n].fd = ses->udpfd;
+      sh->pfds[n].events = POLLIN | (ses->dgHead != NULL ? POLLOUT : 0);
+      sh->pmap[n++] = -2 - f * 2;
+    }
+  }
+  // dispatch follows poll set order; rotate it so budgets are fair
+  if (++sh->rr >= sh->connCount)
+    sh->rr = 0;
+  for (int i = 0; i < sh->connCount; ++i) {
+    int f = (sh->rr + i) % sh->connCount;
+    Sam3AConnection *c = sh->conns[f];
+    short ev = 0;
+    //
+    if (c == NULL || !sam3aIsActiveConnection(c))
+      continue;
+    if (c->cbAIOProcessorR != NULL && !c->readPaused)
+      ev |= POLLIN;
+    if (connHaveLeftover(c))
+      ++sh->leftovers;
+    if (c->cbAIOProcessorW != NULL &&
+        (!c->callDisconnectCB || c->sendq.head != NULL || c->writeBlocked))
+      ev |= POLLOUT;
+    if (ev != 0) {
+      sh->pfds[n].fd = c->fd;
+      sh->pfds[n].events = ev;
+      sh->pmap[n++] = f;
+    }
+  }
+  return n;
+}
+
+static void shardDispatch(Sam3AShard *sh, int n) {
+  for (int f = 1; f < n; ++f) {
+    short ev = sh->pfds[f].events, rev = sh->pfds[f].revents;
+    int rd = (ev & POLLIN) && (rev & (POLLIN | POLLHUP | POLLERR)),
+        wr = (ev & POLLOUT) && (rev & (POLLOUT | POLLHUP | POLLERR));
     //
-    for (Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
-      if (c->fd >= 0 && !c->cancelled && c->cbAIOProcessorR != NULL &&
-          rds != NULL && FD_ISSET(c->fd, rds))
+    if (!rd && !wr && (sh->leftovers == 0 || sh->pmap[f] < 0))
+      continue;
+    if (sh->pmap[f] < 0) {
+      int idx = -1 - sh->pmap[f];
+      //
+      if (idx % 2 == 0)
+        sesProcessIO(sh->sess[idx / 2], rd, wr, 0, 0);
+      else
+        sesProcessIO(sh->sess[idx / 2], 0, 0, rd, wr);
+    } else {
+      int slot = sh->pmap[f];
+      Sam3AConnection *c = sh->conns[slot];
+      //
+      if (c == NULL)
+        continue; // closed or handed off by previous callback
+      if ((rd || connHaveLeftover(c)) && c->fd >= 0 && !c->cancelled &&
+          c->cbAIOProcessorR != NULL && !c->readPaused)
         c->cbAIOProcessorR(c);
-      if (c->fd >= 0 && !c->cancelled && c->cbAIOProcessorW != NULL &&
-          wrs != NULL && FD_ISSET(c->fd, wrs))
+      if (sh->conns[slot] != c)
+        continue;
+      if (wr && c->fd >= 0 && !c->cancelled && c->cbAIOProcessorW != NULL)
         c->cbAIOProcessorW(c);
     }
   }
 }
+
+// step connections of draining sessions
+static void shardDrainConns(Sam3AShard *sh) {
+  uint64_t now = 0;
+  //
+  for (int f = 0; f < sh->connCount; ++f) {
+    Sam3AConnection *c = sh->conns[f];
+    Sam3ADrain *d;
+    //
+    if (c == NULL || (d = sesDrain(c->ses)) == NULL ||
+        !__atomic_load_n(&d->started, __ATOMIC_ACQUIRE))
+      continue;
+    if (now == 0)
+      now = drainNow();
+    drainConn(c, now);
+  }
+}
+
+static void shardCompact(Sam3AShard *sh) {
+  int n = 0;
+  //
+  for (int f = 0; f < sh->connCount; ++f) {
+    Sam3AConnection *c = sh->conns[f];
+    //
+    if (c != NULL) {
+      c->slot = n;
+      sh->conns[n++] = c;
+    }
+  }
+  sh->connCount = n;
+}
+
+static void *shardThread(void *arg) {
+  Sam3AShard *sh = (Sam3AShard *)arg;
+  //
+  curShard = sh;
+  while (!__atomic_load_n(&sh->r->stop, __ATOMIC_ACQUIRE)) {
+    int n = shardBuildPoll(sh);
+    //
+    if (poll(sh->pfds, n, (sh->leftovers ? 0 : SAM3A_REACTOR_IDLE_MS)) < 0) {
+      if (errno != EINTR && libsam3a_debug)
+        fprintf(stderr, "reactor: poll() failed: %s\n", strerror(errno));
+      continue;
+    }
+    if (sh->pfds[0].revents & POLLIN)
+      wakeDrain(sh->wake[0]);
+    // new connections first, so requests submitted to them can run now
+    shardDrainInbox(sh);
+    shardSubmitDrain(sh);
+    shardDispatch(sh, n);
+    shardDrainConns(sh);
+    for (int f = 0; f < sh->sesCount; ++f) {
+      if (!sam3aIsActiveSession(sh->sess[f]))
+        continue;
+      if (sh->sess[f]->listener != NULL)
+        listenRefill(sh->sess[f]);
+      if (sh->sess[f]->warm != NULL)
+        warmRefill(sh->sess[f]);
+      if (sesDrain(sh->sess[f]) != NULL)
+        drainCheck(sh->sess[f]);
+    }
+    shardCompact(sh);
+    shardSteal(sh);
+  }
+  curShard = NULL;
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+Sam3AReactor *sam3aReactorCreate(int nthreads) {
+  Sam3AReactor *r;
+  pthread_mutexattr_t attr;
+  int started = 0;
+  //
+  if (nthreads < 1 || nthreads > SAM3A_REACTOR_MAX_THREADS)
+    return NULL;
+  if ((r = calloc(1, sizeof(Sam3AReactor) + nthreads * sizeof(Sam3AShard))) ==
+      NULL)
+    return NULL;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&r->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  r->nshards = nthreads;
+  for (int f = 0; f < nthreads; ++f) {
+    Sam3AShard *sh = &r->shards[f];
+    //
+    sh->r = r;
+    pthread_mutex_init(&sh->lock, NULL);
+    if (wakeOpen(sh->wake) < 0)
+      goto error;
+    sh->submit.wake[0] = sh->wake[0];
+    sh->submit.wake[1] = sh->wake[1];
+  }
+  for (; started < nthreads; ++started) {
+    if (pthread_create(&r->shards[started].thread, NULL, shardThread,
+                       &r->shards[started]) != 0)
+      goto error;
+  }
+  return r;
+error:
+  __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+  for (int f = 0; f < nthreads; ++f) {
+    if (f < started) {
+      wakeSignal(r->shards[f].wake[1]);
+      pthread_join(r->shards[f].thread, NULL);
+    }
+    if (r->shards[f].r != NULL) {
+      wakeClose(r->shards[f].wake);
+      pthread_mutex_destroy(&r->shards[f].lock);
+    }
+  }
+  pthread_mutex_destroy(&r->lock);
+  free(r);
+  return NULL;
+}
+
+int sam3aReactorThreads(const Sam3AReactor *r) {
+  return (r != NULL ? r->nshards : -1);
+}
+
+int sam3aReactorAddSession(Sam3AReactor *r, Sam3ASession *ses) {
+  Sam3AShard *home;
+  int best = -1;
+  //
+  if (r == NULL || ses == NULL || ses->home != NULL || ses->connlist != NULL ||
+      ses->type == SAM3A_SESSION_PRIMARY || ses->primary != NULL)
+    return -1;
+  // spread sessions over shards; sesCount is only a hint here
+  home = &r->shards[0];
+  for (int f = 0; f < r->nshards; ++f) {
+    int cnt = __atomic_load_n(&r->shards[f].sesCount, __ATOMIC_RELAXED);
+    //
+    if (best < 0 || cnt < best) {
+      home = &r->shards[f];
+      best = cnt;
+    }
+  }
+  ses->home = home;
+  if (shardPost(home, SHARD_OP_SESSION, ses, NULL) < 0) {
+    ses->home = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void reactorDetachSession(Sam3ASession *ses) {
+  ses->home = NULL;
+  for (Sam3AConnection *c = ses->connlist; c != NULL; c = c->next) {
+    c->owner = NULL;
+    c->pool = &ses->pool;
+  }
+}
+
+// inbox op the shard didn't get to; sessions are detached already
+static void reactorRunLeftover(Sam3AShardOp *o) {
+  switch (o->op) {
+  case SHARD_OP_CONNECTED:
+  case SHARD_OP_ACCEPTED:
+    connNotifyUp(o->conn, (o->op == SHARD_OP_ACCEPTED));
+    break;
+  case SHARD_OP_DISCONNECT:
+    connDisconnect(o->conn);
+    break;
+  case SHARD_OP_CLOSE:
+    sam3aCloseConnection(o->conn);
+    break;
+  case SHARD_OP_DRAIN:
+    if (sam3aIsActiveSession(o->ses))
+      drainStart(o->ses);
+    break;
+  default:
+    break; // caller polls adopted connections now
+  }
+}
+
+void sam3aReactorDestroy(Sam3AReactor *r) {
+  Sam3AShardOp *left = NULL, **lastp = &left;
+  //
+  if (r == NULL)
+    return;
+  __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+  for (int f = 0; f < r->nshards; ++f) {
+    wakeSignal(r->shards[f].wake[1]);
+    pthread_join(r->shards[f].thread, NULL);
+  }
+  // give everything back to the caller's thread
+  for (int f = 0; f < r->nshards; ++f) {
+    Sam3AShard *sh = &r->shards[f];
+    //
+    while (sh->inHead != NULL) {
+      Sam3AShardOp *o = sh->inHead;
+      //
+      sh->inHead = o->next;
+      if (o->op == SHARD_OP_SESSION) {
+        reactorDetachSession(o->ses);
+        free(o);
+      } else {
+        o->next = NULL;
+        *lastp = o;
+        lastp = &o->next;
+      }
+    }
+    sh->inTail = NULL;
+    for (int s = 0; s < sh->sesCount; ++s)
+      reactorDetachSession(sh->sess[s]);
+  }
+  // run forwarded closes and the like in the order they were posted
+  while (left != NULL) {
+    Sam3AShardOp *o = left;
+    //
+    left = o->next;
+    reactorRunLeftover(o);
+    free(o);
+  }
+  // run what was submitted but not processed yet
+  for (int f = 0; f < r->nshards; ++f) {
+    Sam3AShard *sh = &r->shards[f];
+    //
+    for (Sam3AConnection *c = sh->deferred, *next; c != NULL; c = next) {
+      next = c->submitNext;
+      submitRun(c);
+    }
+    submitDrain(&sh->submit);
+  }
+  for (int f = 0; f < r->nshards; ++f) {
+    Sam3AShard *sh = &r->shards[f];
+    //
+    poolClear(&sh->pool);
+    wakeClose(sh->wake);
+    pthread_mutex_destroy(&sh->lock);
+    free(sh->sess);
+    free(sh->conns);
+    free(sh->pfds);
+    free(sh->pmap);
+  }
+  pthread_mutex_destroy(&r->lock);
+  free(r);
+}
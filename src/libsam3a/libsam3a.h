@@ -32,6 +32,9 @@
 
 #include <sys/types.h>
 #include <sys/time.h>
+#ifndef __MINGW32__
+#include <sys/uio.h>
+#endif
 
 #ifdef __MINGW32__
 //#include <winsock.h>
@@ -77,11 +80,13 @@ extern int sam3aIsValidPrivKey(const char *key);
 ////////////////////////////////////////////////////////////////////////////////
 typedef struct Sam3ASession Sam3ASession;
 typedef struct Sam3AConnection Sam3AConnection;
+typedef struct Sam3ADatagram Sam3ADatagram;
 
 typedef enum {
   SAM3A_SESSION_RAW,
   SAM3A_SESSION_DGRAM,
-  SAM3A_SESSION_STREAM
+  SAM3A_SESSION_STREAM,
+  SAM3A_SESSION_PRIMARY /** SAM 3.3; carries subsessions, see below */
 } Sam3ASessionType;
 
 typedef struct {
@@ -94,8 +99,202 @@ typedef struct {
     void (*cbReplyCheckSes)(Sam3ASession *ses);
     void (*cbReplyCheckConn)(Sam3AConnection *conn);
   };
+  // received but not consumed control bytes; after handshake leftovers are
+  // the first stream data
+  char *rbuf;
+  int rbufSize;
+  int rbufUsed;
+  int rbufScan; // bytes already checked for '\n'
 } Sam3AIO;
 
+/** initial size of control line read buffer */
+#define SAM3A_LINE_BUFSIZE (1024)
+/** longest control line accepted from bridge (with '\n') */
+#define SAM3A_LINE_MAX (65536)
+
+/** payload bytes in one send queue segment */
+#define SAM3A_SENDSEG_SIZE (16384)
+/** how many free segments (of each kind) session keeps for reuse */
+#define SAM3A_SENDSEG_CACHE (64)
+
+/** size of read buffers passed to cbRead() */
+#define SAM3A_READBUF_SIZE (16384)
+/** how many free read buffers session keeps for reuse */
+#define SAM3A_READBUF_CACHE (4)
+
+/** bytes one connection may read per sam3aProcessSessionIO() (default) */
+#define SAM3A_READ_BUDGET (4 * SAM3A_READBUF_SIZE)
+/** bytes one connection may write per sam3aProcessSessionIO() (default) */
+#define SAM3A_WRITE_BUDGET (4 * SAM3A_SENDSEG_SIZE)
+
+/** max datagrams queued by sam3aDatagramSend() (default) */
+#define SAM3A_DGRAM_QUEUE_MAX (256)
+
+/** returned by sam3aSend() when send queue limit is reached */
+#define SAM3A_SEND_FULL (-2)
+
+/** how many resolved bridge host names are remembered */
+#define SAM3A_RESOLVE_CACHE_SIZE (16)
+/** how long resolved host name stays in cache (seconds) */
+#define SAM3A_RESOLVE_CACHE_TTL (60)
+
+typedef struct Sam3AResolve Sam3AResolve;
+
+/** how long idle reactor thread sleeps before looking for work to steal (ms) */
+#define SAM3A_REACTOR_IDLE_MS (100)
+/** max reactor threads */
+#define SAM3A_REACTOR_MAX_THREADS (64)
+
+typedef struct Sam3AReactor Sam3AReactor;
+typedef struct Sam3AShard Sam3AShard;
+
+/** sam3aListen() stops after this many accepts failed in a row */
+#define SAM3A_LISTEN_MAX_FAILURES (8)
+
+typedef struct Sam3AListener Sam3AListener;
+
+/** delay before warm pool retries after failed bridge connect (ms) */
+#define SAM3A_WARM_RETRY_MS (1000)
+
+typedef struct Sam3AWarmPool Sam3AWarmPool;
+
+typedef struct Sam3AForward Sam3AForward;
+
+typedef struct Sam3ASubCmd Sam3ASubCmd;
+
+typedef struct Sam3APortHandler Sam3APortHandler;
+
+/** bytes sam3aRelay() moves through a pipe at once (default pipe capacity) */
+#define SAM3A_RELAY_CHUNK (65536)
+
+typedef struct Sam3ARelay Sam3ARelay;
+
+typedef struct Sam3ADrain Sam3ADrain;
+
+/** sam3aDrainSession() outcome; every stream is counted once */
+typedef struct {
+  int streams;    /** established streams that were drained */
+  int finished;   /** sent everything, then peer (or user) closed */
+  int failed;     /** i/o error while draining */
+  int timedOut;   /** still open at deadline */
+  int cancelled;  /** not established yet when drain started */
+  int64_t unsent; /** queued bytes dropped by failed and timed out streams */
+} Sam3ADrainStats;
+
+typedef struct Sam3ABridgeSet Sam3ABridgeSet;
+
+/** most bridges in one Sam3ABridgeSet */
+#define SAM3A_BRIDGE_MAX (16)
+
+/** SAM bridge (router) of a bridge set; see sam3aBridgeCreateSession() */
+typedef struct {
+  char host[256];
+  int port;
+  int weight;
+  uint32_t ip;  /** resolved address; 0: not known yet */
+  int healthy;  /** bool */
+  int failures; /** in a row */
+  int rttms;    /** smoothed HELLO probe time (with connect); -1: not yet */
+  int sessions; /** created on this bridge */
+  /** begin internal members */
+  int current;            // weighted round robin state
+  Sam3ASession *probe;    // HELLO in flight
+  uint64_t probeStart;
+  int probeDone;          // 1: HELLO ok; -1: failed
+  /** end internal members */
+} Sam3ABridge;
+
+struct Sam3ABridgeSet {
+  Sam3ABridge bridges[SAM3A_BRIDGE_MAX];
+  int count;
+  int probing; /** probes in flight */
+  /** begin internal members */
+  int probeTimeoutms;
+  /** end internal members */
+};
+
+typedef struct Sam3ASupervisor Sam3ASupervisor;
+
+/** sam3aSuperviseSession() counters */
+typedef struct {
+  int reconnects;     /** session was lost and created again */
+  int failures;       /** attempts to create it again that failed */
+  int attempt;        /** failed attempts in current outage; 0: up */
+  int retryms;        /** time till next attempt; -1: none is scheduled */
+  int64_t downtimems; /** total time without session (current outage too) */
+  int64_t lastdownms; /** length of the last outage that ended */
+} Sam3ASupervisorStats;
+
+typedef struct Sam3AKeepalive Sam3AKeepalive;
+
+/** keepalive RTT buckets: RTTs under 2^f ms each, the last one the rest */
+#define SAM3A_RTT_BUCKETS (16)
+
+/** sam3aSetKeepalive() counters */
+typedef struct {
+  int sent;         /** PINGs sent */
+  int received;     /** PONGs to them */
+  int missed;       /** PINGs with no PONG before the next one was due */
+  int lastrttms;    /** -1: no PONG yet */
+  int minrttms;
+  int maxrttms;
+  int64_t sumrttms; /** mean is sumrttms / received */
+  uint32_t hist[SAM3A_RTT_BUCKETS];
+} Sam3AKeepaliveStats;
+
+typedef struct Sam3ASubmit Sam3ASubmit;
+typedef struct Sam3ASubmitQueue Sam3ASubmitQueue;
+
+/** connections allocated at once; closed connections are reused */
+#define SAM3A_CONN_SLAB_SIZE (64)
+
+typedef struct Sam3AConnSlab Sam3AConnSlab;
+
+typedef struct Sam3ASendSeg Sam3ASendSeg;
+
+/*
+ * chunk of the connection send queue
+ * either owns SAM3A_SENDSEG_SIZE bytes right after the header (copied data)
+ * or points to caller memory queued with sam3aSendv()
+ */
+struct Sam3ASendSeg {
+  Sam3ASendSeg *next;
+  char *buf; /** payload */
+  int size;  /** payload capacity; 0 for caller memory */
+  int used;  /** bytes queued in this segment */
+  int pos;   /** bytes already written to socket */
+  void (*freecb)(void *udata); /** called when segment is released */
+  void *udata;
+};
+
+/** chunked send queue; segments are taken from session freelist */
+typedef struct {
+  Sam3ASendSeg *head; /** first segment to write */
+  Sam3ASendSeg *tail; /** segment to append to */
+  int64_t bytes;      /** bytes queued but not written yet */
+  int64_t maxBytes;   /** queue limit; <=0: unlimited */
+} Sam3ASendQueue;
+
+/** per-session buffer caches; buffers are recycled, not freed */
+typedef struct {
+  Sam3ASendSeg *segFree; /** cached send segments */
+  int segFreeCount;
+  Sam3ASendSeg *refFree; /** cached caller memory descriptors */
+  int refFreeCount;
+  char *readFree; /** cached read buffers */
+  int readFreeCount;
+  uint64_t allocs; /** number of malloc() calls made by the pool */
+} Sam3APool;
+
+/** per-session connection slabs; memory is released with the session */
+typedef struct {
+  Sam3AConnSlab *slabs;  /** all allocated slabs */
+  Sam3AConnection *free; /** closed connections, most recent first */
+  int freeCount;
+  int used;        /** connections handed out */
+  uint64_t allocs; /** number of slabs allocated */
+} Sam3AConnCache;
+
 /** session callback functions */
 typedef struct {
   void (*cbError)(Sam3ASession *ses); /** called on error */
@@ -131,6 +330,38 @@ struct Sam3ASession {
   int callDisconnectCB;
   char *params; // will be cleared only by sam3aCloseSession()
   int timeoutms;
+  Sam3APool pool; // buffers shared by session connections
+  Sam3AConnCache connCache; // memory for session connections
+  // datagrams (DGRAM/RAW sessions)
+  int udpfd;                    // bound UDP socket, bridge forwards here
+  Sam3ADatagram *dgHead;        // outgoing queue
+  Sam3ADatagram *dgTail;
+  int dgQueued;
+  int dgQueueMax;
+  char *dgRecvBuf;              // receive slots for batched reads
+  Sam3AResolve *resolve; // pending host lookup; fd is its wakeup fd
+  Sam3AShard *home;      // reactor shard running control traffic
+  Sam3ASubmitQueue *submit; // requests from other threads (select loop)
+  int64_t readBudget;  // per connection per tick; 0: default, <0: unlimited
+  int64_t writeBudget;
+  Sam3AConnection *ioCursor; // connection served first on next tick
+  Sam3AListener *listener;   // sam3aListen() state
+  Sam3AWarmPool *warm;       // sam3aSetWarmPool() state
+  Sam3ASession *primary;     // subsession: PRIMARY session it was added to
+  Sam3ASession *subNext;     // in primary's subsession list
+  Sam3ASession *subs;        // PRIMARY: added subsessions
+  Sam3ASubCmd *subCmds;      // PRIMARY: queued SESSION ADD/REMOVE
+  Sam3APortHandler *ports;   // TO_PORT dispatch table, sorted by port
+  int portCount;
+  Sam3ADrain *drain;         // sam3aDrainSession() state (atomic)
+  Sam3ABridgeSet *bridges;   // sam3aBridgeCreateSession() set
+  int bridge;                // index in 'bridges'
+  uint32_t bridgeTried;      // bridges tried while creating (bit mask)
+  int bridgeRetry;           // try next bridge at the end of this tick
+  int ctlPort;               // bridge TCP port (ses->port may be UDP one)
+  Sam3ASupervisor *super;    // sam3aSuperviseSession() state
+  Sam3AKeepalive *keepalive; // sam3aSetKeepalive() state
+  char *pong;                // PONG owed to bridge; sent once command is out
 
   /** end internal members */
 
@@ -157,6 +388,8 @@ typedef struct {
   void (*cbRead)(Sam3AConnection *ct, const void *buf, int bufsize);
   /** fd already closed, but keys is not cleared */
   void (*cbDestroy)(Sam3AConnection *ct);
+  /** send queue went above high watermark and drained below low watermark */
+  void (*cbWritable)(Sam3AConnection *ct);
 } Sam3AConnectionCallbacks;
 
 struct Sam3AConnection {
@@ -168,6 +401,8 @@ struct Sam3AConnection {
   int cancelled; // fd was shutdown()ed, but not closed yet
   char destkey[SAM3A_PUBKEY_SIZE + 1]; // (asciiz)
   char error[32];                      // (asciiz)
+  int fromPort; // SAM 3.2 stream ports; set by connect, or from peer's
+  int toPort;   // header line for inbound streams (0: none)
 
   /** begin internal members */
   // for async i/o
@@ -177,6 +412,25 @@ struct Sam3AConnection {
   int callDisconnectCB;
   char *params; // will be cleared only by sam3aCloseConnection()
   int timeoutms;
+  Sam3ASendQueue sendq; // outgoing stream data
+  int64_t lowWater;     // cbWritable() threshold
+  int64_t highWater;    // 0: no watermarks
+  int aboveHighWater;   // queue reached highWater, cbWritable() pending
+  int readPaused;       // don't poll for reading
+  int writeBlocked;     // poll for writing though send queue is empty (relay)
+  Sam3APool *pool;      // &ses->pool or owner shard's pool
+  Sam3AShard *owner;    // reactor shard polling this connection
+  int slot;             // index in owner's connection table
+  Sam3ASubmit *submitHead;        // requests from other threads (atomic)
+  Sam3AConnection *submitNext;    // in loop's queue of connections to run
+  Sam3AConnection *prev;          // in ses->connlist
+  Sam3AListener *listener;        // accepted by sam3aListen()
+  int listenSlot;                 // pending accept index; -1: accepted
+  Sam3AWarmPool *warm;            // this is idle bridge socket of the pool
+  int warmSlot;
+  Sam3AForward *fwd;              // STREAM FORWARD control or listener
+  Sam3ARelay *relay;              // sam3aRelay() stream or its local side
+  int drain;                      // sam3aDrainSession() step (atomic)
   /** end internal members */
 
   /** callbacks */
@@ -185,6 +439,45 @@ struct Sam3AConnection {
   void *udata;
 };
 
+typedef struct Sam3ASessionPool Sam3ASessionPool;
+
+/** most sessions in one Sam3ASessionPool */
+#define SAM3A_POOL_MAX (16)
+
+typedef enum {
+  SAM3A_POOL_LEAST_OUTSTANDING, /** fewest open streams (queued datagrams) */
+  SAM3A_POOL_PEER_HASH /** same peer, same member while the member is up */
+} Sam3APoolPolicy;
+
+/** session of a pool; see sam3aSessionPoolCreate() */
+typedef struct {
+  Sam3ASession ses;
+  Sam3ASessionPool *pool;
+  int healthy;        /** created, and no error or disconnect since */
+  int streams;        /** open streams (as of last pick) */
+  uint64_t connects;  /** streams started */
+  uint64_t datagrams; /** datagrams queued */
+  uint64_t failures;  /** connects and sends that failed at once */
+} Sam3APoolMember;
+
+struct Sam3ASessionPool {
+  Sam3APoolMember members[SAM3A_POOL_MAX];
+  int count;
+  Sam3APoolPolicy policy; /** can be changed any time */
+  int created;            /** members created so far */
+  /** begin internal members */
+  Sam3ABridgeSet *bridges;
+  char host[256];
+  int port;
+  Sam3ASessionType type;
+  char *params;
+  int timeoutms;
+  int waiting; // TRANSIENT: rest wait for the first member's destination
+  /** end internal members */
+  Sam3ASessionCallbacks cb;
+  void *udata;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /*
  * check if session is active (i.e. have opened socket)
@@ -213,6 +506,12 @@ extern int sam3aIsActiveConnection(const Sam3AConnection *conn);
  * and http://www.i2p2.i2p/streaming.html#options for STREAM options
  * if result<0: error, 'ses' fields are undefined, no need to call
  * sam3aCloseSession() if result==0: ok, all 'ses' fields are filled
+ * 'hostname' is never resolved on the caller thread: numeric and cached
+ * addresses are used at once, other names are looked up by a resolver thread
+ * while session is polled as usual; lookup failure is reported via cbError()
+ * with "RESOLVE_ERROR"
+ * PRIMARY sessions need SAM 3.3 bridge and only carry subsessions added with
+ * sam3aAddSubsession()
  * TODO: don't clear 'error' field on error (and set it to something meaningful)
  */
 extern int sam3aCreateSessionEx(Sam3ASession *ses,
@@ -246,6 +545,236 @@ extern int sam3aCloseSession(Sam3ASession *ses);
  */
 extern int sam3aCancelSession(Sam3ASession *ses);
 
+/*
+ * graceful shutdown of STREAM session: stop accepting, let streams finish,
+ * then cancel the session
+ * sam3aListen(), STREAM FORWARD and warm pool stop at once and new streams
+ * can't be started; pending connects and accepts fail with SESSION_DRAINING;
+ * established streams send what is queued (sam3aSend() still works), then
+ * their write side is shut down (sam3aSend() fails) and they are read until
+ * the peer closes (cbDisconnected()); streams still open 'timeoutms' later
+ * fail with DRAIN_TIMEOUT; relayed streams end with their relay
+ * when no stream is left the session is cancelled and 'cbDrained' is called
+ * with per-stream outcome; don't close the session from it
+ * drain advances in sam3aProcessSessionIO() (home reactor shard and owners
+ * of connections), so select() loop must call it on timeouts too
+ * call it from the thread running the session; with reactor any thread will
+ * do
+ * returns <0 on error (or if drain was started already), 0 on ok
+ */
+extern int sam3aDrainSession(Sam3ASession *ses, int timeoutms,
+                             void (*cbDrained)(Sam3ASession *ses,
+                                               const Sam3ADrainStats *st));
+
+/*
+ * hot restart: pass created session and its streams to another process
+ * (libsam3 or libsam3a), so it doesn't have to wait for new tunnels and
+ * leaseset; same records as sam3HandoverSend(), datagram socket goes too
+ * 'sock' is connected AF_UNIX SOCK_SEQPACKET socket
+ * only streams in data phase are passed; they must have nothing queued by
+ * sam3aSend() and nothing unread (pause, let them flush, then hand over);
+ * other connections (pending connects, accepts, listeners, relays, warm
+ * pool) are closed as by sam3aCloseSession()
+ * on success the session is closed without callbacks for passed streams and
+ * without shutting down passed sockets; on error nothing is released, close
+ * 'sock' so the other side fails too
+ * PRIMARY sessions, subsessions and reactor sessions can't be handed over
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aHandoverSend(Sam3ASession *ses, int sock);
+
+/*
+ * adopt session sent by sam3aHandoverSend() or sam3HandoverSend() (without
+ * STREAM FORWARD) as if it was just created; no callbacks are called, streams
+ * are in ses->connlist with 'ccb' callbacks and can be used at once
+ * 'ses' is initialized here
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aHandoverRecv(Sam3ASession *ses,
+                             const Sam3ASessionCallbacks *cb,
+                             const Sam3AConnectionCallbacks *ccb, int sock);
+
+/*
+ * bridge set: several SAM bridges (routers) sessions can be created on
+ * new sessions go to healthy bridges in proportion to their weights; a
+ * bridge is unhealthy after a failed probe or session, and healthy again
+ * after a good one; unhealthy bridges are tried only when healthy ones fail
+ * zero the set before use, release with sam3aBridgeSetClose(); sessions
+ * keep a pointer to it
+ */
+
+/*
+ * pass NULL as hostname for '127.0.0.1' and 0 as port for 7656
+ * 'weight' is >= 1
+ * returns <0 on error, bridge index on ok
+ */
+extern int sam3aBridgeSetAdd(Sam3ABridgeSet *set, const char *hostname,
+                             int port, int weight);
+
+/*
+ * send HELLO to every bridge that is not being probed already; probes run
+ * in sam3aProcessBridgeSetIO() and update health and 'rttms'; probes that
+ * take longer than 'timeoutms' fail; set->probing is 0 when all are done
+ * returns <0 on error, number of started probes on ok
+ */
+extern int sam3aBridgeProbe(Sam3ABridgeSet *set, int timeoutms);
+
+/* same as for sessions, for probes in flight; call it on timeouts too */
+extern int sam3aAddBridgeSetToFDS(Sam3ABridgeSet *set, int maxfd, fd_set *rds,
+                                  fd_set *wrs);
+extern void sam3aProcessBridgeSetIO(Sam3ABridgeSet *set, fd_set *rds,
+                                    fd_set *wrs);
+
+/* stop probes in flight */
+extern void sam3aBridgeSetClose(Sam3ABridgeSet *set);
+
+/*
+ * sam3aCreateSessionEx() on a bridge of the set
+ * until the session is created, a bridge that fails is marked unhealthy and
+ * the next one is tried (from sam3aProcessSessionIO()); cbError() is called
+ * only when every bridge failed
+ * not for sessions run by reactor
+ * returns <0 on error, index of the first bridge on ok (ses->bridge is the
+ * current one)
+ */
+extern int sam3aBridgeCreateSession(Sam3ABridgeSet *set, Sam3ASession *ses,
+                                    const Sam3ASessionCallbacks *cb,
+                                    const char *privkey, Sam3ASessionType type,
+                                    const char *params, int timeoutms);
+
+/*
+ * session from sam3aBridgeCreateSession() is lost (cbDisconnected() or
+ * cbError() was called): close it, mark its bridge unhealthy and create it
+ * again on the set with the same destination, type, options, callbacks and
+ * 'udata'; cbDestroy() is not called for the old session
+ * call it outside of session callbacks; PRIMARY sessions lose their
+ * subsessions, subsessions can't be recreated
+ * returns <0 on error ('ses' is closed), bridge index on ok
+ */
+extern int sam3aBridgeRecreateSession(Sam3ASession *ses);
+
+/*
+ * keep session up: when the bridge connection of created session is lost
+ * (bridge closed it or a session error), create it again with the same
+ * destination (TRANSIENT sessions keep the one they got), type, options,
+ * callbacks and 'udata'; sessions of a bridge set go to the next bridge
+ * attempts are spaced by exponential backoff from 'mindelayms' up to
+ * 'maxdelayms', each delay is picked from its upper half at random so
+ * clients of a restarted router don't come back all at once; 'maxattempts'
+ * failed attempts in a row (<=0: no limit) give up with cbError()
+ * loss calls cbDisconnected() (cbError() is not called), recreation calls
+ * cbCreated() again with a new ses->channel; the session is not active in
+ * between
+ * sam3aListen() accepts, warm pool sockets and STREAM FORWARD that were not
+ * closed are set up again (forward control connection calls cbConnected()
+ * again); other streams are gone, close them; PRIMARY sessions lose their
+ * subsessions (close them and add again from cbCreated())
+ * the control socket of supervised session is watched while idle, so loss
+ * is seen without traffic; retries run in sam3aProcessSessionIO(), so
+ * select() loop must call it on timeouts too
+ * cancelling or closing the session stops supervision; not for reactor
+ * sessions and subsessions
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aSuperviseSession(Sam3ASession *ses, int mindelayms,
+                                 int maxdelayms, int maxattempts);
+
+/* returns <0 on error (session is not supervised), 0 on ok */
+extern int sam3aSupervisorStats(const Sam3ASession *ses,
+                                Sam3ASupervisorStats *st);
+
+/*
+ * SAM 3.2 keepalive: created session sends PING on its control socket every
+ * 'intervalms' (when no command is in flight) and times the PONG; a PING not
+ * answered when the next one is due is missed, and 'maxmissed' missed in a
+ * row fail the session with PING_TIMEOUT (cbError(), or reconnect if it is
+ * supervised)
+ * RTTs go to the histogram of sam3aKeepaliveStats() and, for bridge set
+ * sessions, to 'rttms' of the bridge; PINGs from the bridge are answered
+ * keepalive survives reconnects of supervised session; it runs in
+ * sam3aProcessSessionIO(), so select() loop must call it on timeouts too
+ * 'intervalms' <= 0 turns it off; not for reactor sessions and subsessions
+ * (keepalive of the primary covers them)
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aSetKeepalive(Sam3ASession *ses, int intervalms, int maxmissed);
+
+/* returns <0 on error (keepalive was never set), 0 on ok */
+extern int sam3aKeepaliveStats(const Sam3ASession *ses,
+                               Sam3AKeepaliveStats *st);
+
+/*
+ * session pool: several sessions of one destination (on one bridge or a
+ * bridge set) with outgoing streams and datagrams spread over them, so one
+ * tunnel pool doesn't limit throughput
+ * the bridge must accept the same destination more than once (across
+ * routers it always does)
+ * member sessions call pool->cb; their 'udata' is their Sam3APoolMember,
+ * use pool->udata for yours
+ */
+
+/*
+ * create 'count' sessions of 'type' (not PRIMARY) with the same destination:
+ * 'privkey', or what the bridge gave the first one if 'privkey' is NULL
+ * (then the rest are started from its cbCreated())
+ * with 'set' sessions are created by sam3aBridgeCreateSession() and spread
+ * over its bridges ('hostname' and 'port' are ignored)
+ * members that fail are not healthy and are never picked
+ * returns <0 on error (no session was started), 0 on ok
+ */
+extern int sam3aSessionPoolCreate(Sam3ASessionPool *pool, Sam3ABridgeSet *set,
+                                  const Sam3ASessionCallbacks *cb,
+                                  const char *hostname, int port, int count,
+                                  const char *privkey, Sam3ASessionType type,
+                                  const char *params, int timeoutms);
+
+/*
+ * sam3aStreamConnectPorts() on a created member picked by pool->policy
+ * returns NULL on error (no member is up, or see member session error)
+ */
+extern Sam3AConnection *
+sam3aSessionPoolConnect(Sam3ASessionPool *pool,
+                        const Sam3AConnectionCallbacks *cb, const char *destkey,
+                        int fromport, int toport, int timeoutms);
+
+/*
+ * sam3aDatagramSend() on a created member picked by pool->policy (DGRAM/RAW
+ * pools); least outstanding is the member with fewest queued datagrams
+ * returns as sam3aDatagramSend(), or <0 if no member is up
+ */
+extern int sam3aSessionPoolDatagramSend(Sam3ASessionPool *pool,
+                                        const char *destkey, const void *buf,
+                                        int bufsize);
+
+/* same as for sessions, for all members */
+extern int sam3aAddSessionPoolToFDS(Sam3ASessionPool *pool, int maxfd,
+                                    fd_set *rds, fd_set *wrs);
+extern void sam3aProcessSessionPoolIO(Sam3ASessionPool *pool, fd_set *rds,
+                                      fd_set *wrs);
+
+/* close all member sessions */
+extern int sam3aSessionPoolClose(Sam3ASessionPool *pool);
+
+/*
+ * add subsession to PRIMARY session (SAM 3.3 SESSION ADD)
+ * 'sub' is used as session of 'type' (STREAM, DGRAM or RAW): it shares the
+ * destination, keys and tunnels of 'primary', but has its own ID, so streams
+ * and datagrams of different subsessions never mix; the bridge routes
+ * inbound streams and datagrams by destination port to the subsession whose
+ * 'listenport' matches (0: ports no other subsession listens on)
+ * 'primary' must be created already; commands are sent one at a time over
+ * its control connection and sub->cb.cbCreated() or sub->cb.cbError() is
+ * called when the bridge replied
+ * subsessions are polled along with their primary session; close them
+ * before the primary (closing the primary cancels them)
+ * 'params' can be NULL
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aAddSubsession(Sam3ASession *primary, Sam3ASession *sub,
+                              const Sam3ASessionCallbacks *cb,
+                              Sam3ASessionType type, int listenport,
+                              const char *params);
+
 /*
  * open stream connection to 'destkey' endpoint
  * 'destkey' is 516-byte public key (asciiz)
@@ -263,6 +792,29 @@ sam3aStreamConnect(Sam3ASession *ses, const Sam3AConnectionCallbacks *cb,
   return sam3aStreamConnectEx(ses, cb, destkey, -1);
 }
 
+/*
+ * same as sam3aStreamConnectEx(), but connect to 'toport' on remote
+ * destination from our 'fromport' (SAM 3.2; 0: default port)
+ */
+extern Sam3AConnection *
+sam3aStreamConnectPorts(Sam3ASession *ses, const Sam3AConnectionCallbacks *cb,
+                        const char *destkey, int fromport, int toport,
+                        int timeoutms);
+
+/*
+ * dispatch inbound streams by TO_PORT: streams accepted in any way
+ * (sam3aStreamAccept*(), sam3aListen(), sam3aStreamForward*()) to 'toport'
+ * get callbacks 'cb' and 'udata' instead of those they were accepted with,
+ * right before cbAccepted(); streams to ports without handler keep theirs
+ * NULL 'cb' removes the handler for 'toport'
+ * set handlers up before accepting: under reactor the table is read by
+ * reactor threads
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aSetPortHandler(Sam3ASession *ses, int toport,
+                               const Sam3AConnectionCallbacks *cb,
+                               void *udata);
+
 /*
  * accepts stream connection and sets 'destkey'
  * 'destkey' is 516-byte public key
@@ -280,6 +832,66 @@ sam3aStreamAccept(Sam3ASession *ses, const Sam3AConnectionCallbacks *cb) {
   return sam3aStreamAcceptEx(ses, cb, -1);
 }
 
+/*
+ * ask bridge to forward inbound streams to a local listener instead of
+ * keeping one STREAM ACCEPT per pending stream
+ * the listener is bound to 'hostname':'port' (numeric IPv4; NULL for
+ * 127.0.0.1, 0 for any free port) and polled with the session; forwarded
+ * connections get callbacks 'cb' and cbAccepted() (destkey is set) once the
+ * bridge sent the destination line; they are closed by the user as usual
+ * returns the forward control connection, which also gets 'cb':
+ * cbConnected() when forwarding is active, cbError() if it fails and
+ * cbDisconnected() if bridge drops it; close it to stop forwarding
+ * returns NULL on error
+ */
+extern Sam3AConnection *sam3aStreamForwardEx(Sam3ASession *ses,
+                                             const Sam3AConnectionCallbacks *cb,
+                                             const char *hostname, int port,
+                                             int timeoutms);
+
+static inline Sam3AConnection *
+sam3aStreamForward(Sam3ASession *ses, const Sam3AConnectionCallbacks *cb) {
+  return sam3aStreamForwardEx(ses, cb, NULL, 0, -1);
+}
+
+/*
+ * keep 'backlog' STREAM ACCEPTs outstanding on created STREAM session;
+ * every accepted stream is replaced with a new accept right away
+ * accepted connections get callbacks 'cb' (cbAccepted() is the first one)
+ * and are closed by the user as usual; they count against 'maxconns'
+ * (<=0: no limit): at the limit no more accepts are issued until some
+ * accepted connection is closed
+ * failed accepts are closed and re-issued; after SAM3A_LISTEN_MAX_FAILURES
+ * failures in a row listening stops and cb->cbError() gets the failed
+ * connection (ct->error is set; it is closed after return)
+ * call again to change parameters
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aListen(Sam3ASession *ses, int backlog,
+                       const Sam3AConnectionCallbacks *cb, int maxconns);
+
+/*
+ * keep 'size' idle bridge sockets connected and past HELLO; new streams
+ * (sam3aStreamConnect*(), sam3aStreamAccept*(), sam3aListen(),
+ * sam3aSubmitConnect()) take one and send STREAM command at once, saving
+ * TCP connect and HELLO round trips; the pool is refilled in background by
+ * sam3aProcessSessionIO() (or home reactor shard); with reactor only streams
+ * started on the home shard thread use it
+ * pass 0 to close idle sockets and stop
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aSetWarmPool(Sam3ASession *ses, int size);
+
+/* returns number of idle sockets ready to use or <0 on error */
+extern int sam3aWarmPoolReady(const Sam3ASession *ses);
+
+/*
+ * close outstanding accepts of sam3aListen(); accepted connections are not
+ * touched; call it from the thread running the session
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aStopListen(Sam3ASession *ses);
+
 /*
  * close SAM connection, remove it from session and free memory
  * returns <0 on error, 0 on ok
@@ -300,15 +912,118 @@ extern int sam3aCancelConnection(Sam3AConnection *conn);
 /*
  * send data
  * this function can be used in cbSent() callback
+ * data is copied to connection send queue
  *
  * return: <0: error; 0: ok
+ * SAM3A_SEND_FULL: queue limit reached, nothing was queued; wait for cbSent()
  */
 extern int sam3aSend(Sam3AConnection *conn, const void *data, int datasize);
 
+/*
+ * limit number of bytes waiting in connection send queue
+ * sam3aSend() will return SAM3A_SEND_FULL instead of growing the queue
+ * over the limit; data is always accepted when the queue is empty
+ * pass 0 to remove the limit (default)
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aSetSendQueueLimit(Sam3AConnection *conn, int64_t maxbytes);
+
+/*
+ * send data without copying
+ * queues references to 'n' caller buffers; they must stay valid and unchanged
+ * until 'freecb(udata)' is called; this happens once all bytes are written or
+ * when the connection is closed with the data still queued; in the latter
+ * case sam3aIsActiveConnection() is already false when 'freecb' runs
+ * 'freecb' can be NULL; it must not close the connection
+ *
+ * return: <0: error; 0: ok
+ * SAM3A_SEND_FULL: queue limit reached, nothing was queued
+ * 'freecb' is not called on error, buffers still belong to caller
+ */
+extern int sam3aSendv(Sam3AConnection *conn, const struct iovec *iov, int n,
+                      void (*freecb)(void *udata), void *udata);
+
+/* returns number of bytes waiting in send queue or <0 on error */
+extern int64_t sam3aSendQueueSize(const Sam3AConnection *conn);
+
+/*
+ * set send queue watermarks
+ * when queued bytes reach 'high', sam3aIsWritable() turns false; once the
+ * queue drains to 'low' or less cbWritable() is called
+ * pass high=0 to disable
+ * returns <0 on error, 0 on ok
+ *
+ * this is meant to couple two connections without buffering everything:
+ *   in A.cbRead():     sam3aSend(B, ...); if (!sam3aIsWritable(B))
+ *                      sam3aPauseRead(A);
+ *   in B.cbWritable(): sam3aResumeRead(A);
+ */
+extern int sam3aSetWatermarks(Sam3AConnection *conn, int64_t low,
+                              int64_t high);
+
+/* returns bool: send queue is below high watermark */
+extern int sam3aIsWritable(const Sam3AConnection *conn);
+
+/*
+ * stop/restart reading from connection socket
+ * while paused fd is not added to the read set and cbRead() is not called;
+ * can be used in cbRead()
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aPauseRead(Sam3AConnection *conn);
+extern int sam3aResumeRead(Sam3AConnection *conn);
+
+/* returns bool */
+extern int sam3aIsReadPaused(const Sam3AConnection *conn);
+
+/*
+ * relay established stream to local socket 'fd' (i.e. backend connection)
+ * until both sides are done; bytes go both ways with splice() through a pipe
+ * per direction on Linux, so they never enter user space (elsewhere they are
+ * copied through a small buffer)
+ * a side that can't take more stops reading from the other one; EOF from
+ * either side is passed on as shutdown(SHUT_WR) once its data is delivered
+ * stream data received so far and not yet given to cbRead() goes to 'fd'
+ * first, data queued with sam3aSend() goes to the stream first
+ * cbRead()/cbSent()/cbWritable() are not called anymore; when both directions
+ * are finished the stream is disconnected with cbDisconnected(), on failure
+ * cbError() is called; 'fd' is owned by the relay from now on and is closed
+ * together with the connection
+ * call on the thread polling the connection (i.e. from its callbacks); under
+ * reactor 'fd' is polled by the same shard
+ * returns <0 on error ('fd' is left alone), 0 on ok
+ */
+extern int sam3aRelay(Sam3AConnection *conn, int fd);
+
+/*
+ * bytes relayed from stream to local socket ('tolocal') and back
+ * ('tostream'); either pointer can be NULL; can be called from any thread
+ * until the connection is closed
+ * returns <0 if connection is not relayed, 0 while relaying, 1 when both
+ * directions are finished
+ */
+extern int sam3aRelayStats(const Sam3AConnection *conn, int64_t *tolocal,
+                           int64_t *tostream);
+
+/*
+ * limit bytes every session connection reads and writes in one
+ * sam3aProcessSessionIO() call (or one reactor round); connections with
+ * work left stay in the poll set and continue on next call, and every call
+ * starts with the next connection in turn, so one bulk transfer can't stall
+ * interactive streams
+ * pass 0 for the default (SAM3A_READ_BUDGET/SAM3A_WRITE_BUDGET), <0 to
+ * remove the limit
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aSetIOBudget(Sam3ASession *ses, int64_t readbytes,
+                            int64_t writebytes);
+
 /*
  * sends datagram to 'destkey' endpoint
  * 'destkey' is 516-byte public key
+ * datagram is queued and sent by sam3aProcessSessionIO()
  * returns <0 on error, 0 on ok
+ * SAM3A_SEND_FULL: too many datagrams queued, nothing was queued
  * you still have to call sam3aCloseSession() on failure
  * sets ses->error on error
  * don't send datagrams bigger than 31KB!
@@ -316,6 +1031,12 @@ extern int sam3aSend(Sam3AConnection *conn, const void *data, int datasize);
 extern int sam3aDatagramSend(Sam3ASession *ses, const char *destkey,
                              const void *buf, int bufsize);
 
+/*
+ * set max number of datagrams waiting to be sent
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aSetDatagramQueueLimit(Sam3ASession *ses, int maxcount);
+
 ////////////////////////////////////////////////////////////////////////////////
 /*
  * generate random channel name
@@ -329,6 +1050,7 @@ extern int sam3aGenChannelName(char *dest, int minlen, int maxlen);
  * fills 'privkey' and 'pubkey' only
  * you should call sam3aCloseSession() on 'ses'
  * cbCreated callback will be called when keys generated
+ * 'hostname' is resolved as in sam3aCreateSessionEx()
  * returns <0 on error, 0 on ok
  */
 extern int sam3aGenerateKeysEx(Sam3ASession *ses,
@@ -347,6 +1069,7 @@ static inline int sam3aGenerateKeys(Sam3ASession *ses,
  * you should call sam3aCloseSession() on 'ses'
  * cbCreated callback will be called when keys generated, ses->destkey will be
  * set returns <0 on error, 0 on ok
+ * 'hostname' is resolved as in sam3aCreateSessionEx()
  */
 extern int sam3aNameLookupEx(Sam3ASession *ses, const Sam3ASessionCallbacks *cb,
                              const char *hostname, int port, const char *name,
@@ -375,6 +1098,83 @@ extern int sam3aAddSessionToFDS(Sam3ASession *ses, int maxfd, fd_set *rds,
  */
 extern void sam3aProcessSessionIO(Sam3ASession *ses, fd_set *rds, fd_set *wrs);
 
+////////////////////////////////////////////////////////////////////////////////
+/*
+ * submission from other threads
+ * these functions can be called from any thread; requests are queued without
+ * locks and run in submission order by the thread which polls the connection:
+ * at the start of sam3aProcessSessionIO() or of a reactor round
+ * don't submit anything to a connection after sam3aSubmitClose()
+ */
+
+/*
+ * create submission queue for select() loop (sam3aAddSessionToFDS() polls
+ * its wakeup fd); call before other threads start submitting; not needed
+ * for sessions added to a reactor
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aEnableSubmit(Sam3ASession *ses);
+
+/*
+ * queue 'datasize' bytes at 'data' for sending; the library owns the buffer
+ * until freecb(udata) is called (NULL 'freecb' means free(data))
+ * buffer is released (and nothing is sent) if connection is closed first;
+ * submitted data is not limited by sam3aSetSendQueueLimit()
+ * returns <0 on error (buffer is still owned by caller), 0 on ok
+ */
+extern int sam3aSubmitSend(Sam3AConnection *conn, void *data, int datasize,
+                           void (*freecb)(void *udata), void *udata);
+
+/* sam3aCloseConnection() on the loop thread; returns <0 on error, 0 on ok */
+extern int sam3aSubmitClose(Sam3AConnection *conn);
+
+/*
+ * sam3aStreamConnect() on the loop thread; 'udata' is set before any
+ * callback is called
+ * returned connection can be used with sam3aSubmit*() right away
+ * if connecting fails, cbError() is called and connection must be closed
+ * returns NULL on error
+ */
+extern Sam3AConnection *sam3aSubmitConnect(Sam3ASession *ses,
+                                           const Sam3AConnectionCallbacks *cb,
+                                           const char *destkey, void *udata);
+
+////////////////////////////////////////////////////////////////////////////////
+/*
+ * multi-threaded reactor: an alternative to the select() loop above
+ * every thread (shard) has its own poller and buffer pool; session control
+ * traffic and connection handshakes run on the session's home shard,
+ * established connections are handed to the least loaded shard (idle shards
+ * may steal them before they are picked up)
+ * callbacks run on the thread owning the session or connection; call
+ * connection functions only from that connection's callbacks, except
+ * sam3aCloseConnection() and sam3aCancelConnection(), which may be called
+ * from anywhere
+ * don't call sam3aAddSessionToFDS()/sam3aProcessSessionIO() on sessions
+ * added to a reactor, and destroy the reactor before closing them
+ */
+
+/* start 'nthreads' reactor threads; returns NULL on error */
+extern Sam3AReactor *sam3aReactorCreate(int nthreads);
+
+/*
+ * hand session to reactor; 'ses' must be just created (or still not polled)
+ * PRIMARY sessions and subsessions can't be added
+ * returns <0 on error, 0 on ok
+ */
+extern int sam3aReactorAddSession(Sam3AReactor *r, Sam3ASession *ses);
+
+/* number of reactor threads */
+extern int sam3aReactorThreads(const Sam3AReactor *r);
+
+/*
+ * stop and join reactor threads; sessions and connections stay open and can
+ * be polled with sam3aProcessSessionIO() or closed
+ * closes, cancels and drains posted from other threads that reactor threads
+ * didn't get to are run on the calling thread
+ */
+extern void sam3aReactorDestroy(Sam3AReactor *r);
+
 ////////////////////////////////////////////////////////////////////////////////
 /* return malloc()ed buffer and len in 'plen' (if plen != NULL) */
 extern char *sam3PrintfVA(int *plen, const char *fmt, va_list app);
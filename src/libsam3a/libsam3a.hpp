@@ -0,0 +1,672 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+#ifndef LIBSAM3A_HPP
+#define LIBSAM3A_HPP
+
+/*
+ * C++20 coroutine layer over libsam3a (header only)
+ *
+ *   sam3a::Executor exec;
+ *   sam3a::Session ses(exec);
+ *
+ *   sam3a::Task<> client(sam3a::Session &ses, const char *dest) {
+ *     if (co_await ses.create(nullptr, 0) < 0)
+ *       co_return;
+ *     sam3a::Connection c = co_await ses.connect(dest);
+ *     char buf[256];
+ *     int n;
+ *     //
+ *     if (!c || co_await c.write(std::span<const char>("hi\n", 3)) < 0)
+ *       co_return;
+ *     while ((n = co_await c.read(buf)) > 0)
+ *       ...
+ *   }
+ *
+ *   exec.spawn(client(ses, dest));
+ *   exec.run();
+ *
+ * everything runs on the thread calling Executor::run() (or poll()): library
+ * callbacks only queue suspended coroutines, which are resumed after
+ * sam3aProcessSessionIO() returns, so coroutines may close connections and
+ * sessions freely
+ * awaiting does not allocate: operation state lives in the awaiter, i.e. in
+ * the coroutine frame, and write() queues caller memory with sam3aSendv()
+ * errors are return codes as in the C API; exceptions are not used
+ */
+
+#include <sys/select.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "libsam3a.h"
+
+namespace sam3a {
+
+class Executor;
+class Session;
+class Connection;
+
+// entry of executor ready queue; embedded into awaiters
+struct Waiter {
+  Waiter *next = nullptr;
+  std::coroutine_handle<> handle;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+template <typename T = void> class Task;
+
+namespace detail {
+
+struct PromiseBase {
+  std::coroutine_handle<> continuation;
+  bool detached = false;
+
+  // resume awaiting coroutine; detached frames free themselves
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<P> h) noexcept {
+      PromiseBase &p = h.promise();
+      //
+      if (p.detached) {
+        h.destroy();
+        return std::noop_coroutine();
+      }
+      return (p.continuation ? p.continuation : std::noop_coroutine());
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() noexcept { std::terminate(); }
+};
+
+template <typename T> struct Promise : PromiseBase {
+  T value{};
+  Task<T> get_return_object() noexcept;
+  void return_value(T v) { value = std::move(v); }
+};
+
+template <> struct Promise<void> : PromiseBase {
+  Task<void> get_return_object() noexcept;
+  void return_void() noexcept {}
+};
+
+} // namespace detail
+
+/*
+ * lazily started coroutine; runs when awaited or passed to
+ * Executor::spawn()
+ */
+template <typename T> class Task {
+public:
+  using promise_type = detail::Promise<T>;
+
+  Task(Task &&t) noexcept : h(std::exchange(t.h, {})) {}
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() {
+    if (h)
+      h.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+    h.promise().continuation = c;
+    return h;
+  }
+  T await_resume() {
+    if constexpr (!std::is_void_v<T>)
+      return std::move(h.promise().value);
+  }
+
+  // start; frame is freed when the coroutine finishes
+  void detach() {
+    std::coroutine_handle<promise_type> c = std::exchange(h, {});
+    //
+    c.promise().detached = true;
+    c.resume();
+  }
+
+private:
+  friend promise_type;
+  explicit Task(std::coroutine_handle<promise_type> c) : h(c) {}
+  std::coroutine_handle<promise_type> h;
+};
+
+namespace detail {
+
+template <typename T> inline Task<T> Promise<T>::get_return_object() noexcept {
+  return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept {
+  return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+////////////////////////////////////////////////////////////////////////////////
+/*
+ * single-threaded executor: select() loop over its sessions plus the queue
+ * of coroutines woken by library callbacks
+ */
+class Executor {
+public:
+  // select() timeout of run(); warm pool and listener retries need ticks
+  static constexpr int tickms = 100;
+
+  Executor() = default;
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  // start detached coroutine; it runs until its first suspension
+  void spawn(Task<void> t) { t.detach(); }
+
+  // queue coroutine to be resumed by runReady()
+  void post(Waiter *w) {
+    w->next = nullptr;
+    if (tail != nullptr)
+      tail->next = w;
+    else
+      head = w;
+    tail = w;
+  }
+
+  // resume queued coroutines; returns number of resumed ones
+  int runReady() {
+    int res = 0;
+    //
+    while (head != nullptr) {
+      Waiter *w = head;
+      //
+      if ((head = w->next) == nullptr)
+        tail = nullptr;
+      w->next = nullptr;
+      w->handle.resume();
+      ++res;
+    }
+    return res;
+  }
+
+  /*
+   * run ready coroutines, then one select() round over all sessions;
+   * waits at most 'timeoutms' (<0: forever)
+   * returns <0 on error, 0 if there is nothing to wait for, >0 on ok
+   */
+  inline int poll(int timeoutms);
+
+  // poll() until stop() is called or nothing is left to wait for
+  void run() {
+    stopped = false;
+    while (!stopped && poll(tickms) > 0)
+      ;
+  }
+
+  void stop() { stopped = true; }
+
+private:
+  friend class Session;
+  Waiter *head = nullptr, *tail = nullptr;
+  Session *sessions = nullptr;
+  bool stopped = false;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/*
+ * stream connection; owns Sam3AConnection and closes it
+ * it can be moved only while no read() or write() is pending
+ */
+class Connection {
+public:
+  Connection() = default;
+  Connection(Connection &&c) noexcept { take(c); }
+  Connection &operator=(Connection &&c) noexcept {
+    if (this != &c) {
+      close();
+      take(c);
+    }
+    return *this;
+  }
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+  ~Connection() { close(); }
+
+  // bool: connection is established and not closed or failed
+  explicit operator bool() const {
+    return (state == UP && sam3aIsActiveConnection(conn));
+  }
+  Sam3AConnection *get() const { return conn; }
+  const char *error() const { return err; }
+  const char *destkey() const { return (conn != nullptr ? conn->destkey : ""); }
+  // SAM 3.2 stream ports (0: none)
+  int fromPort() const { return (conn != nullptr ? conn->fromPort : 0); }
+  int toPort() const { return (conn != nullptr ? conn->toPort : 0); }
+
+  // read into 'buf'; resumes with >0: bytes, 0: EOF, <0: error
+  struct ReadOp : Waiter {
+    Connection *c;
+    std::span<char> buf;
+    int result = 0;
+
+    bool await_ready() { return c->tryRead(*this); }
+    void await_suspend(std::coroutine_handle<> h) {
+      handle = h;
+      c->reader = this;
+      if (sam3aIsReadPaused(c->conn))
+        sam3aResumeRead(c->conn);
+    }
+    int await_resume() const { return result; }
+  };
+  ReadOp read(std::span<char> buf) {
+    ReadOp op;
+    //
+    op.c = this;
+    op.buf = buf;
+    return op;
+  }
+
+  /*
+   * queue 'buf' without copying (it must stay valid while suspended);
+   * resumes with 0 when all bytes are written, <0 on error
+   */
+  struct WriteOp : Waiter {
+    Connection *c;
+    std::span<const char> buf;
+    int result = 0;
+
+    bool await_ready() {
+      if (!*c) {
+        result = -1;
+        return true;
+      }
+      return buf.empty();
+    }
+    bool await_suspend(std::coroutine_handle<> h) {
+      struct iovec iov = {const_cast<char *>(buf.data()), buf.size()};
+      //
+      handle = h;
+      if (sam3aSendv(c->conn, &iov, 1, written, this) != 0) {
+        result = -1;
+        return false;
+      }
+      return true;
+    }
+    int await_resume() const { return result; }
+
+    // also called when queued data is dropped; connection is inactive then
+    static void written(void *udata) {
+      WriteOp *op = static_cast<WriteOp *>(udata);
+      //
+      op->result = (sam3aIsActiveConnection(op->c->conn) ? 0 : -1);
+      op->c->exec->post(op);
+    }
+  };
+  WriteOp write(std::span<const char> buf) {
+    WriteOp op;
+    //
+    op.c = this;
+    op.buf = buf;
+    return op;
+  }
+
+  void close() {
+    if (conn != nullptr)
+      sam3aCloseConnection(conn); // cbDestroy() clears 'conn'
+    conn = nullptr;
+    stash.clear();
+    stashPos = 0;
+  }
+
+private:
+  friend class Session;
+  enum { OPENING, UP, DOWN, FAILED };
+
+  // don't keep more than this unread; reading is paused instead
+  static constexpr size_t stashMax = 65536;
+
+  Sam3AConnection *conn = nullptr;
+  Executor *exec = nullptr;
+  int state = OPENING;
+  char err[32] = "";
+  Waiter *opener = nullptr; // connect()/accept() in progress
+  ReadOp *reader = nullptr;
+  std::vector<char> stash; // received, not read yet
+  size_t stashPos = 0;
+
+  void take(Connection &c) {
+    conn = std::exchange(c.conn, nullptr);
+    exec = c.exec;
+    state = c.state;
+    memcpy(err, c.err, sizeof(err));
+    opener = std::exchange(c.opener, nullptr);
+    reader = std::exchange(c.reader, nullptr);
+    stash = std::move(c.stash);
+    stashPos = std::exchange(c.stashPos, 0);
+    if (conn != nullptr)
+      conn->udata = this;
+  }
+
+  // complete read at once from stash or with EOF/error
+  bool tryRead(ReadOp &op) {
+    if (stashPos < stash.size()) {
+      size_t n = std::min(op.buf.size(), stash.size() - stashPos);
+      //
+      memcpy(op.buf.data(), stash.data() + stashPos, n);
+      if ((stashPos += n) == stash.size()) {
+        stash.clear();
+        stashPos = 0;
+      }
+      op.result = (int)n;
+      return true;
+    }
+    if (conn == nullptr || state != UP) {
+      op.result = (state == DOWN ? 0 : -1);
+      return true;
+    }
+    return op.buf.empty();
+  }
+
+  // wake everyone waiting on this connection
+  void wake() {
+    if (opener != nullptr)
+      exec->post(std::exchange(opener, nullptr));
+    if (reader != nullptr) {
+      ReadOp *op = std::exchange(reader, nullptr);
+      //
+      tryRead(*op);
+      exec->post(op);
+    }
+  }
+
+  static Connection *self(Sam3AConnection *ct) {
+    return static_cast<Connection *>(ct->udata);
+  }
+
+  static void cbError(Sam3AConnection *ct) {
+    Connection *c = self(ct);
+    //
+    if (c == nullptr)
+      return;
+    static_assert(sizeof(c->err) == sizeof(ct->error));
+    memcpy(c->err, ct->error, sizeof(c->err));
+    c->state = FAILED;
+    c->wake();
+  }
+
+  static void cbDisconnected(Sam3AConnection *ct) {
+    Connection *c = self(ct);
+    //
+    if (c != nullptr && c->state == UP) {
+      c->state = DOWN;
+      c->wake();
+    }
+  }
+
+  static void cbUp(Sam3AConnection *ct) {
+    Connection *c = self(ct);
+    //
+    if (c != nullptr) {
+      c->state = UP;
+      c->wake();
+    }
+  }
+
+  static void cbRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+    Connection *c = self(ct);
+    const char *p = static_cast<const char *>(buf);
+    //
+    if (c == nullptr)
+      return;
+    if (c->reader != nullptr) {
+      ReadOp *op = std::exchange(c->reader, nullptr);
+      int n = std::min((int)op->buf.size(), bufsize);
+      //
+      memcpy(op->buf.data(), p, n);
+      op->result = n;
+      c->exec->post(op);
+      p += n;
+      bufsize -= n;
+    }
+    c->stash.insert(c->stash.end(), p, p + bufsize);
+    if (c->stash.size() - c->stashPos >= stashMax)
+      sam3aPauseRead(ct);
+  }
+
+  static void cbDestroy(Sam3AConnection *ct) {
+    Connection *c = self(ct);
+    //
+    if (c != nullptr) {
+      c->conn = nullptr;
+      if (c->state == OPENING || c->state == UP) {
+        strcpy(c->err, "CLOSED");
+        c->state = FAILED;
+      }
+      c->wake();
+    }
+  }
+
+  static constexpr Sam3AConnectionCallbacks callbacks = {
+      .cbError = cbError,
+      .cbDisconnected = cbDisconnected,
+      .cbConnected = cbUp,
+      .cbAccepted = cbUp,
+      .cbSent = nullptr,
+      .cbRead = cbRead,
+      .cbDestroy = cbDestroy,
+      .cbWritable = nullptr,
+  };
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/*
+ * SAM session polled by executor; closes itself and its connections
+ * session must outlive its Connection objects
+ */
+class Session {
+public:
+  explicit Session(Executor &e) : exec(e) {
+    memset(&ses, 0, sizeof(ses));
+    ses.fd = ses.udpfd = -1;
+    ses.udata = this;
+    if ((next = exec.sessions) != nullptr)
+      next->prev = this;
+    exec.sessions = this;
+  }
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+  ~Session() {
+    sam3aCloseSession(&ses);
+    if (prev != nullptr)
+      prev->next = next;
+    else
+      exec.sessions = next;
+    if (next != nullptr)
+      next->prev = prev;
+  }
+
+  Sam3ASession *get() { return &ses; }
+  const char *error() const { return ses.error; }
+
+  // SESSION CREATE; resumes with 0 on ok, <0 on error (see error())
+  struct CreateOp : Waiter {
+    Session *s;
+    const char *hostname, *privkey, *params;
+    int port;
+    Sam3ASessionType type;
+    int result = -1;
+
+    bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+      handle = h;
+      s->creator = this;
+      if (sam3aCreateSessionEx(&s->ses, &Session::callbacks, hostname, port,
+                               privkey, type, params, -1) < 0) {
+        s->creator = nullptr;
+        return false;
+      }
+      s->ses.udata = s;
+      return true;
+    }
+    int await_resume() const { return result; }
+  };
+  CreateOp create(const char *hostname, int port,
+                  const char *privkey = nullptr,
+                  Sam3ASessionType type = SAM3A_SESSION_STREAM,
+                  const char *params = nullptr) {
+    CreateOp op;
+    //
+    op.s = this;
+    op.hostname = hostname;
+    op.port = port;
+    op.privkey = privkey;
+    op.type = type;
+    op.params = params;
+    return op;
+  }
+
+  /*
+   * STREAM CONNECT ('destkey' != nullptr) or STREAM ACCEPT; resumes with
+   * connection, which is false on error (see Connection::error())
+   */
+  struct OpenOp : Waiter {
+    Session *s;
+    const char *destkey;
+    int fromport = 0, toport = 0;
+    Connection c;
+
+    bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+      Sam3AConnection *ct;
+      //
+      handle = h;
+      c.exec = &s->exec;
+      if (destkey != nullptr)
+        ct = sam3aStreamConnectPorts(&s->ses, &Connection::callbacks, destkey,
+                                     fromport, toport, -1);
+      else
+        ct = sam3aStreamAccept(&s->ses, &Connection::callbacks);
+      if (ct == nullptr) {
+        strcpy(c.err, "SESSION_ERROR");
+        c.state = Connection::FAILED;
+        return false;
+      }
+      ct->udata = &c;
+      c.conn = ct;
+      c.opener = this;
+      return true;
+    }
+    Connection await_resume() {
+      if (c.state != Connection::UP)
+        c.close();
+      return std::move(c);
+    }
+  };
+  OpenOp connect(const char *destkey, int fromport = 0, int toport = 0) {
+    OpenOp op;
+    //
+    op.s = this;
+    op.destkey = destkey;
+    op.fromport = fromport;
+    op.toport = toport;
+    return op;
+  }
+  OpenOp accept() { return connect(nullptr); }
+
+private:
+  friend class Executor;
+  Sam3ASession ses;
+  Executor &exec;
+  Session *prev = nullptr, *next = nullptr;
+  CreateOp *creator = nullptr;
+
+  static void created(Sam3ASession *s, int result) {
+    Session *self = static_cast<Session *>(s->udata);
+    //
+    if (self != nullptr && self->creator != nullptr) {
+      CreateOp *op = std::exchange(self->creator, nullptr);
+      //
+      op->result = result;
+      self->exec.post(op);
+    }
+  }
+  static void cbError(Sam3ASession *s) { created(s, -1); }
+  static void cbCreated(Sam3ASession *s) { created(s, 0); }
+
+  static constexpr Sam3ASessionCallbacks callbacks = {
+      .cbError = cbError,
+      .cbCreated = cbCreated,
+      .cbDisconnected = nullptr,
+      .cbDatagramRead = nullptr,
+      .cbDestroy = nullptr,
+  };
+};
+
+////////////////////////////////////////////////////////////////////////////////
+inline int Executor::poll(int timeoutms) {
+  fd_set rds, wrs;
+  struct timeval tv;
+  int maxfd = -1;
+  //
+  runReady();
+  FD_ZERO(&rds);
+  FD_ZERO(&wrs);
+  for (Session *s = sessions; s != nullptr; s = s->next) {
+    // not created yet or failed: nothing to poll, keep the others' fds
+    if (!sam3aIsActiveSession(&s->ses))
+      continue;
+    maxfd = std::max(maxfd, sam3aAddSessionToFDS(&s->ses, maxfd, &rds, &wrs));
+  }
+  if (maxfd < 0)
+    return (runReady() > 0 ? 1 : 0);
+  tv.tv_sec = timeoutms / 1000;
+  tv.tv_usec = (timeoutms % 1000) * 1000;
+  if (select(maxfd + 1, &rds, &wrs, nullptr, (timeoutms < 0 ? nullptr : &tv)) <
+      0) {
+    if (errno != EINTR)
+      return -1;
+    FD_ZERO(&rds);
+    FD_ZERO(&wrs);
+  }
+  for (Session *s = sessions; s != nullptr; s = s->next)
+    sam3aProcessSessionIO(&s->ses, &rds, &wrs);
+  runReady();
+  return 1;
+}
+
+} // namespace sam3a
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+/*
+ * libsam3a connection churn: keeps N connections open and repeatedly closes
+ * a random one and opens a replacement; prints cost of one close+open pair
+ * for growing N (should stay flat) and how many slabs were allocated
+ * connections are never polled, so no bridge threads are involved: the
+ * session is created on the in-process fake bridge and then pointed to a
+ * listener that never accepts
+ * usage: bench_churn [churn operations]
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../../src/libsam3a/libsam3a.h"
+#include "../libsam3a/fakesam.h"
+
+static int created, failed;
+
+static void scbError(Sam3ASession *ses) {
+  fprintf(stderr, "session error: %s\n", ses->error);
+  failed = 1;
+}
+
+static void scbCreated(Sam3ASession *ses) {
+  (void)ses;
+  created = 1;
+}
+
+static uint64_t nowus(void) {
+  struct timeval tv;
+  //
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// <0: error; >=0: port of listener that never accepts
+static int blackhole(int *fd) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  //
+  if ((*fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  // tiny backlog: pending connects stay in SYN_SENT and close without
+  // leaving TIME_WAIT behind
+  if (bind(*fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(*fd, 1) < 0 ||
+      getsockname(*fd, (struct sockaddr *)&addr, &len) < 0) {
+    close(*fd);
+    return -1;
+  }
+  return ntohs(addr.sin_port);
+}
+
+// returns ns per close+open pair or <0 on error
+static double run(Sam3ASession *ses, int live, int ops) {
+  Sam3AConnection **conns = calloc(live, sizeof(Sam3AConnection *));
+  double res = -1;
+  uint64_t start;
+  //
+  if (conns == NULL)
+    return -1;
+  for (int f = 0; f < live; ++f)
+    if ((conns[f] = sam3aStreamConnect(ses, NULL, fakesamPubKey())) == NULL)
+      goto done;
+  start = nowus();
+  for (int f = 0; f < ops; ++f) {
+    int idx = rand() % live;
+    //
+    sam3aCloseConnection(conns[idx]);
+    if ((conns[idx] = sam3aStreamConnect(ses, NULL, fakesamPubKey())) == NULL)
+      goto done;
+  }
+  res = (double)(nowus() - start) * 1000.0 / ops;
+done:
+  for (int f = 0; f < live; ++f)
+    if (conns[f] != NULL)
+      sam3aCloseConnection(conns[f]);
+  free(conns);
+  return res;
+}
+
+int main(int argc, char *argv[]) {
+  static const int lives[] = {10, 100, 1000, 10000};
+  Sam3ASessionCallbacks scb = {
+      .cbError = scbError,
+      .cbCreated = scbCreated,
+  };
+  Sam3ASession ses;
+  struct rlimit rl;
+  FakeSam *fs;
+  int ops = (argc > 1 ? atoi(argv[1]) : 20000), lfd, port;
+  //
+  if (ops < 1) {
+    fprintf(stderr, "usage: %s [churn operations]\n", argv[0]);
+    return 1;
+  }
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+  }
+  if ((fs = fakesamStart(NULL, NULL)) == NULL ||
+      (port = blackhole(&lfd)) < 0) {
+    fprintf(stderr, "can't start fake bridge\n");
+    return 1;
+  }
+  if (sam3aCreateSession(&ses, &scb, "127.0.0.1", fakesamPort(fs), NULL,
+                         SAM3A_SESSION_STREAM) < 0)
+    return 1;
+  while (!created && !failed) {
+    fd_set rds, wrs;
+    int maxfd;
+    //
+    FD_ZERO(&rds);
+    FD_ZERO(&wrs);
+    maxfd = sam3aAddSessionToFDS(&ses, -1, &rds, &wrs);
+    if (select(maxfd + 1, &rds, &wrs, NULL, NULL) > 0)
+      sam3aProcessSessionIO(&ses, &rds, &wrs);
+  }
+  if (failed)
+    return 1;
+  ses.port = port;
+  printf("%d close+open operations\n", ops);
+  printf("   live    ns/op   slabs\n");
+  for (size_t f = 0; f < sizeof(lives) / sizeof(lives[0]); ++f) {
+    double ns;
+    //
+    if ((rlim_t)lives[f] + 64 > rl.rlim_cur) {
+      printf("%7d  skipped (fd limit)\n", lives[f]);
+      continue;
+    }
+    if ((ns = run(&ses, lives[f], ops)) < 0) {
+      printf("%7d   failed\n", lives[f]);
+      continue;
+    }
+    printf("%7d %8.0f %7llu\n", lives[f], ns,
+           (unsigned long long)ses.connCache.allocs);
+    fflush(stdout);
+  }
+  sam3aCloseSession(&ses);
+  close(lfd);
+  fakesamStop(fs);
+  return 0;
+}
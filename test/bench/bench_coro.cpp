@@ -0,0 +1,296 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+/*
+ * libsam3a coroutine layer overhead
+ * every stream sends a small message and waits for the bridge to echo it
+ * back, then repeats; runs once with plain callbacks and once with
+ * libsam3a.hpp coroutines over the same select() loop and prints round trips
+ * per second; operator new calls while measuring are counted to check that
+ * awaiting does not allocate
+ * usage: bench_coro [streams [seconds]]
+ */
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "../../src/libsam3a/libsam3a.hpp"
+#include "../libsam3a/fakesam.h"
+
+#define MSG_SIZE (64)
+#define MAX_CONNS (1024)
+
+static int nconns, seconds;
+static int failed, stop, counting, up, finished;
+static uint64_t trips, news, start, end;
+
+void *operator new(size_t size) {
+  void *p;
+  //
+  if (counting)
+    ++news;
+  if ((p = malloc(size ? size : 1)) == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static uint64_t nowns(void) {
+  struct timespec ts;
+  //
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// bridge side
+static void echo(int fd, void *udata) {
+  char buf[4096];
+  ssize_t rd;
+  //
+  (void)udata;
+  while ((rd = recv(fd, buf, sizeof(buf), 0)) > 0)
+    if (send(fd, buf, rd, MSG_NOSIGNAL) != rd)
+      break;
+}
+
+static char msg[MSG_SIZE];
+
+////////////////////////////////////////////////////////////////////////////////
+// plain callbacks
+static int got[MAX_CONNS];
+
+static void cbError(Sam3AConnection *ct) {
+  (void)ct;
+  failed = 1;
+}
+
+static void cbConnected(Sam3AConnection *ct) {
+  ++up;
+  if (sam3aSend(ct, msg, MSG_SIZE) < 0)
+    failed = 1;
+}
+
+static void cbRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  int *g = (int *)ct->udata;
+  //
+  (void)buf;
+  if ((*g += bufsize) < MSG_SIZE)
+    return;
+  *g -= MSG_SIZE;
+  if (counting)
+    ++trips;
+  if (stop) {
+    ++finished;
+    return;
+  }
+  if (sam3aSend(ct, msg, MSG_SIZE) < 0)
+    failed = 1;
+}
+
+static const Sam3AConnectionCallbacks ccb = {
+    .cbError = cbError,
+    .cbDisconnected = NULL,
+    .cbConnected = cbConnected,
+    .cbAccepted = NULL,
+    .cbSent = NULL,
+    .cbRead = cbRead,
+    .cbDestroy = NULL,
+    .cbWritable = NULL,
+};
+
+static void scbError(Sam3ASession *ses) {
+  fprintf(stderr, "session error: %s\n", ses->error);
+  failed = 1;
+}
+
+static void scbCreated(Sam3ASession *ses) {
+  for (int f = 0; f < nconns; ++f) {
+    Sam3AConnection *conn = sam3aStreamConnect(ses, &ccb, fakesamPubKey());
+    //
+    if (conn == NULL) {
+      scbError(ses);
+      return;
+    }
+    conn->udata = &got[f];
+  }
+}
+
+// measure only when every stream is up
+static void measure(void) {
+  if (start == 0 && up == nconns) {
+    start = nowns();
+    trips = news = 0;
+    counting = 1;
+  }
+  if (!stop && start != 0 &&
+      nowns() - start >= (uint64_t)seconds * 1000000000ULL) {
+    end = nowns();
+    counting = 0;
+    stop = 1;
+  }
+}
+
+static void report(const char *name) {
+  double secs = (end - start) / 1e9;
+  //
+  printf("%10s %10.0f %10.2f\n", name, trips / secs,
+         (trips ? (double)news / trips : 0.0));
+}
+
+static int runCallbacks(FakeSam *fs) {
+  Sam3ASessionCallbacks scb = {
+      .cbError = scbError,
+      .cbCreated = scbCreated,
+      .cbDisconnected = NULL,
+      .cbDatagramRead = NULL,
+      .cbDestroy = NULL,
+  };
+  Sam3ASession ses;
+  //
+  memset(got, 0, sizeof(got));
+  if (sam3aCreateSession(&ses, &scb, "127.0.0.1", fakesamPort(fs), NULL,
+                         SAM3A_SESSION_STREAM) < 0)
+    return -1;
+  while (!failed && finished < nconns) {
+    fd_set rds, wrs;
+    struct timeval tv = {0, 10000};
+    int maxfd;
+    //
+    measure();
+    FD_ZERO(&rds);
+    FD_ZERO(&wrs);
+    maxfd = sam3aAddSessionToFDS(&ses, -1, &rds, &wrs);
+    if (select(maxfd + 1, &rds, &wrs, NULL, &tv) > 0)
+      sam3aProcessSessionIO(&ses, &rds, &wrs);
+  }
+  sam3aCloseSession(&ses);
+  if (failed)
+    return -1;
+  report("callbacks");
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// coroutines
+static sam3a::Task<> pinger(sam3a::Session &ses) {
+  sam3a::Connection c = co_await ses.connect(fakesamPubKey());
+  char buf[MSG_SIZE];
+  //
+  if (!c) {
+    failed = 1;
+    co_return;
+  }
+  ++up;
+  while (!stop) {
+    if (co_await c.write(msg) < 0) {
+      failed = 1;
+      co_return;
+    }
+    for (int g = 0; g < MSG_SIZE;) {
+      int n = co_await c.read(std::span<char>(buf + g, MSG_SIZE - g));
+      //
+      if (n <= 0) {
+        failed = 1;
+        co_return;
+      }
+      g += n;
+    }
+    if (counting)
+      ++trips;
+  }
+  ++finished;
+}
+
+static sam3a::Task<> starter(sam3a::Executor &exec, sam3a::Session &ses,
+                             int port) {
+  if (co_await ses.create("127.0.0.1", port) < 0) {
+    fprintf(stderr, "session error: %s\n", ses.error());
+    failed = 1;
+    co_return;
+  }
+  for (int f = 0; f < nconns; ++f)
+    exec.spawn(pinger(ses));
+}
+
+static int runCoroutines(FakeSam *fs) {
+  sam3a::Executor exec;
+  sam3a::Session ses(exec);
+  //
+  exec.spawn(starter(exec, ses, fakesamPort(fs)));
+  while (!failed && finished < nconns) {
+    measure();
+    if (exec.poll(10) < 0)
+      failed = 1;
+  }
+  if (failed)
+    return -1;
+  report("coroutines");
+  return 0;
+}
+
+static void reset(void) {
+  failed = stop = counting = up = finished = 0;
+  start = end = 0;
+}
+
+int main(int argc, char *argv[]) {
+  FakeSam *fs;
+  int res = 0;
+  //
+  nconns = (argc > 1 ? atoi(argv[1]) : 16);
+  seconds = (argc > 2 ? atoi(argv[2]) : 2);
+  if (nconns < 1 || nconns > MAX_CONNS || seconds < 1) {
+    fprintf(stderr, "usage: %s [streams [seconds]]\n", argv[0]);
+    return 1;
+  }
+  memset(msg, 'x', sizeof(msg));
+  if ((fs = fakesamStart(echo, NULL)) == NULL) {
+    fprintf(stderr, "can't start fake bridge\n");
+    return 1;
+  }
+  printf("%d streams, %d byte messages, %d seconds\n", nconns, MSG_SIZE,
+         seconds);
+  printf("%10s %10s %10s\n", "api", "trips/s", "news/trip");
+  reset();
+  if (runCallbacks(fs) < 0) {
+    printf("%10s     failed\n", "callbacks");
+    res = 1;
+  }
+  reset();
+  if (runCoroutines(fs) < 0) {
+    printf("%10s     failed\n", "coroutines");
+    res = 1;
+  }
+  fakesamStop(fs);
+  return res;
+}
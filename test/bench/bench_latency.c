@@ -0,0 +1,233 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+/*
+ * libsam3a tail latency of interactive streams next to bulk transfers
+ * bridge side of every interactive stream sends a small timestamped message
+ * every millisecond while bulk streams write as fast as they can; one
+ * select() loop drives all of them; prints p50/p99/max delivery latency of
+ * the small messages and bulk throughput with and without per-tick I/O
+ * budgets
+ * usage: bench_latency [bulk streams [interactive streams [seconds]]]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../src/libsam3a/libsam3a.h"
+#include "../libsam3a/fakesam.h"
+
+#define MAX_CONNS (256)
+#define MSG_SIZE (24) // "T<20 digits ns>\n" plus padding
+#define MAX_SAMPLES (1 << 20)
+
+typedef struct {
+  int kind; // 0: unknown yet, 'B': bulk, 'T': interactive
+  char msg[MSG_SIZE];
+  int msgUsed;
+} ConnState;
+
+static int bulkConns, interConns, seconds;
+static int streams; // bridge side: streams started in this run
+static int failed, stop;
+static ConnState states[MAX_CONNS];
+static uint64_t samples[MAX_SAMPLES];
+static int sampleCount;
+static int64_t bulkBytes;
+
+static uint64_t nowns(void) {
+  struct timespec ts;
+  //
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// bridge side; first 'bulkConns' streams are bulk ones
+static void writer(int fd, void *udata) {
+  (void)udata;
+  if (__atomic_fetch_add(&streams, 1, __ATOMIC_RELAXED) < bulkConns) {
+    static char buf[65536];
+    //
+    while (send(fd, buf, sizeof(buf), MSG_NOSIGNAL) > 0)
+      ;
+  } else {
+    for (;;) {
+      char msg[MSG_SIZE + 1];
+      //
+      snprintf(msg, sizeof(msg), "T%020llu  \n", (unsigned long long)nowns());
+      if (send(fd, msg, MSG_SIZE, MSG_NOSIGNAL) != MSG_SIZE)
+        break;
+      usleep(1000);
+    }
+  }
+}
+
+static void cbError(Sam3AConnection *ct) {
+  (void)ct;
+  failed = 1;
+}
+
+static void cbRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  ConnState *cs = (ConnState *)ct->udata;
+  const char *b = (const char *)buf;
+  //
+  if (cs->kind == 0)
+    cs->kind = (b[0] == 'T' ? 'T' : 'B');
+  if (cs->kind == 'B') {
+    if (!stop)
+      bulkBytes += bufsize;
+    return;
+  }
+  while (bufsize > 0) {
+    int chunk = MSG_SIZE - cs->msgUsed;
+    //
+    if (chunk > bufsize)
+      chunk = bufsize;
+    memcpy(cs->msg + cs->msgUsed, b, chunk);
+    cs->msgUsed += chunk;
+    b += chunk;
+    bufsize -= chunk;
+    if (cs->msgUsed == MSG_SIZE) {
+      uint64_t sent = strtoull(cs->msg + 1, NULL, 10);
+      //
+      if (!stop && sampleCount < MAX_SAMPLES)
+        samples[sampleCount++] = nowns() - sent;
+      cs->msgUsed = 0;
+    }
+  }
+}
+
+static Sam3AConnectionCallbacks ccb = {
+    .cbError = cbError,
+    .cbRead = cbRead,
+};
+
+static void scbError(Sam3ASession *ses) {
+  fprintf(stderr, "session error: %s\n", ses->error);
+  failed = 1;
+}
+
+static void scbCreated(Sam3ASession *ses) {
+  for (int f = 0; f < bulkConns + interConns; ++f) {
+    Sam3AConnection *conn = sam3aStreamConnect(ses, &ccb, fakesamPubKey());
+    //
+    if (conn == NULL) {
+      scbError(ses);
+      return;
+    }
+    conn->udata = &states[f];
+  }
+}
+
+static int cmpU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  //
+  return (x < y ? -1 : x > y);
+}
+
+static int run(FakeSam *fs, int64_t budget) {
+  Sam3ASessionCallbacks scb = {
+      .cbError = scbError,
+      .cbCreated = scbCreated,
+  };
+  Sam3ASession ses;
+  uint64_t start = 0, end;
+  //
+  memset(states, 0, sizeof(states));
+  streams = sampleCount = failed = stop = 0;
+  bulkBytes = 0;
+  if (sam3aCreateSession(&ses, &scb, "127.0.0.1", fakesamPort(fs), NULL,
+                         SAM3A_SESSION_STREAM) < 0)
+    return -1;
+  sam3aSetIOBudget(&ses, budget, budget);
+  for (;;) {
+    fd_set rds, wrs;
+    struct timeval tv = {0, 10000};
+    int maxfd;
+    //
+    if (failed)
+      break;
+    // measure only when every stream is running
+    if (start == 0 &&
+        __atomic_load_n(&streams, __ATOMIC_RELAXED) == bulkConns + interConns)
+      start = nowns(), sampleCount = 0, bulkBytes = 0;
+    if (start != 0 && nowns() - start >= (uint64_t)seconds * 1000000000ULL)
+      break;
+    FD_ZERO(&rds);
+    FD_ZERO(&wrs);
+    maxfd = sam3aAddSessionToFDS(&ses, -1, &rds, &wrs);
+    if (select(maxfd + 1, &rds, &wrs, NULL, &tv) > 0)
+      sam3aProcessSessionIO(&ses, &rds, &wrs);
+  }
+  end = nowns();
+  stop = 1;
+  sam3aCloseSession(&ses);
+  if (failed || sampleCount == 0)
+    return -1;
+  qsort(samples, sampleCount, sizeof(samples[0]), cmpU64);
+  printf("%9s %9llu %9llu %9llu %9.1f\n",
+         (budget < 0 ? "unlimited" : "default"),
+         (unsigned long long)samples[sampleCount / 2] / 1000,
+         (unsigned long long)samples[(sampleCount - 1) * 99 / 100] / 1000,
+         (unsigned long long)samples[sampleCount - 1] / 1000,
+         (double)bulkBytes / (1024.0 * 1024.0) /
+             ((double)(end - start) / 1000000000.0));
+  fflush(stdout);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  FakeSam *fs;
+  //
+  bulkConns = (argc > 1 ? atoi(argv[1]) : 8);
+  interConns = (argc > 2 ? atoi(argv[2]) : 8);
+  seconds = (argc > 3 ? atoi(argv[3]) : 3);
+  if (bulkConns < 0 || interConns < 1 || bulkConns + interConns > MAX_CONNS ||
+      seconds < 1) {
+    fprintf(stderr,
+            "usage: %s [bulk streams [interactive streams [seconds]]]\n",
+            argv[0]);
+    return 1;
+  }
+  if ((fs = fakesamStart(writer, NULL)) == NULL) {
+    fprintf(stderr, "can't start fake bridge\n");
+    return 1;
+  }
+  printf("%d bulk + %d interactive streams, %d s\n", bulkConns, interConns,
+         seconds);
+  printf("   budget   p50(us)   p99(us)   max(us)  bulk MB/s\n");
+  if (run(fs, -1) < 0)
+    printf("unlimited    failed\n");
+  if (run(fs, 0) < 0)
+    printf("  default    failed\n");
+  fakesamStop(fs);
+  return 0;
+}
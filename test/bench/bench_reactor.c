@@ -0,0 +1,176 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+/*
+ * libsam3a reactor throughput with 1..16 threads
+ * every connection downloads the same amount of data from in-process fake
+ * bridge; prints aggregate throughput for each thread count
+ * usage: bench_reactor [connections [MB per connection]]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../../src/libsam3a/libsam3a.h"
+#include "../libsam3a/fakesam.h"
+
+#define MAX_CONNS (1024)
+
+static int64_t perConn;
+static int conns;
+static int done, failed;
+static int64_t received;
+
+// bridge side
+static void writer(int fd, void *udata) {
+  static char buf[65536];
+  int64_t left = perConn;
+  //
+  (void)udata;
+  while (left > 0) {
+    size_t chunk = (left < (int64_t)sizeof(buf) ? (size_t)left : sizeof(buf));
+    ssize_t wr = send(fd, buf, chunk, MSG_NOSIGNAL);
+    //
+    if (wr <= 0)
+      break;
+    left -= wr;
+  }
+}
+
+static void cbError(Sam3AConnection *ct) {
+  (void)ct;
+  __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void cbRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  (void)buf;
+  *(int64_t *)ct->udata += bufsize;
+}
+
+static void cbDisconnected(Sam3AConnection *ct) {
+  __atomic_add_fetch(&received, *(int64_t *)ct->udata, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELEASE);
+}
+
+static Sam3AConnectionCallbacks ccb = {
+    .cbError = cbError,
+    .cbDisconnected = cbDisconnected,
+    .cbRead = cbRead,
+};
+
+static int64_t counters[MAX_CONNS];
+
+static void scbError(Sam3ASession *ses) {
+  fprintf(stderr, "session error: %s\n", ses->error);
+  __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void scbCreated(Sam3ASession *ses) {
+  for (int f = 0; f < conns; ++f) {
+    Sam3AConnection *conn = sam3aStreamConnect(ses, &ccb, fakesamPubKey());
+    //
+    if (conn == NULL) {
+      scbError(ses);
+      return;
+    }
+    conn->udata = &counters[f];
+  }
+}
+
+static uint64_t nowms(void) {
+  struct timeval tv;
+  //
+  gettimeofday(&tv, NULL);
+  return sam3atimeval2ms(&tv);
+}
+
+// returns MB/s or <0 on error
+static double run(FakeSam *fs, int threads) {
+  Sam3ASessionCallbacks scb = {
+      .cbError = scbError,
+      .cbCreated = scbCreated,
+  };
+  Sam3ASession ses;
+  Sam3AReactor *r;
+  uint64_t start;
+  double res = -1;
+  //
+  memset(counters, 0, sizeof(counters));
+  done = failed = 0;
+  received = 0;
+  if ((r = sam3aReactorCreate(threads)) == NULL)
+    return -1;
+  start = nowms();
+  if (sam3aCreateSession(&ses, &scb, "127.0.0.1", fakesamPort(fs), NULL,
+                         SAM3A_SESSION_STREAM) < 0 ||
+      sam3aReactorAddSession(r, &ses) < 0) {
+    sam3aReactorDestroy(r);
+    return -1;
+  }
+  while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < conns &&
+         !__atomic_load_n(&failed, __ATOMIC_RELAXED))
+    usleep(1000);
+  if (!failed && received == perConn * conns)
+    res = (double)received / (1024.0 * 1024.0) /
+          ((double)(nowms() - start + 1) / 1000.0);
+  sam3aReactorDestroy(r);
+  sam3aCloseSession(&ses);
+  return res;
+}
+
+int main(int argc, char *argv[]) {
+  static const int threads[] = {1, 2, 4, 8, 16};
+  FakeSam *fs;
+  //
+  conns = (argc > 1 ? atoi(argv[1]) : 64);
+  perConn = (int64_t)(argc > 2 ? atoi(argv[2]) : 16) * 1024 * 1024;
+  if (conns < 1 || conns > MAX_CONNS || perConn < 1) {
+    fprintf(stderr, "usage: %s [connections [MB per connection]]\n", argv[0]);
+    return 1;
+  }
+  if ((fs = fakesamStart(writer, NULL)) == NULL) {
+    fprintf(stderr, "can't start fake bridge\n");
+    return 1;
+  }
+  printf("%d connections, %d MB each\n", conns, (int)(perConn >> 20));
+  printf("threads      MB/s\n");
+  for (size_t f = 0; f < sizeof(threads) / sizeof(threads[0]); ++f) {
+    double mbs = run(fs, threads[f]);
+    //
+    if (mbs < 0) {
+      printf("%7d    failed\n", threads[f]);
+      continue;
+    }
+    printf("%7d %9.1f\n", threads[f], mbs);
+    fflush(stdout);
+  }
+  fakesamStop(fs);
+  return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+/*
+ * libsam3a stream to local socket relay throughput
+ * bridge side of every stream writes as fast as it can; library side passes
+ * the bytes to a local socket pair whose other end is drained by a sink
+ * thread; runs once copying in cbRead() (send() to the local socket) and
+ * once with sam3aRelay() and prints MB/s delivered to the sinks
+ * usage: bench_relay [streams [seconds]]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../src/libsam3a/libsam3a.h"
+#include "../libsam3a/fakesam.h"
+
+#define MAX_CONNS (64)
+
+static int nconns, seconds, useRelay;
+static int failed, stop; // atomic
+static int up;
+static int local[MAX_CONNS][2]; // [0]: library side, [1]: sink side
+static pthread_t sinks[MAX_CONNS];
+static int64_t sunk; // atomic
+
+static uint64_t nowns(void) {
+  struct timespec ts;
+  //
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// bridge side
+static void bulk(int fd, void *udata) {
+  static char buf[65536];
+  //
+  (void)udata;
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    if (send(fd, buf, sizeof(buf), MSG_NOSIGNAL) <= 0)
+      break;
+}
+
+static void *sink(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  char buf[65536];
+  ssize_t rd;
+  //
+  while ((rd = recv(fd, buf, sizeof(buf), 0)) > 0)
+    __atomic_add_fetch(&sunk, rd, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void cbError(Sam3AConnection *ct) {
+  if (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    fprintf(stderr, "stream error: %s\n", ct->error);
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void cbConnected(Sam3AConnection *ct) {
+  int *sv = local[up++];
+  //
+  ct->udata = sv;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ||
+      pthread_create(&sinks[up - 1], NULL, sink, (void *)(intptr_t)sv[1]) !=
+          0 ||
+      (useRelay && sam3aRelay(ct, sv[0]) < 0))
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+// copying relay: bytes come up to user space and go back down
+static void cbRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  int *sv = (int *)ct->udata;
+  //
+  if (send(sv[0], buf, bufsize, MSG_NOSIGNAL) != bufsize)
+    cbError(ct);
+}
+
+static const Sam3AConnectionCallbacks ccb = {
+    .cbError = cbError,
+    .cbConnected = cbConnected,
+    .cbRead = cbRead,
+};
+
+static void scbError(Sam3ASession *ses) {
+  fprintf(stderr, "session error: %s\n", ses->error);
+  __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void scbCreated(Sam3ASession *ses) {
+  for (int f = 0; f < nconns; ++f)
+    if (sam3aStreamConnect(ses, &ccb, fakesamPubKey()) == NULL)
+      scbError(ses);
+}
+
+static int run(FakeSam *fs, const char *name) {
+  Sam3ASessionCallbacks scb = {
+      .cbError = scbError,
+      .cbCreated = scbCreated,
+  };
+  Sam3ASession ses;
+  uint64_t start = 0, end = 0;
+  int64_t base = 0;
+  int started = 0;
+  //
+  failed = stop = up = 0;
+  sunk = 0;
+  if (sam3aCreateSession(&ses, &scb, "127.0.0.1", fakesamPort(fs), NULL,
+                         SAM3A_SESSION_STREAM) < 0)
+    return -1;
+  while (!__atomic_load_n(&failed, __ATOMIC_RELAXED)) {
+    fd_set rds, wrs;
+    struct timeval tv = {0, 10000};
+    int maxfd;
+    //
+    // measure only when every stream is up
+    if (start == 0 && up == nconns) {
+      start = nowns();
+      base = __atomic_load_n(&sunk, __ATOMIC_RELAXED);
+    }
+    if (start != 0 && nowns() - start >= (uint64_t)seconds * 1000000000ULL) {
+      end = nowns();
+      break;
+    }
+    FD_ZERO(&rds);
+    FD_ZERO(&wrs);
+    maxfd = sam3aAddSessionToFDS(&ses, -1, &rds, &wrs);
+    if (select(maxfd + 1, &rds, &wrs, NULL, &tv) > 0)
+      sam3aProcessSessionIO(&ses, &rds, &wrs);
+  }
+  base = __atomic_load_n(&sunk, __ATOMIC_RELAXED) - base;
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  started = up;
+  sam3aCloseSession(&ses);
+  // closing relayed streams closes their local side; shut down the rest
+  for (int f = 0; f < started; ++f) {
+    if (!useRelay)
+      close(local[f][0]);
+    pthread_join(sinks[f], NULL);
+    close(local[f][1]);
+  }
+  if (failed || end == 0)
+    return -1;
+  printf("%10s %10.1f\n", name, base / ((end - start) / 1e9) / 1e6);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  FakeSam *fs;
+  int res = 0;
+  //
+  nconns = (argc > 1 ? atoi(argv[1]) : 4);
+  seconds = (argc > 2 ? atoi(argv[2]) : 2);
+  if (nconns < 1 || nconns > MAX_CONNS || seconds < 1) {
+    fprintf(stderr, "usage: %s [streams [seconds]]\n", argv[0]);
+    return 1;
+  }
+  if ((fs = fakesamStart(bulk, NULL)) == NULL) {
+    fprintf(stderr, "can't start fake bridge\n");
+    return 1;
+  }
+  printf("%d streams, %d seconds\n", nconns, seconds);
+  printf("%10s %10s\n", "relay", "MB/s");
+  useRelay = 0;
+  if (run(fs, "copy") < 0) {
+    printf("%10s     failed\n", "copy");
+    res = 1;
+  }
+  useRelay = 1;
+  if (run(fs, "splice") < 0) {
+    printf("%10s     failed\n", "splice");
+    res = 1;
+  }
+  fakesamStop(fs);
+  return res;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+#include <sys/socket.h>
+
+#include <cstring>
+#include <span>
+#include <string_view>
+
+extern "C" {
+#include "../../src/ext/tinytest.h"
+#include "../../src/ext/tinytest_macros.h"
+#include "../libsam3a/fakesam.h"
+}
+#include "../../src/libsam3/libsam3.hpp"
+
+// tt_*() macros jump to 'end:', so objects live in inner blocks
+
+// bridge side: echo everything back
+static void echoer(int fd, void *udata) {
+  char buf[4096];
+  ssize_t rd;
+  //
+  (void)udata;
+  while ((rd = recv(fd, buf, sizeof(buf), 0)) > 0)
+    if (send(fd, buf, rd, MSG_NOSIGNAL) != rd)
+      return;
+}
+
+// round trip through an echo stream; returns bool
+static bool echoRoundTrip(sam3::Connection &c) {
+  static const char msg[] = "hello through the echo stream";
+  char back[sizeof(msg)];
+  //
+  if (!c.send(std::as_bytes(std::span(msg))))
+    return false;
+  auto rd = c.receiveAll(std::as_writable_bytes(std::span(back)));
+  //
+  return (rd && *rd == sizeof(msg) && memcmp(back, msg, sizeof(msg)) == 0);
+}
+
+static void test_hpp_session(void *data) {
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  {
+    auto ses = sam3::Session::create("127.0.0.1", fakesamPort(fs));
+    //
+    tt_assert(ses.has_value());
+    tt_assert(ses->pubkey() == fakesamPubKey());
+    tt_assert(ses->privkey() == fakesamPrivKey());
+    {
+      auto conn = ses->connect(fakesamPubKey());
+      //
+      tt_assert(conn.has_value());
+      tt_assert(conn->fd() >= 0);
+      tt_assert(echoRoundTrip(*conn));
+      conn->close();
+      tt_assert(!*conn);
+      tt_assert(ses->get()->connlist == NULL);
+    }
+    // moving hands the session over; the old object is empty
+    sam3::Session moved = std::move(*ses);
+    //
+    tt_assert(!*ses);
+    tt_assert(moved);
+    tt_assert(!ses->connect(fakesamPubKey()));
+    {
+      auto conn = moved.connect(fakesamPubKey());
+      //
+      tt_assert(conn.has_value());
+      tt_assert(echoRoundTrip(*conn));
+    }
+    // keys that don't fit are refused before reaching the bridge
+    char big[SAM3_PUBKEY_SIZE + SAM3_CERT_SIZE + 2];
+    //
+    memset(big, 'B', sizeof(big) - 1);
+    big[sizeof(big) - 1] = 0;
+    auto bad = moved.connect(big);
+    //
+    tt_assert(!bad);
+    tt_assert(bad.error().message() == "INVALID_KEY");
+  }
+
+end:
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+static void test_hpp_keys(void *data) {
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  tt_assert((fs = fakesamStart(NULL, NULL)) != NULL);
+  {
+    auto keys = sam3::Session::generateKeys("127.0.0.1", fakesamPort(fs));
+    auto found = sam3::Session::lookup("127.0.0.1", fakesamPort(fs),
+                                       "test.i2p");
+    //
+    tt_assert(keys.has_value());
+    tt_assert(keys->pubkey() == fakesamPubKey());
+    tt_assert(keys->privkey() == fakesamPrivKey());
+    tt_assert(found.has_value());
+    tt_assert(found->pubkey() == fakesamPubKey());
+    tt_assert(found->privkey().empty());
+  }
+
+end:
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+static void test_hpp_errors(void *data) {
+  FakeSam *fs = NULL;
+  int port;
+  //
+  (void)data;
+  tt_assert((fs = fakesamStart(NULL, NULL)) != NULL);
+  port = fakesamPort(fs);
+  {
+    // a STREAM session can't carry subsessions
+    auto ses = sam3::Session::create("127.0.0.1", port);
+    //
+    tt_assert(ses.has_value());
+    auto sub = ses->addSubsession(SAM3_SESSION_STREAM);
+    //
+    tt_assert(!sub);
+    tt_assert(!sub.error().message().empty());
+  }
+  fakesamStop(fs);
+  fs = NULL;
+  {
+    // nobody listens there now
+    auto ses = sam3::Session::create("127.0.0.1", port);
+    //
+    tt_assert(!ses);
+    tt_assert(!ses.error().message().empty());
+  }
+
+end:
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+static void test_hpp_subsession(void *data) {
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  {
+    auto primary = sam3::Session::create("127.0.0.1", fakesamPort(fs), {},
+                                         SAM3_SESSION_PRIMARY);
+    //
+    tt_assert(primary.has_value());
+    auto sub = primary->addSubsession(SAM3_SESSION_STREAM);
+    //
+    tt_assert(sub.has_value());
+    tt_assert(sub->pubkey() == primary->pubkey());
+    auto conn = sub->connect(fakesamPubKey());
+    //
+    tt_assert(conn.has_value());
+    tt_assert(echoRoundTrip(*conn));
+  }
+
+end:
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+extern "C" {
+struct testcase_t hpp_tests[] = {{"session", test_hpp_session, 0, NULL, NULL},
+                                 {"keys", test_hpp_keys, 0, NULL, NULL},
+                                 {"errors", test_hpp_errors, 0, NULL, NULL},
+                                 {"subsession", test_hpp_subsession, 0, NULL,
+                                  NULL},
+                                 END_OF_TESTCASES};
+}
@@ -0,0 +1,736 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../../src/ext/tinytest.h"
+#include "../../src/ext/tinytest_macros.h"
+#include "../../src/libsam3/libsam3.h"
+#include "../libsam3a/fakesam.h"
+
+// bridge side: keep stream open until library closes it
+static void holder(int fd, void *udata) {
+  char buf[256];
+  //
+  (void)udata;
+  while (recv(fd, buf, sizeof(buf), 0) > 0)
+    ;
+}
+
+// bridge side: echo everything back
+static void echoer(int fd, void *udata) {
+  char buf[4096];
+  ssize_t rd;
+  //
+  (void)udata;
+  while ((rd = recv(fd, buf, sizeof(buf), 0)) > 0)
+    if (send(fd, buf, rd, MSG_NOSIGNAL) != rd)
+      return;
+}
+
+// returns bool: 'conn' goes to echoer
+static int echoRoundTrip(Sam3Connection *conn) {
+  static const char msg[] = "hello through the echo stream";
+  char back[sizeof(msg)];
+  //
+  return (sam3tcpSend(conn->fd, msg, sizeof(msg)) == 0 &&
+          sam3tcpReceive(conn->fd, back, sizeof(back)) == sizeof(back) &&
+          memcmp(back, msg, sizeof(msg)) == 0);
+}
+
+// returns bool: datagram for 'ses' arrives within 5 seconds
+static int dgramReady(const Sam3Session *ses) {
+  struct pollfd pfd = {.fd = ses->udpfd, .events = POLLIN};
+  //
+  return (poll(&pfd, 1, 5000) == 1);
+}
+
+void test_sam3_subsessions(void *data) {
+  Sam3Session ses, sub, dg1, dg2;
+  Sam3Connection *conn;
+  FakeSam *fs = NULL;
+  char buf[64];
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  ses.fd = ses.fwd_fd = -1;
+  sub = dg1 = dg2 = ses;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  tt_int_op(sam3CreateSession(&ses, "127.0.0.1", fakesamPort(fs), NULL,
+                              SAM3_SESSION_PRIMARY, EdDSA_SHA512_Ed25519,
+                              NULL),
+            ==, 0);
+  // rejected SESSION ADD leaves primary usable
+  fakesamFailNextAdd(fs, "DUPLICATED_ID");
+  tt_int_op(sam3AddSubsession(&ses, &sub, SAM3_SESSION_STREAM, 80, NULL), <,
+            0);
+  tt_str_op(ses.error, ==, "DUPLICATED_ID");
+  tt_int_op(sub.fd, ==, -1);
+  tt_int_op(sub.udpfd, ==, -1);
+  tt_assert(sub.primary == NULL);
+  tt_int_op(sam3AddSubsession(&ses, &sub, SAM3_SESSION_STREAM, 80, NULL), ==,
+            0);
+  tt_assert(fakesamHaveSession(fs, sub.channel));
+  tt_str_op(sub.pubkey, ==, ses.pubkey);
+  tt_assert((conn = sam3StreamConnect(&sub, fakesamPubKey())) != NULL);
+  tt_assert(sub.connlist == conn);
+  if (!fakesamHaveUDP(fs)) {
+    sam3CloseSession(&sub);
+    tt_skip();
+  }
+  // each datagram subsession reads only its own datagrams
+  tt_int_op(sam3AddSubsession(&ses, &dg1, SAM3_SESSION_DGRAM, 0, NULL), ==, 0);
+  tt_int_op(sam3AddSubsession(&ses, &dg2, SAM3_SESSION_DGRAM, 0, NULL), ==, 0);
+  tt_int_op(sam3DatagramSend(&dg2, fakesamPubKey(), "two", 3), ==, 0);
+  tt_int_op(sam3DatagramSend(&dg1, fakesamPubKey(), "one", 3), ==, 0);
+  tt_assert(dgramReady(&dg1));
+  tt_int_op(sam3DatagramReceive(&dg1, buf, sizeof(buf)), ==, 3);
+  tt_assert(memcmp(buf, "one", 3) == 0);
+  tt_str_op(dg1.destkey, ==, fakesamPubKey());
+  tt_assert(dgramReady(&dg2));
+  tt_int_op(sam3DatagramReceive(&dg2, buf, sizeof(buf)), ==, 3);
+  tt_assert(memcmp(buf, "two", 3) == 0);
+  // too big for buffer
+  tt_int_op(sam3DatagramSend(&dg1, fakesamPubKey(), "0123456789", 10), ==, 0);
+  tt_assert(dgramReady(&dg1));
+  tt_int_op(sam3DatagramReceive(&dg1, buf, 4), <, 0);
+  tt_str_op(dg1.error, ==, "I2P_ERROR_BUFFER_TOO_SMALL");
+  // closing subsession removes it on the bridge, primary stays
+  strcpy(buf, dg1.channel);
+  sam3CloseSession(&dg1);
+  tt_int_op(dg1.udpfd, ==, -1);
+  tt_assert(!fakesamHaveSession(fs, buf));
+  tt_assert(fakesamHaveSession(fs, dg2.channel));
+
+end:
+  sam3CloseSession(&dg1);
+  sam3CloseSession(&dg2);
+  sam3CloseSession(&sub);
+  sam3CloseSession(&ses);
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+void test_sam3_accept_error(void *data) {
+  Sam3Session ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  ses.fd = ses.fwd_fd = -1;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  tt_int_op(sam3CreateSession(&ses, "127.0.0.1", fakesamPort(fs), NULL,
+                              SAM3_SESSION_STREAM, EdDSA_SHA512_Ed25519,
+                              NULL),
+            ==, 0);
+  // error reply comes where peer destination was expected
+  fakesamSetAcceptError(fs, "I2P_ERROR");
+  tt_assert(sam3StreamAccept(&ses) == NULL);
+  tt_str_op(ses.error, ==, "I2P_ERROR");
+  tt_assert(ses.connlist == NULL);
+  fakesamSetAcceptError(fs, NULL);
+  tt_assert(sam3StreamAccept(&ses) != NULL);
+  tt_str_op(ses.connlist->destkey, ==, fakesamPubKey());
+
+end:
+  sam3CloseSession(&ses);
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+// dispatch handler: remember TO_PORT in 'udata'
+static void portHandler(Sam3Connection *conn, void *udata) {
+  *(int *)udata = conn->toPort;
+  sam3CloseConnection(conn);
+}
+
+void test_sam3_accept_dispatch(void *data) {
+  static const int ports[3] = {80, 443, 7};
+  int web = 0, other = 0;
+  Sam3PortHandler table[2] = {
+      {80, portHandler, &web},
+      {0, portHandler, &other},
+  };
+  Sam3Session ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  ses.fd = ses.fwd_fd = -1;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  fakesamSetInboundPorts(fs, ports, 3);
+  tt_int_op(sam3CreateSession(&ses, "127.0.0.1", fakesamPort(fs), NULL,
+                              SAM3_SESSION_STREAM, EdDSA_SHA512_Ed25519,
+                              NULL),
+            ==, 0);
+  tt_int_op(sam3StreamAcceptDispatch(&ses, NULL, 0), <, 0);
+  tt_str_op(ses.error, ==, "INVALID_ARGUMENT");
+  // exact match
+  tt_int_op(sam3StreamAcceptDispatch(&ses, table, 2), ==, 0);
+  tt_int_op(web, ==, 80);
+  tt_int_op(other, ==, 0);
+  // falls back to TO_PORT 0 entry
+  tt_int_op(sam3StreamAcceptDispatch(&ses, table, 2), ==, 0);
+  tt_int_op(other, ==, 443);
+  // no entry: dropped
+  tt_int_op(sam3StreamAcceptDispatch(&ses, table, 1), ==, 1);
+  tt_assert(ses.connlist == NULL);
+  // accept errors come through
+  fakesamSetAcceptError(fs, "I2P_ERROR");
+  tt_int_op(sam3StreamAcceptDispatch(&ses, table, 2), <, 0);
+  tt_str_op(ses.error, ==, "I2P_ERROR");
+
+end:
+  sam3CloseSession(&ses);
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// one end of relayed stream: send 'size' bytes, then read until EOF
+typedef struct {
+  int64_t size;
+  int64_t got; // bytes received in order; -1: corrupted
+  int fd;
+  int done[2]; // pipe; written when finished
+} RelayEnd;
+
+static unsigned char relayByte(int64_t pos) {
+  return (unsigned char)(pos * 7 + 3);
+}
+
+static void *relayWriter(void *arg) {
+  RelayEnd *e = (RelayEnd *)arg;
+  unsigned char buf[4096];
+  //
+  for (int64_t pos = 0; pos < e->size;) {
+    int chunk = (e->size - pos < (int64_t)sizeof(buf) ? (int)(e->size - pos)
+                                                      : (int)sizeof(buf));
+    ssize_t wr;
+    //
+    for (int f = 0; f < chunk; ++f)
+      buf[f] = relayByte(pos + f);
+    if ((wr = send(e->fd, buf, chunk, MSG_NOSIGNAL)) <= 0)
+      break;
+    pos += wr;
+  }
+  shutdown(e->fd, SHUT_WR);
+  return NULL;
+}
+
+static void relayEnd(int fd, void *udata) {
+  RelayEnd *e = (RelayEnd *)udata;
+  unsigned char buf[4096];
+  int64_t got = 0;
+  ssize_t rd;
+  pthread_t thr;
+  //
+  e->fd = fd;
+  if (pthread_create(&thr, NULL, relayWriter, e) != 0) {
+    e->got = -1;
+    write(e->done[1], "", 1);
+    return;
+  }
+  while (got >= 0 && (rd = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    for (ssize_t f = 0; f < rd; ++f)
+      if (buf[f] != relayByte(got + f))
+        rd = got = -1;
+    if (got >= 0)
+      got += rd;
+  }
+  pthread_join(thr, NULL);
+  e->got = got;
+  write(e->done[1], "", 1);
+}
+
+static void *relayLocal(void *arg) {
+  RelayEnd *e = (RelayEnd *)arg;
+  //
+  relayEnd(e->fd, e);
+  return NULL;
+}
+
+// returns bool: 'e' finished within 10 seconds
+static int relayWait(RelayEnd *e) {
+  struct pollfd pfd = {.fd = e->done[0], .events = POLLIN};
+  char c;
+  //
+  return (poll(&pfd, 1, 10000) == 1 && read(e->done[0], &c, 1) == 1);
+}
+
+void test_sam3_relay(void *data) {
+  RelayEnd peer, local;
+  Sam3Session ses;
+  Sam3Connection *conn;
+  FakeSam *fs = NULL;
+  int sp[2] = {-1, -1}, started = 0;
+  int64_t tolocal = 0, tostream = 0;
+  pthread_t thr;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  ses.fd = ses.fwd_fd = -1;
+  memset(&peer, 0, sizeof(peer));
+  memset(&local, 0, sizeof(local));
+  peer.size = 3 * 1024 * 1024;
+  local.size = 1024 * 1024 + 123;
+  tt_assert(pipe(peer.done) == 0);
+  tt_assert(pipe(local.done) == 0);
+  tt_assert((fs = fakesamStart(relayEnd, &peer)) != NULL);
+  tt_int_op(sam3CreateSession(&ses, "127.0.0.1", fakesamPort(fs), NULL,
+                              SAM3_SESSION_STREAM, EdDSA_SHA512_Ed25519,
+                              NULL),
+            ==, 0);
+  tt_assert((conn = sam3StreamConnect(&ses, fakesamPubKey())) != NULL);
+  tt_int_op(sam3Relay(conn, -1, NULL, NULL), <, 0);
+  tt_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == 0);
+  local.fd = sp[1];
+  tt_assert(pthread_create(&thr, NULL, relayLocal, &local) == 0);
+  started = 1;
+  // both directions at once, each EOF passed on
+  tt_int_op(sam3Relay(conn, sp[0], &tolocal, &tostream), ==, 0);
+  tt_int_op(tolocal, ==, peer.size);
+  tt_int_op(tostream, ==, local.size);
+  tt_assert(relayWait(&peer));
+  tt_assert(relayWait(&local));
+  tt_int_op(peer.got, ==, local.size);
+  tt_int_op(local.got, ==, peer.size);
+  // sockets are left open
+  tt_int_op(fcntl(conn->fd, F_GETFD), >=, 0);
+  tt_int_op(fcntl(sp[0], F_GETFD), >=, 0);
+
+end:
+  if (started)
+    pthread_join(thr, NULL);
+  for (int f = 0; f < 2; ++f) {
+    if (sp[f] >= 0)
+      close(sp[f]);
+    if (peer.done[f] > 0)
+      close(peer.done[f]);
+    if (local.done[f] > 0)
+      close(local.done[f]);
+  }
+  sam3CloseSession(&ses);
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+void test_sam3_handover(void *data) {
+  Sam3Session ses, adopted;
+  Sam3Connection *c;
+  FakeSam *fs = NULL;
+  int hp[2] = {-1, -1}, sp[2] = {-1, -1}, n = 0, ported = 0;
+  char channel[sizeof(ses.channel)];
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  ses.fd = ses.fwd_fd = -1;
+  adopted = ses;
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  tt_int_op(sam3CreateSession(&ses, "127.0.0.1", fakesamPort(fs), NULL,
+                              SAM3_SESSION_STREAM, EdDSA_SHA512_Ed25519,
+                              NULL),
+            ==, 0);
+  tt_assert(sam3StreamConnect(&ses, fakesamPubKey()) != NULL);
+  tt_assert(sam3StreamConnectEx(&ses, fakesamPubKey(), 5, 22) != NULL);
+  strcpy(channel, ses.channel);
+  // records need SOCK_SEQPACKET; nothing is released on error
+  tt_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == 0);
+  tt_int_op(sam3HandoverSend(&ses, sp[0]), <, 0);
+  tt_int_op(ses.fd, >=, 0);
+  tt_assert(ses.connlist != NULL);
+  tt_assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, hp) == 0);
+  tt_int_op(sam3HandoverSend(&ses, hp[0]), ==, 0);
+  tt_int_op(ses.fd, ==, -1);
+  tt_assert(ses.connlist == NULL);
+  // adopted without SESSION CREATE; streams keep working
+  tt_int_op(sam3HandoverRecv(&adopted, hp[1]), ==, 0);
+  tt_str_op(adopted.channel, ==, channel);
+  tt_str_op(adopted.privkey, ==, fakesamPrivKey());
+  tt_str_op(adopted.pubkey, ==, fakesamPubKey());
+  tt_int_op(adopted.type, ==, SAM3_SESSION_STREAM);
+  tt_assert(fakesamHaveSession(fs, channel));
+  for (c = adopted.connlist; c != NULL; c = c->next, ++n) {
+    tt_assert(c->ses == &adopted);
+    tt_str_op(c->destkey, ==, fakesamPubKey());
+    tt_assert(echoRoundTrip(c));
+    ported += (c->fromPort == 5 && c->toPort == 22);
+  }
+  tt_int_op(n, ==, 2);
+  tt_int_op(ported, ==, 1);
+  tt_assert((c = sam3StreamConnect(&adopted, fakesamPubKey())) != NULL);
+  tt_assert(echoRoundTrip(c));
+
+end:
+  for (int f = 0; f < 2; ++f) {
+    if (hp[f] >= 0)
+      close(hp[f]);
+    if (sp[f] >= 0)
+      close(sp[f]);
+  }
+  sam3CloseSession(&adopted);
+  sam3CloseSession(&ses);
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// bound but not listening socket refuses connections; returns its port
+static int deadPort(int *fd) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  //
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((*fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+      bind(*fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      getsockname(*fd, (struct sockaddr *)&addr, &len) < 0)
+    return -1;
+  return ntohs(addr.sin_port);
+}
+
+// make sure fd 0 is open and remember what it is
+static int stdinKeep(struct stat *st) {
+  if (fstat(0, st) < 0 && open("/dev/null", O_RDONLY) != 0)
+    return -1;
+  return fstat(0, st);
+}
+
+// returns bool: fd 0 is still what stdinKeep() saw
+static int stdinKept(const struct stat *st) {
+  struct stat now;
+  //
+  return (fstat(0, &now) == 0 && now.st_dev == st->st_dev &&
+          now.st_ino == st->st_ino);
+}
+
+void test_sam3_bridges(void *data) {
+  Sam3BridgeSet set, down;
+  Sam3Session ses;
+  FakeSam *fs = NULL;
+  struct stat in;
+  int dead = -1, port;
+  //
+  (void)data;
+  memset(&set, 0, sizeof(set));
+  memset(&down, 0, sizeof(down));
+  memset(&ses, 0, sizeof(ses));
+  ses.fd = ses.fwd_fd = -1;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  tt_assert((port = deadPort(&dead)) > 0);
+  tt_int_op(sam3BridgeSetAdd(&set, "127.0.0.1", port, 5), ==, 0);
+  tt_int_op(sam3BridgeSetAdd(&set, "127.0.0.1", fakesamPort(fs), 1), ==, 1);
+  tt_int_op(sam3BridgeSetAdd(&down, "127.0.0.1", port, 1), ==, 0);
+  // heavier bridge is tried first; it fails over to the live one
+  tt_int_op(sam3BridgeCreateSession(&set, &ses, NULL, SAM3_SESSION_STREAM,
+                                    EdDSA_SHA512_Ed25519, NULL),
+            ==, 1);
+  tt_int_op(set.bridges[0].healthy, ==, 0);
+  tt_int_op(set.bridges[0].failures, ==, 1);
+  tt_int_op(set.bridges[1].sessions, ==, 1);
+  tt_assert(sam3StreamConnect(&ses, fakesamPubKey()) != NULL);
+  // probes
+  tt_int_op(sam3BridgeProbe(&set, 0), <, 0);
+  tt_int_op(sam3BridgeProbe(&set, 2000), ==, 1);
+  tt_int_op(set.bridges[0].failures, ==, 2);
+  tt_int_op(set.bridges[1].healthy, ==, 1);
+  tt_int_op(set.bridges[1].rttms, >=, 0);
+  // lost session comes back with fewest failures first
+  tt_int_op(sam3BridgeRecreateSession(&set, &ses, 1, NULL), ==, 1);
+  tt_assert(ses.connlist == NULL);
+  tt_str_op(ses.privkey, ==, fakesamPrivKey());
+  tt_assert(fakesamHaveSession(fs, ses.channel));
+  tt_int_op(set.bridges[1].sessions, ==, 2);
+  // every bridge down; closing failed session again spares fd 0
+  tt_int_op(stdinKeep(&in), ==, 0);
+  sam3CloseSession(&ses);
+  tt_int_op(sam3BridgeCreateSession(&down, &ses, NULL, SAM3_SESSION_STREAM,
+                                    EdDSA_SHA512_Ed25519, NULL),
+            <, 0);
+  tt_int_op(down.bridges[0].failures, ==, 1);
+  sam3CloseSession(&ses);
+  tt_assert(stdinKept(&in));
+
+end:
+  if (dead >= 0)
+    close(dead);
+  sam3CloseSession(&ses);
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+void test_sam3_session_pool(void *data) {
+  static Sam3SessionPool pool;
+  FakeSam *fs = NULL;
+  int hashed = -1;
+  //
+  (void)data;
+  memset(&pool, 0, sizeof(pool));
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  tt_int_op(sam3SessionPoolCreate(&pool, NULL, "127.0.0.1", fakesamPort(fs),
+                                  3, NULL, SAM3_SESSION_PRIMARY,
+                                  EdDSA_SHA512_Ed25519, NULL),
+            <, 0);
+  // first member fails; the rest share the destination of the second
+  fakesamFailNextCreate(fs, "I2P_ERROR");
+  tt_int_op(sam3SessionPoolCreate(&pool, NULL, "127.0.0.1", fakesamPort(fs),
+                                  3, NULL, SAM3_SESSION_STREAM,
+                                  EdDSA_SHA512_Ed25519, NULL),
+            ==, 2);
+  tt_assert(!pool.members[0].healthy);
+  tt_assert(pool.members[1].healthy && pool.members[2].healthy);
+  tt_str_op(pool.members[1].ses.privkey, ==, pool.members[2].ses.privkey);
+  // least outstanding: one stream each, never on the failed member
+  for (int f = 0; f < 2; ++f)
+    tt_assert(sam3SessionPoolConnect(&pool, fakesamPubKey(), 0, 0) != NULL);
+  tt_int_op(pool.members[0].connects, ==, 0);
+  tt_int_op(pool.members[1].connects, ==, 1);
+  tt_int_op(pool.members[2].connects, ==, 1);
+  // peer hash: same peer, same member
+  pool.policy = SAM3_POOL_PEER_HASH;
+  for (int f = 0; f < 2; ++f)
+    tt_assert(sam3SessionPoolConnect(&pool, fakesamPubKey(), 0, 0) != NULL);
+  hashed = (pool.members[1].connects == 3 ? 1 : 2);
+  tt_int_op(pool.members[hashed].connects, ==, 3);
+  // peer errors are returned at once
+  tt_assert(sam3SessionPoolConnect(&pool, "nokey", 0, 0) == NULL);
+  tt_str_op(pool.error, ==, "INVALID_KEY");
+  tt_int_op(pool.members[hashed].failures, ==, 1);
+  tt_int_op(pool.members[3 - hashed].failures, ==, 0);
+  tt_assert(pool.members[hashed].healthy);
+  // bridge forgot the sessions: every member is tried and marked
+  fakesamDropSessions(fs);
+  tt_assert(sam3SessionPoolConnect(&pool, fakesamPubKey(), 0, 0) == NULL);
+  tt_str_op(pool.error, ==, "INVALID_ID");
+  for (int f = 1; f < 3; ++f)
+    tt_assert(!pool.members[f].healthy);
+  tt_int_op(pool.members[hashed].failures, ==, 2);
+  tt_int_op(pool.members[3 - hashed].failures, ==, 1);
+  tt_assert(sam3SessionPoolConnect(&pool, fakesamPubKey(), 0, 0) == NULL);
+  tt_str_op(pool.error, ==, "NO_SESSION");
+  sam3SessionPoolClose(&pool);
+  tt_int_op(pool.count, ==, 0);
+  // datagrams are spread too
+  tt_int_op(sam3SessionPoolCreate(&pool, NULL, "127.0.0.1", fakesamPort(fs),
+                                  2, fakesamPrivKey(), SAM3_SESSION_DGRAM,
+                                  EdDSA_SHA512_Ed25519, NULL),
+            ==, 2);
+  for (int f = 0; f < 2; ++f)
+    tt_int_op(sam3SessionPoolDatagramSend(&pool, fakesamPubKey(), "dg", 2),
+              ==, 0);
+  tt_int_op(pool.members[0].datagrams, ==, 1);
+  tt_int_op(pool.members[1].datagrams, ==, 1);
+
+end:
+  sam3SessionPoolClose(&pool);
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+void test_sam3_supervisor(void *data) {
+  Sam3Supervisor sv;
+  Sam3BridgeSet down;
+  Sam3Session ses;
+  FakeSam *fs = NULL;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  struct pollfd pfd;
+  struct stat in;
+  int lsn = -1, dead = -1, port;
+  //
+  (void)data;
+  memset(&sv, 0, sizeof(sv));
+  memset(&down, 0, sizeof(down));
+  memset(&ses, 0, sizeof(ses));
+  ses.fd = ses.fwd_fd = -1;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  tt_assert((port = deadPort(&dead)) > 0);
+  tt_int_op(sam3BridgeSetAdd(&down, "127.0.0.1", port, 1), ==, 0);
+  // forwarding target; nobody has to accept for the test
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  tt_assert((lsn = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+  tt_assert(bind(lsn, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+            listen(lsn, 4) == 0 &&
+            getsockname(lsn, (struct sockaddr *)&addr, &len) == 0);
+  sv.mindelayms = 1;
+  sv.maxdelayms = 4;
+  sv.fwdhost = "127.0.0.1";
+  sv.fwdport = ntohs(addr.sin_port);
+  tt_int_op(sam3SupervisorReconnect(&sv, &ses, NULL, "127.0.0.1",
+                                    fakesamPort(fs), NULL),
+            <, 0); // nothing to reconnect
+  tt_int_op(sam3CreateSession(&ses, "127.0.0.1", fakesamPort(fs), NULL,
+                              SAM3_SESSION_STREAM, EdDSA_SHA512_Ed25519,
+                              NULL),
+            ==, 0);
+  // router restart
+  fakesamDropSessions(fs);
+  tt_assert(sam3StreamConnect(&ses, fakesamPubKey()) == NULL);
+  tt_assert(sam3SessionLost(&ses));
+  tt_int_op(sam3SupervisorReconnect(&sv, &ses, NULL, "127.0.0.1",
+                                    fakesamPort(fs), NULL),
+            ==, 0);
+  tt_int_op(sv.reconnects, ==, 1);
+  tt_int_op(sv.failures, ==, 0);
+  tt_str_op(ses.privkey, ==, fakesamPrivKey());
+  tt_assert(fakesamHaveSession(fs, ses.channel));
+  tt_assert(sam3StreamConnect(&ses, fakesamPubKey()) != NULL);
+  // forwarding is back: bridge pushes a stream to it
+  tt_int_op(ses.fwd_fd, >=, 0);
+  pfd.fd = lsn;
+  pfd.events = POLLIN;
+  tt_int_op(poll(&pfd, 1, 5000), ==, 1);
+  // bridge gone for good: give up after maxattempts
+  sv.maxattempts = 2;
+  sv.bridge = 0;
+  tt_int_op(stdinKeep(&in), ==, 0);
+  tt_int_op(sam3SupervisorReconnect(&sv, &ses, &down, NULL, 0, NULL), <, 0);
+  tt_int_op(sv.failures, ==, 2);
+  tt_int_op(sv.reconnects, ==, 1);
+  tt_int_op(ses.fd, ==, -1);
+  tt_int_op(ses.fwd_fd, ==, -1);
+  // closing what is left spares fd 0
+  sam3CloseSession(&ses);
+  tt_assert(stdinKept(&in));
+
+end:
+  if (lsn >= 0)
+    close(lsn);
+  if (dead >= 0)
+    close(dead);
+  sam3CloseSession(&ses);
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+void test_sam3_ping(void *data) {
+  Sam3Session ses, sub, dg;
+  FakeSam *fs = NULL;
+  struct timeval tv;
+  socklen_t len = sizeof(tv);
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  ses.fd = ses.fwd_fd = -1;
+  sub = dg = ses;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  tt_int_op(sam3CreateSession(&ses, "127.0.0.1", fakesamPort(fs), NULL,
+                              SAM3_SESSION_STREAM, EdDSA_SHA512_Ed25519,
+                              NULL),
+            ==, 0);
+  // caller's receive timeout survives the ping
+  tv.tv_sec = 1;
+  tv.tv_usec = 500000;
+  tt_assert(setsockopt(ses.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ==
+            0);
+  tt_int_op(sam3Ping(&ses, 2000), >=, 0);
+  tt_assert(getsockopt(ses.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, &len) == 0);
+  tt_int_op(tv.tv_sec, ==, 1);
+  tt_int_op(tv.tv_usec / 100000, ==, 5);
+  // silent bridge
+  fakesamSetPong(fs, 0);
+  tt_int_op(sam3Ping(&ses, 50), <, 0);
+  tt_str_op(ses.error, ==, "PING_TIMEOUT");
+  tt_assert(getsockopt(ses.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, &len) == 0);
+  tt_int_op(tv.tv_sec, ==, 1);
+  fakesamSetPong(fs, 1);
+  // late PONG of the timed out ping is dropped
+  tt_int_op(sam3Ping(&ses, 2000), >=, 0);
+  sam3CloseSession(&ses);
+  // datagrams share control connection of a DGRAM session
+  tt_int_op(sam3CreateSession(&dg, "127.0.0.1", fakesamPort(fs), NULL,
+                              SAM3_SESSION_DGRAM, EdDSA_SHA512_Ed25519, NULL),
+            ==, 0);
+  tt_int_op(sam3Ping(&dg, 2000), <, 0);
+  tt_str_op(dg.error, ==, "INVALID_SESSION_TYPE");
+  sam3CloseSession(&dg);
+  // subsessions ping over the one of their PRIMARY session
+  tt_int_op(sam3CreateSession(&ses, "127.0.0.1", fakesamPort(fs), NULL,
+                              SAM3_SESSION_PRIMARY, EdDSA_SHA512_Ed25519,
+                              NULL),
+            ==, 0);
+  tt_int_op(sam3AddSubsession(&ses, &sub, SAM3_SESSION_STREAM, 80, NULL), ==,
+            0);
+  tt_int_op(sam3Ping(&sub, 2000), >=, 0);
+  tt_int_op(sam3Ping(&ses, 2000), >=, 0);
+
+end:
+  sam3CloseSession(&sub);
+  sam3CloseSession(&dg);
+  sam3CloseSession(&ses);
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+struct testcase_t sam3_tests[] = {{
+                                      "subsessions",
+                                      test_sam3_subsessions,
+                                  },
+                                  {
+                                      "accept_error",
+                                      test_sam3_accept_error,
+                                  },
+                                  {
+                                      "accept_dispatch",
+                                      test_sam3_accept_dispatch,
+                                  },
+                                  {
+                                      "relay",
+                                      test_sam3_relay,
+                                  },
+                                  {
+                                      "handover",
+                                      test_sam3_handover,
+                                  },
+                                  {
+                                      "bridges",
+                                      test_sam3_bridges,
+                                  },
+                                  {
+                                      "session_pool",
+                                      test_sam3_session_pool,
+                                  },
+                                  {
+                                      "supervisor",
+                                      test_sam3_supervisor,
+                                  },
+                                  {
+                                      "ping",
+                                      test_sam3_ping,
+                                  },
+                                  END_OF_TESTCASES};
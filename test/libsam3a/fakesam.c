@@ -0,0 +1,628 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+#include "fakesam.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// session created or added on the bridge
+typedef struct FakeSamSes {
+  struct FakeSamSes *next;
+  char id[128];
+  int primary;            // STYLE=PRIMARY: only carries subsessions
+  struct sockaddr_in fwd; // PORT/HOST of datagram sessions
+  int ctl;                // dup of its control connection (number stays ours)
+} FakeSamSes;
+
+struct FakeSam {
+  int fd;
+  int port;
+  pthread_t thread;
+  FakeSamStreamFn onStream;
+  void *udata;
+  const char *greeting; // sent along with last stream handshake line
+  int fwdCount;         // streams pushed to STREAM FORWARD target
+  // datagram echo
+  int udpfd;
+  pthread_t udpThread;
+  pthread_mutex_t lock;
+  FakeSamSes *sessions; // guarded by lock
+  // stream ports; guarded by lock
+  int inPorts[16]; // TO_PORT of inbound streams, round robin
+  int inPortCount;
+  int inPortNext;
+  int lastToPort; // of last STREAM CONNECT
+  int noPong;     // PINGs go unanswered; guarded by lock
+  // injected failures; guarded by lock
+  const char *createError; // RESULT of next SESSION CREATE
+  const char *addError;    // RESULT of next SESSION ADD
+  const char *acceptError; // RESULT sent instead of accepted peer
+};
+
+typedef struct {
+  FakeSam *fs;
+  FakeSamStreamFn onStream;
+  void *udata;
+  const char *greeting; // copied, bridge may be stopped while stream runs
+  int fwdCount;
+  int fd;
+  int primary; // created PRIMARY session on this connection
+} FakeSamConn;
+
+typedef struct {
+  FakeSamStreamFn onStream;
+  void *udata;
+  const char *greeting;
+  int toPort;
+  struct sockaddr_in to;
+} FakeSamForward;
+
+static char privkey[884 + 1];
+static char pubkey[516 + 1];
+
+static void initKeys(void) {
+  if (!privkey[0]) {
+    memset(privkey, 'A', sizeof(privkey) - 1);
+    memset(pubkey, 'B', sizeof(pubkey) - 1);
+  }
+}
+
+const char *fakesamPrivKey(void) {
+  initKeys();
+  return privkey;
+}
+
+const char *fakesamPubKey(void) {
+  initKeys();
+  return pubkey;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// <0: error or EOF; 0: ok
+static int readLine(int fd, char *dest, size_t maxSize) {
+  size_t len = 0;
+  //
+  while (len + 1 < maxSize) {
+    ssize_t rd = recv(fd, dest + len, 1, 0);
+    //
+    if (rd < 0 && errno == EINTR)
+      continue;
+    if (rd <= 0)
+      return -1;
+    if (dest[len] == '\n') {
+      dest[len] = 0;
+      return 0;
+    }
+    ++len;
+  }
+  return -1;
+}
+
+static int sendStr(int fd, const char *str) {
+  size_t len = strlen(str);
+  //
+  while (len > 0) {
+    ssize_t wr = send(fd, str, len, MSG_NOSIGNAL);
+    //
+    if (wr < 0 && errno == EINTR)
+      continue;
+    if (wr <= 0)
+      return -1;
+    str += wr;
+    len -= wr;
+  }
+  return 0;
+}
+
+// copy value of 'NAME=' field to 'dest'
+static void findField(const char *line, const char *name, char *dest,
+                      size_t maxSize) {
+  const char *p = strstr(line, name);
+  size_t len = 0;
+  //
+  if (p != NULL) {
+    for (p += strlen(name); *p && *p != ' ' && len + 1 < maxSize; ++p)
+      dest[len++] = *p;
+  }
+  dest[len] = 0;
+}
+
+// SESSION CREATE/ADD; <0: ID is taken
+static int sesAdd(FakeSam *fs, const char *line, int primary, int ctl) {
+  FakeSamSes *ss = calloc(1, sizeof(FakeSamSes));
+  char port[16], host[64];
+  int res = 0;
+  //
+  if (ss == NULL)
+    return -1;
+  if ((ss->ctl = dup(ctl)) < 0) {
+    free(ss);
+    return -1;
+  }
+  findField(line, " ID=", ss->id, sizeof(ss->id));
+  findField(line, " PORT=", port, sizeof(port));
+  findField(line, " HOST=", host, sizeof(host));
+  ss->primary = primary;
+  if (port[0] && host[0]) {
+    ss->fwd.sin_family = AF_INET;
+    ss->fwd.sin_port = htons(atoi(port));
+    inet_pton(AF_INET, host, &ss->fwd.sin_addr);
+  }
+  pthread_mutex_lock(&fs->lock);
+  for (FakeSamSes *p = fs->sessions; p != NULL; p = p->next)
+    if (strcmp(p->id, ss->id) == 0)
+      res = -1;
+  if (res == 0) {
+    ss->next = fs->sessions;
+    fs->sessions = ss;
+  }
+  pthread_mutex_unlock(&fs->lock);
+  if (res < 0) {
+    close(ss->ctl);
+    free(ss);
+  }
+  return res;
+}
+
+// <0: no such session
+static int sesRemove(FakeSam *fs, const char *id) {
+  int res = -1;
+  //
+  pthread_mutex_lock(&fs->lock);
+  for (FakeSamSes **pp = &fs->sessions; *pp != NULL; pp = &(*pp)->next) {
+    if (strcmp((*pp)->id, id) == 0) {
+      FakeSamSes *ss = *pp;
+      //
+      *pp = ss->next;
+      close(ss->ctl);
+      free(ss);
+      res = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fs->lock);
+  return res;
+}
+
+// returns bool: stream or datagram session 'id' exists; 'fwd' can be NULL
+static int sesFind(FakeSam *fs, const char *id, struct sockaddr_in *fwd) {
+  int res = 0;
+  //
+  pthread_mutex_lock(&fs->lock);
+  for (FakeSamSes *p = fs->sessions; p != NULL; p = p->next) {
+    if (strcmp(p->id, id) == 0 && !p->primary) {
+      if (fwd != NULL)
+        *fwd = p->fwd;
+      res = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fs->lock);
+  return res;
+}
+
+// TO_PORT for next inbound stream
+static int nextInPort(FakeSam *fs) {
+  int port = 0;
+  //
+  pthread_mutex_lock(&fs->lock);
+  if (fs->inPortCount > 0)
+    port = fs->inPorts[fs->inPortNext++ % fs->inPortCount];
+  pthread_mutex_unlock(&fs->lock);
+  return port;
+}
+
+// one inbound stream pushed to forward target
+static void *forwardThread(void *arg) {
+  FakeSamForward *ff = (FakeSamForward *)arg;
+  const char *greeting = (ff->greeting ? ff->greeting : "");
+  char head[8192];
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  //
+  snprintf(head, sizeof(head), "%s FROM_PORT=0 TO_PORT=%d\n%s",
+           fakesamPubKey(), ff->toPort, greeting);
+  if (fd >= 0 &&
+      connect(fd, (struct sockaddr *)&ff->to, sizeof(ff->to)) == 0 &&
+      sendStr(fd, head) == 0 && ff->onStream != NULL)
+    ff->onStream(fd, ff->udata);
+  if (fd >= 0)
+    close(fd);
+  free(ff);
+  return NULL;
+}
+
+static void startForward(const FakeSamConn *fc, const char *line) {
+  char port[16], host[64];
+  //
+  findField(line, " PORT=", port, sizeof(port));
+  findField(line, " HOST=", host, sizeof(host));
+  for (int f = 0; f < fc->fwdCount; ++f) {
+    FakeSamForward *ff = calloc(1, sizeof(FakeSamForward));
+    pthread_t thr;
+    //
+    if (ff == NULL)
+      return;
+    ff->onStream = fc->onStream;
+    ff->udata = fc->udata;
+    ff->greeting = fc->greeting;
+    ff->toPort = nextInPort(fc->fs);
+    ff->to.sin_family = AF_INET;
+    ff->to.sin_port = htons(atoi(port));
+    inet_pton(AF_INET, host, &ff->to.sin_addr);
+    if (pthread_create(&thr, NULL, forwardThread, ff) != 0) {
+      free(ff);
+      return;
+    }
+    pthread_detach(thr);
+  }
+}
+
+static void *connThread(void *arg) {
+  FakeSamConn *fc = (FakeSamConn *)arg;
+  char line[8192], reply[8192], id[128];
+  //
+  while (readLine(fc->fd, line, sizeof(line)) == 0) {
+    findField(line, " ID=", id, sizeof(id));
+    if (strncmp(line, "HELLO VERSION", 13) == 0) {
+      char ver[16];
+      //
+      findField(line, "MAX=", ver, sizeof(ver));
+      snprintf(reply, sizeof(reply), "HELLO REPLY RESULT=OK VERSION=%s\n",
+               (ver[0] ? ver : "3.0"));
+    } else if (strncmp(line, "SESSION CREATE", 14) == 0) {
+      const char *inj;
+      //
+      pthread_mutex_lock(&fc->fs->lock);
+      inj = fc->fs->createError;
+      fc->fs->createError = NULL;
+      pthread_mutex_unlock(&fc->fs->lock);
+      fc->primary = (strstr(line, " STYLE=PRIMARY") != NULL);
+      if (inj != NULL)
+        snprintf(reply, sizeof(reply), "SESSION STATUS RESULT=%s\n", inj);
+      else if (sesAdd(fc->fs, line, fc->primary, fc->fd) < 0)
+        snprintf(reply, sizeof(reply),
+                 "SESSION STATUS RESULT=DUPLICATED_ID\n");
+      else
+        snprintf(reply, sizeof(reply),
+                 "SESSION STATUS RESULT=OK DESTINATION=%s\n",
+                 fakesamPrivKey());
+    } else if (strncmp(line, "SESSION ADD", 11) == 0 ||
+               strncmp(line, "SESSION REMOVE", 14) == 0) {
+      const char *res = "OK", *inj = NULL;
+      //
+      if (line[8] == 'A') {
+        pthread_mutex_lock(&fc->fs->lock);
+        inj = fc->fs->addError;
+        fc->fs->addError = NULL;
+        pthread_mutex_unlock(&fc->fs->lock);
+      }
+      if (!fc->primary)
+        res = "I2P_ERROR";
+      else if (inj != NULL)
+        res = inj;
+      else if (line[8] == 'A' && sesAdd(fc->fs, line, 0, fc->fd) < 0)
+        res = "DUPLICATED_ID";
+      else if (line[8] == 'R' && sesRemove(fc->fs, id) < 0)
+        res = "INVALID_ID";
+      snprintf(reply, sizeof(reply), "SESSION STATUS RESULT=%s ID=%s\n", res,
+               id);
+    } else if (strncmp(line, "NAMING LOOKUP", 13) == 0) {
+      char name[4096];
+      //
+      findField(line, "NAME=", name, sizeof(name));
+      snprintf(reply, sizeof(reply),
+               "NAMING REPLY RESULT=OK NAME=%s VALUE=%s\n", name,
+               fakesamPubKey());
+    } else if (strncmp(line, "PING", 4) == 0) {
+      int mute;
+      //
+      pthread_mutex_lock(&fc->fs->lock);
+      mute = fc->fs->noPong;
+      pthread_mutex_unlock(&fc->fs->lock);
+      if (mute)
+        continue;
+      snprintf(reply, sizeof(reply), "PONG%.64s\n", line + 4);
+    } else if (strncmp(line, "DEST GENERATE", 13) == 0) {
+      snprintf(reply, sizeof(reply), "DEST REPLY PUB=%s PRIV=%s\n",
+               fakesamPubKey(), fakesamPrivKey());
+    } else if (strncmp(line, "STREAM ", 7) == 0 &&
+               !sesFind(fc->fs, id, NULL)) {
+      snprintf(reply, sizeof(reply), "STREAM STATUS RESULT=INVALID_ID\n");
+    } else if (strncmp(line, "STREAM FORWARD", 14) == 0) {
+      // control socket stays open until the library closes it
+      if (sendStr(fc->fd, "STREAM STATUS RESULT=OK\n") < 0)
+        break;
+      startForward(fc, line);
+      continue;
+    } else if (strncmp(line, "STREAM CONNECT", 14) == 0 ||
+               strncmp(line, "STREAM ACCEPT", 13) == 0) {
+      const char *greeting = (fc->greeting ? fc->greeting : "");
+      //
+      const char *aerr;
+      //
+      pthread_mutex_lock(&fc->fs->lock);
+      aerr = fc->fs->acceptError;
+      pthread_mutex_unlock(&fc->fs->lock);
+      if (line[7] == 'A' && aerr != NULL) {
+        // accept went through, no peer came
+        snprintf(reply, sizeof(reply),
+                 "STREAM STATUS RESULT=OK\nSTREAM STATUS RESULT=%s\n", aerr);
+        sendStr(fc->fd, reply);
+        break;
+      } else if (line[7] == 'A') {
+        snprintf(reply, sizeof(reply),
+                 "STREAM STATUS RESULT=OK\n%s FROM_PORT=0 TO_PORT=%d\n%s",
+                 fakesamPubKey(), nextInPort(fc->fs), greeting);
+      } else {
+        char port[16];
+        //
+        findField(line, " TO_PORT=", port, sizeof(port));
+        pthread_mutex_lock(&fc->fs->lock);
+        fc->fs->lastToPort = atoi(port);
+        pthread_mutex_unlock(&fc->fs->lock);
+        snprintf(reply, sizeof(reply), "STREAM STATUS RESULT=OK\n%s",
+                 greeting);
+      }
+      if (sendStr(fc->fd, reply) < 0)
+        break;
+      if (fc->onStream != NULL)
+        fc->onStream(fc->fd, fc->udata);
+      break;
+    } else {
+      break; // unknown command
+    }
+    if (sendStr(fc->fd, reply) < 0)
+      break;
+  }
+  close(fc->fd);
+  free(fc);
+  return NULL;
+}
+
+static void *acceptThread(void *arg) {
+  FakeSam *fs = (FakeSam *)arg;
+  //
+  for (;;) {
+    FakeSamConn *fc;
+    pthread_t thr;
+    int fd = accept(fs->fd, NULL, NULL);
+    //
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      break; // listener closed
+    }
+    if ((fc = malloc(sizeof(FakeSamConn))) == NULL) {
+      close(fd);
+      continue;
+    }
+    fc->fs = fs;
+    fc->onStream = fs->onStream;
+    fc->udata = fs->udata;
+    fc->greeting = fs->greeting;
+    fc->fwdCount = fs->fwdCount;
+    fc->fd = fd;
+    fc->primary = 0;
+    if (pthread_create(&thr, NULL, connThread, fc) != 0) {
+      close(fd);
+      free(fc);
+      continue;
+    }
+    pthread_detach(thr);
+  }
+  return NULL;
+}
+
+// "3.0 <id> <dest>\n<payload>" -> "<our pubkey>\n<payload>" to PORT/HOST of
+// session <id>
+static void *udpThread(void *arg) {
+  FakeSam *fs = (FakeSam *)arg;
+  static char buf[65536], out[65536];
+  //
+  for (;;) {
+    struct sockaddr_in fwd;
+    ssize_t rd = recv(fs->udpfd, buf, sizeof(buf) - 1, 0);
+    char *nl, *sp, id[128];
+    size_t hlen;
+    //
+    if (rd < 0 && errno == EINTR)
+      continue;
+    if (rd <= 0)
+      break; // socket shut down
+    if (strncmp(buf, "3.0 ", 4) != 0 || (nl = memchr(buf, '\n', rd)) == NULL)
+      continue;
+    if ((sp = memchr(buf + 4, ' ', nl - buf - 4)) == NULL ||
+        (size_t)(sp - buf - 4) >= sizeof(id))
+      continue;
+    memcpy(id, buf + 4, sp - buf - 4);
+    id[sp - buf - 4] = 0;
+    memset(&fwd, 0, sizeof(fwd));
+    if (!sesFind(fs, id, &fwd))
+      continue;
+    hlen = strlen(fakesamPubKey());
+    memcpy(out, fakesamPubKey(), hlen);
+    out[hlen++] = '\n';
+    memcpy(out + hlen, nl + 1, rd - (nl + 1 - buf));
+    if (fwd.sin_port != 0)
+      sendto(fs->udpfd, out, hlen + rd - (nl + 1 - buf), 0,
+             (struct sockaddr *)&fwd, sizeof(fwd));
+  }
+  return NULL;
+}
+
+static void udpStart(FakeSam *fs) {
+  struct sockaddr_in addr;
+  //
+  if ((fs->udpfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    return;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(7655);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fs->udpfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      pthread_create(&fs->udpThread, NULL, udpThread, fs) != 0) {
+    close(fs->udpfd);
+    fs->udpfd = -1;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+FakeSam *fakesamStart(FakeSamStreamFn onStream, void *udata) {
+  FakeSam *fs = calloc(1, sizeof(FakeSam));
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int val = 1;
+  //
+  if (fs == NULL)
+    return NULL;
+  fs->onStream = onStream;
+  fs->udata = udata;
+  fs->udpfd = -1;
+  fs->fwdCount = 1;
+  pthread_mutex_init(&fs->lock, NULL);
+  if ((fs->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    goto error;
+  setsockopt(fs->fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fs->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fs->fd, 64) < 0 ||
+      getsockname(fs->fd, (struct sockaddr *)&addr, &len) < 0)
+    goto error;
+  fs->port = ntohs(addr.sin_port);
+  if (pthread_create(&fs->thread, NULL, acceptThread, fs) != 0)
+    goto error;
+  udpStart(fs);
+  return fs;
+error:
+  if (fs->fd >= 0)
+    close(fs->fd);
+  free(fs);
+  return NULL;
+}
+
+int fakesamPort(const FakeSam *fs) { return fs->port; }
+
+int fakesamHaveUDP(const FakeSam *fs) { return (fs->udpfd >= 0); }
+
+int fakesamHaveSession(FakeSam *fs, const char *id) {
+  return sesFind(fs, id, NULL);
+}
+
+void fakesamSetGreeting(FakeSam *fs, const char *greeting) {
+  fs->greeting = greeting;
+}
+
+void fakesamSetForwardCount(FakeSam *fs, int count) { fs->fwdCount = count; }
+
+void fakesamSetInboundPorts(FakeSam *fs, const int *ports, int count) {
+  pthread_mutex_lock(&fs->lock);
+  fs->inPortCount = 0;
+  for (int f = 0; f < count && f < 16; ++f)
+    fs->inPorts[fs->inPortCount++] = ports[f];
+  fs->inPortNext = 0;
+  pthread_mutex_unlock(&fs->lock);
+}
+
+void fakesamSetPong(FakeSam *fs, int on) {
+  pthread_mutex_lock(&fs->lock);
+  fs->noPong = !on;
+  pthread_mutex_unlock(&fs->lock);
+}
+
+void fakesamFailNextCreate(FakeSam *fs, const char *result) {
+  pthread_mutex_lock(&fs->lock);
+  fs->createError = result;
+  pthread_mutex_unlock(&fs->lock);
+}
+
+void fakesamFailNextAdd(FakeSam *fs, const char *result) {
+  pthread_mutex_lock(&fs->lock);
+  fs->addError = result;
+  pthread_mutex_unlock(&fs->lock);
+}
+
+void fakesamSetAcceptError(FakeSam *fs, const char *result) {
+  pthread_mutex_lock(&fs->lock);
+  fs->acceptError = result;
+  pthread_mutex_unlock(&fs->lock);
+}
+
+void fakesamDropSessions(FakeSam *fs) {
+  pthread_mutex_lock(&fs->lock);
+  while (fs->sessions != NULL) {
+    FakeSamSes *ss = fs->sessions;
+    //
+    fs->sessions = ss->next;
+    shutdown(ss->ctl, SHUT_RDWR);
+    close(ss->ctl);
+    free(ss);
+  }
+  pthread_mutex_unlock(&fs->lock);
+}
+
+int fakesamLastToPort(FakeSam *fs) {
+  int port;
+  //
+  pthread_mutex_lock(&fs->lock);
+  port = fs->lastToPort;
+  pthread_mutex_unlock(&fs->lock);
+  return port;
+}
+
+void fakesamStop(FakeSam *fs) {
+  if (fs != NULL) {
+    shutdown(fs->fd, SHUT_RDWR);
+    close(fs->fd);
+    pthread_join(fs->thread, NULL);
+    if (fs->udpfd >= 0) {
+      shutdown(fs->udpfd, SHUT_RDWR);
+      pthread_join(fs->udpThread, NULL);
+      close(fs->udpfd);
+    }
+    // after connection threads that are done with the lock
+    pthread_mutex_lock(&fs->lock);
+    while (fs->sessions != NULL) {
+      FakeSamSes *ss = fs->sessions;
+      //
+      fs->sessions = ss->next;
+      close(ss->ctl);
+      free(ss);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    pthread_mutex_destroy(&fs->lock);
+    free(fs);
+  }
+}
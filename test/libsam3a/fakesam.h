@@ -0,0 +1,123 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+#ifndef FAKESAM_H
+#define FAKESAM_H
+
+/*
+ * minimal in-process SAM bridge for tests
+ * answers HELLO, SESSION CREATE/ADD/REMOVE, NAMING LOOKUP, PING and STREAM
+ * CONNECT/ACCEPT/FORWARD; every bridge connection is served by its own thread
+ * STREAM commands fail with INVALID_ID unless ID is a created or added
+ * non-PRIMARY session
+ * STREAM FORWARD pushes inbound streams to the target at once
+ * if UDP port 7655 is free, datagrams sent to it are echoed back to the
+ * PORT/HOST given when session ID from the datagram header was created
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct FakeSam FakeSam;
+
+/*
+ * called in bridge thread when stream is established
+ * 'fd' is blocking socket connected to library side; it is closed after
+ * return
+ */
+typedef void (*FakeSamStreamFn)(int fd, void *udata);
+
+/* returns NULL on error */
+extern FakeSam *fakesamStart(FakeSamStreamFn onStream, void *udata);
+
+/* TCP port bridge listens on (127.0.0.1) */
+extern int fakesamPort(const FakeSam *fs);
+
+/* returns bool: datagram echo is running */
+extern int fakesamHaveUDP(const FakeSam *fs);
+
+/* returns bool: non-PRIMARY session 'id' exists on the bridge */
+extern int fakesamHaveSession(FakeSam *fs, const char *id);
+
+/*
+ * stream data written in the same packet as the handshake reply (i.e. before
+ * onStream is called); 'greeting' must stay valid; set before connecting
+ */
+extern void fakesamSetGreeting(FakeSam *fs, const char *greeting);
+
+/*
+ * number of inbound streams pushed to every STREAM FORWARD target (1 by
+ * default); set before forwarding
+ */
+extern void fakesamSetForwardCount(FakeSam *fs, int count);
+
+/*
+ * TO_PORT given to inbound (accepted or forwarded) streams, in turn; up to
+ * 16 ports; 0 when none were set
+ */
+extern void fakesamSetInboundPorts(FakeSam *fs, const int *ports, int count);
+
+/* TO_PORT of the last STREAM CONNECT (0: none) */
+extern int fakesamLastToPort(FakeSam *fs);
+
+/* answer PING with PONG (on by default) */
+extern void fakesamSetPong(FakeSam *fs, int on);
+
+/*
+ * next SESSION CREATE fails with RESULT='result'; 'result' must stay valid
+ */
+extern void fakesamFailNextCreate(FakeSam *fs, const char *result);
+
+/*
+ * next SESSION ADD fails with RESULT='result' (e.g. "DUPLICATED_ID");
+ * 'result' must stay valid
+ */
+extern void fakesamFailNextAdd(FakeSam *fs, const char *result);
+
+/*
+ * STREAM ACCEPT is answered with OK and then with STATUS RESULT='result'
+ * instead of peer destination; NULL: accept normally (default)
+ */
+extern void fakesamSetAcceptError(FakeSam *fs, const char *result);
+
+/*
+ * drop every session and shut its control connection down, as a restarted
+ * router would; the bridge keeps running
+ */
+extern void fakesamDropSessions(FakeSam *fs);
+
+/* stop listening; doesn't wait for stream threads */
+extern void fakesamStop(FakeSam *fs);
+
+/* fake keys */
+extern const char *fakesamPrivKey(void);
+extern const char *fakesamPubKey(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,2661 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../../src/ext/tinytest.h"
+#include "../../src/ext/tinytest_macros.h"
+#include "../../src/libsam3a/libsam3a.h"
+#include "fakesam.h"
+
+#define STREAM_BYTES (4 * 1024 * 1024)
+#define ECHO_BYTES (256 * 1024)
+
+typedef struct {
+  int done;
+  int failed;
+  int64_t received;
+  int64_t queued;
+  uint64_t allocsBase;
+  int sendvCalls;
+  int freed;
+  int writable;
+  int pausedTicks;
+  int created;
+  int64_t tickRead; // bytes read in current tick
+  int64_t maxTickRead;
+  int64_t lastQueue; // send queue size after previous tick
+  int64_t maxTickWritten;
+  Sam3AConnection *conn;
+  Sam3AConnectionCallbacks *ccb;
+  void (*tick)(Sam3ASession *ses);
+} TestState;
+
+static unsigned char pattern[65536];
+
+static void initPattern(void) {
+  for (size_t f = 0; f < sizeof(pattern); ++f)
+    pattern[f] = (unsigned char)(f * 7 + 3);
+}
+
+static int checkPattern(int64_t pos, const void *buf, int bufsize) {
+  const unsigned char *b = (const unsigned char *)buf;
+  //
+  for (int f = 0; f < bufsize; ++f, ++pos)
+    if (b[f] != pattern[pos % sizeof(pattern)])
+      return 0;
+  return 1;
+}
+
+// drive session until 'st->done' is set; returns 0 on success
+static int runLoop(Sam3ASession *ses, TestState *st, int timeoutms) {
+  struct timeval start, now;
+  //
+  gettimeofday(&start, NULL);
+  while (!st->done && !st->failed) {
+    fd_set rds, wrs;
+    struct timeval tv = {0, 50000};
+    int maxfd;
+    //
+    gettimeofday(&now, NULL);
+    if (sam3atimeval2ms(&now) - sam3atimeval2ms(&start) > (uint64_t)timeoutms)
+      return -1;
+    FD_ZERO(&rds);
+    FD_ZERO(&wrs);
+    // maxfd is -1 when there is nothing to wait for (i.e. reading paused)
+    maxfd = sam3aAddSessionToFDS(ses, -1, &rds, &wrs);
+    if (select(maxfd + 1, &rds, &wrs, NULL, &tv) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    sam3aProcessSessionIO(ses, &rds, &wrs);
+    if (st->tick != NULL)
+      st->tick(ses);
+  }
+  return (st->failed ? -1 : 0);
+}
+
+static void scbError(Sam3ASession *ses) {
+  ((TestState *)ses->udata)->failed = 1;
+}
+
+static void scbCreated(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  Sam3AConnection *conn;
+  //
+  if ((conn = sam3aStreamConnect(ses, st->ccb, fakesamPubKey())) == NULL)
+    st->failed = 1;
+  else
+    conn->udata = st;
+  st->conn = conn;
+}
+
+static const Sam3ASessionCallbacks scb = {
+    .cbError = scbError,
+    .cbCreated = scbCreated,
+};
+
+static void ccbError(Sam3AConnection *ct) {
+  ((TestState *)ct->udata)->failed = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// bridge side: write STREAM_BYTES of pattern and close
+static void bulkWriter(int fd, void *udata) {
+  int64_t pos = 0;
+  //
+  (void)udata;
+  while (pos < STREAM_BYTES) {
+    int chunk = 4096 - (int)(pos % 4096);
+    ssize_t wr = send(fd, pattern + (pos % sizeof(pattern)), chunk, 0);
+    //
+    if (wr <= 0)
+      break;
+    pos += wr;
+  }
+}
+
+static void rdRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  if (!checkPattern(st->received, buf, bufsize))
+    st->failed = 1;
+  if (st->received == 0)
+    st->allocsBase = ct->ses->pool.allocs; // read buffer is allocated now
+  st->received += bufsize;
+}
+
+static void rdDisconnected(Sam3AConnection *ct) {
+  ((TestState *)ct->udata)->done = 1;
+}
+
+void test_aio_read_pool(void *data) {
+  Sam3AConnectionCallbacks ccb = {
+      .cbError = ccbError,
+      .cbDisconnected = rdDisconnected,
+      .cbRead = rdRead,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  initPattern();
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  st.ccb = &ccb;
+  tt_assert((fs = fakesamStart(bulkWriter, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &scb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(st.received, ==, STREAM_BYTES);
+  // no allocations while reading in steady state
+  tt_int_op(ses.pool.allocs, ==, st.allocsBase);
+  tt_int_op(ses.pool.readFreeCount, ==, 1);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// bridge side: echo everything back
+static void echoer(int fd, void *udata) {
+  char buf[8192];
+  ssize_t rd;
+  //
+  (void)udata;
+  while ((rd = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    for (ssize_t pos = 0; pos < rd;) {
+      ssize_t wr = send(fd, buf + pos, rd - pos, MSG_NOSIGNAL);
+      //
+      if (wr <= 0)
+        return;
+      pos += wr;
+    }
+  }
+}
+
+static void freeCounter(void *udata) { ++((TestState *)udata)->freed; }
+
+static void echoSent(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  // alternate copied and referenced chunks of odd sizes
+  while (st->queued < ECHO_BYTES) {
+    int64_t pos = st->queued;
+    int chunk = 1000 + (int)(pos % 7000);
+    int res;
+    //
+    if (chunk > ECHO_BYTES - pos)
+      chunk = ECHO_BYTES - pos;
+    // don't wrap around the end of pattern
+    if (chunk > (int)(sizeof(pattern) - pos % sizeof(pattern)))
+      chunk = (int)(sizeof(pattern) - pos % sizeof(pattern));
+    if ((pos / 1000) % 2) {
+      struct iovec iov[2];
+      int half = chunk / 2;
+      //
+      iov[0].iov_base = pattern + pos % sizeof(pattern);
+      iov[0].iov_len = half;
+      iov[1].iov_base = pattern + (pos + half) % sizeof(pattern);
+      iov[1].iov_len = chunk - half;
+      if ((res = sam3aSendv(ct, iov, 2, freeCounter, st)) == 0)
+        ++st->sendvCalls;
+    } else {
+      res = sam3aSend(ct, pattern + pos % sizeof(pattern), chunk);
+    }
+    if (res == SAM3A_SEND_FULL)
+      return; // wait for next cbSent()
+    if (res < 0) {
+      st->failed = 1;
+      return;
+    }
+    st->queued += chunk;
+  }
+}
+
+static void echoRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  if (!checkPattern(st->received, buf, bufsize))
+    st->failed = 1;
+  if ((st->received += bufsize) == ECHO_BYTES)
+    st->done = 1;
+}
+
+static void echoConnected(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  sam3aSetSendQueueLimit(ct, 32768);
+  // the queue is empty, so one oversized chunk is accepted
+  if (sam3aSend(ct, pattern, 40000) != 0 ||
+      sam3aSend(ct, pattern, 1) != SAM3A_SEND_FULL ||
+      sam3aSendQueueSize(ct) != 40000)
+    st->failed = 1;
+  st->queued = 40000;
+}
+
+void test_aio_send_queue(void *data) {
+  Sam3AConnectionCallbacks ccb = {
+      .cbError = ccbError,
+      .cbConnected = echoConnected,
+      .cbSent = echoSent,
+      .cbRead = echoRead,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  initPattern();
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  st.ccb = &ccb;
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &scb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(st.received, ==, ECHO_BYTES);
+  tt_assert(st.sendvCalls > 0);
+  tt_int_op(st.freed, ==, st.sendvCalls);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// push data while the queue is below high watermark
+static void wmFill(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  while (st->queued < ECHO_BYTES && sam3aIsWritable(ct)) {
+    int chunk = 4096;
+    //
+    if (chunk > ECHO_BYTES - st->queued)
+      chunk = ECHO_BYTES - st->queued;
+    if (sam3aSend(ct, pattern + st->queued % sizeof(pattern), chunk) < 0) {
+      st->failed = 1;
+      return;
+    }
+    st->queued += chunk;
+    // queue never grows much over high watermark
+    if (sam3aSendQueueSize(ct) >= 65536 + 4096)
+      st->failed = 1;
+  }
+}
+
+static void wmWritable(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  if (sam3aSendQueueSize(ct) > 16384)
+    st->failed = 1;
+  ++st->writable;
+  wmFill(ct);
+}
+
+static void wmConnected(Sam3AConnection *ct) {
+  sam3aSetWatermarks(ct, 16384, 65536);
+  wmFill(ct);
+}
+
+static void wmRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  if (sam3aIsReadPaused(ct))
+    st->failed = 1;
+  if (!checkPattern(st->received, buf, bufsize))
+    st->failed = 1;
+  if ((st->received += bufsize) == ECHO_BYTES)
+    st->done = 1;
+  else if (st->pausedTicks == 0)
+    sam3aPauseRead(ct); // once; tick resumes reading
+}
+
+static void wmTick(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  if (st->conn != NULL && sam3aIsReadPaused(st->conn) &&
+      ++st->pausedTicks == 5)
+    sam3aResumeRead(st->conn);
+}
+
+void test_aio_watermarks(void *data) {
+  Sam3AConnectionCallbacks ccb = {
+      .cbError = ccbError,
+      .cbConnected = wmConnected,
+      .cbRead = wmRead,
+      .cbWritable = wmWritable,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  initPattern();
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  st.ccb = &ccb;
+  st.tick = wmTick;
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &scb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(st.received, ==, ECHO_BYTES);
+  tt_assert(st.writable > 0);
+  tt_int_op(st.pausedTicks, ==, 5);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define DGRAM_COUNT (200)
+#define DGRAM_BURST (25) // keep loopback socket buffers from overflowing
+
+static void dgRead(Sam3ASession *ses, const void *buf, int bufsize) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  if (strcmp(ses->destkey, fakesamPubKey()) != 0 || bufsize != 100 ||
+      !checkPattern(0, buf, bufsize))
+    st->failed = 1;
+  if (++st->received == DGRAM_COUNT)
+    st->done = 1;
+}
+
+// send next burst once previous one was echoed
+static void dgTick(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  if (!st->created || st->queued == DGRAM_COUNT || st->received < st->queued)
+    return;
+  for (int f = 0; f < DGRAM_BURST; ++f) {
+    if (sam3aDatagramSend(ses, fakesamPubKey(), pattern, 100) != 0)
+      st->failed = 1;
+  }
+  st->queued += DGRAM_BURST;
+  // queue is full until it is flushed
+  if (sam3aDatagramSend(ses, fakesamPubKey(), pattern, 100) != SAM3A_SEND_FULL)
+    st->failed = 1;
+}
+
+static void dgCreated(Sam3ASession *ses) {
+  ((TestState *)ses->udata)->created = 1;
+  sam3aSetDatagramQueueLimit(ses, DGRAM_BURST);
+  dgTick(ses);
+}
+
+void test_aio_datagrams(void *data) {
+  Sam3ASessionCallbacks dscb = {
+      .cbError = scbError,
+      .cbCreated = dgCreated,
+      .cbDatagramRead = dgRead,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  initPattern();
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  st.tick = dgTick;
+  tt_assert((fs = fakesamStart(NULL, NULL)) != NULL);
+  if (!fakesamHaveUDP(fs))
+    tt_skip(); // UDP port 7655 is busy
+  tt_int_op(sam3aCreateSession(&ses, &dscb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_DGRAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(st.received, ==, DGRAM_COUNT);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void lookupDone(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  if (strcmp(ses->destkey, fakesamPubKey()) != 0)
+    st->failed = 1;
+  st->done = 1;
+}
+
+void test_aio_resolve(void *data) {
+  Sam3ASessionCallbacks lcb = {
+      .cbError = scbError,
+      .cbCreated = lookupDone,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  tt_assert((fs = fakesamStart(NULL, NULL)) != NULL);
+  // "127.1" is not taken by inet_pton(), but getaddrinfo() parses it
+  // without /etc/hosts or DNS; no other test looks it up
+  // first lookup goes through resolver thread
+  tt_int_op(sam3aNameLookup(&ses, &lcb, "127.1", fakesamPort(fs),
+                            "test.i2p"),
+            ==, 0);
+  tt_assert(ses.resolve != NULL);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_assert(ses.resolve == NULL);
+  sam3aCloseSession(&ses);
+  // second one is served from cache
+  memset(&st, 0, sizeof(st));
+  tt_int_op(sam3aNameLookup(&ses, &lcb, "127.1", fakesamPort(fs),
+                            "test.i2p"),
+            ==, 0);
+  tt_assert(ses.resolve == NULL);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  sam3aCloseSession(&ses);
+  // closing while lookup is in progress must not leak or crash
+  tt_int_op(sam3aNameLookup(&ses, &lcb, "127.0.1", fakesamPort(fs),
+                            "test.i2p"),
+            ==, 0);
+  tt_assert(ses.resolve != NULL);
+  sam3aCloseSession(&ses);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define REACTOR_THREADS (4)
+#define REACTOR_CONNS (8)
+
+typedef struct {
+  int64_t received;
+  pthread_t thread; // last thread cbRead() was called on
+  int failed;
+} ReactorConnState;
+
+static ReactorConnState rconns[REACTOR_CONNS];
+static int rdone, rfailed;
+
+static void rcbError(Sam3AConnection *ct) {
+  (void)ct;
+  __atomic_store_n(&rfailed, 1, __ATOMIC_RELAXED);
+}
+
+static void rcbRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  ReactorConnState *rc = (ReactorConnState *)ct->udata;
+  //
+  if (!checkPattern(rc->received, buf, bufsize))
+    rc->failed = 1;
+  rc->received += bufsize;
+  rc->thread = pthread_self();
+}
+
+static void rcbDisconnected(Sam3AConnection *ct) {
+  (void)ct;
+  __atomic_add_fetch(&rdone, 1, __ATOMIC_RELEASE);
+}
+
+static Sam3AConnectionCallbacks rccb = {
+    .cbError = rcbError,
+    .cbDisconnected = rcbDisconnected,
+    .cbRead = rcbRead,
+};
+
+static void rscbError(Sam3ASession *ses) {
+  (void)ses;
+  __atomic_store_n(&rfailed, 1, __ATOMIC_RELAXED);
+}
+
+// runs on session home shard
+static void rscbCreated(Sam3ASession *ses) {
+  for (int f = 0; f < REACTOR_CONNS; ++f) {
+    Sam3AConnection *conn = sam3aStreamConnect(ses, &rccb, fakesamPubKey());
+    //
+    if (conn == NULL) {
+      rscbError(ses);
+      return;
+    }
+    conn->udata = &rconns[f];
+  }
+}
+
+void test_aio_reactor(void *data) {
+  Sam3ASessionCallbacks rscb = {
+      .cbError = rscbError,
+      .cbCreated = rscbCreated,
+  };
+  Sam3ASession ses;
+  Sam3AReactor *r = NULL;
+  FakeSam *fs = NULL;
+  int threads = 0;
+  //
+  (void)data;
+  initPattern();
+  memset(&ses, 0, sizeof(ses));
+  memset(rconns, 0, sizeof(rconns));
+  rdone = rfailed = 0;
+  tt_assert((fs = fakesamStart(bulkWriter, NULL)) != NULL);
+  tt_assert((r = sam3aReactorCreate(REACTOR_THREADS)) != NULL);
+  tt_int_op(sam3aReactorThreads(r), ==, REACTOR_THREADS);
+  tt_int_op(sam3aCreateSession(&ses, &rscb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_STREAM),
+            ==, 0);
+  tt_int_op(sam3aReactorAddSession(r, &ses), ==, 0);
+  for (int f = 0; f < 1000; ++f) {
+    if (__atomic_load_n(&rdone, __ATOMIC_ACQUIRE) == REACTOR_CONNS ||
+        __atomic_load_n(&rfailed, __ATOMIC_RELAXED))
+      break;
+    usleep(10000);
+  }
+  sam3aReactorDestroy(r);
+  r = NULL;
+  tt_int_op(rfailed, ==, 0);
+  tt_int_op(rdone, ==, REACTOR_CONNS);
+  for (int f = 0; f < REACTOR_CONNS; ++f) {
+    int seen = 0;
+    //
+    tt_int_op(rconns[f].failed, ==, 0);
+    tt_int_op(rconns[f].received, ==, STREAM_BYTES);
+    for (int p = 0; p < f; ++p)
+      if (pthread_equal(rconns[p].thread, rconns[f].thread))
+        seen = 1;
+    threads += !seen;
+  }
+  // connections were spread over shards
+  tt_int_op(threads, >, 1);
+
+end:
+  sam3aReactorDestroy(r);
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+// shard blocks in cbRead() until released, so closes posted meanwhile stay
+// in its inbox when the reactor is destroyed
+static Sam3AConnection *lconn;
+static int lblocked, lrelease, ldestroyed;
+
+static void leftRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  (void)buf;
+  (void)bufsize;
+  if (__atomic_load_n(&lblocked, __ATOMIC_RELAXED))
+    return;
+  __atomic_store_n(&lconn, ct, __ATOMIC_RELEASE);
+  __atomic_store_n(&lblocked, 1, __ATOMIC_RELEASE);
+  while (!__atomic_load_n(&lrelease, __ATOMIC_ACQUIRE))
+    usleep(1000);
+}
+
+static void leftDestroy(Sam3AConnection *ct) {
+  (void)ct;
+  __atomic_add_fetch(&ldestroyed, 1, __ATOMIC_RELAXED);
+}
+
+static Sam3AConnectionCallbacks lccb = {
+    .cbError = rcbError,
+    .cbRead = leftRead,
+    .cbDestroy = leftDestroy,
+};
+
+static void leftCreated(Sam3ASession *ses) {
+  if (sam3aStreamConnect(ses, &lccb, fakesamPubKey()) == NULL)
+    rscbError(ses);
+}
+
+// bridge side: a few bytes, then wait for close
+static void leftWriter(int fd, void *udata) {
+  char buf[256] = {0};
+  //
+  (void)udata;
+  if (send(fd, buf, sizeof(buf), MSG_NOSIGNAL) > 0)
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+      ;
+}
+
+static void *leftReleaser(void *arg) {
+  (void)arg;
+  usleep(100000); // sam3aReactorDestroy() has set stop by now
+  __atomic_store_n(&lrelease, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+void test_aio_reactor_leftover(void *data) {
+  Sam3ASessionCallbacks lscb = {
+      .cbError = rscbError,
+      .cbCreated = leftCreated,
+  };
+  Sam3ASession ses;
+  Sam3AReactor *r = NULL;
+  FakeSam *fs = NULL;
+  pthread_t rel;
+  int relStarted = 0;
+  //
+  (void)data;
+  initPattern();
+  memset(&ses, 0, sizeof(ses));
+  lconn = NULL;
+  lblocked = lrelease = ldestroyed = rfailed = 0;
+  tt_assert((fs = fakesamStart(leftWriter, NULL)) != NULL);
+  tt_assert((r = sam3aReactorCreate(1)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &lscb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_STREAM),
+            ==, 0);
+  tt_int_op(sam3aReactorAddSession(r, &ses), ==, 0);
+  for (int f = 0; f < 1000 && !__atomic_load_n(&lblocked, __ATOMIC_ACQUIRE) &&
+                  !__atomic_load_n(&rfailed, __ATOMIC_RELAXED);
+       ++f)
+    usleep(10000);
+  tt_int_op(rfailed, ==, 0);
+  tt_assert(__atomic_load_n(&lblocked, __ATOMIC_ACQUIRE));
+  // shard is busy: this goes to its inbox
+  tt_int_op(sam3aCloseConnection(lconn), ==, 0);
+  tt_int_op(ldestroyed, ==, 0);
+  tt_int_op(pthread_create(&rel, NULL, leftReleaser, NULL), ==, 0);
+  relStarted = 1;
+  sam3aReactorDestroy(r);
+  r = NULL;
+  // the posted close was run, not dropped
+  tt_int_op(ldestroyed, ==, 1);
+  tt_assert(ses.connlist == NULL);
+
+end:
+  __atomic_store_n(&lrelease, 1, __ATOMIC_RELEASE);
+  if (relStarted)
+    pthread_join(rel, NULL);
+  sam3aReactorDestroy(r);
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define SUBMIT_WORKERS (4)
+#define SUBMIT_CHUNKS (64)
+#define SUBMIT_CHUNK (4096)
+
+typedef struct {
+  Sam3ASession *ses;
+  pthread_t thread;
+  int64_t received; // by loop thread
+  int failed;
+  int freed;        // atomic
+  int started;
+} SubmitWorker;
+
+static SubmitWorker workers[SUBMIT_WORKERS];
+static int submitDone; // atomic
+
+static void submitFreed(void *udata) {
+  SubmitWorker *w = (SubmitWorker *)((void **)udata)[0];
+  //
+  __atomic_add_fetch(&w->freed, 1, __ATOMIC_RELAXED);
+  free(udata);
+}
+
+static void sbRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  SubmitWorker *w = (SubmitWorker *)ct->udata;
+  //
+  if (!checkPattern(w->received, buf, bufsize))
+    w->failed = 1;
+  w->received += bufsize;
+  if (w->received == SUBMIT_CHUNKS * SUBMIT_CHUNK)
+    __atomic_add_fetch(&submitDone, 1, __ATOMIC_RELEASE);
+}
+
+static void sbError(Sam3AConnection *ct) {
+  ((SubmitWorker *)ct->udata)->failed = 1;
+}
+
+static Sam3AConnectionCallbacks sbcb = {
+    .cbError = sbError,
+    .cbRead = sbRead,
+};
+
+// connect and send everything without waiting for the loop
+static void *submitWorker(void *arg) {
+  SubmitWorker *w = (SubmitWorker *)arg;
+  Sam3AConnection *conn = sam3aSubmitConnect(w->ses, &sbcb, fakesamPubKey(), w);
+  //
+  if (conn == NULL) {
+    w->failed = 1;
+    return NULL;
+  }
+  for (int f = 0; f < SUBMIT_CHUNKS; ++f) {
+    // freecb gets whole allocation: worker pointer, then payload
+    void **buf = malloc(sizeof(void *) + SUBMIT_CHUNK);
+    //
+    if (buf == NULL) {
+      w->failed = 1;
+      return NULL;
+    }
+    buf[0] = w;
+    memcpy(buf + 1, pattern + (f * SUBMIT_CHUNK) % sizeof(pattern),
+           SUBMIT_CHUNK);
+    if (sam3aSubmitSend(conn, buf + 1, SUBMIT_CHUNK, submitFreed, buf) < 0) {
+      free(buf);
+      w->failed = 1;
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+static void submitStart(Sam3ASession *ses) {
+  for (int f = 0; f < SUBMIT_WORKERS; ++f) {
+    workers[f].ses = ses;
+    workers[f].started = (pthread_create(&workers[f].thread, NULL,
+                                         submitWorker, &workers[f]) == 0);
+  }
+}
+
+// returns bool: all workers did their job
+static int submitJoin(void) {
+  int ok = 1;
+  //
+  for (int f = 0; f < SUBMIT_WORKERS; ++f) {
+    if (!workers[f].started) {
+      ok = 0;
+      continue;
+    }
+    pthread_join(workers[f].thread, NULL);
+    workers[f].started = 0;
+    if (workers[f].failed ||
+        workers[f].received != SUBMIT_CHUNKS * SUBMIT_CHUNK ||
+        workers[f].freed != SUBMIT_CHUNKS)
+      ok = 0;
+  }
+  return ok;
+}
+
+static void submitTick(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  if (!st->created)
+    return;
+  if (!st->queued) {
+    st->queued = 1;
+    submitStart(ses);
+  }
+  if (__atomic_load_n(&submitDone, __ATOMIC_ACQUIRE) == SUBMIT_WORKERS)
+    st->done = 1;
+}
+
+static void submitCreated(Sam3ASession *ses) {
+  ((TestState *)ses->udata)->created = 1;
+}
+
+void test_aio_submit(void *data) {
+  Sam3ASessionCallbacks sscb = {
+      .cbError = scbError,
+      .cbCreated = submitCreated,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  initPattern();
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  memset(workers, 0, sizeof(workers));
+  submitDone = 0;
+  st.tick = submitTick;
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &sscb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_STREAM),
+            ==, 0);
+  tt_int_op(sam3aEnableSubmit(&ses), ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_assert(submitJoin());
+
+end:
+  submitJoin();
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+static void rsubmitCreated(Sam3ASession *ses) { submitStart(ses); }
+
+void test_aio_submit_reactor(void *data) {
+  Sam3ASessionCallbacks sscb = {
+      .cbError = rscbError,
+      .cbCreated = rsubmitCreated,
+  };
+  Sam3ASession ses;
+  Sam3AReactor *r = NULL;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  initPattern();
+  memset(&ses, 0, sizeof(ses));
+  memset(workers, 0, sizeof(workers));
+  submitDone = rfailed = 0;
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  tt_assert((r = sam3aReactorCreate(REACTOR_THREADS)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &sscb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_STREAM),
+            ==, 0);
+  tt_int_op(sam3aReactorAddSession(r, &ses), ==, 0);
+  for (int f = 0; f < 1000; ++f) {
+    if (__atomic_load_n(&submitDone, __ATOMIC_ACQUIRE) == SUBMIT_WORKERS ||
+        __atomic_load_n(&rfailed, __ATOMIC_RELAXED))
+      break;
+    usleep(10000);
+  }
+  sam3aReactorDestroy(r);
+  r = NULL;
+  tt_int_op(rfailed, ==, 0);
+  tt_assert(submitJoin());
+
+end:
+  sam3aReactorDestroy(r);
+  submitJoin();
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define CACHE_CONNS (100)
+
+static void cacheCreated(Sam3ASession *ses) {
+  ((TestState *)ses->udata)->done = 1;
+}
+
+// walk connection list checking back links; returns length or -1
+static int connListLength(const Sam3ASession *ses) {
+  int len = 0;
+  //
+  for (const Sam3AConnection *p = NULL, *c = ses->connlist; c != NULL;
+       p = c, c = c->next, ++len) {
+    if (c->prev != p)
+      return -1;
+  }
+  return len;
+}
+
+void test_aio_conn_cache(void *data) {
+  Sam3ASessionCallbacks ccscb = {
+      .cbError = scbError,
+      .cbCreated = cacheCreated,
+  };
+  Sam3AConnection *conns[CACHE_CONNS];
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  uint64_t allocs;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  tt_assert((fs = fakesamStart(NULL, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &ccscb, "127.0.0.1", fakesamPort(fs),
+                               NULL, SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  for (int f = 0; f < CACHE_CONNS; ++f)
+    tt_assert((conns[f] = sam3aStreamConnect(&ses, NULL, fakesamPubKey())) !=
+              NULL);
+  tt_int_op(connListLength(&ses), ==, CACHE_CONNS);
+  allocs = ses.connCache.allocs;
+  tt_int_op(allocs, ==,
+            (CACHE_CONNS + SAM3A_CONN_SLAB_SIZE - 1) / SAM3A_CONN_SLAB_SIZE);
+  // unlink from the middle, both ends and then reopen
+  for (int f = 0; f < CACHE_CONNS; f += 2)
+    sam3aCloseConnection(conns[f]);
+  tt_int_op(connListLength(&ses), ==, CACHE_CONNS / 2);
+  tt_int_op(ses.connCache.used, ==, CACHE_CONNS / 2);
+  for (int f = 0; f < CACHE_CONNS; f += 2)
+    tt_assert((conns[f] = sam3aStreamConnect(&ses, NULL, fakesamPubKey())) !=
+              NULL);
+  tt_int_op(connListLength(&ses), ==, CACHE_CONNS);
+  // closed connections were reused
+  tt_int_op(ses.connCache.allocs, ==, allocs);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define CLOSE_CONNS (3)
+
+static Sam3AConnection *closing[CLOSE_CONNS];
+static int closingUp, closedInRead;
+
+// bridge side: a few bytes, then hold until library closes
+static void closeWriter(int fd, void *udata) {
+  char buf[256];
+  //
+  (void)udata;
+  if (send(fd, "data", 4, MSG_NOSIGNAL) == 4)
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+      ;
+}
+
+static void closeConnected(Sam3AConnection *ct) {
+  if (++closingUp == CLOSE_CONNS)
+    ((TestState *)ct->udata)->done = 1;
+}
+
+static void closeRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  (void)buf;
+  (void)bufsize;
+  for (int f = 0; f < CLOSE_CONNS; ++f)
+    if (closing[f] == ct)
+      closing[f] = NULL;
+  ++closedInRead;
+  sam3aCloseConnection(ct);
+  // freed entry must look dead: nothing to close twice, no recv() on fd 0
+  sam3aCloseConnection(ct);
+}
+
+void test_aio_close_in_read(void *data) {
+  Sam3ASessionCallbacks ccscb = {
+      .cbError = scbError,
+      .cbCreated = cacheCreated,
+  };
+  Sam3AConnectionCallbacks ccb = {
+      .cbError = ccbError,
+      .cbConnected = closeConnected,
+      .cbRead = closeRead,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  struct stat in, now;
+  struct timeval tv = {0, 0};
+  fd_set rds, wrs;
+  int maxfd;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  closingUp = closedInRead = 0;
+  if (fstat(0, &in) < 0)
+    tt_int_op(open("/dev/null", O_RDONLY), ==, 0);
+  tt_int_op(fstat(0, &in), ==, 0);
+  tt_assert((fs = fakesamStart(closeWriter, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &ccscb, "127.0.0.1", fakesamPort(fs),
+                               NULL, SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  for (int f = 0; f < CLOSE_CONNS; ++f) {
+    tt_assert((closing[f] = sam3aStreamConnect(&ses, &ccb,
+                                               fakesamPubKey())) != NULL);
+    closing[f]->udata = &st;
+  }
+  st.done = 0;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  // once all are readable one pass must reach every connection, even when
+  // the one before it in the list closed itself
+  for (int f = 0; f < CLOSE_CONNS; ++f) {
+    struct pollfd pfd;
+    //
+    if (closing[f] == NULL)
+      continue; // data came with the handshake reply
+    pfd.fd = closing[f]->fd;
+    pfd.events = POLLIN;
+    tt_int_op(poll(&pfd, 1, 5000), ==, 1);
+  }
+  FD_ZERO(&rds);
+  FD_ZERO(&wrs);
+  maxfd = sam3aAddSessionToFDS(&ses, -1, &rds, &wrs);
+  tt_int_op(select(maxfd + 1, &rds, &wrs, NULL, &tv), >=, 0);
+  sam3aProcessSessionIO(&ses, &rds, &wrs);
+  tt_int_op(closedInRead, ==, CLOSE_CONNS);
+  tt_assert(ses.connlist == NULL);
+  tt_int_op(ses.connCache.used, ==, 0);
+  tt_int_op(fstat(0, &now), ==, 0);
+  tt_assert(now.st_dev == in.st_dev && now.st_ino == in.st_ino);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define LONG_NAME_SIZE (3000)
+#define GREETING "first bytes"
+
+static char greetBuf[64];
+
+static void greetRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  if (st->received + bufsize >= (int64_t)sizeof(greetBuf)) {
+    st->failed = 1;
+    return;
+  }
+  memcpy(greetBuf + st->received, buf, bufsize);
+  st->received += bufsize;
+}
+
+static void greetAccepted(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  if (st->received != 0 || strcmp(ct->destkey, fakesamPubKey()) != 0)
+    st->failed = 1;
+}
+
+static void greetCreated(Sam3ASession *ses) {
+  static Sam3AConnectionCallbacks gccb = {
+      .cbError = ccbError,
+      .cbAccepted = greetAccepted,
+      .cbRead = greetRead,
+      .cbDisconnected = rdDisconnected,
+  };
+  TestState *st = (TestState *)ses->udata;
+  //
+  if ((st->conn = sam3aStreamAccept(ses, &gccb)) == NULL)
+    st->failed = 1;
+  else
+    st->conn->udata = st;
+}
+
+void test_aio_line_reader(void *data) {
+  Sam3ASessionCallbacks lcb = {
+      .cbError = scbError,
+      .cbCreated = lookupDone,
+  };
+  Sam3ASessionCallbacks gscb = {
+      .cbError = scbError,
+      .cbCreated = greetCreated,
+  };
+  char name[LONG_NAME_SIZE + 1];
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  memset(greetBuf, 0, sizeof(greetBuf));
+  tt_assert((fs = fakesamStart(NULL, NULL)) != NULL);
+  fakesamSetGreeting(fs, GREETING);
+  // reply line is longer than old 2048 bytes limit
+  memset(name, 'n', LONG_NAME_SIZE);
+  strcpy(name + LONG_NAME_SIZE - 4, ".i2p");
+  tt_int_op(sam3aNameLookup(&ses, &lcb, "127.0.0.1", fakesamPort(fs), name),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  sam3aCloseSession(&ses);
+  // status, peer destination and stream data arrive in one packet
+  memset(&st, 0, sizeof(st));
+  tt_int_op(sam3aCreateSession(&ses, &gscb, "127.0.0.1", fakesamPort(fs),
+                               NULL, SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(st.received, ==, strlen(GREETING));
+  tt_str_op(greetBuf, ==, GREETING);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define READ_BUDGET (5000)
+#define WRITE_BUDGET (7000)
+
+static void budgetRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  ((TestState *)ct->udata)->tickRead += bufsize;
+  echoRead(ct, buf, bufsize);
+}
+
+static void budgetTick(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  int64_t queue;
+  //
+  if (st->conn == NULL || (queue = sam3aSendQueueSize(st->conn)) < 0)
+    return;
+  if (st->tickRead > st->maxTickRead)
+    st->maxTickRead = st->tickRead;
+  if (st->lastQueue - queue > st->maxTickWritten)
+    st->maxTickWritten = st->lastQueue - queue;
+  st->tickRead = 0;
+  st->lastQueue = queue;
+}
+
+void test_aio_io_budget(void *data) {
+  Sam3AConnectionCallbacks ccb = {
+      .cbError = ccbError,
+      .cbSent = echoSent,
+      .cbRead = budgetRead,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  initPattern();
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  st.ccb = &ccb;
+  st.tick = budgetTick;
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &scb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_STREAM),
+            ==, 0);
+  tt_int_op(sam3aSetIOBudget(&ses, READ_BUDGET, WRITE_BUDGET), ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(st.received, ==, ECHO_BYTES);
+  tt_assert(st.maxTickRead > 0);
+  tt_int_op(st.maxTickRead, <=, READ_BUDGET);
+  tt_assert(st.maxTickWritten > 0);
+  tt_int_op(st.maxTickWritten, <=, WRITE_BUDGET);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define LISTEN_BACKLOG (4)
+#define LISTEN_MAX (6)
+
+static Sam3AConnection *listened[LISTEN_MAX + 2];
+static int listenCount, listenTarget;
+static uint64_t listenUntil;
+
+// bridge side: hold stream open until library closes it
+static void holder(int fd, void *udata) {
+  char buf[256];
+  //
+  (void)udata;
+  while (recv(fd, buf, sizeof(buf), 0) > 0)
+    ;
+}
+
+static void lsAccepted(Sam3AConnection *ct) {
+  if (strcmp(ct->destkey, fakesamPubKey()) != 0 ||
+      listenCount >= LISTEN_MAX + 2) {
+    ((TestState *)ct->ses->udata)->failed = 1;
+    return;
+  }
+  listened[listenCount++] = ct;
+}
+
+static void lsError(Sam3AConnection *ct) {
+  ((TestState *)ct->ses->udata)->failed = 1;
+}
+
+static void lsCreated(Sam3ASession *ses) {
+  static const Sam3AConnectionCallbacks lccb = {
+      .cbError = lsError,
+      .cbAccepted = lsAccepted,
+  };
+  //
+  if (sam3aListen(ses, LISTEN_BACKLOG, &lccb, LISTEN_MAX) < 0)
+    ((TestState *)ses->udata)->failed = 1;
+}
+
+// wait for 'listenTarget' accepts, then a bit more to catch extra ones
+static void lsTick(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  struct timeval tv;
+  //
+  gettimeofday(&tv, NULL);
+  if (listenCount < listenTarget)
+    return;
+  if (listenUntil == 0)
+    listenUntil = sam3atimeval2ms(&tv) + 300;
+  else if (sam3atimeval2ms(&tv) >= listenUntil)
+    st->done = 1;
+}
+
+void test_aio_listen(void *data) {
+  Sam3ASessionCallbacks lscb = {
+      .cbError = scbError,
+      .cbCreated = lsCreated,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  listenCount = 0;
+  listenTarget = LISTEN_MAX;
+  listenUntil = 0;
+  st.tick = lsTick;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &lscb, "127.0.0.1", fakesamPort(fs),
+                               NULL, SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  // bridge accepts at once, so the pool keeps going up to the cap
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(listenCount, ==, LISTEN_MAX);
+  // closing accepted streams makes room for new ones
+  sam3aCloseConnection(listened[0]);
+  sam3aCloseConnection(listened[1]);
+  st.done = 0;
+  listenTarget = LISTEN_MAX + 2;
+  listenUntil = 0;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(listenCount, ==, LISTEN_MAX + 2);
+  tt_int_op(sam3aStopListen(&ses), ==, 0);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define WARM_SIZE (2)
+
+static void wpConnected(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->ses->udata;
+  //
+  if (ct != st->conn)
+    st->failed = 1;
+  else
+    st->created = 1;
+}
+
+static void wpCreated(Sam3ASession *ses) {
+  if (sam3aSetWarmPool(ses, WARM_SIZE) < 0)
+    ((TestState *)ses->udata)->failed = 1;
+}
+
+// connect once the pool is full; finish when stream is up and pool refilled
+static void wpTick(Sam3ASession *ses) {
+  static const Sam3AConnectionCallbacks wccb = {
+      .cbError = ccbError,
+      .cbConnected = wpConnected,
+  };
+  TestState *st = (TestState *)ses->udata;
+  //
+  if (sam3aWarmPoolReady(ses) != WARM_SIZE)
+    return;
+  if (st->conn == NULL) {
+    // idle sockets are not user connections
+    if (sam3aIsHaveActiveConnections(ses))
+      st->failed = 1;
+    st->conn = sam3aStreamConnectEx(ses, &wccb, fakesamPubKey(), -1);
+    // taken synchronously
+    if (st->conn == NULL || sam3aWarmPoolReady(ses) != WARM_SIZE - 1)
+      st->failed = 1;
+  } else if (st->created) {
+    st->done = 1;
+  }
+}
+
+void test_aio_warm_pool(void *data) {
+  Sam3ASessionCallbacks wscb = {
+      .cbError = scbError,
+      .cbCreated = wpCreated,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  st.tick = wpTick;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &wscb, "127.0.0.1", fakesamPort(fs),
+                               NULL, SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_assert(sam3aIsActiveConnection(st.conn));
+  tt_int_op(sam3aWarmPoolReady(&ses), ==, WARM_SIZE);
+  // disabling closes idle sockets but not user streams
+  tt_int_op(sam3aSetWarmPool(&ses, 0), ==, 0);
+  tt_int_op(sam3aWarmPoolReady(&ses), ==, 0);
+  tt_assert(sam3aIsActiveConnection(st.conn));
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define FORWARD_STREAMS (3)
+#define FORWARD_GREETING "greet"
+
+static Sam3AConnection *forwarded[FORWARD_STREAMS + 1];
+static int forwardCount, forwardUp;
+
+static void fwAccepted(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->ses->udata;
+  //
+  if (strcmp(ct->destkey, fakesamPubKey()) != 0 || ct == st->conn ||
+      forwardCount >= FORWARD_STREAMS) {
+    st->failed = 1;
+    return;
+  }
+  forwarded[forwardCount++] = ct;
+}
+
+// forward control connection
+static void fwConnected(Sam3AConnection *ct) {
+  if (ct != ((TestState *)ct->ses->udata)->conn)
+    ((TestState *)ct->ses->udata)->failed = 1;
+  forwardUp = 1;
+}
+
+static void fwRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  TestState *st = (TestState *)ct->ses->udata;
+  //
+  (void)buf;
+  st->received += bufsize;
+  if (forwardUp && forwardCount == FORWARD_STREAMS &&
+      st->received == FORWARD_STREAMS * strlen(FORWARD_GREETING))
+    st->done = 1;
+}
+
+static void fwCreated(Sam3ASession *ses) {
+  static const Sam3AConnectionCallbacks fccb = {
+      .cbError = ccbError,
+      .cbConnected = fwConnected,
+      .cbAccepted = fwAccepted,
+      .cbRead = fwRead,
+  };
+  TestState *st = (TestState *)ses->udata;
+  //
+  if ((st->conn = sam3aStreamForward(ses, &fccb)) == NULL)
+    st->failed = 1;
+}
+
+void test_aio_stream_forward(void *data) {
+  Sam3ASessionCallbacks fscb = {
+      .cbError = scbError,
+      .cbCreated = fwCreated,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  int left = 0;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  forwardCount = forwardUp = 0;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  fakesamSetForwardCount(fs, FORWARD_STREAMS);
+  fakesamSetGreeting(fs, FORWARD_GREETING);
+  tt_int_op(sam3aCreateSession(&ses, &fscb, "127.0.0.1", fakesamPort(fs),
+                               NULL, SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  // destination line is parsed, stream data comes to cbRead()
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  // closing control connection takes listener along, streams stay
+  sam3aCloseConnection(st.conn);
+  for (Sam3AConnection *c = ses.connlist; c != NULL; c = c->next)
+    ++left;
+  tt_int_op(left, ==, FORWARD_STREAMS);
+  tt_int_op(sam3aIsHaveActiveConnections(&ses), ==, 1);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static Sam3ASession subStream, subDgram;
+static int subUdp;
+static FakeSam *subBridge;
+static char subRemoved[sizeof(subStream.channel)];
+
+static void subConnected(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  if (ct->ses != &subStream)
+    st->failed = 1;
+  st->created = 1;
+  st->done = (!subUdp || st->received > 0);
+}
+
+static void subStreamCreated(Sam3ASession *ses) {
+  static const Sam3AConnectionCallbacks sccb = {
+      .cbError = ccbError,
+      .cbConnected = subConnected,
+  };
+  TestState *st = (TestState *)ses->udata;
+  //
+  if ((st->conn = sam3aStreamConnect(ses, &sccb, fakesamPubKey())) == NULL)
+    st->failed = 1;
+  else
+    st->conn->udata = st;
+}
+
+static void subDgramCreated(Sam3ASession *ses) {
+  if (sam3aDatagramSend(ses, fakesamPubKey(), pattern, 100) != 0)
+    ((TestState *)ses->udata)->failed = 1;
+}
+
+static void subDgramRead(Sam3ASession *ses, const void *buf, int bufsize) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  if (ses != &subDgram || bufsize != 100 || !checkPattern(0, buf, bufsize))
+    st->failed = 1;
+  ++st->received;
+  st->done = st->created;
+}
+
+static void primaryCreated(Sam3ASession *ses) {
+  static const Sam3ASessionCallbacks stcb = {
+      .cbError = scbError,
+      .cbCreated = subStreamCreated,
+  };
+  static const Sam3ASessionCallbacks dgcb = {
+      .cbError = scbError,
+      .cbCreated = subDgramCreated,
+      .cbDatagramRead = subDgramRead,
+  };
+  TestState *st = (TestState *)ses->udata;
+  //
+  // PRIMARY itself carries no streams
+  if (sam3aStreamConnect(ses, NULL, fakesamPubKey()) != NULL ||
+      sam3aAddSubsession(ses, &subStream, &stcb, SAM3A_SESSION_STREAM, 80,
+                         NULL) < 0 ||
+      (subUdp && sam3aAddSubsession(ses, &subDgram, &dgcb,
+                                    SAM3A_SESSION_DGRAM, 0, NULL) < 0)) {
+    st->failed = 1;
+    return;
+  }
+  subStream.udata = subDgram.udata = st;
+}
+
+// wait for SESSION REMOVE
+static void subRemovedTick(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  st->done = !fakesamHaveSession(subBridge, subRemoved);
+}
+
+void test_aio_subsessions(void *data) {
+  Sam3ASessionCallbacks pscb = {
+      .cbError = scbError,
+      .cbCreated = primaryCreated,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  initPattern();
+  memset(&ses, 0, sizeof(ses));
+  memset(&subStream, 0, sizeof(subStream));
+  memset(&subDgram, 0, sizeof(subDgram));
+  memset(&st, 0, sizeof(st));
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  subBridge = fs;
+  subUdp = fakesamHaveUDP(fs);
+  tt_int_op(sam3aCreateSession(&ses, &pscb, "127.0.0.1", fakesamPort(fs),
+                               NULL, SAM3A_SESSION_PRIMARY),
+            ==, 0);
+  // not created yet
+  tt_int_op(sam3aAddSubsession(&ses, &subStream, NULL, SAM3A_SESSION_STREAM,
+                               0, NULL),
+            <, 0);
+  ses.udata = &st;
+  // subsessions are polled with the primary
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_assert(sam3aIsActiveConnection(st.conn));
+  tt_assert(fakesamHaveSession(fs, subStream.channel));
+  tt_str_op(subStream.pubkey, ==, ses.pubkey);
+  // closing subsession removes it on the bridge, primary stays
+  strcpy(subRemoved, subStream.channel);
+  sam3aCloseSession(&subStream);
+  tt_assert(sam3aIsActiveSession(&ses));
+  st.done = 0;
+  st.tick = subRemovedTick;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  // closing primary cancels the rest
+  sam3aCloseSession(&ses);
+  tt_assert(!sam3aIsActiveSession(&subDgram));
+
+end:
+  sam3aCloseSession(&subStream);
+  sam3aCloseSession(&ses);
+  sam3aCloseSession(&subDgram);
+  fakesamStop(fs);
+}
+
+// rejected SESSION ADD
+static Sam3ASession subRejected;
+
+static void rejectedError(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  if (strcmp(ses->error, "DUPLICATED_ID") != 0)
+    st->failed = 1;
+  st->done = 1;
+}
+
+static void rejectedPrimaryCreated(Sam3ASession *ses) {
+  static const Sam3ASessionCallbacks rcb = {
+      .cbError = rejectedError,
+      .cbCreated = scbError,
+  };
+  //
+  if (sam3aAddSubsession(ses, &subRejected, &rcb, SAM3A_SESSION_STREAM, 0,
+                         NULL) < 0)
+    ((TestState *)ses->udata)->failed = 1;
+  subRejected.udata = ses->udata;
+}
+
+void test_aio_subsession_rejected(void *data) {
+  static const Sam3ASessionCallbacks stcb = {
+      .cbError = scbError,
+      .cbCreated = subStreamCreated,
+  };
+  Sam3ASessionCallbacks pscb = {
+      .cbError = scbError,
+      .cbCreated = rejectedPrimaryCreated,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  fd_set rds, wrs;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&subStream, 0, sizeof(subStream));
+  memset(&subRejected, 0, sizeof(subRejected));
+  memset(&st, 0, sizeof(st));
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  subUdp = 0;
+  fakesamFailNextAdd(fs, "DUPLICATED_ID");
+  tt_int_op(sam3aCreateSession(&ses, &pscb, "127.0.0.1", fakesamPort(fs),
+                               NULL, SAM3A_SESSION_PRIMARY),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_assert(!sam3aIsActiveSession(&subRejected));
+  tt_assert(sam3aIsActiveSession(&ses));
+  // next SESSION ADD goes through
+  tt_int_op(sam3aAddSubsession(&ses, &subStream, &stcb, SAM3A_SESSION_STREAM,
+                               0, NULL),
+            ==, 0);
+  subStream.udata = &st;
+  st.done = 0;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_assert(st.created);
+  tt_assert(sam3aIsActiveConnection(st.conn));
+  // dead subsession stays linked behind the live one; its stream is polled
+  FD_ZERO(&rds);
+  FD_ZERO(&wrs);
+  tt_assert(ses.subs == &subStream && subStream.subNext == &subRejected);
+  tt_int_op(sam3aAddSessionToFDS(&ses, -1, &rds, &wrs), >=, st.conn->fd);
+  tt_assert(FD_ISSET(st.conn->fd, &rds));
+
+end:
+  sam3aCloseSession(&subRejected);
+  sam3aCloseSession(&subStream);
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define PORT_STREAMS (6)
+
+static int portHits[3]; // 80, 443, other
+static int portFailed, portConnected;
+
+static void portError(Sam3AConnection *ct) {
+  (void)ct;
+  portFailed = 1;
+}
+
+static void portAccepted(Sam3AConnection *ct) {
+  int *hits = (int *)ct->udata;
+  //
+  if (hits == &portHits[0] ? ct->toPort != 80 : ct->toPort != 443)
+    portFailed = 1;
+  ++*hits;
+}
+
+static void portAcceptedOther(Sam3AConnection *ct) {
+  if (ct->toPort != 7 || ct->udata != NULL)
+    portFailed = 1;
+  ++portHits[2];
+}
+
+static void portConnectedCb(Sam3AConnection *ct) {
+  if (ct->fromPort != 1234 || ct->toPort != 22)
+    portFailed = 1;
+  portConnected = 1;
+}
+
+static void portCreated(Sam3ASession *ses) {
+  static const Sam3AConnectionCallbacks lcb = {
+      .cbError = portError,
+      .cbAccepted = portAcceptedOther,
+  };
+  static const Sam3AConnectionCallbacks ccb = {
+      .cbError = portError,
+      .cbConnected = portConnectedCb,
+  };
+  //
+  if (sam3aListen(ses, PORT_STREAMS, &lcb, PORT_STREAMS) < 0 ||
+      sam3aStreamConnectPorts(ses, &ccb, fakesamPubKey(), 1234, 22, -1) ==
+          NULL)
+    portFailed = 1;
+}
+
+static void portTick(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  st->failed = portFailed;
+  st->done = (portConnected && portHits[0] + portHits[1] + portHits[2] ==
+                                   PORT_STREAMS);
+}
+
+void test_aio_stream_ports(void *data) {
+  static const int inPorts[] = {80, 443, 7};
+  Sam3ASessionCallbacks pscb = {
+      .cbError = scbError,
+      .cbCreated = portCreated,
+  };
+  Sam3AConnectionCallbacks hcb = {
+      .cbError = portError,
+      .cbAccepted = portAccepted,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  memset(portHits, 0, sizeof(portHits));
+  portFailed = portConnected = 0;
+  st.tick = portTick;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  fakesamSetInboundPorts(fs, inPorts, 3);
+  tt_int_op(sam3aCreateSession(&ses, &pscb, "127.0.0.1", fakesamPort(fs),
+                               NULL, SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(sam3aSetPortHandler(&ses, 443, &hcb, &portHits[1]), ==, 0);
+  tt_int_op(sam3aSetPortHandler(&ses, 80, &hcb, &portHits[0]), ==, 0);
+  tt_int_op(sam3aSetPortHandler(&ses, 22, &hcb, NULL), ==, 0);
+  tt_int_op(sam3aSetPortHandler(&ses, 22, NULL, NULL), ==, 0);
+  tt_int_op(ses.portCount, ==, 2);
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(portHits[0], ==, PORT_STREAMS / 3);
+  tt_int_op(portHits[1], ==, PORT_STREAMS / 3);
+  tt_int_op(portHits[2], ==, PORT_STREAMS / 3);
+  tt_int_op(fakesamLastToPort(fs), ==, 22);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define RELAY_BYTES (4 * ECHO_BYTES)
+#define RELAY_PREFIX "queued"
+
+static int relayFd = -1; // backend side of the relayed socket pair
+static int64_t relaySent, relayGot;
+static int relayEof, relayDisconnected;
+
+static void relayConnected(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->udata;
+  int sv[2];
+  //
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    st->failed = 1;
+    return;
+  }
+  relayFd = sv[1];
+  // goes to the stream before relayed data
+  if (sam3aSend(ct, RELAY_PREFIX, -1) < 0 || sam3aRelay(ct, sv[0]) < 0 ||
+      sam3aRelay(ct, sv[0]) == 0 || fcntl(relayFd, F_SETFL, O_NONBLOCK) < 0)
+    st->failed = 1;
+}
+
+static void relayDisconnectedCb(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->udata;
+  int64_t tolocal, tostream;
+  //
+  if (sam3aRelayStats(ct, &tolocal, &tostream) != 1 ||
+      tolocal != (int64_t)(strlen(GREETING RELAY_PREFIX) + RELAY_BYTES) ||
+      tostream != RELAY_BYTES)
+    st->failed = 1;
+  relayDisconnected = 1;
+}
+
+// backend: write pattern, half-close, check what comes back
+static void relayTick(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  const char *head = GREETING RELAY_PREFIX;
+  int64_t headLen = strlen(head);
+  char buf[8192];
+  ssize_t n;
+  //
+  if (relayFd < 0)
+    return;
+  while (relaySent < RELAY_BYTES) {
+    int64_t chunk = sizeof(pattern) - relaySent % sizeof(pattern);
+    //
+    if (chunk > RELAY_BYTES - relaySent)
+      chunk = RELAY_BYTES - relaySent;
+    if ((n = send(relayFd, pattern + relaySent % sizeof(pattern), chunk,
+                  MSG_NOSIGNAL)) <= 0)
+      break;
+    if ((relaySent += n) == RELAY_BYTES)
+      shutdown(relayFd, SHUT_WR);
+  }
+  while ((n = recv(relayFd, buf, sizeof(buf), 0)) > 0) {
+    for (ssize_t f = 0; f < n; ++f, ++relayGot) {
+      if (relayGot < headLen ? buf[f] != head[relayGot]
+                             : !checkPattern(relayGot - headLen, buf + f, 1))
+        st->failed = 1;
+    }
+  }
+  if (n == 0)
+    relayEof = 1;
+  st->done = (relayEof && relayDisconnected);
+}
+
+void test_aio_relay(void *data) {
+  Sam3AConnectionCallbacks rlcb = {
+      .cbError = ccbError,
+      .cbConnected = relayConnected,
+      .cbRead = rdRead,
+      .cbDisconnected = relayDisconnectedCb,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  initPattern();
+  relayFd = -1;
+  relaySent = relayGot = 0;
+  relayEof = relayDisconnected = 0;
+  st.ccb = &rlcb;
+  st.tick = relayTick;
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  fakesamSetGreeting(fs, GREETING);
+  tt_int_op(sam3aCreateSession(&ses, &scb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(relayGot, ==, strlen(GREETING RELAY_PREFIX) + RELAY_BYTES);
+  tt_int_op(st.received, ==, 0); // cbRead() is not called while relaying
+
+end:
+  sam3aCloseSession(&ses);
+  if (relayFd >= 0)
+    close(relayFd);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#define DRAIN_TIMEOUT_MS (1000)
+#define DRAIN_HOLD "hold"
+
+static Sam3AConnection *drainEcho, *drainHold, *drainLate;
+static int drainUp, drainStarted, drainHoldRelease; // release is atomic
+static int drainEchoClosed, drainHoldTimedOut, drainLateCancelled;
+static Sam3ADrainStats drainStats;
+
+// bridge side: echo, or keep the stream open after EOF until released
+static void drainPeer(int fd, void *udata) {
+  char buf[64];
+  ssize_t rd;
+  //
+  if ((rd = recv(fd, buf, sizeof(buf), MSG_PEEK)) <= 0)
+    return;
+  if (rd < (ssize_t)strlen(DRAIN_HOLD) ||
+      memcmp(buf, DRAIN_HOLD, strlen(DRAIN_HOLD)) != 0) {
+    echoer(fd, udata);
+    return;
+  }
+  while (recv(fd, buf, sizeof(buf), 0) > 0)
+    ;
+  for (int f = 0; f < 500 && !__atomic_load_n(&drainHoldRelease,
+                                               __ATOMIC_RELAXED);
+       ++f)
+    usleep(10000);
+}
+
+static void drainConnected(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  if (ct == drainHold) {
+    if (sam3aSend(ct, DRAIN_HOLD, -1) < 0)
+      st->failed = 1;
+  } else {
+    // queued at once; must be sent and echoed before the stream closes
+    for (int64_t pos = 0; pos < ECHO_BYTES; pos += sizeof(pattern)) {
+      if (sam3aSend(ct, pattern, sizeof(pattern)) < 0)
+        st->failed = 1;
+    }
+  }
+  ++drainUp;
+}
+
+static void drainError(Sam3AConnection *ct) {
+  if (ct == drainHold && strcmp(ct->error, "DRAIN_TIMEOUT") == 0)
+    drainHoldTimedOut = 1;
+  else if (ct == drainLate && strcmp(ct->error, "SESSION_DRAINING") == 0)
+    drainLateCancelled = 1;
+  else
+    ((TestState *)ct->udata)->failed = 1;
+}
+
+static void drainDisconnected(Sam3AConnection *ct) {
+  if (ct == drainEcho)
+    drainEchoClosed = 1;
+}
+
+static void drainDone(Sam3ASession *ses, const Sam3ADrainStats *st) {
+  drainStats = *st;
+  ((TestState *)ses->udata)->done = 1;
+}
+
+static void drainCreated(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  drainEcho = sam3aStreamConnect(ses, st->ccb, fakesamPubKey());
+  drainHold = sam3aStreamConnect(ses, st->ccb, fakesamPubKey());
+  if (drainEcho == NULL || drainHold == NULL) {
+    st->failed = 1;
+    return;
+  }
+  drainEcho->udata = drainHold->udata = st;
+}
+
+static void drainTick(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  if (drainUp < 2 || drainStarted)
+    return;
+  drainStarted = 1;
+  // still connecting when drain starts
+  if ((drainLate = sam3aStreamConnect(ses, st->ccb, fakesamPubKey())) == NULL)
+    st->failed = 1;
+  else
+    drainLate->udata = st;
+  if (sam3aDrainSession(ses, DRAIN_TIMEOUT_MS, drainDone) < 0 ||
+      sam3aDrainSession(ses, DRAIN_TIMEOUT_MS, drainDone) == 0 ||
+      sam3aStreamConnect(ses, st->ccb, fakesamPubKey()) != NULL)
+    st->failed = 1;
+}
+
+void test_aio_drain(void *data) {
+  Sam3AConnectionCallbacks dccb = {
+      .cbError = drainError,
+      .cbConnected = drainConnected,
+      .cbRead = rdRead,
+      .cbDisconnected = drainDisconnected,
+  };
+  Sam3ASessionCallbacks dscb = {
+      .cbError = scbError,
+      .cbCreated = drainCreated,
+  };
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  memset(&drainStats, 0, sizeof(drainStats));
+  initPattern();
+  drainEcho = drainHold = drainLate = NULL;
+  drainUp = drainStarted = drainEchoClosed = drainHoldTimedOut = 0;
+  drainLateCancelled = 0;
+  __atomic_store_n(&drainHoldRelease, 0, __ATOMIC_RELAXED);
+  st.ccb = &dccb;
+  st.tick = drainTick;
+  tt_assert((fs = fakesamStart(drainPeer, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &dscb, "127.0.0.1", fakesamPort(fs),
+                               NULL, SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  // echo stream delivered everything after its write side was shut down
+  tt_int_op(st.received, ==, ECHO_BYTES);
+  tt_assert(drainEchoClosed);
+  tt_assert(drainHoldTimedOut);
+  tt_assert(drainLateCancelled);
+  tt_int_op(drainStats.streams, ==, 2);
+  tt_int_op(drainStats.finished, ==, 1);
+  tt_int_op(drainStats.timedOut, ==, 1);
+  tt_int_op(drainStats.failed, ==, 0);
+  tt_int_op(drainStats.cancelled, ==, 1);
+  tt_int_op(drainStats.unsent, ==, 0);
+  tt_assert(!sam3aIsActiveSession(&ses));
+
+end:
+  __atomic_store_n(&drainHoldRelease, 1, __ATOMIC_RELAXED);
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// hot restart: echo stream goes on in the other session
+#define HANDOVER_CHUNK (16384)
+
+static int handoverDisconnects, handoverSecond;
+
+static void hoConnected(Sam3AConnection *ct) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  if (handoverSecond) {
+    st->done = 1; // new stream from adopted session
+    return;
+  }
+  if (sam3aSend(ct, pattern, HANDOVER_CHUNK) < 0)
+    st->failed = 1;
+  st->queued = HANDOVER_CHUNK;
+}
+
+static void hoRead(Sam3AConnection *ct, const void *buf, int bufsize) {
+  TestState *st = (TestState *)ct->udata;
+  //
+  if (!checkPattern(st->received, buf, bufsize))
+    st->failed = 1;
+  if ((st->received += bufsize) == st->queued)
+    st->done = 1;
+}
+
+static void hoDisconnected(Sam3AConnection *ct) {
+  (void)ct;
+  ++handoverDisconnects;
+}
+
+void test_aio_handover(void *data) {
+  Sam3AConnectionCallbacks hccb = {
+      .cbError = ccbError,
+      .cbConnected = hoConnected,
+      .cbRead = hoRead,
+      .cbDisconnected = hoDisconnected,
+  };
+  TestState st;
+  Sam3ASession ses, adopted;
+  Sam3AConnection *conn;
+  char channel[sizeof(ses.channel)];
+  FakeSam *fs = NULL;
+  int sv[2] = {-1, -1};
+  //
+  (void)data;
+  initPattern();
+  memset(&ses, 0, sizeof(ses));
+  memset(&adopted, 0, sizeof(adopted));
+  memset(&st, 0, sizeof(st));
+  handoverDisconnects = handoverSecond = 0;
+  st.ccb = &hccb;
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &scb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(st.received, ==, HANDOVER_CHUNK);
+  // record boundaries are required
+  tt_int_op(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+  tt_int_op(sam3aHandoverSend(&ses, sv[0]), <, 0);
+  tt_assert(sam3aIsActiveSession(&ses));
+  close(sv[0]);
+  close(sv[1]);
+  strcpy(channel, ses.channel);
+  tt_int_op(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), ==, 0);
+  tt_int_op(sam3aHandoverSend(&ses, sv[0]), ==, 0);
+  tt_assert(!sam3aIsActiveSession(&ses));
+  tt_int_op(sam3aHandoverRecv(&adopted, &scb, &hccb, sv[1]), ==, 0);
+  adopted.udata = &st;
+  tt_assert(sam3aIsActiveSession(&adopted));
+  tt_str_op(adopted.channel, ==, channel);
+  tt_assert((conn = adopted.connlist) != NULL);
+  tt_assert(conn->next == NULL);
+  tt_str_op(conn->destkey, ==, fakesamPubKey());
+  // the same bridge stream echoes for the new owner
+  conn->udata = &st;
+  st.done = 0;
+  tt_int_op(sam3aSend(conn, pattern + HANDOVER_CHUNK, HANDOVER_CHUNK), ==, 0);
+  st.queued += HANDOVER_CHUNK;
+  tt_int_op(runLoop(&adopted, &st, 10000), ==, 0);
+  tt_int_op(st.received, ==, 2 * HANDOVER_CHUNK);
+  // bridge knows the session ID
+  st.done = 0;
+  handoverSecond = 1;
+  tt_assert((conn = sam3aStreamConnect(&adopted, &hccb, fakesamPubKey())) !=
+            NULL);
+  conn->udata = &st;
+  tt_int_op(runLoop(&adopted, &st, 10000), ==, 0);
+  // nothing was disconnected on the way
+  tt_int_op(handoverDisconnects, ==, 0);
+
+end:
+  if (sv[0] >= 0)
+    close(sv[0]);
+  if (sv[1] >= 0)
+    close(sv[1]);
+  sam3aCloseSession(&ses);
+  sam3aCloseSession(&adopted);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// bridge set: dead bridge fails probe and session creation moves on
+static int deadPort(void) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0), port = -1;
+  //
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+      getsockname(fd, (struct sockaddr *)&addr, &len) == 0)
+    port = ntohs(addr.sin_port);
+  if (fd >= 0)
+    close(fd); // nobody listens there now
+  return port;
+}
+
+static int runProbes(Sam3ABridgeSet *set, int timeoutms) {
+  struct timeval start, now;
+  //
+  gettimeofday(&start, NULL);
+  while (set->probing > 0) {
+    fd_set rds, wrs;
+    struct timeval tv = {0, 50000};
+    int maxfd;
+    //
+    gettimeofday(&now, NULL);
+    if (sam3atimeval2ms(&now) - sam3atimeval2ms(&start) > (uint64_t)timeoutms)
+      return -1;
+    FD_ZERO(&rds);
+    FD_ZERO(&wrs);
+    maxfd = sam3aAddBridgeSetToFDS(set, -1, &rds, &wrs);
+    if (select(maxfd + 1, &rds, &wrs, NULL, &tv) < 0 && errno != EINTR)
+      return -1;
+    sam3aProcessBridgeSetIO(set, &rds, &wrs);
+  }
+  return 0;
+}
+
+static void brCreated(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  ++st->created;
+  st->done = 1;
+}
+
+void test_aio_bridges(void *data) {
+  Sam3ASessionCallbacks bcb = {
+      .cbError = scbError,
+      .cbCreated = brCreated,
+  };
+  char privkey[SAM3A_PRIVKEY_SIZE + 1];
+  Sam3ABridgeSet set;
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  int dead;
+  //
+  (void)data;
+  memset(&set, 0, sizeof(set));
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  tt_assert((dead = deadPort()) > 0);
+  tt_int_op(sam3aBridgeSetAdd(&set, "127.0.0.1", dead, 10), ==, 0);
+  tt_int_op(sam3aBridgeSetAdd(&set, "127.0.0.1", fakesamPort(fs), 1), ==, 1);
+  tt_int_op(sam3aBridgeSetAdd(&set, "127.0.0.1", 1, 0), <, 0);
+  // probes tell them apart
+  tt_int_op(sam3aBridgeProbe(&set, 5000), ==, 2);
+  tt_int_op(runProbes(&set, 10000), ==, 0);
+  tt_assert(!set.bridges[0].healthy);
+  tt_int_op(set.bridges[0].rttms, ==, -1);
+  tt_assert(set.bridges[1].healthy);
+  tt_assert(set.bridges[1].rttms >= 0);
+  tt_assert(set.bridges[1].ip != 0);
+  // stale health: heavier dead bridge is tried first, then the live one
+  set.bridges[0].healthy = 1;
+  tt_int_op(sam3aBridgeCreateSession(&set, &ses, &bcb, NULL,
+                                     SAM3A_SESSION_STREAM, NULL, -1),
+            >=, 0);
+  ses.udata = &st;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(st.created, ==, 1);
+  tt_int_op(ses.bridge, ==, 1);
+  tt_assert(!set.bridges[0].healthy);
+  tt_int_op(set.bridges[0].failures, ==, 2);
+  tt_int_op(set.bridges[1].sessions, ==, 1);
+  // lost session comes back with the same destination
+  strcpy(privkey, ses.privkey);
+  sam3aCancelSession(&ses);
+  tt_int_op(sam3aBridgeRecreateSession(&ses), ==, 1);
+  tt_str_op(ses.privkey, ==, privkey);
+  st.done = 0;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(st.created, ==, 2);
+  tt_int_op(set.bridges[1].sessions, ==, 2);
+  tt_assert(set.bridges[1].healthy);
+
+end:
+  sam3aCloseSession(&ses);
+  sam3aBridgeSetClose(&set);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// session pool: TRANSIENT members share a destination, streams are spread
+#define POOL_SIZE (3)
+
+static int poolCreated, poolConnected;
+
+static void plCreated(Sam3ASession *ses) {
+  (void)ses;
+  ++poolCreated;
+}
+
+static void plError(Sam3ASession *ses) {
+  ((TestState *)((Sam3APoolMember *)ses->udata)->pool->udata)->failed = 1;
+}
+
+static void plConnected(Sam3AConnection *ct) {
+  (void)ct;
+  ++poolConnected;
+}
+
+// drive pool until '*counter' reaches 'target'; returns 0 on success
+static int runPool(Sam3ASessionPool *pool, TestState *st, const int *counter,
+                   int target, int timeoutms) {
+  struct timeval start, now;
+  //
+  gettimeofday(&start, NULL);
+  while (*counter < target && !st->failed) {
+    fd_set rds, wrs;
+    struct timeval tv = {0, 50000};
+    int maxfd;
+    //
+    gettimeofday(&now, NULL);
+    if (sam3atimeval2ms(&now) - sam3atimeval2ms(&start) > (uint64_t)timeoutms)
+      return -1;
+    FD_ZERO(&rds);
+    FD_ZERO(&wrs);
+    maxfd = sam3aAddSessionPoolToFDS(pool, -1, &rds, &wrs);
+    if (select(maxfd + 1, &rds, &wrs, NULL, &tv) < 0 && errno != EINTR)
+      return -1;
+    sam3aProcessSessionPoolIO(pool, &rds, &wrs);
+  }
+  return (st->failed ? -1 : 0);
+}
+
+void test_aio_session_pool(void *data) {
+  Sam3ASessionCallbacks pcb = {
+      .cbError = plError,
+      .cbCreated = plCreated,
+  };
+  Sam3AConnectionCallbacks pccb = {
+      .cbError = ccbError,
+      .cbConnected = plConnected,
+  };
+  static Sam3ASessionPool pool;
+  Sam3AConnection *conn;
+  TestState st;
+  FakeSam *fs = NULL;
+  int hashed = -1;
+  //
+  (void)data;
+  memset(&pool, 0, sizeof(pool));
+  memset(&st, 0, sizeof(st));
+  poolCreated = poolConnected = 0;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  tt_int_op(sam3aSessionPoolCreate(&pool, NULL, &pcb, "127.0.0.1",
+                                   fakesamPort(fs), POOL_SIZE, NULL,
+                                   SAM3A_SESSION_STREAM, NULL, -1),
+            ==, 0);
+  pool.udata = &st;
+  // nothing is up yet
+  tt_assert(sam3aSessionPoolConnect(&pool, &pccb, fakesamPubKey(), 0, 0,
+                                    -1) == NULL);
+  tt_int_op(runPool(&pool, &st, &poolCreated, POOL_SIZE, 10000), ==, 0);
+  tt_int_op(pool.created, ==, POOL_SIZE);
+  for (int f = 0; f < POOL_SIZE; ++f) {
+    tt_assert(pool.members[f].healthy);
+    tt_str_op(pool.members[f].ses.privkey, ==, pool.members[0].ses.privkey);
+  }
+  // least outstanding: one stream each
+  for (int f = 0; f < POOL_SIZE; ++f) {
+    Sam3AConnection *ct = sam3aSessionPoolConnect(&pool, &pccb,
+                                                  fakesamPubKey(), 0, 0, -1);
+    //
+    tt_assert(ct != NULL);
+    ct->udata = &st;
+  }
+  for (int f = 0; f < POOL_SIZE; ++f)
+    tt_int_op(pool.members[f].connects, ==, 1);
+  // peer hash: same peer, same member
+  pool.policy = SAM3A_POOL_PEER_HASH;
+  for (int f = 0; f < POOL_SIZE; ++f) {
+    Sam3AConnection *ct = sam3aSessionPoolConnect(&pool, &pccb,
+                                                  fakesamPubKey(), 0, 0, -1);
+    //
+    tt_assert(ct != NULL);
+    ct->udata = &st;
+  }
+  for (int f = 0; f < POOL_SIZE; ++f) {
+    if (pool.members[f].connects == 1 + POOL_SIZE)
+      hashed = f;
+    else
+      tt_int_op(pool.members[f].connects, ==, 1);
+  }
+  tt_assert(hashed >= 0);
+  tt_int_op(runPool(&pool, &st, &poolConnected, 2 * POOL_SIZE, 10000), ==, 0);
+  // member that is down is skipped; its peers move, others stay
+  sam3aCancelSession(&pool.members[hashed].ses);
+  tt_assert(!pool.members[hashed].healthy);
+  tt_assert((conn = sam3aSessionPoolConnect(&pool, &pccb, fakesamPubKey(), 0,
+                                            0, -1)) != NULL);
+  conn->udata = &st;
+  tt_assert(conn->ses != &pool.members[hashed].ses);
+
+end:
+  sam3aSessionPoolClose(&pool);
+  fakesamStop(fs);
+}
+
+// member that fails to create is left out, the rest carry streams
+static int poolSettled, poolFailed;
+
+static void plSettled(Sam3ASession *ses) {
+  (void)ses;
+  ++poolSettled;
+}
+
+static void plFailed(Sam3ASession *ses) {
+  (void)ses;
+  ++poolSettled;
+  ++poolFailed;
+}
+
+void test_aio_session_pool_failed(void *data) {
+  Sam3ASessionCallbacks pcb = {
+      .cbError = plFailed,
+      .cbCreated = plSettled,
+  };
+  Sam3AConnectionCallbacks pccb = {
+      .cbError = ccbError,
+      .cbConnected = plConnected,
+  };
+  static Sam3ASessionPool pool;
+  TestState st;
+  FakeSam *fs = NULL;
+  fd_set rds, wrs;
+  int failed = -1, maxfd, streams = 0;
+  //
+  (void)data;
+  memset(&pool, 0, sizeof(pool));
+  memset(&st, 0, sizeof(st));
+  poolSettled = poolFailed = poolConnected = 0;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  fakesamFailNextCreate(fs, "I2P_ERROR");
+  tt_int_op(sam3aSessionPoolCreate(&pool, NULL, &pcb, "127.0.0.1",
+                                   fakesamPort(fs), POOL_SIZE,
+                                   fakesamPrivKey(), SAM3A_SESSION_STREAM,
+                                   NULL, -1),
+            ==, 0);
+  pool.udata = &st;
+  tt_int_op(runPool(&pool, &st, &poolSettled, POOL_SIZE, 10000), ==, 0);
+  tt_int_op(poolFailed, ==, 1);
+  tt_int_op(pool.created, ==, POOL_SIZE - 1);
+  for (int f = 0; f < POOL_SIZE; ++f)
+    if (!pool.members[f].healthy)
+      failed = f;
+  tt_assert(failed >= 0);
+  for (int f = 0; f < POOL_SIZE - 1; ++f) {
+    Sam3AConnection *ct = sam3aSessionPoolConnect(&pool, &pccb,
+                                                  fakesamPubKey(), 0, 0, -1);
+    //
+    tt_assert(ct != NULL);
+    tt_assert(ct->ses != &pool.members[failed].ses);
+    ct->udata = &st;
+  }
+  tt_int_op(runPool(&pool, &st, &poolConnected, POOL_SIZE - 1, 10000), ==,
+            0);
+  // dead member doesn't hide streams of the others
+  FD_ZERO(&rds);
+  FD_ZERO(&wrs);
+  maxfd = sam3aAddSessionPoolToFDS(&pool, -1, &rds, &wrs);
+  for (int f = 0; f < POOL_SIZE; ++f) {
+    for (Sam3AConnection *c = pool.members[f].ses.connlist; c != NULL;
+         c = c->next, ++streams) {
+      tt_int_op(maxfd, >=, c->fd);
+      tt_assert(FD_ISSET(c->fd, &rds));
+    }
+  }
+  tt_int_op(streams, ==, POOL_SIZE - 1);
+
+end:
+  sam3aSessionPoolClose(&pool);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// supervisor: session dropped by the bridge comes back with the same
+// destination and warm pool; bridge that is gone is retried, then given up
+static int svCreatedTarget, svLost, svErrors;
+
+static void svCreated(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  if (st->created++ == 0 && sam3aSetWarmPool(ses, WARM_SIZE) < 0)
+    st->failed = 1;
+}
+
+static void svDisconnected(Sam3ASession *ses) {
+  (void)ses;
+  ++svLost;
+}
+
+static void svError(Sam3ASession *ses) {
+  ++svErrors;
+  ((TestState *)ses->udata)->done = 1;
+}
+
+static void svTick(Sam3ASession *ses) {
+  TestState *st = (TestState *)ses->udata;
+  //
+  st->done = (st->created == svCreatedTarget &&
+              sam3aWarmPoolReady(ses) == WARM_SIZE);
+}
+
+void test_aio_supervisor(void *data) {
+  Sam3ASessionCallbacks svcb = {
+      .cbError = svError,
+      .cbCreated = svCreated,
+      .cbDisconnected = svDisconnected,
+  };
+  char privkey[SAM3A_PRIVKEY_SIZE + 1], channel[66];
+  Sam3ASupervisorStats sst;
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  svLost = svErrors = 0;
+  svCreatedTarget = 1;
+  st.tick = svTick;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &svcb, "127.0.0.1", fakesamPort(fs),
+                               NULL, SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(sam3aSuperviseSession(&ses, 20, 200, 3), ==, 0);
+  tt_int_op(sam3aSuperviseSession(&ses, 20, 10, 3), <, 0);
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  strcpy(privkey, ses.privkey);
+  strcpy(channel, ses.channel);
+  // router restart: no traffic, the idle control socket tells
+  fakesamDropSessions(fs);
+  svCreatedTarget = 2;
+  st.done = 0;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(svLost, ==, 1);
+  tt_int_op(svErrors, ==, 0);
+  tt_str_op(ses.privkey, ==, privkey);
+  tt_str_op(ses.channel, !=, channel);
+  tt_assert(fakesamHaveSession(fs, ses.channel));
+  tt_int_op(sam3aSupervisorStats(&ses, &sst), ==, 0);
+  tt_int_op(sst.reconnects, ==, 1);
+  tt_int_op(sst.failures, ==, 0);
+  tt_int_op(sst.attempt, ==, 0);
+  tt_int_op(sst.retryms, ==, -1);
+  tt_assert(sst.lastdownms >= 10); // upper half of the first delay
+  tt_assert(sst.downtimems == sst.lastdownms);
+  // bridge is gone for good: 3 attempts, then cbError()
+  fakesamDropSessions(fs);
+  fakesamStop(fs);
+  fs = NULL;
+  st.tick = NULL;
+  st.done = 0;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_int_op(svLost, ==, 2);
+  tt_int_op(svErrors, ==, 1);
+  tt_assert(!sam3aIsActiveSession(&ses));
+  tt_int_op(sam3aSupervisorStats(&ses, &sst), ==, 0);
+  tt_int_op(sst.reconnects, ==, 1);
+  tt_int_op(sst.failures, ==, 3);
+  tt_int_op(sst.retryms, ==, -1);
+  tt_assert(sst.downtimems > sst.lastdownms);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// keepalive: PONGs fill RTT histogram, silent bridge fails the session
+static void kaError(Sam3ASession *ses) {
+  ((TestState *)ses->udata)->done = 1;
+}
+
+static void kaTick(Sam3ASession *ses) {
+  Sam3AKeepaliveStats kst;
+  //
+  if (sam3aKeepaliveStats(ses, &kst) == 0 && kst.received >= 3)
+    ((TestState *)ses->udata)->done = 1;
+}
+
+void test_aio_keepalive(void *data) {
+  Sam3ASessionCallbacks kcb = {
+      .cbError = kaError,
+  };
+  Sam3AKeepaliveStats kst;
+  TestState st;
+  Sam3ASession ses;
+  FakeSam *fs = NULL;
+  uint32_t total = 0;
+  //
+  (void)data;
+  memset(&ses, 0, sizeof(ses));
+  memset(&st, 0, sizeof(st));
+  st.tick = kaTick;
+  tt_assert((fs = fakesamStart(holder, NULL)) != NULL);
+  tt_int_op(sam3aCreateSession(&ses, &kcb, "127.0.0.1", fakesamPort(fs), NULL,
+                               SAM3A_SESSION_STREAM),
+            ==, 0);
+  ses.udata = &st;
+  tt_int_op(sam3aKeepaliveStats(&ses, &kst), <, 0);
+  tt_int_op(sam3aSetKeepalive(&ses, 20, 0), <, 0);
+  tt_int_op(sam3aSetKeepalive(&ses, 20, 2), ==, 0);
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_assert(sam3aIsActiveSession(&ses));
+  tt_int_op(sam3aKeepaliveStats(&ses, &kst), ==, 0);
+  tt_int_op(kst.sent, >=, kst.received);
+  tt_int_op(kst.missed, ==, 0);
+  tt_assert(kst.lastrttms >= 0);
+  tt_assert(kst.minrttms <= kst.maxrttms);
+  for (int f = 0; f < SAM3A_RTT_BUCKETS; ++f)
+    total += kst.hist[f];
+  tt_int_op(total, ==, kst.received);
+  // half-dead bridge: connection is up, nobody answers
+  fakesamSetPong(fs, 0);
+  st.tick = NULL;
+  st.done = 0;
+  tt_int_op(runLoop(&ses, &st, 10000), ==, 0);
+  tt_str_op(ses.error, ==, "PING_TIMEOUT");
+  tt_assert(!sam3aIsActiveSession(&ses));
+  tt_int_op(sam3aKeepaliveStats(&ses, &kst), ==, 0);
+  tt_int_op(kst.missed, ==, 2);
+
+end:
+  sam3aCloseSession(&ses);
+  fakesamStop(fs);
+}
+
+struct testcase_t aio_tests[] = {{
+                                     "read_pool",
+                                     test_aio_read_pool,
+                                 },
+                                 {
+                                     "send_queue",
+                                     test_aio_send_queue,
+                                 },
+                                 {
+                                     "watermarks",
+                                     test_aio_watermarks,
+                                 },
+                                 {
+                                     "datagrams",
+                                     test_aio_datagrams,
+                                 },
+                                 {
+                                     "resolve",
+                                     test_aio_resolve,
+                                 },
+                                 {
+                                     "reactor",
+                                     test_aio_reactor,
+                                 },
+                                 {
+                                     "reactor_leftover",
+                                     test_aio_reactor_leftover,
+                                 },
+                                 {
+                                     "submit",
+                                     test_aio_submit,
+                                 },
+                                 {
+                                     "submit_reactor",
+                                     test_aio_submit_reactor,
+                                 },
+                                 {
+                                     "conn_cache",
+                                     test_aio_conn_cache,
+                                 },
+                                 {
+                                     "close_in_read",
+                                     test_aio_close_in_read,
+                                 },
+                                 {
+                                     "line_reader",
+                                     test_aio_line_reader,
+                                 },
+                                 {
+                                     "io_budget",
+                                     test_aio_io_budget,
+                                 },
+                                 {
+                                     "listen",
+                                     test_aio_listen,
+                                 },
+                                 {
+                                     "warm_pool",
+                                     test_aio_warm_pool,
+                                 },
+                                 {
+                                     "stream_forward",
+                                     test_aio_stream_forward,
+                                 },
+                                 {
+                                     "subsessions",
+                                     test_aio_subsessions,
+                                 },
+                                 {
+                                     "subsession_rejected",
+                                     test_aio_subsession_rejected,
+                                 },
+                                 {
+                                     "stream_ports",
+                                     test_aio_stream_ports,
+                                 },
+                                 {
+                                     "relay",
+                                     test_aio_relay,
+                                 },
+                                 {
+                                     "drain",
+                                     test_aio_drain,
+                                 },
+                                 {
+                                     "handover",
+                                     test_aio_handover,
+                                 },
+                                 {
+                                     "bridges",
+                                     test_aio_bridges,
+                                 },
+                                 {
+                                     "session_pool",
+                                     test_aio_session_pool,
+                                 },
+                                 {
+                                     "session_pool_failed",
+                                     test_aio_session_pool_failed,
+                                 },
+                                 {
+                                     "supervisor",
+                                     test_aio_supervisor,
+                                 },
+                                 {
+                                     "keepalive",
+                                     test_aio_keepalive,
+                                 },
+                                 END_OF_TESTCASES};
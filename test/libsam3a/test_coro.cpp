@@ -0,0 +1,207 @@
+/*
+ * Copyright Â© 2023 I2P
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the âSoftwareâ), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED âAS ISâ, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * http://git.idk.i2p/i2p-hackers/libsam3/
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <vector>
+
+extern "C" {
+#include "../../src/ext/tinytest.h"
+#include "../../src/ext/tinytest_macros.h"
+#include "fakesam.h"
+}
+#include "../../src/libsam3a/libsam3a.hpp"
+
+// tt_*() macros jump to 'end:', so objects live in inner blocks; coroutines
+// only record what they saw and the test checks it afterwards
+
+// bridge side: echo everything back
+static void echoer(int fd, void *udata) {
+  char buf[4096];
+  ssize_t rd;
+  //
+  (void)udata;
+  while ((rd = recv(fd, buf, sizeof(buf), 0)) > 0)
+    if (send(fd, buf, rd, MSG_NOSIGNAL) != rd)
+      return;
+}
+
+// bridge side: take one byte, then the peer goes away
+static void dropper(int fd, void *udata) {
+  char c;
+  //
+  (void)udata;
+  recv(fd, &c, 1, 0);
+}
+
+// poll 'exec' until 'done' is set; returns 0 on success
+static int runUntil(sam3a::Executor &exec, const bool &done, int timeoutms) {
+  struct timeval start, now;
+  //
+  gettimeofday(&start, NULL);
+  while (!done) {
+    gettimeofday(&now, NULL);
+    if (sam3atimeval2ms(&now) - sam3atimeval2ms(&start) > (uint64_t)timeoutms)
+      return -1;
+    if (exec.poll(50) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+struct EchoState {
+  bool done = false;
+  int created = -1;
+  int wrote[2] = {-1, -1};
+  int got[2] = {0, 0};
+  bool match[2] = {false, false};
+  bool accepted = false;
+  bool closedUp = true;
+  int afterClose = 1;
+};
+
+// write 'msg' and read it back; 'idx' selects where results go
+static sam3a::Task<> echoOnce(sam3a::Connection &c, EchoState &st, int idx) {
+  static const char msg[] = "hello through the echo stream";
+  char back[sizeof(msg)];
+  //
+  st.wrote[idx] = co_await c.write(std::span<const char>(msg, sizeof(msg)));
+  while (st.got[idx] < (int)sizeof(msg)) {
+    int n = co_await c.read(
+        std::span<char>(back + st.got[idx], sizeof(msg) - st.got[idx]));
+    //
+    if (n <= 0)
+      co_return;
+    st.got[idx] += n;
+  }
+  st.match[idx] = (memcmp(back, msg, sizeof(msg)) == 0);
+}
+
+static sam3a::Task<> echoClient(sam3a::Session &ses, int port, EchoState &st) {
+  char buf[16];
+  //
+  if ((st.created = co_await ses.create("127.0.0.1", port)) == 0) {
+    sam3a::Connection out = co_await ses.connect(fakesamPubKey());
+    //
+    if (out)
+      co_await echoOnce(out, st, 0);
+    {
+      sam3a::Connection in = co_await ses.accept();
+      //
+      st.accepted = (in && strcmp(in.destkey(), fakesamPubKey()) == 0);
+      if (in)
+        co_await echoOnce(in, st, 1);
+    }
+    // closed connection has nothing more to read and does not suspend
+    out.close();
+    st.closedUp = (bool)out;
+    st.afterClose = co_await out.read(buf);
+  }
+  st.done = true;
+}
+
+static void test_coro_streams(void *data) {
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  tt_assert((fs = fakesamStart(echoer, NULL)) != NULL);
+  {
+    sam3a::Executor exec;
+    sam3a::Session ses(exec);
+    EchoState st;
+    //
+    exec.spawn(echoClient(ses, fakesamPort(fs), st));
+    tt_int_op(runUntil(exec, st.done, 10000), ==, 0);
+    tt_int_op(st.created, ==, 0);
+    tt_int_op(st.wrote[0], ==, 0);
+    tt_assert(st.match[0]);
+    tt_assert(st.accepted);
+    tt_int_op(st.wrote[1], ==, 0);
+    tt_assert(st.match[1]);
+    tt_assert(!st.closedUp);
+    tt_int_op(st.afterClose, <=, 0);
+  }
+
+end:
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// far more than socket buffers take, so the write is still queued when the
+// peer goes away
+#define DROP_BYTES (16 * 1024 * 1024)
+
+struct DropState {
+  bool done = false;
+  bool up = false;
+  int wrote = 0;
+};
+
+static sam3a::Task<> dropClient(sam3a::Session &ses, int port, DropState &st,
+                                const std::vector<char> &big) {
+  if (co_await ses.create("127.0.0.1", port) == 0) {
+    sam3a::Connection c = co_await ses.connect(fakesamPubKey());
+    //
+    if ((st.up = (bool)c))
+      st.wrote = co_await c.write(std::span<const char>(big));
+  }
+  st.done = true;
+}
+
+static void test_coro_write_dropped(void *data) {
+  FakeSam *fs = NULL;
+  //
+  (void)data;
+  tt_assert((fs = fakesamStart(dropper, NULL)) != NULL);
+  {
+    std::vector<char> big(DROP_BYTES, 'x');
+    sam3a::Executor exec;
+    sam3a::Session ses(exec);
+    DropState st;
+    //
+    exec.spawn(dropClient(ses, fakesamPort(fs), st, big));
+    tt_int_op(runUntil(exec, st.done, 10000), ==, 0);
+    tt_assert(st.up);
+    // bytes were dropped, not written
+    tt_int_op(st.wrote, <, 0);
+  }
+
+end:
+  if (fs != NULL)
+    fakesamStop(fs);
+}
+
+extern "C" {
+struct testcase_t coro_tests[] = {{"streams", test_coro_streams, 0, NULL, NULL},
+                                  {"write_dropped", test_coro_write_dropped, 0,
+                                   NULL, NULL},
+                                  END_OF_TESTCASES};
+}
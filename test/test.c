@@ -4,8 +4,17 @@
 #include "../src/ext/tinytest_macros.h"
 
 extern struct testcase_t b32_tests[];
+extern struct testcase_t aio_tests[];
+extern struct testcase_t coro_tests[];
+extern struct testcase_t hpp_tests[];
+extern struct testcase_t sam3_tests[];
 
-struct testgroup_t test_groups[] = {{"b32/", b32_tests}, END_OF_GROUPS};
+struct testgroup_t test_groups[] = {{"b32/", b32_tests},
+                                    {"aio/", aio_tests},
+                                    {"coro/", coro_tests},
+                                    {"hpp/", hpp_tests},
+                                    {"sam3/", sam3_tests},
+                                    END_OF_GROUPS};
 
 int main(int argc, const char **argv) {
   return tinytest_main(argc, argv, test_groups);